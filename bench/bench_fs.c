@@ -0,0 +1,415 @@
+/* bench_fs.c: Benchmarks for SimpleFS */
+
+#include "sfs/disk.h"
+#include "sfs/fs.h"
+#include "sfs/utils.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define BENCH_BLOCKS        (8192)              /* Blocks in scratch image */
+#define BENCH_FILE_SIZE     (4*1024*1024)       /* Bytes per benchmark file */
+#define BENCH_RANDOM_OPS    (512)               /* Operations per random benchmark */
+#define BENCH_CREATE_OPS    (1024)              /* Inodes created per create benchmark */
+#define BENCH_MOUNT_OPS     (100)               /* Mounts per mount benchmark */
+#define BENCH_MAX_RESULTS   (64)                /* Maximum number of results */
+
+#define streq(a, b) (strcmp((a), (b)) == 0)
+
+/* Structures */
+
+typedef struct Result Result;
+struct Result {
+    const char *name;                           /* Benchmark name */
+    size_t      size;                           /* I/O size per operation (bytes) */
+    size_t      ops;                            /* Number of operations */
+    size_t      bytes;                          /* Number of bytes transferred */
+    double      seconds;                        /* Elapsed wall clock time */
+    size_t      reads;                          /* Disk block reads */
+    size_t      writes;                         /* Disk block writes */
+};
+
+typedef struct Timer Timer;
+struct Timer {
+    Disk       *disk;                           /* Disk being measured */
+    double      start;                          /* Start time */
+    size_t      reads;                          /* Disk block reads at start */
+    size_t      writes;                         /* Disk block writes at start */
+};
+
+/* Globals */
+
+Result  Results[BENCH_MAX_RESULTS];
+size_t  NResults = 0;
+
+size_t  IOSizes[] = {4096, 65536, 1048576};
+#define NIOSIZES (sizeof(IOSizes) / sizeof(IOSizes[0]))
+
+/* Utility Functions */
+
+double  now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void    timer_start(Timer *timer, Disk *disk) {
+    timer->disk   = disk;
+    timer->reads  = disk->reads;
+    timer->writes = disk->writes;
+    timer->start  = now();
+}
+
+void    timer_stop(Timer *timer, const char *name, size_t size, size_t ops, size_t bytes) {
+    double seconds = now() - timer->start;
+    if (NResults == BENCH_MAX_RESULTS) return;
+
+    Results[NResults++] = (Result) {
+        .name    = name,
+        .size    = size,
+        .ops     = ops,
+        .bytes   = bytes,
+        .seconds = seconds,
+        .reads   = timer->disk->reads  - timer->reads,
+        .writes  = timer->disk->writes - timer->writes,
+    };
+}
+
+void    fill_random(char *buffer, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        buffer[i] = rand();
+    }
+}
+
+bool    copy_image(const char *source, const char *target) {
+    FILE *in  = fopen(source, "r");
+    FILE *out = fopen(target, "w");
+    bool  success = in && out;
+
+    char buffer[BLOCK_SIZE];
+    size_t nread;
+    while (success && (nread = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+        success = fwrite(buffer, 1, nread, out) == nread;
+    }
+
+    if (in)  fclose(in);
+    if (out) fclose(out);
+    return success;
+}
+
+/* Benchmark Functions */
+
+bool    bench_mount(const char *image, size_t blocks, const char *scratch, DiskMode mode) {
+    if (!copy_image(image, scratch)) return false;
+
+    Disk *disk = disk_open_mode(scratch, blocks, mode);
+    if (!disk) return false;
+
+    Timer timer;
+    timer_start(&timer, disk);
+    for (size_t i = 0; i < BENCH_MOUNT_OPS; i++) {
+        FileSystem fs = {0};
+        if (!fs_mount(&fs, disk)) {
+            disk_close(disk);
+            return false;
+        }
+        fs_unmount(&fs);
+    }
+    timer_stop(&timer, "mount", 0, BENCH_MOUNT_OPS, 0);
+
+    disk_close(disk);
+    return true;
+}
+
+bool    bench_create(FileSystem *fs) {
+    ssize_t inodes[BENCH_CREATE_OPS];
+    size_t  count = min((size_t)BENCH_CREATE_OPS, bitmap_count(fs->free_inodes));
+
+    Timer timer;
+    timer_start(&timer, fs->disk);
+    for (size_t i = 0; i < count; i++) {
+        if ((inodes[i] = fs_create(fs)) < 0) return false;
+    }
+    fs_sync(fs);
+    timer_stop(&timer, "create", 0, count, 0);
+
+    timer_start(&timer, fs->disk);
+    for (size_t i = 0; i < count; i++) {
+        if (!fs_remove(fs, inodes[i])) return false;
+    }
+    fs_sync(fs);
+    timer_stop(&timer, "remove_empty", 0, count, 0);
+    return true;
+}
+
+bool    bench_sequential(FileSystem *fs, size_t size, char *buffer, ssize_t *inode_number) {
+    if ((*inode_number = fs_create(fs)) < 0) return false;
+
+    size_t ops = BENCH_FILE_SIZE / size;
+    Timer  timer;
+
+    timer_start(&timer, fs->disk);
+    for (size_t i = 0; i < ops; i++) {
+        if (fs_write(fs, *inode_number, buffer + i*size, size, i*size) != (ssize_t)size) return false;
+    }
+    fs_sync(fs);
+    timer_stop(&timer, "seq_write", size, ops, ops*size);
+
+    timer_start(&timer, fs->disk);
+    for (size_t i = 0; i < ops; i++) {
+        if (fs_read(fs, *inode_number, buffer + i*size, size, i*size) != (ssize_t)size) return false;
+    }
+    timer_stop(&timer, "seq_read", size, ops, ops*size);
+    return true;
+}
+
+bool    bench_random(FileSystem *fs, size_t size, char *buffer, ssize_t inode_number) {
+    size_t slots = BENCH_FILE_SIZE / size;
+    Timer  timer;
+
+    srand(size);
+    timer_start(&timer, fs->disk);
+    for (size_t i = 0; i < BENCH_RANDOM_OPS; i++) {
+        size_t offset = (rand() % slots) * size;
+        if (fs_write(fs, inode_number, buffer + offset, size, offset) != (ssize_t)size) return false;
+    }
+    fs_sync(fs);
+    timer_stop(&timer, "rand_write", size, BENCH_RANDOM_OPS, BENCH_RANDOM_OPS*size);
+
+    srand(size);
+    timer_start(&timer, fs->disk);
+    for (size_t i = 0; i < BENCH_RANDOM_OPS; i++) {
+        size_t offset = (rand() % slots) * size;
+        if (fs_read(fs, inode_number, buffer + offset, size, offset) != (ssize_t)size) return false;
+    }
+    timer_stop(&timer, "rand_read", size, BENCH_RANDOM_OPS, BENCH_RANDOM_OPS*size);
+    return true;
+}
+
+bool    bench_remove(FileSystem *fs, ssize_t *inodes, size_t count) {
+    Timer timer;
+    timer_start(&timer, fs->disk);
+    for (size_t i = 0; i < count; i++) {
+        if (!fs_remove(fs, inodes[i])) return false;
+    }
+    fs_sync(fs);
+    timer_stop(&timer, "remove", BENCH_FILE_SIZE, count, count*BENCH_FILE_SIZE);
+    return true;
+}
+
+bool    bench_copy(FileSystem *fs, const char *host, char *buffer) {
+    FILE *stream = fopen(host, "w");
+    if (!stream) return false;
+    bool success = fwrite(buffer, 1, BENCH_FILE_SIZE, stream) == BENCH_FILE_SIZE;
+    fclose(stream);
+    if (!success) return false;
+
+    ssize_t inode_number = fs_create(fs);
+    if (inode_number < 0) return false;
+
+    char   chunk[4*BUFSIZ];
+    size_t offset = 0;
+    size_t nread;
+    Timer  timer;
+
+    timer_start(&timer, fs->disk);
+    if (!(stream = fopen(host, "r"))) return false;
+    while ((nread = fread(chunk, 1, sizeof(chunk), stream)) > 0) {
+        if (fs_write(fs, inode_number, chunk, nread, offset) != (ssize_t)nread) break;
+        offset += nread;
+    }
+    fclose(stream);
+    fs_sync(fs);
+    timer_stop(&timer, "copyin", sizeof(chunk), (offset + sizeof(chunk) - 1) / sizeof(chunk), offset);
+    if (offset != BENCH_FILE_SIZE) return false;
+
+    offset = 0;
+    timer_start(&timer, fs->disk);
+    if (!(stream = fopen(host, "w"))) return false;
+    ssize_t result;
+    while ((result = fs_read(fs, inode_number, chunk, sizeof(chunk), offset)) > 0) {
+        fwrite(chunk, 1, result, stream);
+        offset += result;
+    }
+    fclose(stream);
+    timer_stop(&timer, "copyout", sizeof(chunk), (offset + sizeof(chunk) - 1) / sizeof(chunk), offset);
+
+    unlink(host);
+    return offset == BENCH_FILE_SIZE && fs_remove(fs, inode_number);
+}
+
+/* Output Functions */
+
+void    report_csv(FILE *stream) {
+    fprintf(stream, "benchmark,size,ops,bytes,seconds,ops_per_sec,mb_per_sec,reads_per_op,writes_per_op\n");
+    for (size_t r = 0; r < NResults; r++) {
+        Result *result = &Results[r];
+        double  seconds = result->seconds > 0 ? result->seconds : 1e-9;
+        fprintf(stream, "%s,%zu,%zu,%zu,%.6f,%.1f,%.2f,%.2f,%.2f\n",
+            result->name, result->size, result->ops, result->bytes, result->seconds,
+            result->ops / seconds, result->bytes / seconds / (1024.0*1024.0),
+            (double)result->reads / result->ops, (double)result->writes / result->ops);
+    }
+}
+
+void    report_json(FILE *stream) {
+    fprintf(stream, "[\n");
+    for (size_t r = 0; r < NResults; r++) {
+        Result *result = &Results[r];
+        double  seconds = result->seconds > 0 ? result->seconds : 1e-9;
+        fprintf(stream, "  {\"benchmark\": \"%s\", \"size\": %zu, \"ops\": %zu, \"bytes\": %zu, "
+                        "\"seconds\": %.6f, \"ops_per_sec\": %.1f, \"mb_per_sec\": %.2f, "
+                        "\"reads_per_op\": %.2f, \"writes_per_op\": %.2f}%s\n",
+            result->name, result->size, result->ops, result->bytes, result->seconds,
+            result->ops / seconds, result->bytes / seconds / (1024.0*1024.0),
+            (double)result->reads / result->ops, (double)result->writes / result->ops,
+            r + 1 < NResults ? "," : "");
+    }
+    fprintf(stream, "]\n");
+}
+
+/* Main Execution */
+
+void    usage(const char *program, int status) {
+    fprintf(stderr, "Usage: %s [options]\n\n", program);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -f FORMAT   Output format (csv or json)\n");
+    fprintf(stderr, "    -i IMAGE    Image to mount (default: data/image.200)\n");
+    fprintf(stderr, "    -n BLOCKS   Blocks in image to mount (default: 200)\n");
+    fprintf(stderr, "    -b BLOCKS   Blocks in scratch image (default: %d)\n", BENCH_BLOCKS);
+    fprintf(stderr, "    -m MODE     Disk mode (fd or mmap)\n");
+    fprintf(stderr, "    -a BACKEND  Asynchronous reads (off, auto, uring or threads)\n");
+    fprintf(stderr, "    -s PATH     Scratch image path (default: data/image.bench)\n");
+    fprintf(stderr, "    -o PATH     Write report to PATH (default: stdout)\n");
+    exit(status);
+}
+
+int main(int argc, char *argv[]) {
+    const char *format  = "csv";
+    const char *image   = "data/image.200";
+    const char *scratch = "data/image.bench";
+    const char *output  = NULL;
+    size_t      nblocks = 200;
+    size_t      sblocks = BENCH_BLOCKS;
+    DiskMode    mode    = DISK_FD;
+    AioBackend  backend = AIO_AUTO;
+    size_t      depth   = 0;
+
+    int option;
+    while ((option = getopt(argc, argv, "f:i:n:b:m:a:s:o:h")) != -1) {
+        switch (option) {
+            case 'f': format  = optarg; break;
+            case 'i': image   = optarg; break;
+            case 'n': nblocks = strtoul(optarg, NULL, 10); break;
+            case 'b': sblocks = strtoul(optarg, NULL, 10); break;
+            case 's': scratch = optarg; break;
+            case 'o': output  = optarg; break;
+            case 'm':
+                if (streq(optarg, "mmap")) {
+                    mode = DISK_MMAP;
+                } else if (streq(optarg, "fd")) {
+                    mode = DISK_FD;
+                } else {
+                    usage(argv[0], EXIT_FAILURE);
+                }
+                break;
+            case 'a':
+                depth = AIO_DEFAULT_DEPTH;
+                if (streq(optarg, "auto")) {
+                    backend = AIO_AUTO;
+                } else if (streq(optarg, "uring")) {
+                    backend = AIO_URING;
+                } else if (streq(optarg, "threads")) {
+                    backend = AIO_THREADS;
+                } else if (streq(optarg, "off")) {
+                    depth = 0;
+                } else {
+                    usage(argv[0], EXIT_FAILURE);
+                }
+                break;
+            case 'h': usage(argv[0], EXIT_SUCCESS); break;
+            default:  usage(argv[0], EXIT_FAILURE); break;
+        }
+    }
+
+    if (!streq(format, "csv") && !streq(format, "json")) usage(argv[0], EXIT_FAILURE);
+
+    char host[BUFSIZ];
+    snprintf(host, sizeof(host), "%s.host", scratch);
+
+    char *buffer = malloc(BENCH_FILE_SIZE);
+    if (!buffer) return EXIT_FAILURE;
+    srand(0);
+    fill_random(buffer, BENCH_FILE_SIZE);
+
+    bool success = bench_mount(image, nblocks, scratch, mode);
+    if (!success) {
+        fprintf(stderr, "Unable to benchmark mount of %s: %s\n", image, strerror(errno));
+    }
+
+    /* Create an empty scratch image of sblocks blocks */
+    FILE *stream = fopen(scratch, "w");
+    if (!stream || ftruncate(fileno(stream), sblocks*BLOCK_SIZE) < 0) {
+        fprintf(stderr, "Unable to create %s: %s\n", scratch, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    fclose(stream);
+
+    Disk *disk = disk_open_mode(scratch, sblocks, mode);
+    if (!disk) return EXIT_FAILURE;
+
+    FileSystem fs = {0};
+    Timer timer;
+    timer_start(&timer, disk);
+    success = fs_format(&fs, disk) && success;
+    timer_stop(&timer, "format", 0, 1, 0);
+
+    success = fs_mount(&fs, disk) && success;
+    fs_set_cache(&fs, CACHE_DEFAULT_BLOCKS);
+    success = fs_set_aio(&fs, backend, depth) && success;
+
+    success = success && bench_create(&fs);
+
+    ssize_t inodes[NIOSIZES];
+    for (size_t s = 0; success && s < NIOSIZES; s++) {
+        success = bench_sequential(&fs, IOSizes[s], buffer, &inodes[s]) &&
+                  bench_random(&fs, IOSizes[s], buffer, inodes[s]);
+    }
+
+    success = success && bench_remove(&fs, inodes, NIOSIZES);
+    success = success && bench_copy(&fs, host, buffer);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    unlink(scratch);
+    free(buffer);
+
+    /* Disk statistics are printed to stdout on close, so a report file keeps
+     * the output machine-readable */
+    FILE *report = output ? fopen(output, "w") : stdout;
+    if (!report) {
+        fprintf(stderr, "Unable to open %s: %s\n", output, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    if (streq(format, "json")) {
+        report_json(report);
+    } else {
+        report_csv(report);
+    }
+
+    if (report != stdout) fclose(report);
+
+    if (!success) {
+        fprintf(stderr, "Benchmark failed!\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -227,9 +227,9 @@ SuperBlock:
     256 inodes
 Inode 0:
     size: 27160 bytes
-    direct blocks: 3 10 11 12 15
-    indirect block: 16
-    indirect data blocks: 17 18
+    direct blocks: 15 16 17 18 19
+    indirect block: 10
+    indirect data blocks: 11 12
 Inode 2:
     size: 27160 bytes
     direct blocks: 4 5 6 7 8
@@ -0,0 +1,92 @@
+/* aio.h: SimpleFS asynchronous disk I/O */
+
+#ifndef AIO_H
+#define AIO_H
+
+#include "sfs/disk.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <pthread.h>
+
+/* Aio Constants */
+
+#define AIO_DEFAULT_DEPTH   (64)                /* Default submission queue depth */
+#define AIO_WORKERS         (4)                 /* Worker threads of thread pool backend */
+
+/* Aio Backends */
+
+typedef enum {
+    AIO_AUTO,                                   /* Use io_uring if available, else thread pool */
+    AIO_URING,                                  /* Submit to kernel with io_uring */
+    AIO_THREADS,                                /* Serve requests from a worker thread pool */
+} AioBackend;
+
+/* Aio Structures */
+
+typedef struct AioRequest AioRequest;
+typedef void (*AioCallback)(AioRequest *request);
+
+struct AioRequest {
+    size_t      block;                          /* First block number to transfer */
+    size_t      count;                          /* Number of contiguous blocks */
+    char       *data;                           /* Buffer (count * BLOCK_SIZE bytes) */
+    bool        write;                          /* Whether to write (true) or read (false) */
+    AioCallback callback;                       /* Called on completion (may be NULL) */
+    void       *arg;                            /* Caller data for callback */
+    ssize_t     result;                         /* Bytes transferred (DISK_FAILURE on failure) */
+    bool        done;                           /* Whether or not request has completed */
+    uint64_t    start;                          /* Submission time (for Disk statistics) */
+    struct iovec iov;                           /* Vector handed to io_uring */
+    AioRequest *next;                           /* Next request in queue */
+};
+
+typedef struct Aio Aio;
+struct Aio {
+    Disk       *disk;                           /* Disk requests are issued to */
+    AioBackend  backend;                        /* Backend in use (AIO_URING or AIO_THREADS) */
+    size_t      depth;                          /* Maximum requests in flight */
+    size_t      inflight;                       /* Requests submitted but not completed */
+
+    pthread_mutex_t lock;                       /* Protects queue, inflight and done flags */
+    pthread_cond_t  ready;                      /* Signalled when requests are queued */
+    pthread_cond_t  complete;                   /* Signalled when requests complete */
+
+    int         ring_fd;                        /* io_uring file descriptor (-1 if unused) */
+    void       *sq_ring;                        /* Mapping of submission ring */
+    void       *cq_ring;                        /* Mapping of completion ring */
+    void       *sqes;                           /* Mapping of submission entries */
+    size_t      sq_ring_size;                   /* Size of submission ring mapping */
+    size_t      cq_ring_size;                   /* Size of completion ring mapping */
+    size_t      sqes_size;                      /* Size of submission entries mapping */
+    unsigned   *sq_tail;                        /* Submission ring tail (written by us) */
+    unsigned   *sq_mask;                        /* Submission ring index mask */
+    unsigned   *sq_array;                       /* Submission ring entry indices */
+    unsigned   *cq_head;                        /* Completion ring head (written by us) */
+    unsigned   *cq_tail;                        /* Completion ring tail (written by kernel) */
+    unsigned   *cq_mask;                        /* Completion ring index mask */
+    void       *cqes;                           /* Completion ring entries */
+    unsigned    unsubmitted;                    /* Entries queued but not yet entered */
+    pthread_mutex_t reap_lock;                  /* Serializes completion ring consumers */
+
+    pthread_t  *workers;                        /* Worker threads (AIO_THREADS) */
+    size_t      nworkers;                       /* Number of worker threads */
+    AioRequest *head;                           /* First queued request (AIO_THREADS) */
+    AioRequest *tail;                           /* Last queued request (AIO_THREADS) */
+    bool        stopping;                       /* Whether or not workers should exit */
+};
+
+/* Aio Functions */
+
+Aio *   aio_create(Disk *disk, AioBackend backend, size_t depth);
+void    aio_delete(Aio *aio);
+
+bool    aio_submit(Aio *aio, AioRequest *requests, size_t n);
+bool    aio_wait(Aio *aio, AioRequest *request);
+bool    aio_wait_all(Aio *aio, AioRequest *requests, size_t n);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
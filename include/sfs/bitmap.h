@@ -0,0 +1,48 @@
+/* bitmap.h: SimpleFS packed bitmap */
+
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Bitmap Constants */
+
+#define BITMAP_WORD_BITS    (64)                /* Number of bits per bitmap word */
+#define BITMAP_NONE         ((size_t)-1)        /* Sentinel for no matching bit */
+
+/* Bitmap Structure */
+
+typedef struct Bitmap Bitmap;
+struct Bitmap {
+    uint64_t   *words;                          /* Packed bits */
+    size_t      bits;                           /* Number of bits in bitmap */
+    size_t      nwords;                         /* Number of words in bitmap */
+    size_t      count;                          /* Number of set bits */
+};
+
+/* Bitmap Functions */
+
+Bitmap *bitmap_create(size_t bits, bool value);
+Bitmap *bitmap_copy(const Bitmap *bitmap);
+void    bitmap_delete(Bitmap *bitmap);
+
+bool    bitmap_test(const Bitmap *bitmap, size_t bit);
+void    bitmap_set(Bitmap *bitmap, size_t bit);
+void    bitmap_clear(Bitmap *bitmap, size_t bit);
+
+void    bitmap_set_range(Bitmap *bitmap, size_t start, size_t count);
+void    bitmap_clear_range(Bitmap *bitmap, size_t start, size_t count);
+void    bitmap_set_bits(Bitmap *bitmap, const Bitmap *mask);
+void    bitmap_clear_bits(Bitmap *bitmap, const Bitmap *mask);
+void    bitmap_load(Bitmap *bitmap, const uint64_t *words);
+
+size_t  bitmap_find(const Bitmap *bitmap, size_t from);
+size_t  bitmap_run(const Bitmap *bitmap, size_t start);
+size_t  bitmap_find_run(const Bitmap *bitmap, size_t count, size_t *length);
+size_t  bitmap_count(const Bitmap *bitmap);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
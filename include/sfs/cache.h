@@ -0,0 +1,63 @@
+/* cache.h: SimpleFS block cache */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "sfs/disk.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <pthread.h>
+
+/* Cache Constants */
+
+#define CACHE_DEFAULT_BLOCKS    (64)            /* Default number of cached blocks */
+#define CACHE_NONE              ((size_t)-1)    /* Sentinel for an empty slot or chain */
+#define CACHE_PREFETCH_RUN      (64)            /* Maximum blocks per prefetch disk read */
+
+/* Cache Structures */
+
+typedef struct CacheEntry CacheEntry;
+struct CacheEntry {
+    size_t      block;                          /* Block number stored in entry */
+    size_t      next;                           /* Next entry in hash chain */
+    bool        valid;                          /* Whether or not entry holds a block */
+    bool        dirty;                          /* Whether or not entry must be written back */
+    bool        referenced;                     /* CLOCK reference bit */
+    char       *data;                           /* Cached block contents */
+};
+
+typedef struct Cache Cache;
+struct Cache {
+    Disk       *disk;                           /* Disk being cached */
+    size_t      capacity;                       /* Number of cache entries */
+    size_t      hand;                           /* CLOCK hand */
+    size_t      nbuckets;                       /* Number of hash buckets (power of 2) */
+    size_t     *buckets;                        /* Hash buckets (head entry index) */
+    CacheEntry *entries;                        /* Cache entries */
+    char       *blocks;                         /* Backing storage for entry data */
+    size_t      hits;                           /* Number of lookups served by cache */
+    size_t      misses;                         /* Number of lookups that went to disk */
+    pthread_mutex_t lock;                       /* Protects entries, buckets, hand and counters */
+};
+
+/* Cache Functions */
+
+Cache * cache_create(Disk *disk, size_t capacity);
+void    cache_delete(Cache *cache);
+
+ssize_t cache_read(Cache *cache, size_t block, char *data);
+ssize_t cache_write(Cache *cache, size_t block, char *data);
+bool    cache_probe(Cache *cache, size_t block, char *data);
+bool    cache_dirty(Cache *cache, size_t start, size_t count);
+
+ssize_t cache_readv(Cache *cache, size_t start, const struct iovec *iov, int iovcnt);
+ssize_t cache_writev(Cache *cache, size_t start, const struct iovec *iov, int iovcnt);
+
+ssize_t cache_prefetch(Cache *cache, size_t start, size_t count);
+bool    cache_flush(Cache *cache);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,24 @@
+/* crc.h: SimpleFS CRC32C checksums */
+
+#ifndef CRC_H
+#define CRC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* CRC Constants */
+
+#define CRC32C_POLYNOMIAL   (0x82f63b78)        /* Castagnoli polynomial (bit reflected) */
+#define CRC_STREAMS         (3)                 /* Buffers checksummed side by side by crc32c_many */
+
+/* CRC Functions */
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t length);
+uint32_t crc32c_software(uint32_t crc, const void *data, size_t length);
+void     crc32c_many(const char *const buffers[], size_t n, size_t length, uint32_t crcs[]);
+bool     crc32c_hardware(void);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -3,14 +3,25 @@
 #ifndef DISK_H
 #define DISK_H
 
+#include "sfs/stats.h"
+
 #include <stdbool.h>
 #include <stdlib.h>
 
+#include <sys/uio.h>
+
 /* Disk Constants */
 
 #define BLOCK_SIZE      (1<<12)
 #define DISK_FAILURE    (-1)
 
+/* Disk Modes */
+
+typedef enum {
+    DISK_FD,            /* Serve blocks with positional file I/O	*/
+    DISK_MMAP,          /* Serve blocks from memory mapping of image	*/
+} DiskMode;
+
 /* Disk Structure */
 
 typedef struct Disk Disk;
@@ -20,16 +31,33 @@ struct Disk {
     size_t  blocks;     /* Number of blocks in disk image	*/
     size_t  reads;      /* Number of reads to disk image	*/
     size_t  writes;     /* Number of writes to disk image	*/
+    size_t  flushes;    /* Number of flushes of disk image	*/
+    char   *map;        /* Mapping of disk image (DISK_MMAP only)	*/
+    OpStats read_stats;     /* Latency and bytes of read calls	*/
+    OpStats write_stats;    /* Latency and bytes of write calls	*/
 }; 
 
 /* Disk Functions */
 
 Disk *	disk_open(const char *path, size_t blocks);
+Disk *	disk_open_mode(const char *path, size_t blocks, DiskMode mode);
 void	disk_close(Disk *disk);
+bool	disk_flush(Disk *disk);
 
 ssize_t	disk_read(Disk *disk, size_t block, char *data);
 ssize_t	disk_write(Disk *disk, size_t block, char *data);
 
+ssize_t	disk_read_range(Disk *disk, size_t start, size_t count, char *data);
+ssize_t	disk_write_range(Disk *disk, size_t start, size_t count, char *data);
+
+ssize_t	disk_readv(Disk *disk, size_t start, const struct iovec *iov, int iovcnt);
+ssize_t	disk_writev(Disk *disk, size_t start, const struct iovec *iov, int iovcnt);
+
+bool	disk_zero(Disk *disk, size_t start, size_t count);
+bool	disk_discard(Disk *disk, size_t start, size_t count);
+
+const char *disk_block(Disk *disk, size_t block);
+
 #endif
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -3,18 +3,63 @@
 #ifndef FS_H
 #define FS_H
 
+#include "sfs/aio.h"
+#include "sfs/bitmap.h"
+#include "sfs/cache.h"
 #include "sfs/disk.h"
 
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 
+#include <pthread.h>
+
 /* File System Constants */
 
-#define MAGIC_NUMBER        (0xf0f03410)
+#define MAGIC_NUMBER        (0xf0f03411)        /* Current format (double and triple indirect pointers) */
+#define MAGIC_NUMBER_V1     (0xf0f03410)        /* Original format (single indirect pointers only) */
 #define INODES_PER_BLOCK    (128)               /* Number of inodes per block */
 #define POINTERS_PER_INODE  (5)                 /* Number of direct pointers per inode */
 #define POINTERS_PER_BLOCK  (1024)              /* Number of pointers per block */
+#define INDIRECT_DOUBLE     (POINTERS_PER_BLOCK - 2)    /* Indirect block slot of double indirect pointer */
+#define INDIRECT_TRIPLE     (POINTERS_PER_BLOCK - 1)    /* Indirect block slot of triple indirect pointer */
+#define EXTENTS_PER_INODE   (2)                 /* Number of extents held by an extent Inode */
+#define EXTENTS_PER_BLOCK   (512)               /* Number of extents (or extent leaves) per block */
+#define FS_INDIRECT_DEPTH   (3)                 /* Pointer blocks below the indirect block of deepest tree */
+#define FS_MAX_FILE_SIZE    (UINT32_MAX)        /* Largest size recorded by an Inode */
+
+/* File System Features */
+
+#define FS_FEATURE_EXTENTS  (1u<<0)             /* Inodes map blocks with extents instead of pointers */
+#define FS_FEATURE_INLINE   (1u<<1)             /* Small files are stored inside larger Inode records */
+#define FS_FEATURE_JOURNAL  (1u<<2)             /* Metadata updates go through a write-ahead journal */
+#define FS_FEATURE_BITMAP   (1u<<3)             /* Free block bitmap is stored after Inode table */
+#define FS_FEATURE_CLONE    (1u<<4)             /* Files may share data blocks (fs_clone, copy-on-write) */
+#define FS_FEATURE_COMPRESS (1u<<5)             /* Files may store data blocks compressed (fs_set_compressed) */
+#define FS_FEATURE_CHECKSUM (1u<<6)             /* CRC32C of each data block is stored in a table after journal */
+#define FS_FEATURES         (FS_FEATURE_EXTENTS | FS_FEATURE_INLINE | FS_FEATURE_JOURNAL | FS_FEATURE_BITMAP | FS_FEATURE_CLONE | FS_FEATURE_COMPRESS | FS_FEATURE_CHECKSUM)   /* Features supported by this implementation */
+#define INLINE_RECORD_SIZE  (128)               /* Size of Inode record with inline data */
+#define INLINE_INODES_PER_BLOCK (BLOCK_SIZE / INLINE_RECORD_SIZE)   /* Number of inline data Inodes per block */
+#define INLINE_DATA_SIZE    (INLINE_RECORD_SIZE - 2*sizeof(uint32_t))   /* Largest file stored in its Inode record */
+#define BITMAP_WORDS_PER_BLOCK  (BLOCK_SIZE / sizeof(uint64_t))   /* Number of stored free block bitmap words per block */
+#define JOURNAL_MAGIC       (0x4a524e4c)        /* Magic number of journal records */
+#define JOURNAL_RECORD_BLOCKS   (POINTERS_PER_BLOCK - 4)    /* Most block images described by a journal record */
+#define FS_JOURNAL_BLOCKS   (256)               /* Largest journal reserved by fs_format */
+#define FS_JOURNAL_MIN      (4)                 /* Smallest usable journal */
+#define FS_COMMIT_MS        (100)               /* Default group commit window (milliseconds) */
+#define FS_IOV_BLOCKS       (128)               /* Maximum blocks per vectored transfer */
+#define FS_SCAN_BATCH       (64)                /* Indirect blocks read per mount-time batch */
+#define FS_INODE_LOCKS      (64)                /* Number of striped Inode locks */
+#define FS_STREAMS          (16)                /* Number of tracked sequential read streams */
+#define FS_READAHEAD_MIN    (4)                 /* Initial read-ahead window (blocks) */
+#define FS_READAHEAD_MAX    (32)                /* Maximum read-ahead window (blocks) */
+#define FS_ITER_EXTENTS     (64)                /* Maximum extents handed to a read iterator at once */
+#define INODE_COMPRESSED    (1u<<1)             /* Inode valid flag of files holding compressed clusters */
+#define FS_CLUSTER_BLOCKS   (4)                 /* Logical blocks compressed together by compressed files */
+#define FS_CLUSTER_SIZE     (FS_CLUSTER_BLOCKS*BLOCK_SIZE)  /* Bytes of file data per compressed cluster */
+#define CHECKSUMS_PER_BLOCK (BLOCK_SIZE / sizeof(uint32_t))    /* Number of block checksums per checksum table block */
+#define FS_SCRUB_THREADS    (4)                 /* Default number of threads of fs_scrub */
+#define FS_SCRUB_BLOCKS     (256)               /* Blocks read at once by each fs_scrub thread */
 
 /* File System Structures */
 
@@ -24,45 +69,273 @@ struct SuperBlock {
     uint32_t    blocks;                         /* Number of blocks in file system */
     uint32_t    inode_blocks;                   /* Number of blocks reserved for inodes */
     uint32_t    inodes;                         /* Number of inodes in file system */
+    uint32_t    features;                       /* Feature flags (FS_FEATURE_*) */
+    uint32_t    journal_blocks;                 /* Number of blocks reserved for journal after free block bitmap */
+    uint32_t    bitmap_blocks;                  /* Number of blocks reserved for free block bitmap after Inode table */
+    uint32_t    clean;                          /* Whether stored free block bitmap is current (cleanly unmounted) */
+    uint32_t    checksum_blocks;                /* Number of blocks reserved for block checksums after journal */
+};
+
+typedef struct JournalHeader JournalHeader;
+struct JournalHeader {
+    uint32_t    magic;                          /* Journal record magic number */
+    uint32_t    sequence;                       /* Transaction sequence number */
+    uint32_t    count;                          /* Number of block images following header */
+    uint32_t    checksum;                       /* Checksum of header fields, block numbers and images */
+    uint32_t    blocks[JOURNAL_RECORD_BLOCKS];  /* Home block of each image */
+};
+
+typedef struct Extent     Extent;
+struct Extent {
+    uint32_t    start;                          /* First block of extent (0 for a hole) */
+    uint32_t    length;                         /* Number of blocks in extent (0 if unused) */
+};
+
+typedef struct ExtentLeaf ExtentLeaf;
+struct ExtentLeaf {
+    uint32_t    block;                          /* Block holding extents (0 if unused) */
+    uint32_t    first;                          /* Logical block of first extent */
 };
 
 typedef struct Inode      Inode;
 struct Inode {
-    uint32_t    valid;                          /* Whether or not inode is valid */
+    uint32_t    valid;                          /* Whether or not inode is valid (plus INODE_* flags) */
     uint32_t    size;                           /* Size of file */
-    uint32_t    direct[POINTERS_PER_INODE];     /* Direct pointers */
-    uint32_t    indirect;                       /* Indirect pointers */
+    union {
+        struct {
+            uint32_t    direct[POINTERS_PER_INODE]; /* Direct pointers */
+            uint32_t    indirect;                   /* Indirect pointers */
+        };
+        struct {
+            Extent      extents[EXTENTS_PER_INODE]; /* Extents in logical order (unless in leaves) */
+            uint32_t    nextents;                   /* Number of extents of file */
+            uint32_t    extent_root;                /* Block of extent leaves (aliases indirect) */
+        };
+    };
+};
+
+typedef struct InlineInode InlineInode;
+struct InlineInode {
+    Inode       inode;                          /* Inode (data overlays pointers while file is inline) */
+    char        tail[INLINE_RECORD_SIZE - sizeof(Inode)];  /* Rest of inline data (zero once file outgrows it) */
 };
 
 typedef union  Block      Block;
 union Block {
     SuperBlock  super;                          /* View block as superblock */
     Inode       inodes[INODES_PER_BLOCK];       /* View block as inode */
+    InlineInode inline_inodes[INLINE_INODES_PER_BLOCK];    /* View block as inline data inodes */
     uint32_t    pointers[POINTERS_PER_BLOCK];   /* View block as pointers */
+    Extent      extents[EXTENTS_PER_BLOCK];     /* View block as extent leaf */
+    ExtentLeaf  leaves[EXTENTS_PER_BLOCK];      /* View block as extent root */
+    JournalHeader journal;                      /* View block as journal record header */
     char        data[BLOCK_SIZE];               /* View block as data */
 };
 
+typedef struct BlockPath  BlockPath;
+struct BlockPath {
+    size_t       block;                         /* Pointer block held (0 if none) */
+    bool         dirty;                         /* Whether or not pointer block was modified */
+    Block        pointers;                      /* Contents of pointer block */
+};
+
+typedef struct BlockMap   BlockMap;
+struct BlockMap {
+    Inode       *inode;                         /* Inode being mapped */
+    Block        indirect;                      /* Indirect pointer block */
+    BlockPath    path[FS_INDIRECT_DEPTH];       /* Pointer blocks on path to last double or triple indirect block */
+    bool         loaded;                        /* Whether or not indirect block was loaded */
+    bool         dirty;                         /* Whether or not indirect block was modified */
+    bool         fresh;                         /* Whether or not last mapped block was just allocated */
+    size_t       copied;                        /* Shared block that last mapped block replaced (0 if none) */
+    size_t       want;                          /* Number of blocks still expected to be allocated */
+    size_t       goal;                          /* Preferred next block to allocate */
+    size_t       next;                          /* Next reserved block */
+    size_t       left;                          /* Number of reserved blocks left */
+    size_t       leaf;                          /* Extent leaf of cursor (extent Inodes) */
+    size_t       slot;                          /* Extent of cursor within leaf */
+    size_t       first;                         /* Logical block cursor extent begins at */
+};
+
+typedef struct ReadStream ReadStream;
+struct ReadStream {
+    size_t       inode_number;                  /* Inode being read */
+    bool         active;                        /* Whether or not stream tracks an Inode */
+    size_t       next;                          /* Byte offset expected by next sequential read */
+    size_t       window;                        /* Read-ahead window in blocks (0 if not sequential) */
+    size_t       ahead;                         /* Logical block up to which blocks were prefetched */
+    bool         pinned;                        /* Whether or not indirect block is pinned */
+    Block        indirect;                      /* Pinned copy of indirect pointer block */
+};
+
+typedef bool (*FsReadIter)(const struct iovec *iov, int iovcnt, size_t offset, void *ctx);
+typedef void (*FsDefragReport)(size_t inode_number, size_t before, size_t after, void *ctx);
+typedef void (*FsScrubReport)(size_t block, void *ctx);
+
+typedef enum {
+    FORMAT_FAST,                                /* Discard data blocks (sparse image) */
+    FORMAT_SECURE,                              /* Overwrite data blocks with zeros */
+} FormatMode;
+
+typedef struct FsInfo FsInfo;
+struct FsInfo {
+    size_t       size;                          /* Logical size of file (bytes) */
+    size_t       physical;                      /* Bytes of data blocks mapped by file (0 if inline) */
+    bool         compressed;                    /* Whether or not file data is compressed */
+};
+
+typedef struct FormatOptions FormatOptions;
+struct FormatOptions {
+    FormatMode   mode;                          /* How to clear data blocks */
+    uint32_t     features;                      /* Feature flags to enable (FS_FEATURE_*) */
+};
+
+typedef struct MountOptions MountOptions;
+struct MountOptions {
+    size_t       threads;                       /* Threads used for mount-time scan (0 or 1 for serial) */
+    bool         deferred_reclaim;              /* Release blocks of removed Inodes in a background thread */
+    size_t       commit_ms;                     /* Group commit window of journal in milliseconds (0 for FS_COMMIT_MS) */
+    bool         skip_verify;                   /* Do not verify data block checksums on read (FS_FEATURE_CHECKSUM) */
+};
+
+typedef struct ReclaimQueue ReclaimQueue;
+struct ReclaimQueue {
+    Inode       *inodes;                        /* Removed Inodes whose blocks are not yet released */
+    size_t       count;                         /* Number of queued Inodes */
+    size_t       capacity;                      /* Number of Inodes queue can hold */
+    size_t       busy;                          /* Number of Inodes being released */
+    bool         started;                       /* Whether or not reclaim thread is running */
+    bool         stopping;                      /* Whether or not reclaim thread should exit */
+    pthread_t    thread;                        /* Thread releasing blocks */
+    pthread_mutex_t lock;                       /* Protects queue and flags */
+    pthread_cond_t  ready;                      /* Signalled when Inodes are queued */
+    pthread_cond_t  drained;                    /* Signalled when queued Inodes are released */
+};
+
+typedef struct Journal Journal;
+struct Journal {
+    uint32_t    *blocks;                        /* Home block of each image in running transaction */
+    Block       *images;                        /* Latest contents of each block in running transaction */
+    size_t       count;                         /* Number of blocks in running transaction */
+    size_t       capacity;                      /* Most blocks one journal record holds (0 if not journaling) */
+    uint32_t     sequence;                      /* Sequence number of running transaction */
+    uint64_t     started;                       /* Time first block joined running transaction (from stats_now) */
+    uint64_t     window;                        /* Group commit window (nanoseconds) */
+    size_t       commits;                       /* Number of transactions committed since mount */
+    Bitmap      *freed;                         /* Blocks released by running transaction (guarded by alloc lock) */
+    Bitmap      *allocated;                     /* Blocks allocated since last record (FS_FEATURE_CHECKSUM, guarded by alloc lock) */
+    pthread_mutex_t  lock;                      /* Protects running transaction */
+    pthread_rwlock_t handles;                   /* Held for reading by updates, for writing by commit */
+};
+
+typedef struct FsStats FsStats;
+struct FsStats {
+    OpStats      mount;                         /* fs_mount calls */
+    OpStats      create;                        /* fs_create calls */
+    OpStats      remove;                        /* fs_remove calls */
+    OpStats      stat;                          /* fs_stat calls */
+    OpStats      read;                          /* fs_read calls (bytes read) */
+    OpStats      write;                         /* fs_write calls (bytes written) */
+    OpStats      clone;                         /* fs_clone calls */
+    OpStats      disk_read;                     /* Disk read calls (bytes read) */
+    OpStats      disk_write;                    /* Disk write calls (bytes written) */
+    size_t       cache_hits;                    /* Block cache lookups served from memory */
+    size_t       cache_misses;                  /* Block cache lookups that went to disk */
+    size_t       alloc_calls;                   /* Block allocator calls */
+    size_t       alloc_words;                   /* Bitmap words searched by block allocator */
+    size_t       commits;                       /* Journal transactions committed */
+    size_t       disk_flushes;                  /* Disk flushes (each journal commit makes one) */
+    size_t       checksum_errors;               /* Data blocks read whose checksum did not match */
+};
+
 typedef struct FileSystem FileSystem;
 struct FileSystem {
     Disk        *disk;                          /* Disk file system is mounted on */
-    bool        *free_blocks;                   /* Free block bitmap */
+    Bitmap      *free_blocks;                   /* Free block bitmap */
+    size_t       free_hint;                     /* Next-fit allocation hint */
+    Bitmap      *stored_blocks;                 /* Free block bitmap as stored on disk (NULL if unknown) */
+    uint32_t    *shares;                        /* Extra references to each block (FS_FEATURE_CLONE, NULL otherwise) */
+    uint32_t    *checksums;                     /* CRC32C of each block, 0 if unknown (FS_FEATURE_CHECKSUM, NULL otherwise) */
+    Bitmap      *dirty_checksums;               /* Checksum table blocks that must be written */
+    bool         clean;                         /* Whether unmount may store free block bitmap and mark SuperBlock clean */
     SuperBlock   meta_data;                     /* File system meta data */
+    MountOptions options;                       /* Options file system was mounted with */
+    Cache       *cache;                         /* Block cache (NULL if disabled) */
+    Aio         *aio;                           /* Asynchronous data reads (NULL if disabled) */
+    Block       *inode_table;                   /* In-memory copy of Inode blocks */
+    Bitmap      *dirty_inodes;                  /* Inode blocks that must be written */
+    Bitmap      *free_inodes;                   /* Free inode bitmap */
+    size_t       inode_hint;                    /* Lowest possibly free inode */
+    size_t       defrag_next;                   /* Next Inode examined by fs_defrag */
+    ReadStream  *streams;                       /* Sequential read streams (hashed by inode) */
+    FsStats      stats;                         /* Operation statistics since mount */
+    ReclaimQueue reclaim;                       /* Deferred block reclamation (MountOptions.deferred_reclaim) */
+    Journal      journal;                       /* Metadata journal (FS_FEATURE_JOURNAL) */
+    bool         locked;                        /* Whether or not locks are initialized */
+    pthread_mutex_t  alloc_lock;                /* Protects free blocks, shares, hint and allocator stats */
+    pthread_mutex_t  table_lock;                /* Protects dirty/free inode bitmaps and hint */
+    pthread_mutex_t  stream_lock;               /* Protects read streams */
+    pthread_mutex_t  checksum_lock;             /* Serializes checksum updates and protects dirty checksum blocks */
+    pthread_rwlock_t inode_locks[FS_INODE_LOCKS];   /* Inode locks (striped by inode number) */
+    size_t       inode_versions[FS_INODE_LOCKS];    /* Bumped when block pointers of an Inode in stripe change */
+};
+
+typedef struct FsHandle FsHandle;
+struct FsHandle {
+    FileSystem  *fs;                            /* FileSystem Inode belongs to */
+    size_t       inode_number;                  /* Inode opened */
+    size_t       offset;                        /* Cursor of fs_hread and fs_hwrite */
+    bool         mapped;                        /* Whether or not node and map are current */
+    size_t       version;                       /* Inode stripe version node and map were loaded at */
+    Inode        node;                          /* Pinned copy of Inode */
+    BlockMap     map;                           /* Decoded pointer blocks (or extent leaves) of node */
 };
 
 /* File System Functions */
 
 void    fs_debug(Disk *disk);
 bool    fs_format(FileSystem *fs, Disk *disk);
+bool    fs_format_mode(FileSystem *fs, Disk *disk, FormatMode mode);
+bool    fs_format_options(FileSystem *fs, Disk *disk, const FormatOptions *options);
 
 bool    fs_mount(FileSystem *fs, Disk *disk);
+bool    fs_mount_options(FileSystem *fs, Disk *disk, const MountOptions *options);
 void    fs_unmount(FileSystem *fs);
 
+bool    fs_set_cache(FileSystem *fs, size_t capacity);
+bool    fs_set_aio(FileSystem *fs, AioBackend backend, size_t depth);
+bool    fs_sync(FileSystem *fs);
+ssize_t fs_free_count(FileSystem *fs);
+FsStats fs_stats(FileSystem *fs);
+size_t  fs_allocate_run(FileSystem *fs, size_t count, size_t goal, size_t *length);
+
 ssize_t fs_create(FileSystem *fs);
+ssize_t fs_create_n(FileSystem *fs, size_t n, ssize_t out[]);
 bool    fs_remove(FileSystem *fs, size_t inode_number);
+ssize_t fs_remove_many(FileSystem *fs, const size_t inode_numbers[], size_t n);
 ssize_t fs_stat(FileSystem *fs, size_t inode_number);
+bool    fs_stat_info(FileSystem *fs, size_t inode_number, FsInfo *info);
+bool    fs_set_compressed(FileSystem *fs, size_t inode_number, bool compressed);
+ssize_t fs_clone(FileSystem *fs, size_t inode_number);
 
 ssize_t fs_read(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset);
 ssize_t fs_write(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset);
+ssize_t fs_read_iter(FileSystem *fs, size_t inode_number, size_t offset, size_t length, FsReadIter callback, void *ctx);
+ssize_t fs_punch_hole(FileSystem *fs, size_t inode_number, size_t offset, size_t length);
+
+FsHandle *fs_open(FileSystem *fs, size_t inode_number);
+void    fs_close(FsHandle *handle);
+ssize_t fs_pread(FsHandle *handle, char *data, size_t length, size_t offset);
+ssize_t fs_pwrite(FsHandle *handle, char *data, size_t length, size_t offset);
+ssize_t fs_pread_iter(FsHandle *handle, size_t offset, size_t length, FsReadIter callback, void *ctx);
+ssize_t fs_append(FsHandle *handle, char *data, size_t length);
+ssize_t fs_hread(FsHandle *handle, char *data, size_t length);
+ssize_t fs_hwrite(FsHandle *handle, char *data, size_t length);
+size_t  fs_seek(FsHandle *handle, size_t offset);
+
+ssize_t fs_fragmentation(FileSystem *fs, size_t inode_number);
+ssize_t fs_defrag(FileSystem *fs, size_t budget, FsDefragReport report, void *ctx);
+ssize_t fs_scrub(FileSystem *fs, size_t threads, FsScrubReport report, void *ctx);
 
 #endif
 
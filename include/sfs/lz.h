@@ -0,0 +1,27 @@
+/* lz.h: SimpleFS LZ4 block codec */
+
+#ifndef LZ_H
+#define LZ_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <sys/types.h>
+
+/* LZ Constants */
+
+#define LZ_MIN_MATCH        (4)                 /* Shortest match encoded by a sequence */
+#define LZ_LAST_LITERALS    (5)                 /* Bytes at end of input always emitted as literals */
+#define LZ_MATCH_LIMIT      (12)                /* Matches start at least this many bytes before end */
+#define LZ_MAX_OFFSET       (65535)             /* Farthest back a match may reach */
+#define LZ_HASH_LOG         (12)                /* Log2 of number of match finder hash slots */
+
+/* LZ Functions */
+
+size_t  lz_bound(size_t length);
+size_t  lz_compress(const char *source, size_t length, char *dest, size_t capacity);
+ssize_t lz_decompress(const char *source, size_t length, char *dest, size_t capacity);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,35 @@
+/* stats.h: SimpleFS operation statistics */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+/* Stats Constants */
+
+#define STATS_BUCKETS       (40)                /* Latency histogram buckets (log2 nanoseconds) */
+
+/* Stats Structures */
+
+typedef struct OpStats OpStats;
+struct OpStats {
+    size_t      calls;                          /* Number of calls */
+    size_t      errors;                         /* Number of calls that failed */
+    size_t      bytes;                          /* Number of bytes transferred */
+    uint64_t    nanoseconds;                    /* Total latency */
+    uint64_t    histogram[STATS_BUCKETS];       /* Calls by log2 latency in nanoseconds */
+};
+
+/* Stats Functions */
+
+uint64_t    stats_now();
+ssize_t     stats_record(OpStats *stats, uint64_t start, ssize_t result);
+void        stats_snapshot(OpStats *snapshot, const OpStats *stats);
+uint64_t    stats_average(const OpStats *stats);
+uint64_t    stats_percentile(const OpStats *stats, double percentile);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,512 @@
+/* aio.c: SimpleFS asynchronous disk I/O */
+
+/* linux/io_uring.h pulls in linux/fs.h, which has its own BLOCK_SIZE */
+#include <linux/io_uring.h>
+#undef  BLOCK_SIZE
+
+#include "sfs/aio.h"
+#include "sfs/utils.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* Internal Prototyes */
+
+bool    aio_uring_setup(Aio *aio);
+void    aio_uring_teardown(Aio *aio);
+bool    aio_uring_enter(Aio *aio, unsigned to_submit, unsigned min_complete);
+void    aio_uring_queue(Aio *aio, AioRequest *request);
+void    aio_uring_reap(Aio *aio, AioRequest *until);
+void *  aio_worker(void *arg);
+void    aio_perform(Aio *aio, AioRequest *request);
+void    aio_complete(Aio *aio, AioRequest *request, ssize_t result);
+bool    aio_done(Aio *aio, AioRequest *request);
+
+/* External Functions */
+
+/**
+ * Create asynchronous I/O engine for Disk by doing the following:
+ *
+ *  1. Allocate Aio structure and initialize locks.
+ *
+ *  2. Set up an io_uring instance (AIO_AUTO or AIO_URING).
+ *
+ *  3. Otherwise start worker thread pool (AIO_AUTO or AIO_THREADS).
+ *
+ * Note: Requests to memory mapped Disks complete synchronously during
+ * aio_submit, so no ring or workers are created for them.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       backend     Backend to use.
+ * @param       depth       Maximum number of requests in flight.
+ *
+ * @return      Pointer to newly allocated Aio structure (NULL on failure).
+ **/
+Aio *   aio_create(Disk *disk, AioBackend backend, size_t depth) {
+    if (!disk || depth == 0) return NULL;
+
+    Aio *aio = calloc(1, sizeof(Aio));
+    if (!aio) return NULL;
+
+    aio->disk    = disk;
+    aio->depth   = depth;
+    aio->ring_fd = -1;
+    pthread_mutex_init(&aio->lock, NULL);
+    pthread_mutex_init(&aio->reap_lock, NULL);
+    pthread_cond_init(&aio->ready, NULL);
+    pthread_cond_init(&aio->complete, NULL);
+
+    if (disk->map) {
+        aio->backend = (backend == AIO_URING) ? AIO_URING : AIO_THREADS;
+        return aio;
+    }
+
+    if (backend != AIO_THREADS && aio_uring_setup(aio)) {
+        aio->backend = AIO_URING;
+        return aio;
+    }
+
+    if (backend == AIO_URING) {
+        aio_delete(aio);
+        return NULL;
+    }
+
+    aio->backend = AIO_THREADS;
+    aio->workers = calloc(AIO_WORKERS, sizeof(pthread_t));
+    if (!aio->workers) {
+        aio_delete(aio);
+        return NULL;
+    }
+
+    for (size_t w = 0; w < AIO_WORKERS; w++) {
+        if (pthread_create(&aio->workers[w], NULL, aio_worker, aio) != 0) break;
+        aio->nworkers++;
+    }
+
+    if (aio->nworkers == 0) {
+        aio_delete(aio);
+        return NULL;
+    }
+    return aio;
+}
+
+/**
+ * Delete asynchronous I/O engine by doing the following:
+ *
+ *  1. Wait for requests in flight to complete.
+ *
+ *  2. Stop worker threads or tear down io_uring instance.
+ *
+ *  3. Release Aio memory.
+ *
+ * @param       aio         Pointer to Aio structure.
+ **/
+void    aio_delete(Aio *aio) {
+    if (!aio) return;
+
+    if (aio->ring_fd >= 0) {
+        aio_uring_reap(aio, NULL);
+        aio_uring_teardown(aio);
+    }
+
+    if (aio->nworkers) {
+        pthread_mutex_lock(&aio->lock);
+        aio->stopping = true;
+        pthread_cond_broadcast(&aio->ready);
+        pthread_mutex_unlock(&aio->lock);
+        for (size_t w = 0; w < aio->nworkers; w++) {
+            pthread_join(aio->workers[w], NULL);
+        }
+    }
+
+    pthread_mutex_destroy(&aio->lock);
+    pthread_mutex_destroy(&aio->reap_lock);
+    pthread_cond_destroy(&aio->ready);
+    pthread_cond_destroy(&aio->complete);
+    free(aio->workers);
+    free(aio);
+}
+
+/**
+ * Submit n requests by doing the following:
+ *
+ *  1. Check every request (nothing is submitted if any request is invalid).
+ *
+ *  2. Queue each request, waiting for completions whenever depth requests
+ *  are already in flight.
+ *
+ *  3. Hand all queued io_uring entries to the kernel with a single call.
+ *
+ * Note: Callbacks may run on any thread (including the submitting one) and
+ * must not submit or wait on requests themselves.
+ *
+ * @param       aio         Pointer to Aio structure.
+ * @param       requests    Array of requests (block, count, data, write,
+ *                          callback and arg must be set).
+ * @param       n           Number of requests.
+ *
+ * @return      Whether or not all requests were submitted.
+ **/
+bool    aio_submit(Aio *aio, AioRequest *requests, size_t n) {
+    if (!aio || (!requests && n)) return false;
+
+    for (size_t r = 0; r < n; r++) {
+        AioRequest *request = &requests[r];
+        if (!request->data || request->count == 0) return false;
+        if (request->block >= aio->disk->blocks || request->count > aio->disk->blocks - request->block) return false;
+    }
+
+    for (size_t r = 0; r < n; r++) {
+        AioRequest *request = &requests[r];
+        request->done   = false;
+        request->result = DISK_FAILURE;
+        request->next   = NULL;
+        request->start  = stats_now();
+
+        pthread_mutex_lock(&aio->lock);
+        while (aio->inflight >= aio->depth) {
+            if (aio->ring_fd >= 0) {
+                bool entered = aio_uring_enter(aio, aio->unsubmitted, 0);
+                aio->unsubmitted = 0;
+                pthread_mutex_unlock(&aio->lock);
+                if (!entered) return false;
+                aio_uring_reap(aio, NULL);
+                pthread_mutex_lock(&aio->lock);
+            } else {
+                pthread_cond_wait(&aio->complete, &aio->lock);
+            }
+        }
+        aio->inflight++;
+
+        if (aio->ring_fd >= 0) {
+            aio_uring_queue(aio, request);
+            pthread_mutex_unlock(&aio->lock);
+        } else if (aio->nworkers) {
+            if (aio->tail) {
+                aio->tail->next = request;
+            } else {
+                aio->head = request;
+            }
+            aio->tail = request;
+            pthread_cond_signal(&aio->ready);
+            pthread_mutex_unlock(&aio->lock);
+        } else {
+            pthread_mutex_unlock(&aio->lock);
+            aio_perform(aio, request);
+        }
+    }
+
+    bool success = true;
+    if (aio->ring_fd >= 0) {
+        pthread_mutex_lock(&aio->lock);
+        success = aio_uring_enter(aio, aio->unsubmitted, 0);
+        aio->unsubmitted = 0;
+        pthread_mutex_unlock(&aio->lock);
+    }
+    return success;
+}
+
+/**
+ * Wait for request to complete (reaping completions of other requests along
+ * the way).
+ *
+ * @param       aio         Pointer to Aio structure.
+ * @param       request     Pointer to submitted AioRequest structure.
+ *
+ * @return      Whether or not the request transferred all of its blocks.
+ **/
+bool    aio_wait(Aio *aio, AioRequest *request) {
+    if (!aio || !request) return false;
+
+    if (aio->ring_fd >= 0) {
+        aio_uring_reap(aio, request);
+    } else {
+        pthread_mutex_lock(&aio->lock);
+        while (!request->done) {
+            pthread_cond_wait(&aio->complete, &aio->lock);
+        }
+        pthread_mutex_unlock(&aio->lock);
+    }
+    return request->result == (ssize_t)(request->count * BLOCK_SIZE);
+}
+
+/**
+ * Wait for n requests to complete.
+ *
+ * @param       aio         Pointer to Aio structure.
+ * @param       requests    Array of submitted requests.
+ * @param       n           Number of requests.
+ *
+ * @return      Whether or not every request transferred all of its blocks.
+ **/
+bool    aio_wait_all(Aio *aio, AioRequest *requests, size_t n) {
+    bool success = true;
+    for (size_t r = 0; r < n; r++) {
+        if (!aio_wait(aio, &requests[r])) {
+            success = false;
+        }
+    }
+    return success;
+}
+
+/* Internal Functions */
+
+/**
+ * Set up io_uring instance by doing the following:
+ *
+ *  1. Create ring with io_uring_setup for depth entries.
+ *
+ *  2. Map submission ring, completion ring, and submission entries.
+ *
+ *  3. Record ring pointers and clamp depth to the number of entries.
+ *
+ * @param       aio         Pointer to Aio structure.
+ *
+ * @return      Whether or not io_uring is available.
+ **/
+bool    aio_uring_setup(Aio *aio) {
+#ifdef __NR_io_uring_setup
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    int fd = syscall(__NR_io_uring_setup, (unsigned)min(aio->depth, (size_t)4096), &params);
+    if (fd < 0) return false;
+    aio->ring_fd = fd;
+
+    aio->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    aio->cq_ring_size = params.cq_off.cqes  + params.cq_entries * sizeof(struct io_uring_cqe);
+    aio->sqes_size    = params.sq_entries * sizeof(struct io_uring_sqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        aio->sq_ring_size = aio->cq_ring_size = max(aio->sq_ring_size, aio->cq_ring_size);
+    }
+
+    aio->sq_ring = mmap(NULL, aio->sq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (aio->sq_ring == MAP_FAILED) {
+        aio->sq_ring = NULL;
+        aio_uring_teardown(aio);
+        return false;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        aio->cq_ring = aio->sq_ring;
+    } else {
+        aio->cq_ring = mmap(NULL, aio->cq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (aio->cq_ring == MAP_FAILED) {
+            aio->cq_ring = NULL;
+            aio_uring_teardown(aio);
+            return false;
+        }
+    }
+
+    aio->sqes = mmap(NULL, aio->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (aio->sqes == MAP_FAILED) {
+        aio->sqes = NULL;
+        aio_uring_teardown(aio);
+        return false;
+    }
+
+    char *sq = aio->sq_ring;
+    char *cq = aio->cq_ring;
+    aio->sq_tail  = (unsigned *)(sq + params.sq_off.tail);
+    aio->sq_mask  = (unsigned *)(sq + params.sq_off.ring_mask);
+    aio->sq_array = (unsigned *)(sq + params.sq_off.array);
+    aio->cq_head  = (unsigned *)(cq + params.cq_off.head);
+    aio->cq_tail  = (unsigned *)(cq + params.cq_off.tail);
+    aio->cq_mask  = (unsigned *)(cq + params.cq_off.ring_mask);
+    aio->cqes     = cq + params.cq_off.cqes;
+    aio->depth    = min(aio->depth, (size_t)params.sq_entries);
+    return true;
+#else
+    return false;
+#endif
+}
+
+/**
+ * Unmap rings and close io_uring instance.
+ *
+ * @param       aio         Pointer to Aio structure.
+ **/
+void    aio_uring_teardown(Aio *aio) {
+    if (aio->sqes) munmap(aio->sqes, aio->sqes_size);
+    if (aio->cq_ring && aio->cq_ring != aio->sq_ring) munmap(aio->cq_ring, aio->cq_ring_size);
+    if (aio->sq_ring) munmap(aio->sq_ring, aio->sq_ring_size);
+    if (aio->ring_fd >= 0) close(aio->ring_fd);
+    aio->sqes    = NULL;
+    aio->cq_ring = NULL;
+    aio->sq_ring = NULL;
+    aio->ring_fd = -1;
+}
+
+/**
+ * Submit queued entries and/or wait for completions with io_uring_enter.
+ *
+ * @param       aio             Pointer to Aio structure.
+ * @param       to_submit       Number of queued entries to submit.
+ * @param       min_complete    Number of completions to wait for.
+ *
+ * @return      Whether or not the call succeeded.
+ **/
+bool    aio_uring_enter(Aio *aio, unsigned to_submit, unsigned min_complete) {
+    if (to_submit == 0 && min_complete == 0) return true;
+#ifdef __NR_io_uring_enter
+    unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+    while (syscall(__NR_io_uring_enter, aio->ring_fd, to_submit, min_complete, flags, NULL, 0) < 0) {
+        if (errno != EINTR) return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+/**
+ * Place request in next submission queue entry.
+ *
+ * Note: Caller must hold aio lock.
+ *
+ * @param       aio         Pointer to Aio structure.
+ * @param       request     Pointer to AioRequest structure.
+ **/
+void    aio_uring_queue(Aio *aio, AioRequest *request) {
+    struct io_uring_sqe *sqes = aio->sqes;
+
+    unsigned tail  = *aio->sq_tail;
+    unsigned index = tail & *aio->sq_mask;
+    struct io_uring_sqe *sqe = &sqes[index];
+
+    request->iov.iov_base = request->data;
+    request->iov.iov_len  = request->count * BLOCK_SIZE;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode    = request->write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd        = aio->disk->fd;
+    sqe->off       = request->block * BLOCK_SIZE;
+    sqe->addr      = (uintptr_t)&request->iov;
+    sqe->len       = 1;
+    sqe->user_data = (uintptr_t)request;
+
+    aio->sq_array[index] = index;
+    __atomic_store_n(aio->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    aio->unsubmitted++;
+}
+
+/**
+ * Reap io_uring completions by doing the following:
+ *
+ *  1. Complete every available completion queue entry.
+ *
+ *  2. Stop once until has completed (or, without until, once something was
+ *  reaped or there is room for more requests); otherwise wait in the kernel
+ *  for another completion.
+ *
+ * @param       aio         Pointer to Aio structure.
+ * @param       until       Request to wait for (NULL to reap what is ready).
+ **/
+void    aio_uring_reap(Aio *aio, AioRequest *until) {
+    struct io_uring_cqe *cqes = aio->cqes;
+
+    pthread_mutex_lock(&aio->reap_lock);
+    while (true) {
+        size_t   reaped = 0;
+        unsigned head   = *aio->cq_head;
+        while (head != __atomic_load_n(aio->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &cqes[head & *aio->cq_mask];
+            AioRequest *request = (AioRequest *)(uintptr_t)cqe->user_data;
+            ssize_t     result  = cqe->res == (int)request->iov.iov_len ? cqe->res : DISK_FAILURE;
+            __atomic_store_n(aio->cq_head, ++head, __ATOMIC_RELEASE);
+            aio_complete(aio, request, result);
+            reaped++;
+        }
+
+        pthread_mutex_lock(&aio->lock);
+        bool finished = until ? until->done : (reaped > 0 || aio->inflight < aio->depth);
+        bool idle     = aio->inflight == 0;
+        pthread_mutex_unlock(&aio->lock);
+
+        if (finished || idle) break;
+        if (!aio_uring_enter(aio, 0, 1)) break;
+    }
+    pthread_mutex_unlock(&aio->reap_lock);
+}
+
+/**
+ * Serve queued requests until Aio is stopped (AIO_THREADS worker).
+ *
+ * @param       arg         Pointer to Aio structure.
+ *
+ * @return      NULL.
+ **/
+void *  aio_worker(void *arg) {
+    Aio *aio = arg;
+
+    pthread_mutex_lock(&aio->lock);
+    while (true) {
+        while (!aio->head && !aio->stopping) {
+            pthread_cond_wait(&aio->ready, &aio->lock);
+        }
+        if (!aio->head) break;
+
+        AioRequest *request = aio->head;
+        aio->head = request->next;
+        if (!aio->head) aio->tail = NULL;
+
+        pthread_mutex_unlock(&aio->lock);
+        aio_perform(aio, request);
+        pthread_mutex_lock(&aio->lock);
+    }
+    pthread_mutex_unlock(&aio->lock);
+    return NULL;
+}
+
+/**
+ * Perform request synchronously with a range read or write and complete it.
+ *
+ * @param       aio         Pointer to Aio structure.
+ * @param       request     Pointer to AioRequest structure.
+ **/
+void    aio_perform(Aio *aio, AioRequest *request) {
+    ssize_t result = request->write ? disk_write_range(aio->disk, request->block, request->count, request->data)
+                                    : disk_read_range(aio->disk, request->block, request->count, request->data);
+    aio_complete(aio, request, result);
+}
+
+/**
+ * Complete request by doing the following:
+ *
+ *  1. Account io_uring transfers in Disk counters and statistics (the other
+ *  backends go through disk_read_range and disk_write_range).
+ *
+ *  2. Mark request done, wake waiters, and invoke its callback.
+ *
+ * @param       aio         Pointer to Aio structure.
+ * @param       request     Pointer to AioRequest structure.
+ * @param       result      Bytes transferred (DISK_FAILURE on failure).
+ **/
+void    aio_complete(Aio *aio, AioRequest *request, ssize_t result) {
+    if (aio->ring_fd >= 0) {
+        Disk *disk = aio->disk;
+        if (result > 0) {
+            __atomic_add_fetch(request->write ? &disk->writes : &disk->reads, result / BLOCK_SIZE, __ATOMIC_RELAXED);
+        }
+        stats_record(request->write ? &disk->write_stats : &disk->read_stats, request->start, result);
+    }
+
+    /* Callback runs before done is published so request may be reused once
+     * waiters return */
+    request->result = result;
+    if (request->callback) {
+        request->callback(request);
+    }
+
+    pthread_mutex_lock(&aio->lock);
+    request->done = true;
+    aio->inflight--;
+    pthread_cond_broadcast(&aio->complete);
+    pthread_mutex_unlock(&aio->lock);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,327 @@
+/* bitmap.c: SimpleFS packed bitmap */
+
+#include "sfs/bitmap.h"
+#include "sfs/utils.h"
+
+#include <string.h>
+
+/* Internal Prototyes */
+
+size_t  bitmap_scan(const Bitmap *bitmap, size_t from, size_t to);
+void    bitmap_update(Bitmap *bitmap, size_t start, size_t count, bool value);
+
+/* External Functions */
+
+/**
+ * Create bitmap by doing the following:
+ *
+ *  1. Allocate Bitmap structure and packed words.
+ *
+ *  2. Set every bit to the specified value (bits past the end stay clear).
+ *
+ * @param       bits        Number of bits in bitmap.
+ * @param       value       Initial value of every bit.
+ *
+ * @return      Pointer to newly allocated Bitmap structure (NULL on failure).
+ **/
+Bitmap *bitmap_create(size_t bits, bool value) {
+    Bitmap *bitmap = calloc(1, sizeof(Bitmap));
+    if (!bitmap) return NULL;
+
+    bitmap->bits   = bits;
+    bitmap->nwords = (bits + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+    bitmap->words  = calloc(bitmap->nwords ? bitmap->nwords : 1, sizeof(uint64_t));
+    if (!bitmap->words) {
+        free(bitmap);
+        return NULL;
+    }
+
+    if (value && bits) {
+        memset(bitmap->words, 0xff, bitmap->nwords * sizeof(uint64_t));
+        if (bits % BITMAP_WORD_BITS) {
+            bitmap->words[bitmap->nwords - 1] = (UINT64_C(1) << (bits % BITMAP_WORD_BITS)) - 1;
+        }
+        bitmap->count = bits;
+    }
+    return bitmap;
+}
+
+/**
+ * Create copy of bitmap.
+ *
+ * @param       bitmap      Pointer to Bitmap structure to copy.
+ *
+ * @return      Pointer to newly allocated Bitmap structure (NULL on failure).
+ **/
+Bitmap *bitmap_copy(const Bitmap *bitmap) {
+    Bitmap *copy = bitmap_create(bitmap->bits, false);
+    if (!copy) return NULL;
+
+    memcpy(copy->words, bitmap->words, bitmap->nwords * sizeof(uint64_t));
+    copy->count = bitmap->count;
+    return copy;
+}
+
+/**
+ * Release bitmap memory.
+ *
+ * @param       bitmap      Pointer to Bitmap structure.
+ **/
+void    bitmap_delete(Bitmap *bitmap) {
+    if (!bitmap) return;
+    free(bitmap->words);
+    free(bitmap);
+}
+
+/**
+ * Test whether specified bit is set.
+ *
+ * @param       bitmap      Pointer to Bitmap structure.
+ * @param       bit         Bit index.
+ *
+ * @return      Whether or not bit is set (false if out of range).
+ **/
+bool    bitmap_test(const Bitmap *bitmap, size_t bit) {
+    if (bit >= bitmap->bits) return false;
+    return (bitmap->words[bit / BITMAP_WORD_BITS] >> (bit % BITMAP_WORD_BITS)) & 1;
+}
+
+/**
+ * Set specified bit (updating set bit count).
+ *
+ * @param       bitmap      Pointer to Bitmap structure.
+ * @param       bit         Bit index.
+ **/
+void    bitmap_set(Bitmap *bitmap, size_t bit) {
+    if (bit >= bitmap->bits || bitmap_test(bitmap, bit)) return;
+    bitmap->words[bit / BITMAP_WORD_BITS] |= UINT64_C(1) << (bit % BITMAP_WORD_BITS);
+    bitmap->count++;
+}
+
+/**
+ * Clear specified bit (updating set bit count).
+ *
+ * @param       bitmap      Pointer to Bitmap structure.
+ * @param       bit         Bit index.
+ **/
+void    bitmap_clear(Bitmap *bitmap, size_t bit) {
+    if (bit >= bitmap->bits || !bitmap_test(bitmap, bit)) return;
+    bitmap->words[bit / BITMAP_WORD_BITS] &= ~(UINT64_C(1) << (bit % BITMAP_WORD_BITS));
+    bitmap->count--;
+}
+
+/**
+ * Find first set bit at or after from, wrapping around to the beginning of
+ * the bitmap (next-fit search).
+ *
+ * @param       bitmap      Pointer to Bitmap structure.
+ * @param       from        Bit index to start searching at.
+ *
+ * @return      Index of set bit (BITMAP_NONE if no bit is set).
+ **/
+size_t  bitmap_find(const Bitmap *bitmap, size_t from) {
+    if (bitmap->count == 0) return BITMAP_NONE;
+    if (from >= bitmap->bits) from = 0;
+
+    size_t bit = bitmap_scan(bitmap, from, bitmap->bits);
+    if (bit == BITMAP_NONE && from > 0) {
+        bit = bitmap_scan(bitmap, 0, from);
+    }
+    return bit;
+}
+
+/**
+ * Return length of the run of set bits beginning at start.
+ *
+ * @param       bitmap      Pointer to Bitmap structure.
+ * @param       start       Bit index of beginning of run.
+ *
+ * @return      Number of consecutive set bits (0 if start is clear).
+ **/
+size_t  bitmap_run(const Bitmap *bitmap, size_t start) {
+    if (start >= bitmap->bits) return 0;
+
+    size_t   w    = start / BITMAP_WORD_BITS;
+    uint64_t word = ~bitmap->words[w] & (~UINT64_C(0) << (start % BITMAP_WORD_BITS));
+    while (!word) {
+        if (++w >= bitmap->nwords) return bitmap->bits - start;
+        word = ~bitmap->words[w];
+    }
+
+    size_t end = w*BITMAP_WORD_BITS + __builtin_ctzll(word);
+    return min(end, bitmap->bits) - start;
+}
+
+/**
+ * Find best-fitting run of set bits for count bits by doing the following:
+ *
+ *  1. Walk every run of set bits, jumping over clear and set words.
+ *
+ *  2. Return the smallest run that holds count bits (stopping early on an
+ *  exact fit), or the largest run if none is long enough.
+ *
+ * @param       bitmap      Pointer to Bitmap structure.
+ * @param       count       Desired number of consecutive set bits.
+ * @param       length      Where to store length of returned run.
+ *
+ * @return      Index of beginning of run (BITMAP_NONE if no bit is set).
+ **/
+size_t  bitmap_find_run(const Bitmap *bitmap, size_t count, size_t *length) {
+    size_t best        = BITMAP_NONE;
+    size_t best_length = 0;
+
+    size_t bit = bitmap_scan(bitmap, 0, bitmap->bits);
+    while (bit != BITMAP_NONE) {
+        size_t run = bitmap_run(bitmap, bit);
+        bool   fits = run >= count;
+        if (best == BITMAP_NONE ||
+            (fits && (best_length < count || run < best_length)) ||
+            (!fits && best_length < count && run > best_length)) {
+            best        = bit;
+            best_length = run;
+            if (run == count) break;
+        }
+        bit = bitmap_scan(bitmap, bit + run, bitmap->bits);
+    }
+
+    if (length) *length = best_length;
+    return best;
+}
+
+/**
+ * Set count bits beginning at start (updating set bit count).
+ *
+ * @param       bitmap      Pointer to Bitmap structure.
+ * @param       start       First bit index.
+ * @param       count       Number of bits.
+ **/
+void    bitmap_set_range(Bitmap *bitmap, size_t start, size_t count) {
+    bitmap_update(bitmap, start, count, true);
+}
+
+/**
+ * Clear count bits beginning at start (updating set bit count).
+ *
+ * @param       bitmap      Pointer to Bitmap structure.
+ * @param       start       First bit index.
+ * @param       count       Number of bits.
+ **/
+void    bitmap_clear_range(Bitmap *bitmap, size_t start, size_t count) {
+    bitmap_update(bitmap, start, count, false);
+}
+
+/**
+ * Set every bit of bitmap that is set in mask (bitmap |= mask) a word at a
+ * time, recounting set bits with popcount.
+ *
+ * @param       bitmap      Pointer to Bitmap structure to update.
+ * @param       mask        Pointer to Bitmap structure with bits to set.
+ **/
+void    bitmap_set_bits(Bitmap *bitmap, const Bitmap *mask) {
+    size_t nwords = min(bitmap->nwords, mask->nwords);
+    for (size_t w = 0; w < nwords; w++) {
+        uint64_t old = bitmap->words[w];
+        bitmap->words[w] = old | mask->words[w];
+        bitmap->count   += __builtin_popcountll(bitmap->words[w]) - __builtin_popcountll(old);
+    }
+}
+
+/**
+ * Clear every bit of bitmap that is set in mask (bitmap &= ~mask) a word at a
+ * time, recounting set bits with popcount.
+ *
+ * @param       bitmap      Pointer to Bitmap structure to update.
+ * @param       mask        Pointer to Bitmap structure with bits to clear.
+ **/
+void    bitmap_clear_bits(Bitmap *bitmap, const Bitmap *mask) {
+    size_t nwords = min(bitmap->nwords, mask->nwords);
+    for (size_t w = 0; w < nwords; w++) {
+        uint64_t old = bitmap->words[w];
+        bitmap->words[w] = old & ~mask->words[w];
+        bitmap->count   -= __builtin_popcountll(old) - __builtin_popcountll(bitmap->words[w]);
+    }
+}
+
+/**
+ * Replace every bit with packed words read from storage, clearing bits past
+ * the end and recounting set bits with popcount.
+ *
+ * @param       bitmap      Pointer to Bitmap structure.
+ * @param       words       Packed words (at least bitmap->nwords of them).
+ **/
+void    bitmap_load(Bitmap *bitmap, const uint64_t *words) {
+    memcpy(bitmap->words, words, bitmap->nwords * sizeof(uint64_t));
+    if (bitmap->bits % BITMAP_WORD_BITS) {
+        bitmap->words[bitmap->nwords - 1] &= (UINT64_C(1) << (bitmap->bits % BITMAP_WORD_BITS)) - 1;
+    }
+
+    bitmap->count = 0;
+    for (size_t w = 0; w < bitmap->nwords; w++) {
+        bitmap->count += __builtin_popcountll(bitmap->words[w]);
+    }
+}
+
+/**
+ * Return number of set bits.
+ *
+ * @param       bitmap      Pointer to Bitmap structure.
+ *
+ * @return      Number of set bits.
+ **/
+size_t  bitmap_count(const Bitmap *bitmap) {
+    return bitmap->count;
+}
+
+/* Internal Functions */
+
+/**
+ * Scan words for first set bit in [from, to) using count-trailing-zeros.
+ *
+ * @param       bitmap      Pointer to Bitmap structure.
+ * @param       from        First bit index to consider.
+ * @param       to          One past last bit index to consider.
+ *
+ * @return      Index of set bit (BITMAP_NONE if no bit is set in range).
+ **/
+size_t  bitmap_scan(const Bitmap *bitmap, size_t from, size_t to) {
+    if (from >= to) return BITMAP_NONE;
+
+    size_t   w    = from / BITMAP_WORD_BITS;
+    uint64_t word = bitmap->words[w] & (~UINT64_C(0) << (from % BITMAP_WORD_BITS));
+    while (true) {
+        if (word) {
+            size_t bit = w*BITMAP_WORD_BITS + __builtin_ctzll(word);
+            return (bit < to) ? bit : BITMAP_NONE;
+        }
+        if (++w >= bitmap->nwords || w*BITMAP_WORD_BITS >= to) return BITMAP_NONE;
+        word = bitmap->words[w];
+    }
+}
+
+/**
+ * Set or clear a range of bits a word at a time, adjusting the set bit count
+ * with popcount.
+ *
+ * @param       bitmap      Pointer to Bitmap structure.
+ * @param       start       First bit index.
+ * @param       count       Number of bits (clamped to end of bitmap).
+ * @param       value       Whether to set (true) or clear (false) bits.
+ **/
+void    bitmap_update(Bitmap *bitmap, size_t start, size_t count, bool value) {
+    if (start >= bitmap->bits) return;
+    size_t end = start + min(count, bitmap->bits - start);
+
+    while (start < end) {
+        size_t   w     = start / BITMAP_WORD_BITS;
+        size_t   lo    = start % BITMAP_WORD_BITS;
+        size_t   hi    = min(end - w*BITMAP_WORD_BITS, BITMAP_WORD_BITS);
+        uint64_t mask  = (hi == BITMAP_WORD_BITS ? ~UINT64_C(0) : (UINT64_C(1) << hi) - 1) & (~UINT64_C(0) << lo);
+        uint64_t old   = bitmap->words[w];
+
+        bitmap->words[w] = value ? (old | mask) : (old & ~mask);
+        bitmap->count   += __builtin_popcountll(bitmap->words[w]) - __builtin_popcountll(old);
+        start = w*BITMAP_WORD_BITS + hi;
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
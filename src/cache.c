@@ -0,0 +1,534 @@
+/* cache.c: SimpleFS block cache */
+
+#include "sfs/cache.h"
+#include "sfs/logging.h"
+#include "sfs/utils.h"
+
+#include <string.h>
+
+/* Internal Prototyes */
+
+const char *cache_load(Cache *cache, size_t block);
+size_t  cache_hash(Cache *cache, size_t block);
+size_t  cache_lookup(Cache *cache, size_t block);
+void    cache_unlink(Cache *cache, size_t entry);
+size_t  cache_evict(Cache *cache);
+bool    cache_writeback(Cache *cache, CacheEntry *entry);
+ssize_t cache_transfer(Cache *cache, size_t start, const struct iovec *iov, int iovcnt, bool write);
+
+/* External Functions */
+
+/**
+ * Create block cache for specified Disk by doing the following:
+ *
+ *  1. Allocate Cache structure and sets appropriate attributes.
+ *
+ *  2. Allocate entries, hash buckets, and block storage.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       capacity    Number of blocks to cache.
+ *
+ * @return      Pointer to newly allocated Cache structure (NULL on failure).
+ **/
+Cache * cache_create(Disk *disk, size_t capacity) {
+    if (!disk || capacity == 0) return NULL;
+
+    Cache *cache = calloc(1, sizeof(Cache));
+    if (!cache) return NULL;
+
+    cache->disk     = disk;
+    cache->capacity = capacity;
+    cache->nbuckets = 1;
+    while (cache->nbuckets < capacity) {
+        cache->nbuckets <<= 1;
+    }
+
+    cache->buckets = malloc(cache->nbuckets * sizeof(size_t));
+    cache->entries = calloc(capacity, sizeof(CacheEntry));
+    cache->blocks  = malloc(capacity * BLOCK_SIZE);
+    if (!cache->buckets || !cache->entries || !cache->blocks) {
+        free(cache->buckets);
+        free(cache->entries);
+        free(cache->blocks);
+        free(cache);
+        return NULL;
+    }
+
+    for (size_t b = 0; b < cache->nbuckets; b++) {
+        cache->buckets[b] = CACHE_NONE;
+    }
+
+    for (size_t e = 0; e < capacity; e++) {
+        cache->entries[e].next = CACHE_NONE;
+        cache->entries[e].data = cache->blocks + e*BLOCK_SIZE;
+    }
+
+    pthread_mutex_init(&cache->lock, NULL);
+    return cache;
+}
+
+/**
+ * Delete block cache by doing the following:
+ *
+ *  1. Write back any dirty blocks.
+ *
+ *  2. Release cache memory.
+ *
+ * @param       cache       Pointer to Cache structure.
+ **/
+void    cache_delete(Cache *cache) {
+    if (!cache) return;
+
+    if (!cache_flush(cache)) {
+        error("Unable to write back dirty blocks");
+    }
+
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->buckets);
+    free(cache->entries);
+    free(cache->blocks);
+    free(cache);
+}
+
+/**
+ * Read block through cache into data buffer.
+ *
+ * @param       cache       Pointer to Cache structure.
+ * @param       block       Block number to perform operation on.
+ * @param       data        Data buffer.
+ *
+ * @return      Number of bytes read.
+ *              (BLOCK_SIZE on success, DISK_FAILURE on failure).
+ **/
+ssize_t cache_read(Cache *cache, size_t block, char *data) {
+    if (!cache || !data) return DISK_FAILURE;
+
+    pthread_mutex_lock(&cache->lock);
+    const char *cached = cache_load(cache, block);
+    if (cached) {
+        memcpy(data, cached, BLOCK_SIZE);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return cached ? BLOCK_SIZE : DISK_FAILURE;
+}
+
+/**
+ * Copy block from cache into data buffer only if it is already cached (the
+ * Disk is never read).
+ *
+ * @param       cache       Pointer to Cache structure.
+ * @param       block       Block number to perform operation on.
+ * @param       data        Data buffer.
+ *
+ * @return      Whether or not block was cached.
+ **/
+bool    cache_probe(Cache *cache, size_t block, char *data) {
+    if (!cache || !data) return false;
+
+    pthread_mutex_lock(&cache->lock);
+    size_t e = cache_lookup(cache, block);
+    if (e != CACHE_NONE) {
+        __atomic_add_fetch(&cache->hits, 1, __ATOMIC_RELAXED);
+        cache->entries[e].referenced = true;
+        memcpy(data, cache->entries[e].data, BLOCK_SIZE);
+    } else {
+        __atomic_add_fetch(&cache->misses, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return e != CACHE_NONE;
+}
+
+/**
+ * Check whether any of count blocks beginning at start is cached with
+ * changes not yet written back.
+ *
+ * @param       cache       Pointer to Cache structure.
+ * @param       start       First block number to check.
+ * @param       count       Number of blocks to check.
+ *
+ * @return      Whether or not a block in range is dirty.
+ **/
+bool    cache_dirty(Cache *cache, size_t start, size_t count) {
+    if (!cache) return false;
+
+    bool dirty = false;
+    pthread_mutex_lock(&cache->lock);
+    for (size_t b = start; !dirty && b < start + count; b++) {
+        size_t e = cache_lookup(cache, b);
+        dirty = e != CACHE_NONE && cache->entries[e].dirty;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return dirty;
+}
+
+/**
+ * Write data buffer to block through cache by doing the following:
+ *
+ *  1. Lookup block in cache (or evict an entry for it).
+ *
+ *  2. Copy data into entry and mark it dirty (written back later).
+ *
+ * @param       cache       Pointer to Cache structure.
+ * @param       block       Block number to perform operation on.
+ * @param       data        Data buffer.
+ *
+ * @return      Number of bytes written.
+ *              (BLOCK_SIZE on success, DISK_FAILURE on failure).
+ **/
+ssize_t cache_write(Cache *cache, size_t block, char *data) {
+    if (!cache || !data || block >= cache->disk->blocks) return DISK_FAILURE;
+
+    pthread_mutex_lock(&cache->lock);
+    size_t e = cache_lookup(cache, block);
+    if (e != CACHE_NONE) {
+        __atomic_add_fetch(&cache->hits, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_add_fetch(&cache->misses, 1, __ATOMIC_RELAXED);
+        if ((e = cache_evict(cache)) == CACHE_NONE) {
+            pthread_mutex_unlock(&cache->lock);
+            return DISK_FAILURE;
+        }
+
+        cache->entries[e].block = block;
+        cache->entries[e].valid = true;
+        cache->entries[e].next  = cache->buckets[cache_hash(cache, block)];
+        cache->buckets[cache_hash(cache, block)] = e;
+    }
+
+    CacheEntry *entry = &cache->entries[e];
+    memcpy(entry->data, data, BLOCK_SIZE);
+    entry->dirty      = true;
+    entry->referenced = true;
+    pthread_mutex_unlock(&cache->lock);
+    return BLOCK_SIZE;
+}
+
+/**
+ * Read contiguous blocks beginning at start through cache into scattered
+ * buffers by doing the following:
+ *
+ *  1. Copy blocks that are already cached.
+ *
+ *  2. Read each run of uncached blocks with a single vectored disk read
+ *  (bulk reads are not inserted into the cache).
+ *
+ * Note: Each vector must be exactly BLOCK_SIZE bytes.
+ *
+ * @param       cache       Pointer to Cache structure.
+ * @param       start       First block number to perform operation on.
+ * @param       iov         Array of block buffers.
+ * @param       iovcnt      Number of block buffers.
+ *
+ * @return      Number of bytes read (DISK_FAILURE on failure).
+ **/
+ssize_t cache_readv(Cache *cache, size_t start, const struct iovec *iov, int iovcnt) {
+    if (!cache) return DISK_FAILURE;
+
+    pthread_mutex_lock(&cache->lock);
+    ssize_t result = cache_transfer(cache, start, iov, iovcnt, false);
+    pthread_mutex_unlock(&cache->lock);
+    return result;
+}
+
+/**
+ * Write contiguous blocks beginning at start through cache from gathered
+ * buffers by doing the following:
+ *
+ *  1. Update blocks that are already cached (marking them dirty).
+ *
+ *  2. Write each run of uncached blocks with a single vectored disk write.
+ *
+ * Note: Each vector must be exactly BLOCK_SIZE bytes.
+ *
+ * @param       cache       Pointer to Cache structure.
+ * @param       start       First block number to perform operation on.
+ * @param       iov         Array of block buffers.
+ * @param       iovcnt      Number of block buffers.
+ *
+ * @return      Number of bytes written (DISK_FAILURE on failure).
+ **/
+ssize_t cache_writev(Cache *cache, size_t start, const struct iovec *iov, int iovcnt) {
+    if (!cache) return DISK_FAILURE;
+
+    pthread_mutex_lock(&cache->lock);
+    ssize_t result = cache_transfer(cache, start, iov, iovcnt, true);
+    pthread_mutex_unlock(&cache->lock);
+    return result;
+}
+
+/**
+ * Load count contiguous blocks beginning at start into cache ahead of use by
+ * doing the following:
+ *
+ *  1. Skip blocks that are already cached.
+ *
+ *  2. Evict an entry for each block in a run of uncached blocks and read the
+ *  run straight into the entries with a single vectored disk read.
+ *
+ * Note: Prefetching does not count as cache hits or misses, and at most
+ * capacity blocks are loaded so a prefetch never evicts itself.
+ *
+ * @param       cache       Pointer to Cache structure.
+ * @param       start       First block number to load.
+ * @param       count       Number of blocks to load.
+ *
+ * @return      Number of blocks read from disk (-1 on failure).
+ **/
+ssize_t cache_prefetch(Cache *cache, size_t start, size_t count) {
+    if (!cache || start >= cache->disk->blocks) return -1;
+    count = min(min(count, cache->disk->blocks - start), cache->capacity);
+
+    size_t       loaded = 0;
+    size_t       entries[CACHE_PREFETCH_RUN];
+    struct iovec iov[CACHE_PREFETCH_RUN];
+
+    pthread_mutex_lock(&cache->lock);
+    size_t b = 0;
+    while (b < count) {
+        if (cache_lookup(cache, start + b) != CACHE_NONE) {
+            b++;
+            continue;
+        }
+
+        /* Entries are linked as soon as they are claimed so the CLOCK hand
+         * cannot hand out the same free entry twice */
+        size_t run = 0;
+        while (b + run < count && run < CACHE_PREFETCH_RUN && cache_lookup(cache, start + b + run) == CACHE_NONE) {
+            size_t e = cache_evict(cache);
+            if (e == CACHE_NONE) break;
+
+            CacheEntry *entry = &cache->entries[e];
+            entry->block      = start + b + run;
+            entry->valid      = true;
+            entry->dirty      = false;
+            entry->referenced = true;
+            entry->next       = cache->buckets[cache_hash(cache, entry->block)];
+            cache->buckets[cache_hash(cache, entry->block)] = e;
+
+            entries[run] = e;
+            iov[run].iov_base = entry->data;
+            iov[run].iov_len  = BLOCK_SIZE;
+            run++;
+        }
+        if (run == 0 || disk_readv(cache->disk, start + b, iov, run) == DISK_FAILURE) {
+            for (size_t r = 0; r < run; r++) {
+                cache_unlink(cache, entries[r]);
+            }
+            pthread_mutex_unlock(&cache->lock);
+            return -1;
+        }
+
+        loaded += run;
+        b      += run;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return loaded;
+}
+
+/**
+ * Write back all dirty blocks in cache to disk.
+ *
+ * @param       cache       Pointer to Cache structure.
+ *
+ * @return      Whether or not all dirty blocks were written.
+ **/
+bool    cache_flush(Cache *cache) {
+    if (!cache) return false;
+
+    bool success = true;
+    pthread_mutex_lock(&cache->lock);
+    for (size_t e = 0; e < cache->capacity; e++) {
+        if (!cache_writeback(cache, &cache->entries[e])) {
+            success = false;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return success;
+}
+
+/* Internal Functions */
+
+/**
+ * Return pointer to cached contents of block by doing the following:
+ *
+ *  1. Lookup block in cache (hit: return entry contents).
+ *
+ *  2. Otherwise evict an entry and read block from disk into it.
+ *
+ * Note: Caller must hold cache lock.
+ *
+ * @param       cache       Pointer to Cache structure.
+ * @param       block       Block number to perform operation on.
+ *
+ * @return      Pointer to block contents (NULL on failure).
+ **/
+const char *cache_load(Cache *cache, size_t block) {
+    if (block >= cache->disk->blocks) return NULL;
+
+    size_t e = cache_lookup(cache, block);
+    if (e != CACHE_NONE) {
+        __atomic_add_fetch(&cache->hits, 1, __ATOMIC_RELAXED);
+        cache->entries[e].referenced = true;
+        return cache->entries[e].data;
+    }
+
+    __atomic_add_fetch(&cache->misses, 1, __ATOMIC_RELAXED);
+    if ((e = cache_evict(cache)) == CACHE_NONE) return NULL;
+
+    CacheEntry *entry = &cache->entries[e];
+    if (disk_read(cache->disk, block, entry->data) == DISK_FAILURE) return NULL;
+
+    entry->block      = block;
+    entry->valid      = true;
+    entry->dirty      = false;
+    entry->referenced = true;
+    entry->next       = cache->buckets[cache_hash(cache, block)];
+    cache->buckets[cache_hash(cache, block)] = e;
+    return entry->data;
+}
+
+/**
+ * Compute hash bucket for specified block.
+ *
+ * @param       cache       Pointer to Cache structure.
+ * @param       block       Block number.
+ *
+ * @return      Bucket index.
+ **/
+size_t  cache_hash(Cache *cache, size_t block) {
+    return (block * 2654435761u) & (cache->nbuckets - 1);
+}
+
+/**
+ * Find entry holding specified block.
+ *
+ * @param       cache       Pointer to Cache structure.
+ * @param       block       Block number.
+ *
+ * @return      Entry index (CACHE_NONE if block is not cached).
+ **/
+size_t  cache_lookup(Cache *cache, size_t block) {
+    for (size_t e = cache->buckets[cache_hash(cache, block)]; e != CACHE_NONE; e = cache->entries[e].next) {
+        if (cache->entries[e].block == block) return e;
+    }
+    return CACHE_NONE;
+}
+
+/**
+ * Remove entry from its hash chain.
+ *
+ * @param       cache       Pointer to Cache structure.
+ * @param       entry       Entry index.
+ **/
+void    cache_unlink(Cache *cache, size_t entry) {
+    size_t *link = &cache->buckets[cache_hash(cache, cache->entries[entry].block)];
+    while (*link != CACHE_NONE) {
+        if (*link == entry) {
+            *link = cache->entries[entry].next;
+            break;
+        }
+        link = &cache->entries[*link].next;
+    }
+    cache->entries[entry].next  = CACHE_NONE;
+    cache->entries[entry].valid = false;
+}
+
+/**
+ * Select victim entry using the CLOCK algorithm by doing the following:
+ *
+ *  1. Advance hand, clearing reference bits, until an unreferenced entry is
+ *  found.
+ *
+ *  2. Write back victim if dirty and remove it from its hash chain.
+ *
+ * @param       cache       Pointer to Cache structure.
+ *
+ * @return      Index of free entry (CACHE_NONE on write back failure).
+ **/
+size_t  cache_evict(Cache *cache) {
+    while (true) {
+        size_t      e     = cache->hand;
+        CacheEntry *entry = &cache->entries[e];
+        cache->hand = (cache->hand + 1) % cache->capacity;
+
+        if (!entry->valid) return e;
+
+        if (entry->referenced) {
+            entry->referenced = false;
+            continue;
+        }
+
+        if (!cache_writeback(cache, entry)) return CACHE_NONE;
+        cache_unlink(cache, e);
+        return e;
+    }
+}
+
+/**
+ * Write back entry to disk if it is dirty.
+ *
+ * @param       cache       Pointer to Cache structure.
+ * @param       entry       Pointer to CacheEntry structure.
+ *
+ * @return      Whether or not entry is clean.
+ **/
+bool    cache_writeback(Cache *cache, CacheEntry *entry) {
+    if (!entry->valid || !entry->dirty) return true;
+    if (disk_write(cache->disk, entry->block, entry->data) == DISK_FAILURE) return false;
+    entry->dirty = false;
+    return true;
+}
+
+/**
+ * Transfer contiguous blocks between buffers and cache (or disk for runs of
+ * uncached blocks).
+ *
+ * Note: Caller must hold cache lock.
+ *
+ * @param       cache       Pointer to Cache structure.
+ * @param       start       First block number to perform operation on.
+ * @param       iov         Array of block buffers.
+ * @param       iovcnt      Number of block buffers.
+ * @param       write       Whether to write (true) or read (false).
+ *
+ * @return      Number of bytes transferred (DISK_FAILURE on failure).
+ **/
+ssize_t cache_transfer(Cache *cache, size_t start, const struct iovec *iov, int iovcnt, bool write) {
+    if (!cache || !iov || iovcnt <= 0) return DISK_FAILURE;
+    if (start >= cache->disk->blocks || (size_t)iovcnt > cache->disk->blocks - start) return DISK_FAILURE;
+
+    int i = 0;
+    while (i < iovcnt) {
+        if (iov[i].iov_len != BLOCK_SIZE) return DISK_FAILURE;
+
+        size_t e = cache_lookup(cache, start + i);
+        if (e != CACHE_NONE) {
+            CacheEntry *entry = &cache->entries[e];
+            __atomic_add_fetch(&cache->hits, 1, __ATOMIC_RELAXED);
+            entry->referenced = true;
+            if (write) {
+                memcpy(entry->data, iov[i].iov_base, BLOCK_SIZE);
+                entry->dirty = true;
+            } else {
+                memcpy(iov[i].iov_base, entry->data, BLOCK_SIZE);
+            }
+            i++;
+            continue;
+        }
+
+        int run = 1;
+        while (i + run < iovcnt && cache_lookup(cache, start + i + run) == CACHE_NONE) {
+            run++;
+        }
+
+        __atomic_add_fetch(&cache->misses, run, __ATOMIC_RELAXED);
+        ssize_t result = write ? disk_writev(cache->disk, start + i, iov + i, run)
+                               : disk_readv(cache->disk, start + i, iov + i, run);
+        if (result == DISK_FAILURE) return DISK_FAILURE;
+        i += run;
+    }
+
+    return iovcnt * BLOCK_SIZE;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,205 @@
+/* crc.c: SimpleFS CRC32C checksums */
+
+#include "sfs/crc.h"
+
+#include <string.h>
+
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC_SSE42
+#endif
+
+/* Internal Variables */
+
+uint32_t       CrcTable[8][256];                /* Slicing-by-8 tables of software implementation */
+pthread_once_t CrcTableOnce = PTHREAD_ONCE_INIT;  /* Builds CrcTable on first use */
+
+/* Internal Prototyes */
+
+void     crc32c_table_init(void);
+#ifdef CRC_SSE42
+uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p, size_t length);
+void     crc32c_sse42_streams(const char *const buffers[], size_t length, uint32_t crcs[]);
+#endif
+
+/* External Functions */
+
+/**
+ * Extend CRC32C checksum with more bytes, using the CPU crc32 instruction
+ * when available (see crc32c_hardware).
+ *
+ * @param       crc         Checksum of preceding bytes (0 to start).
+ * @param       data        Bytes to checksum.
+ * @param       length      Number of bytes.
+ *
+ * @return      Checksum of preceding bytes followed by data.
+ **/
+uint32_t crc32c(uint32_t crc, const void *data, size_t length) {
+#ifdef CRC_SSE42
+    if (crc32c_hardware()) return crc32c_sse42(crc, data, length);
+#endif
+    return crc32c_software(crc, data, length);
+}
+
+/**
+ * Extend CRC32C checksum with more bytes using lookup tables only (8 bytes
+ * per step with slicing-by-8).
+ *
+ * @param       crc         Checksum of preceding bytes (0 to start).
+ * @param       data        Bytes to checksum.
+ * @param       length      Number of bytes.
+ *
+ * @return      Checksum of preceding bytes followed by data.
+ **/
+uint32_t crc32c_software(uint32_t crc, const void *data, size_t length) {
+    pthread_once(&CrcTableOnce, crc32c_table_init);
+
+    const uint8_t *p = data;
+    crc = ~crc;
+    for (; length >= 8; length -= 8, p += 8) {
+        uint32_t lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+        uint32_t hi = p[4] | p[5] << 8 | p[6] << 16 | (uint32_t)p[7] << 24;
+        crc = CrcTable[7][lo & 0xff] ^ CrcTable[6][(lo >> 8) & 0xff] ^
+              CrcTable[5][(lo >> 16) & 0xff] ^ CrcTable[4][lo >> 24] ^
+              CrcTable[3][hi & 0xff] ^ CrcTable[2][(hi >> 8) & 0xff] ^
+              CrcTable[1][(hi >> 16) & 0xff] ^ CrcTable[0][hi >> 24];
+    }
+    for (; length; length--) {
+        crc = (crc >> 8) ^ CrcTable[0][(crc ^ *p++) & 0xff];
+    }
+    return ~crc;
+}
+
+/**
+ * Compute CRC32C checksums of several equally sized buffers by doing the
+ * following:
+ *
+ *  1. Checksum CRC_STREAMS buffers side by side with interleaved crc32
+ *  instructions, which hides the latency of each instruction behind the
+ *  other streams (when available, see crc32c_hardware).
+ *
+ *  2. Checksum remaining buffers one at a time.
+ *
+ * @param       buffers     Buffers to checksum.
+ * @param       n           Number of buffers.
+ * @param       length      Number of bytes in each buffer.
+ * @param       crcs        Where to store checksum of each buffer.
+ **/
+void     crc32c_many(const char *const buffers[], size_t n, size_t length, uint32_t crcs[]) {
+    size_t i = 0;
+#ifdef CRC_SSE42
+    if (crc32c_hardware()) {
+        for (; i + CRC_STREAMS <= n; i += CRC_STREAMS) {
+            crc32c_sse42_streams(buffers + i, length, crcs + i);
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        crcs[i] = crc32c(0, buffers[i], length);
+    }
+}
+
+/**
+ * Return whether or not the CPU computes CRC32C in hardware (SSE 4.2).
+ *
+ * @return      Whether or not crc32c uses crc32 instructions.
+ **/
+bool     crc32c_hardware(void) {
+#ifdef CRC_SSE42
+    return __builtin_cpu_supports("sse4.2");
+#else
+    return false;
+#endif
+}
+
+/* Internal Functions */
+
+/**
+ * Build slicing-by-8 tables (table k advances a byte through k more zero
+ * bytes).
+ **/
+void     crc32c_table_init(void) {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = n;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLYNOMIAL : crc >> 1;
+        }
+        CrcTable[0][n] = crc;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        for (int k = 1; k < 8; k++) {
+            CrcTable[k][n] = (CrcTable[k - 1][n] >> 8) ^ CrcTable[0][CrcTable[k - 1][n] & 0xff];
+        }
+    }
+}
+
+#ifdef CRC_SSE42
+/**
+ * Extend CRC32C checksum with the SSE 4.2 crc32 instruction (8 bytes per
+ * instruction once data is aligned).
+ *
+ * @param       crc         Checksum of preceding bytes (0 to start).
+ * @param       p           Bytes to checksum.
+ * @param       length      Number of bytes.
+ *
+ * @return      Checksum of preceding bytes followed by data.
+ **/
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p, size_t length) {
+    crc = ~crc;
+    for (; length && ((uintptr_t)p & 7); length--) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    for (; length >= 8; length -= 8, p += 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc = _mm_crc32_u64(crc, word);
+    }
+    for (; length; length--) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return ~crc;
+}
+
+/**
+ * Compute CRC32C checksums of CRC_STREAMS buffers with interleaved SSE 4.2
+ * crc32 instructions (each has a latency of three cycles but one can start
+ * every cycle).
+ *
+ * @param       buffers     CRC_STREAMS buffers to checksum.
+ * @param       length      Number of bytes in each buffer.
+ * @param       crcs        Where to store checksum of each buffer.
+ **/
+__attribute__((target("sse4.2")))
+void     crc32c_sse42_streams(const char *const buffers[], size_t length, uint32_t crcs[]) {
+    const uint8_t *a  = (const uint8_t *)buffers[0];
+    const uint8_t *b  = (const uint8_t *)buffers[1];
+    const uint8_t *c  = (const uint8_t *)buffers[2];
+    uint64_t       ca = UINT32_MAX;
+    uint64_t       cb = UINT32_MAX;
+    uint64_t       cc = UINT32_MAX;
+
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t wa, wb, wc;
+        memcpy(&wa, a + i, sizeof(wa));
+        memcpy(&wb, b + i, sizeof(wb));
+        memcpy(&wc, c + i, sizeof(wc));
+        ca = _mm_crc32_u64(ca, wa);
+        cb = _mm_crc32_u64(cb, wb);
+        cc = _mm_crc32_u64(cc, wc);
+    }
+    for (; i < length; i++) {
+        ca = _mm_crc32_u8(ca, a[i]);
+        cb = _mm_crc32_u8(cb, b[i]);
+        cc = _mm_crc32_u8(cc, c[i]);
+    }
+    crcs[0] = ~(uint32_t)ca;
+    crcs[1] = ~(uint32_t)cb;
+    crcs[2] = ~(uint32_t)cc;
+}
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
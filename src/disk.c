@@ -1,14 +1,29 @@
 /* disk.c: SimpleFS disk emulator */
 
+#define _GNU_SOURCE
+
 #include "sfs/disk.h"
 #include "sfs/logging.h"
+#include "sfs/utils.h"
 
 #include <fcntl.h>
+#include <limits.h>
+#include <string.h>
 #include <unistd.h>
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX (1024)
+#endif
+
+#define DISK_ZERO_BLOCKS (256)
+
 /* Internal Prototyes */
 
 bool    disk_sanity_check(Disk *disk, size_t blocknum, const char *data);
+ssize_t disk_transfer(Disk *disk, size_t start, const struct iovec *iov, int iovcnt, bool write);
 
 /* External Functions */
 
@@ -30,6 +45,30 @@ bool    disk_sanity_check(Disk *disk, size_t blocknum, const char *data);
  *              on failure).
  **/
 Disk *	disk_open(const char *path, size_t blocks) {
+    return disk_open_mode(path, blocks, DISK_FD);
+}
+
+/**
+ *
+ * Opens disk at specified path with the specified number of blocks and
+ * backend mode by doing the following:
+ *
+ *  1. Allocate Disk structure and sets appropriate attributes.
+ *
+ *  2. Open file descriptor to specified path.
+ *
+ *  3. Truncate file to desired file size (blocks * BLOCK_SIZE).
+ *
+ *  4. Map whole image into memory (DISK_MMAP only).
+ *
+ * @param       path        Path to disk image to create.
+ * @param       blocks      Number of blocks to allocate for disk image.
+ * @param       mode        Backend used to serve block reads and writes.
+ *
+ * @return      Pointer to newly allocated and configured Disk structure (NULL
+ *              on failure).
+ **/
+Disk *	disk_open_mode(const char *path, size_t blocks, DiskMode mode) {
     
     Disk *disk = calloc(1, sizeof(Disk));
     if (disk) {
@@ -52,6 +91,16 @@ Disk *	disk_open(const char *path, size_t blocks) {
         } // checking ??
         disk->fd = fd;
 
+        if (mode == DISK_MMAP) {
+            void *map = mmap(NULL, blocks * BLOCK_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+            if (map == MAP_FAILED) {
+                close(fd);
+                free(disk);
+                return NULL;
+            }
+            disk->map = map;
+        }
+
         return disk;
 
     }
@@ -61,30 +110,50 @@ Disk *	disk_open(const char *path, size_t blocks) {
 /**
  * Close disk structure by doing the following:
  *
- *  1. Close disk file descriptor.
+ *  1. Synchronize and unmap memory mapping (DISK_MMAP only).
+ *
+ *  2. Close disk file descriptor.
  *
- *  2. Report number of disk reads and writes.
+ *  3. Report number of disk reads and writes.
  *
- *  3. Release disk structure memory.
+ *  4. Release disk structure memory.
  *
  * @param       disk        Pointer to Disk structure.
  */
 void	disk_close(Disk *disk) {
+    if (disk->map) {
+        msync(disk->map, disk->blocks * BLOCK_SIZE, MS_SYNC);
+        munmap(disk->map, disk->blocks * BLOCK_SIZE);
+    }
     close(disk->fd);
     printf("%zu disk block reads\n", disk->reads);
     printf("%zu disk block writes\n", disk->writes);
     free(disk);
 }
 
+/**
+ * Flush disk image to stable storage (msync for DISK_MMAP, fsync otherwise).
+ *
+ * @param       disk        Pointer to Disk structure.
+ *
+ * @return      Whether or not the flush was successful.
+ */
+bool	disk_flush(Disk *disk) {
+    if (!disk) return false;
+    __atomic_add_fetch(&disk->flushes, 1, __ATOMIC_RELAXED);
+    if (disk->map) {
+        return msync(disk->map, disk->blocks * BLOCK_SIZE, MS_SYNC) == 0;
+    }
+    return fsync(disk->fd) == 0;
+}
+
 /**
  * Read data from disk at specified block into data buffer by doing the
  * following:
  *
  *  1. Perform sanity check.
  *
- *  2. Seek to specified block.
- *
- *  3. Read from block to data buffer (must be BLOCK_SIZE).
+ *  2. Read from block offset to data buffer (must be BLOCK_SIZE).
  *
  * @param       disk        Pointer to Disk structure.
  * @param       block       Block number to perform operation on.
@@ -95,12 +164,18 @@ void	disk_close(Disk *disk) {
  **/
 ssize_t disk_read(Disk *disk, size_t block, char *data) {
     if (disk_sanity_check(disk, block, data)) {
-        lseek(disk->fd, block*BLOCK_SIZE, SEEK_SET);
-        ssize_t readed = read(disk->fd, data, BLOCK_SIZE);
+        uint64_t start = stats_now();
+        if (disk->map) {
+            memcpy(data, disk->map + block*BLOCK_SIZE, BLOCK_SIZE);
+            __atomic_add_fetch(&disk->reads, 1, __ATOMIC_RELAXED);
+            return stats_record(&disk->read_stats, start, BLOCK_SIZE);
+        }
+        ssize_t readed = pread(disk->fd, data, BLOCK_SIZE, block*BLOCK_SIZE);
         if (readed > 0) {
-            disk->reads++;
-            return readed; // :'(
+            __atomic_add_fetch(&disk->reads, 1, __ATOMIC_RELAXED);
+            return stats_record(&disk->read_stats, start, readed); // :'(
         }
+        stats_record(&disk->read_stats, start, DISK_FAILURE);
     }
     return DISK_FAILURE;
 }
@@ -111,9 +186,7 @@ ssize_t disk_read(Disk *disk, size_t block, char *data) {
  *
  *  1. Perform sanity check.
  *
- *  2. Seek to specified block.
- *
- *  3. Write data buffer (must be BLOCK_SIZE) to disk block.
+ *  2. Write data buffer (must be BLOCK_SIZE) to disk block offset.
  *
  * @param       disk        Pointer to Disk structure.
  * @param       block       Block number to perform operation on.
@@ -124,19 +197,259 @@ ssize_t disk_read(Disk *disk, size_t block, char *data) {
  **/
 ssize_t disk_write(Disk *disk, size_t block, char *data) {
     if (disk_sanity_check(disk, block, data)) {
-        lseek(disk->fd, block*BLOCK_SIZE, SEEK_SET);
-        ssize_t written = write(disk->fd, data, BLOCK_SIZE);
+        uint64_t start = stats_now();
+        if (disk->map) {
+            memcpy(disk->map + block*BLOCK_SIZE, data, BLOCK_SIZE);
+            __atomic_add_fetch(&disk->writes, 1, __ATOMIC_RELAXED);
+            return stats_record(&disk->write_stats, start, BLOCK_SIZE);
+        }
+        ssize_t written = pwrite(disk->fd, data, BLOCK_SIZE, block*BLOCK_SIZE);
         if (written > 0) {
-            disk->writes++;
-            return written;
+            __atomic_add_fetch(&disk->writes, 1, __ATOMIC_RELAXED);
+            return stats_record(&disk->write_stats, start, written);
         }
+        stats_record(&disk->write_stats, start, DISK_FAILURE);
     }
 
     return DISK_FAILURE;
 }
 
+/**
+ * Read count contiguous blocks beginning at start into data buffer (must be
+ * count * BLOCK_SIZE).
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       start       First block number to perform operation on.
+ * @param       count       Number of blocks to read.
+ * @param       data        Data buffer.
+ *
+ * @return      Number of bytes read.
+ *              (count * BLOCK_SIZE on success, DISK_FAILURE on failure).
+ **/
+ssize_t disk_read_range(Disk *disk, size_t start, size_t count, char *data) {
+    struct iovec iov = {data, count*BLOCK_SIZE};
+    return disk_readv(disk, start, &iov, 1);
+}
+
+/**
+ * Write count contiguous blocks beginning at start from data buffer (must be
+ * count * BLOCK_SIZE).
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       start       First block number to perform operation on.
+ * @param       count       Number of blocks to write.
+ * @param       data        Data buffer.
+ *
+ * @return      Number of bytes written.
+ *              (count * BLOCK_SIZE on success, DISK_FAILURE on failure).
+ **/
+ssize_t disk_write_range(Disk *disk, size_t start, size_t count, char *data) {
+    struct iovec iov = {data, count*BLOCK_SIZE};
+    return disk_writev(disk, start, &iov, 1);
+}
+
+/**
+ * Read contiguous blocks beginning at start into scattered buffers.
+ *
+ * Note: The vector lengths must add up to a multiple of BLOCK_SIZE.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       start       First block number to perform operation on.
+ * @param       iov         Array of buffers to fill in order.
+ * @param       iovcnt      Number of buffers.
+ *
+ * @return      Number of bytes read (DISK_FAILURE on failure).
+ **/
+ssize_t disk_readv(Disk *disk, size_t start, const struct iovec *iov, int iovcnt) {
+    if (!disk) return DISK_FAILURE;
+    uint64_t begin = stats_now();
+    return stats_record(&disk->read_stats, begin, disk_transfer(disk, start, iov, iovcnt, false));
+}
+
+/**
+ * Write contiguous blocks beginning at start from gathered buffers.
+ *
+ * Note: The vector lengths must add up to a multiple of BLOCK_SIZE.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       start       First block number to perform operation on.
+ * @param       iov         Array of buffers to write in order.
+ * @param       iovcnt      Number of buffers.
+ *
+ * @return      Number of bytes written (DISK_FAILURE on failure).
+ **/
+ssize_t disk_writev(Disk *disk, size_t start, const struct iovec *iov, int iovcnt) {
+    if (!disk) return DISK_FAILURE;
+    uint64_t begin = stats_now();
+    return stats_record(&disk->write_stats, begin, disk_transfer(disk, start, iov, iovcnt, true));
+}
+
+/**
+ * Overwrite count contiguous blocks beginning at start with zeros, writing at
+ * most DISK_ZERO_BLOCKS blocks per range write.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       start       First block number to perform operation on.
+ * @param       count       Number of blocks to zero.
+ *
+ * @return      Whether or not all blocks were written.
+ **/
+bool    disk_zero(Disk *disk, size_t start, size_t count) {
+    if (!disk || start > disk->blocks || count > disk->blocks - start) return false;
+    if (count == 0) return true;
+
+    char *zeros = calloc(min(count, (size_t)DISK_ZERO_BLOCKS), BLOCK_SIZE);
+    if (!zeros) return false;
+
+    bool success = true;
+    while (count && success) {
+        size_t chunk = min(count, (size_t)DISK_ZERO_BLOCKS);
+        success = disk_write_range(disk, start, chunk, zeros) != DISK_FAILURE;
+        start  += chunk;
+        count  -= chunk;
+    }
+
+    free(zeros);
+    return success;
+}
+
+/**
+ * Discard count contiguous blocks beginning at start so they read back as
+ * zeros without writing them by doing the following:
+ *
+ *  1. Punch a hole in the disk image with fallocate (blocks become sparse).
+ *
+ *  2. Otherwise, if the range reaches the end of the image (and nothing
+ *  follows it), truncate and re-extend it (not done for DISK_MMAP since the
+ *  mapping would be cut).
+ *
+ *  3. Otherwise, fall back to writing zeros.
+ *
+ * Note: Discarded blocks do not count as disk writes (unless zeros are
+ * written).
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       start       First block number to perform operation on.
+ * @param       count       Number of blocks to discard.
+ *
+ * @return      Whether or not all blocks were discarded.
+ **/
+bool    disk_discard(Disk *disk, size_t start, size_t count) {
+    if (!disk || start > disk->blocks || count > disk->blocks - start) return false;
+    if (count == 0) return true;
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+    if (fallocate(disk->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start*BLOCK_SIZE, count*BLOCK_SIZE) == 0) {
+        return true;
+    }
+#endif
+
+    struct stat st;
+    if (!disk->map && start + count == disk->blocks &&
+        fstat(disk->fd, &st) == 0 && (size_t)st.st_size == disk->blocks*BLOCK_SIZE) {
+        if (ftruncate(disk->fd, start*BLOCK_SIZE) == 0 &&
+            ftruncate(disk->fd, disk->blocks*BLOCK_SIZE) == 0) {
+            return true;
+        }
+    }
+
+    return disk_zero(disk, start, count);
+}
+
+/**
+ * Return pointer to specified block inside the memory mapping so metadata
+ * can be inspected in place without copying.
+ *
+ * Note: Only available for DISK_MMAP; the block counts as a disk read.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       Block number to access.
+ *
+ * @return      Pointer to block contents (NULL if unmapped or invalid block).
+ **/
+const char *disk_block(Disk *disk, size_t block) {
+    if (!disk || !disk->map || block >= disk->blocks) return NULL;
+    __atomic_add_fetch(&disk->reads, 1, __ATOMIC_RELAXED);
+    return disk->map + block*BLOCK_SIZE;
+}
+
 /* Internal Functions */
 
+/**
+ * Perform positional vectored read or write by doing the following:
+ *
+ *  1. Perform sanity check on disk, vectors, and block range.
+ *
+ *  2. Copy to or from the memory mapping (DISK_MMAP), or issue
+ *  preadv/pwritev in batches of at most IOV_MAX vectors, resuming after any
+ *  short transfer.
+ *
+ *  3. Account transferred blocks in disk reads or writes.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       start       First block number to perform operation on.
+ * @param       iov         Array of buffers.
+ * @param       iovcnt      Number of buffers.
+ * @param       write       Whether to write (true) or read (false).
+ *
+ * @return      Number of bytes transferred (DISK_FAILURE on failure).
+ **/
+ssize_t disk_transfer(Disk *disk, size_t start, const struct iovec *iov, int iovcnt, bool write) {
+    if (!disk || !iov || iovcnt <= 0) return DISK_FAILURE;
+
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (!iov[i].iov_base && iov[i].iov_len) return DISK_FAILURE;
+        total += iov[i].iov_len;
+    }
+    if (total == 0 || total % BLOCK_SIZE) return DISK_FAILURE;
+    if (start >= disk->blocks || total / BLOCK_SIZE > disk->blocks - start) return DISK_FAILURE;
+
+    if (disk->map) {
+        char *cursor = disk->map + start*BLOCK_SIZE;
+        for (int i = 0; i < iovcnt; i++) {
+            if (write) {
+                memcpy(cursor, iov[i].iov_base, iov[i].iov_len);
+            } else {
+                memcpy(iov[i].iov_base, cursor, iov[i].iov_len);
+            }
+            cursor += iov[i].iov_len;
+        }
+    } else {
+        struct iovec batch[IOV_MAX];
+        off_t  offset = start*BLOCK_SIZE;
+        size_t done   = 0;
+        int    next   = 0;
+        size_t skip   = 0;
+
+        while (done < total) {
+            int n = 0;
+            for (int i = next; i < iovcnt && n < IOV_MAX; i++, n++) {
+                batch[n].iov_base = (char *)iov[i].iov_base + (i == next ? skip : 0);
+                batch[n].iov_len  = iov[i].iov_len - (i == next ? skip : 0);
+            }
+
+            ssize_t result = write ? pwritev(disk->fd, batch, n, offset) : preadv(disk->fd, batch, n, offset);
+            if (result <= 0) return DISK_FAILURE;
+
+            done   += result;
+            offset += result;
+            skip   += result;
+            while (next < iovcnt && skip >= iov[next].iov_len) {
+                skip -= iov[next].iov_len;
+                next++;
+            }
+        }
+    }
+
+    if (write) {
+        __atomic_add_fetch(&disk->writes, total / BLOCK_SIZE, __ATOMIC_RELAXED);
+    } else {
+        __atomic_add_fetch(&disk->reads, total / BLOCK_SIZE, __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
 /**
  * Perform sanity check before read or write operation by doing the following:
  *
@@ -1,18 +1,189 @@
 /* fs.c: SimpleFS file system */
 
+#include "sfs/crc.h"
 #include "sfs/fs.h"
 #include "sfs/logging.h"
+#include "sfs/lz.h"
 #include "sfs/utils.h"
 
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 
+#include <pthread.h>
+
+/* Internal Structures */
+
+typedef struct ScanTask ScanTask;
+struct ScanTask {
+    FileSystem  *fs;                            /* FileSystem being mounted */
+    size_t       first;                         /* First Inode block index to scan */
+    size_t       last;                          /* One past last Inode block index */
+    Bitmap      *used;                          /* Partial map of used blocks */
+    bool         ok;                            /* Whether or not scan succeeded */
+    bool         started;                       /* Whether or not thread was started */
+    pthread_t    thread;                        /* Thread performing scan */
+};
+
+typedef struct ScrubTask ScrubTask;
+struct ScrubTask {
+    FileSystem  *fs;                            /* FileSystem being scrubbed */
+    size_t       first;                         /* First block to verify */
+    size_t       last;                          /* One past last block to verify */
+    size_t       verified;                      /* Number of blocks verified */
+    size_t      *corrupt;                       /* Blocks whose checksum did not match */
+    size_t       ncorrupt;                      /* Number of corrupt blocks */
+    size_t       capacity;                      /* Number of blocks corrupt can hold */
+    bool         ok;                            /* Whether or not every block was read */
+    bool         started;                       /* Whether or not thread was started */
+    pthread_t    thread;                        /* Thread performing scrub */
+};
+
+typedef struct DefragResult DefragResult;
+struct DefragResult {
+    size_t       before;                        /* Fragmentation score before relocation */
+    size_t       after;                         /* Fragmentation score after relocation */
+    size_t       needed;                        /* Data blocks of file left alone for exceeding budget */
+    Inode        old;                           /* Inode before relocation (for deferred reclamation) */
+};
+
+/* Internal Constants */
+
+const Block FsZeroBlock = {{0}};                /* Contents of unmapped blocks */
+
 /* Internal Functions */
-void fs_initialize_free_block_bitmap(FileSystem *fs);
+void fs_debug_extents(Disk *disk, const Inode *node);
+size_t  fs_debug_blocks(Disk *disk, const SuperBlock *sb, const Inode *node);
+size_t  fs_debug_tree(Disk *disk, const SuperBlock *sb, size_t block, size_t depth, bool root);
+bool fs_mount_disk(FileSystem *fs, Disk *disk, const MountOptions *options);
+bool fs_release_inode(FileSystem *fs, size_t inode_number, Inode *deferred);
+bool fs_release_blocks(FileSystem *fs, Inode *node);
+bool fs_release_pointers(FileSystem *fs, Inode *node);
+bool fs_release_extents(FileSystem *fs, Inode *node);
+void fs_release_runs(FileSystem *fs, const Extent *extents, size_t capacity);
+bool fs_release_tree(FileSystem *fs, size_t block, size_t depth);
+bool    fs_clone_inode(FileSystem *fs, size_t inode_number, size_t clone_number, const Inode *node);
+size_t  fs_clone_tree(FileSystem *fs, size_t block, size_t depth, bool root, bool *complete);
+size_t  fs_clone_extents(FileSystem *fs, size_t block, bool *complete);
+void    fs_share_runs(FileSystem *fs, const Extent *extents, size_t capacity);
+bool fs_reclaim_start(FileSystem *fs);
+void fs_reclaim_stop(FileSystem *fs);
+void fs_reclaim_queue(FileSystem *fs, const Inode *nodes, size_t n);
+bool fs_reclaim_wait(FileSystem *fs);
+void *fs_reclaim_worker(void *arg);
+ssize_t fs_read_inode(FileSystem *fs, size_t inode_number, BlockMap *map, char *data, size_t length, size_t offset);
+ssize_t fs_iterate_inode(FileSystem *fs, size_t inode_number, BlockMap *map, size_t offset, size_t length, FsReadIter callback, void *ctx);
+ssize_t fs_write_inode(FileSystem *fs, size_t inode_number, BlockMap *map, char *data, size_t length, size_t offset);
+ssize_t fs_write_handle(FsHandle *handle, char *data, size_t length, size_t offset, bool append);
+bool    fs_handle_map(FileSystem *fs, FsHandle *handle);
+ssize_t fs_write_inline(FileSystem *fs, size_t inode_number, const char *data, size_t length, size_t offset);
+ssize_t fs_punch_inode(FileSystem *fs, size_t inode_number, BlockMap *map, size_t offset, size_t length);
+ssize_t fs_punch_pointers(FileSystem *fs, BlockMap *map, size_t first, size_t last);
+ssize_t fs_punch_extents(FileSystem *fs, BlockMap *map, size_t first, size_t last);
+ssize_t fs_punch_blocks(FileSystem *fs, BlockMap *map, size_t first, size_t last);
+ssize_t fs_defrag_inode(FileSystem *fs, size_t inode_number, size_t budget, char *buffer, DefragResult *result);
+bool    fs_defrag_copy(FileSystem *fs, BlockMap *source, BlockMap *target, size_t nblocks, char *buffer);
+size_t  fs_fragments(FileSystem *fs, Inode *node, size_t *mapped, size_t *shared);
+bool    fs_pointer_boundary(const SuperBlock *sb, size_t index);
+void   *fs_scrub_range(void *arg);
+bool    fs_scrub_recheck(ScrubTask *task, size_t block, char *buffer);
+bool fs_initialize_free_block_bitmap(FileSystem *fs, size_t threads);
+void *fs_scan_inode_blocks(void *arg);
+void fs_scan_mark(ScanTask *task, size_t start, size_t count);
+bool fs_scan_indirect_blocks(ScanTask *task, uint32_t *batch, size_t nbatch, size_t depth, bool root);
+bool fs_scan_extents(ScanTask *task, const Inode *node);
+bool fs_scan_runs(ScanTask *task, const Extent *extents, size_t capacity);
+int  fs_compare_blocks(const void *a, const void *b);
 bool fs_load_inode(FileSystem *fs, size_t inode_number, Inode *node);
 bool fs_save_inode(FileSystem *fs, size_t inode_number, Inode *node);
+Inode *fs_inode(FileSystem *fs, size_t inode_number);
+char  *fs_inline_data(FileSystem *fs, size_t inode_number);
+void fs_dirty_inode(FileSystem *fs, size_t inode_number);
+bool fs_flush_inodes(FileSystem *fs);
+pthread_rwlock_t *fs_inode_lock(FileSystem *fs, size_t inode_number);
+ssize_t fs_read_block(FileSystem *fs, size_t block, char *data);
+const Block *fs_disk_block(Disk *disk, size_t block, Block *buffer);
+ssize_t fs_write_block(FileSystem *fs, size_t block, char *data);
+ssize_t fs_write_metadata(FileSystem *fs, size_t block, char *data);
+
+ssize_t fs_readv_blocks(FileSystem *fs, size_t start, const struct iovec *iov, int iovcnt);
+ssize_t fs_writev_blocks(FileSystem *fs, size_t start, const struct iovec *iov, int iovcnt);
+bool    fs_checksum_load(FileSystem *fs);
+bool    fs_flush_checksums(FileSystem *fs);
+size_t  fs_checksum_compute(const struct iovec *iov, int iovcnt, size_t skip, size_t count, uint32_t crcs[]);
+void    fs_checksum_update(FileSystem *fs, size_t start, const struct iovec *iov, int iovcnt);
+void    fs_checksum_clear(FileSystem *fs, size_t block);
+bool    fs_checksum_verify(FileSystem *fs, size_t start, const struct iovec *iov, int iovcnt);
+size_t  fs_iov_blocks(const struct iovec *iov, int iovcnt);
+size_t  fs_bmap(FileSystem *fs, BlockMap *map, size_t index, bool allocate);
+uint32_t *fs_bmap_pointer(FileSystem *fs, BlockMap *map, size_t index, bool allocate, bool **dirty);
+bool    fs_bmap_sync(FileSystem *fs, BlockMap *map);
+bool    fs_bmap_load(FileSystem *fs, BlockMap *map, bool allocate);
+bool    fs_bmap_path(FileSystem *fs, BlockMap *map, size_t level, size_t block, bool fresh);
+size_t  fs_bmap_extent(FileSystem *fs, BlockMap *map, size_t index, bool allocate);
+Extent *fs_extent_seek(FileSystem *fs, BlockMap *map, size_t index, size_t *capacity);
+bool    fs_extent_grow(FileSystem *fs, BlockMap *map, Extent *extents, size_t capacity);
+size_t  fs_extent_alloc(FileSystem *fs);
+bool    fs_extent_insert(BlockMap *map, Extent *extents, size_t capacity, size_t index, size_t block);
+bool    fs_extent_punch(BlockMap *map, Extent *extents, size_t capacity, size_t index, size_t count);
+size_t  fs_extent_count(const Extent *extents, size_t capacity);
+void    fs_bmap_reserve(FileSystem *fs, BlockMap *map, size_t length, size_t offset);
+void    fs_bmap_release(FileSystem *fs, BlockMap *map);
+size_t  fs_bmap_alloc(FileSystem *fs, BlockMap *map);
+ssize_t fs_transfer(FileSystem *fs, BlockMap *map, char *data, size_t length, size_t offset, bool write);
+ssize_t fs_read_async(FileSystem *fs, BlockMap *map, char *data, size_t length, size_t offset);
+ssize_t fs_iterate(FileSystem *fs, BlockMap *map, size_t offset, size_t length, FsReadIter callback, void *ctx);
+ssize_t fs_compress_read(FileSystem *fs, BlockMap *map, char *data, size_t length, size_t offset);
+ssize_t fs_compress_write(FileSystem *fs, BlockMap *map, char *data, size_t length, size_t offset);
+ssize_t fs_compress_iterate(FileSystem *fs, BlockMap *map, size_t offset, size_t length, FsReadIter callback, void *ctx);
+size_t  fs_cluster_blocks(FileSystem *fs, BlockMap *map, size_t cluster, size_t size, size_t *slots);
+bool    fs_cluster_load(FileSystem *fs, BlockMap *map, size_t cluster, size_t size, char *buffer, char *packed);
+bool    fs_cluster_store(FileSystem *fs, BlockMap *map, size_t cluster, size_t size, char *buffer, char *packed);
+size_t  fs_cluster_slots(size_t size, size_t cluster);
+size_t  fs_stream_begin(FileSystem *fs, size_t inode_number, BlockMap *map, size_t offset);
+void    fs_stream_end(FileSystem *fs, size_t inode_number, BlockMap *map, size_t end, size_t window);
+void    fs_stream_reset(FileSystem *fs, size_t inode_number);
+
+size_t  fs_indirect_pointers(const SuperBlock *sb);
+size_t  fs_max_blocks(const SuperBlock *sb);
+size_t  fs_inodes_per_block(const SuperBlock *sb);
+const Inode *fs_block_inode(const SuperBlock *sb, const Block *block, size_t slot);
+bool    fs_inline(const SuperBlock *sb, const Inode *node);
+bool    fs_compressed(const Inode *node);
+size_t  fs_bitmap_blocks(const SuperBlock *sb);
+size_t  fs_bitmap_first(const SuperBlock *sb);
+size_t  fs_journal_first(const SuperBlock *sb);
+size_t  fs_checksum_blocks(const SuperBlock *sb);
+size_t  fs_checksum_first(const SuperBlock *sb);
+size_t  fs_data_first(const SuperBlock *sb);
+
+bool    fs_journal_start(FileSystem *fs, uint32_t sequence);
+void    fs_journal_stop(FileSystem *fs);
+void    fs_journal_begin(FileSystem *fs);
+void    fs_journal_end(FileSystem *fs);
+bool    fs_journal_write(FileSystem *fs, size_t block, const char *data);
+bool    fs_journal_read(FileSystem *fs, size_t block, char *data);
+void    fs_journal_revoke(FileSystem *fs, size_t start, size_t count);
+bool    fs_journal_commit(FileSystem *fs);
+bool    fs_journal_flush(FileSystem *fs);
+bool    fs_journal_reclaim(FileSystem *fs);
+bool    fs_journal_replay(Disk *disk, const SuperBlock *sb, uint32_t *sequence);
+uint32_t fs_journal_checksum(const JournalHeader *header, const char *images);
+
+bool    fs_bitmap_load(FileSystem *fs);
+bool    fs_bitmap_store(Disk *disk, const SuperBlock *sb, const Bitmap *bitmap, const Bitmap *stored);
+bool    fs_mark_clean(FileSystem *fs, bool clean);
 
 size_t find_free_block(FileSystem *fs);
+bool    fs_block_shared(FileSystem *fs, size_t block);
+bool    fs_block_pinned(FileSystem *fs, size_t block);
+void    fs_share_block(FileSystem *fs, size_t block);
+void    fs_drop_block(FileSystem *fs, size_t block);
+void    fs_drop_range(FileSystem *fs, size_t start, size_t count);
+void    fs_free_block(FileSystem *fs, size_t block);
+void    fs_free_range(FileSystem *fs, size_t start, size_t count);
+void    fs_unshare_block(FileSystem *fs, size_t block);
+bool    fs_bmap_cow(FileSystem *fs, BlockMap *map, uint32_t *pointer);
 /* External Functions */
 
 /**
@@ -34,53 +205,189 @@ void    fs_debug(Disk *disk) {
 
     printf("SuperBlock:\n");
     printf("    magic number is %s\n",
-        (block.super.magic_number == MAGIC_NUMBER) ? "valid" : "invalid");
+        (block.super.magic_number == MAGIC_NUMBER || block.super.magic_number == MAGIC_NUMBER_V1) ? "valid" : "invalid");
     printf("    %u blocks\n"         , block.super.blocks);
     printf("    %u inode blocks\n"   , block.super.inode_blocks);
     printf("    %u inodes\n"         , block.super.inodes);
+    if (block.super.features & FS_FEATURE_EXTENTS) {
+        printf("    extents enabled\n");
+    }
+    if (block.super.features & FS_FEATURE_INLINE) {
+        printf("    inline data enabled\n");
+    }
+    if (block.super.features & FS_FEATURE_CLONE) {
+        printf("    clones enabled\n");
+    }
+    if (block.super.features & FS_FEATURE_COMPRESS) {
+        printf("    compression enabled\n");
+    }
+    if (block.super.features & FS_FEATURE_BITMAP) {
+        printf("    bitmap: %u blocks (%s)\n", block.super.bitmap_blocks, block.super.clean ? "clean" : "not clean");
+    }
+    if (block.super.features & FS_FEATURE_JOURNAL) {
+        printf("    journal: %u blocks\n", block.super.journal_blocks);
+    }
+    if (block.super.features & FS_FEATURE_CHECKSUM) {
+        printf("    checksums: %u blocks\n", block.super.checksum_blocks);
+    }
 
     /* Read Inodes */
 
     for (int inode_block = 1; inode_block <= block.super.inode_blocks; inode_block++) {
-        Block inode_blk;
-        disk_read(disk,inode_block,inode_blk.data);
+        Block inode_buffer;
+        const Block *inode_blk = fs_disk_block(disk, inode_block, &inode_buffer);
+        if (!inode_blk) continue;
 
-        for (int inode = 0; inode < INODES_PER_BLOCK; inode++){
-            if (!inode_blk.inodes[inode].valid) continue;
-            printf("Inode %d:\n", (inode_block-1)*INODES_PER_BLOCK + inode);
-            printf("    size: %u bytes\n", inode_blk.inodes[inode].size);
+        for (size_t inode = 0; inode < fs_inodes_per_block(&block.super); inode++){
+            const Inode *node = fs_block_inode(&block.super, inode_blk, inode);
+            if (!node->valid) continue;
+            printf("Inode %zu:\n", (inode_block-1)*fs_inodes_per_block(&block.super) + inode);
+            printf("    size: %u bytes\n", node->size);
+            if (fs_inline(&block.super, node)) {
+                printf("    inline data\n");
+                continue;
+            }
+            if (fs_compressed(node)) {
+                printf("    compressed: %zu bytes on disk\n", fs_debug_blocks(disk, &block.super, node)*BLOCK_SIZE);
+            }
+            if (block.super.features & FS_FEATURE_EXTENTS) {
+                fs_debug_extents(disk, node);
+                continue;
+            }
             printf("    direct blocks:");
 
             // all direct inodes
             for (int dp = 0; dp < POINTERS_PER_INODE; dp++) {
-                if (inode_blk.inodes[inode].direct[dp] == 0) continue;
-                printf(" %u", inode_blk.inodes[inode].direct[dp]);
+                if (node->direct[dp] == 0) continue;
+                printf(" %u", node->direct[dp]);
             }
             printf("\n");
 
         // all the blocks from the indirect inode
-            if (inode_blk.inodes[inode].indirect != 0) {
-                printf("    indirect block: %u\n", inode_blk.inodes[inode].indirect);
-                Block ind_blk;
-                disk_read(disk, inode_blk.inodes[inode].indirect, ind_blk.data);
+            if (node->indirect != 0) {
+                printf("    indirect block: %u\n", node->indirect);
+                Block ind_buffer;
+                const Block *ind_blk = fs_disk_block(disk, node->indirect, &ind_buffer);
                 printf("    indirect data blocks:");
-                for (int ip = 0; ip < POINTERS_PER_BLOCK; ip++) {
-                    if (ind_blk.pointers[ip] == 0) continue;
-                    printf(" %u", ind_blk.pointers[ip]);
+                for (size_t ip = 0; ind_blk && ip < fs_indirect_pointers(&block.super); ip++) {
+                    if (ind_blk->pointers[ip] == 0) continue;
+                    printf(" %u", ind_blk->pointers[ip]);
                 }
                 printf("\n");
+
+                // roots of double and triple indirect trees
+                if (ind_blk && fs_indirect_pointers(&block.super) == INDIRECT_DOUBLE) {
+                    if (ind_blk->pointers[INDIRECT_DOUBLE] != 0) {
+                        printf("    double indirect block: %u\n", ind_blk->pointers[INDIRECT_DOUBLE]);
+                    }
+                    if (ind_blk->pointers[INDIRECT_TRIPLE] != 0) {
+                        printf("    triple indirect block: %u\n", ind_blk->pointers[INDIRECT_TRIPLE]);
+                    }
+                }
             }
         }
     }
 }
 
 /**
- * Format Disk by doing the following:
+ * Report extents of an extent Inode (holes start at block 0).
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       node        Pointer to valid extent Inode.
+ **/
+void    fs_debug_extents(Disk *disk, const Inode *node) {
+    printf("    extents (%u):", node->nextents);
+    if (node->extent_root == 0) {
+        for (size_t e = 0; e < EXTENTS_PER_INODE && node->extents[e].length; e++) {
+            printf(" %u+%u", node->extents[e].start, node->extents[e].length);
+        }
+        printf("\n");
+        return;
+    }
+    printf("\n");
+
+    Block        root_buffer;
+    Block        leaf_buffer;
+    const Block *root = fs_disk_block(disk, node->extent_root, &root_buffer);
+    printf("    extent root: %u\n", node->extent_root);
+    for (size_t l = 0; root && l < EXTENTS_PER_BLOCK && root->leaves[l].block; l++) {
+        const Block *leaf = fs_disk_block(disk, root->leaves[l].block, &leaf_buffer);
+        printf("    extent leaf %u:", root->leaves[l].block);
+        for (size_t e = 0; leaf && e < EXTENTS_PER_BLOCK && leaf->extents[e].length; e++) {
+            printf(" %u+%u", leaf->extents[e].start, leaf->extents[e].length);
+        }
+        printf("\n");
+    }
+}
+
+/**
+ * Count data blocks mapped by an Inode from its pointer blocks (or extent
+ * leaves) on Disk.
  *
- *  1. Write SuperBlock (with appropriate magic number, number of blocks,
- *  number of inode blocks, and number of inodes).
+ * @param       disk        Pointer to Disk structure.
+ * @param       sb          Pointer to SuperBlock of FileSystem.
+ * @param       node        Pointer to valid Inode (not inline).
+ * @return      Number of data blocks.
+ **/
+size_t  fs_debug_blocks(Disk *disk, const SuperBlock *sb, const Inode *node) {
+    size_t blocks = 0;
+    if (sb->features & FS_FEATURE_EXTENTS) {
+        if (node->extent_root == 0) {
+            for (size_t e = 0; e < EXTENTS_PER_INODE && node->extents[e].length; e++) {
+                blocks += node->extents[e].start ? node->extents[e].length : 0;
+            }
+            return blocks;
+        }
+
+        Block        root_buffer;
+        Block        leaf_buffer;
+        const Block *root = fs_disk_block(disk, node->extent_root, &root_buffer);
+        for (size_t l = 0; root && l < EXTENTS_PER_BLOCK && root->leaves[l].block; l++) {
+            const Block *leaf = fs_disk_block(disk, root->leaves[l].block, &leaf_buffer);
+            for (size_t e = 0; leaf && e < EXTENTS_PER_BLOCK && leaf->extents[e].length; e++) {
+                blocks += leaf->extents[e].start ? leaf->extents[e].length : 0;
+            }
+        }
+        return blocks;
+    }
+
+    for (size_t dp = 0; dp < POINTERS_PER_INODE; dp++) {
+        blocks += node->direct[dp] != 0;
+    }
+    return blocks + (node->indirect ? fs_debug_tree(disk, sb, node->indirect, 0, true) : 0);
+}
+
+/**
+ * Count data blocks below a pointer block on Disk.
  *
- *  2. Clear all remaining blocks.
+ * @param       disk        Pointer to Disk structure.
+ * @param       sb          Pointer to SuperBlock of FileSystem.
+ * @param       block       Pointer block to examine.
+ * @param       depth       Levels of pointer blocks below block (0 if it
+ *                          points to data blocks).
+ * @param       root        Whether or not block is an Inode indirect block.
+ * @return      Number of data blocks.
+ **/
+size_t  fs_debug_tree(Disk *disk, const SuperBlock *sb, size_t block, size_t depth, bool root) {
+    Block        buffer;
+    const Block *pointers = fs_disk_block(disk, block, &buffer);
+    if (!pointers) return 0;
+
+    const uint32_t *below = pointers->pointers;
+    size_t data   = root ? fs_indirect_pointers(sb) : (depth == 0 ? POINTERS_PER_BLOCK : 0);
+    size_t blocks = 0;
+    for (size_t p = 0; p < data; p++) {
+        blocks += below[p] != 0;
+    }
+    for (size_t p = data; p < POINTERS_PER_BLOCK; p++) {
+        if (below[p] == 0) continue;
+        blocks += fs_debug_tree(disk, sb, below[p], root ? (p == INDIRECT_DOUBLE ? 1 : 2) : depth - 1, false);
+    }
+    return blocks;
+}
+
+/**
+ * Format Disk using fast mode (see fs_format_mode).
  *
  * Note: Do not format a mounted Disk!
  *
@@ -89,16 +396,65 @@ void    fs_debug(Disk *disk) {
  * @return      Whether or not all disk operations were successful.
  **/
 bool    fs_format(FileSystem *fs, Disk *disk) {
+    return fs_format_mode(fs, disk, FORMAT_FAST);
+}
+
+/**
+ * Format Disk with the specified mode and no optional features (see
+ * fs_format_options).
+ *
+ * Note: Do not format a mounted Disk!
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       disk    Pointer to Disk structure.
+ * @param       mode    How to clear data blocks.
+ * @return      Whether or not all disk operations were successful.
+ **/
+bool    fs_format_mode(FileSystem *fs, Disk *disk, FormatMode mode) {
+    FormatOptions options = {.mode = mode};
+    return fs_format_options(fs, disk, &options);
+}
+
+/**
+ * Format Disk by doing the following:
+ *
+ *  1. Store free block bitmap of the empty file system after the Inode
+ *  table (FS_FEATURE_BITMAP).
+ *
+ *  2. Write SuperBlock (with appropriate magic number, number of blocks,
+ *  number of inode blocks, number of inodes, feature flags, size of the
+ *  bitmap, of the journal reserved after it and of the block checksum table
+ *  after that, and clean flag).
+ *
+ *  3. Clear Inode table, journal and checksum table with range writes (a
+ *  zero checksum means the block has none yet).
+ *
+ *  4. Discard data blocks so they become sparse (FORMAT_FAST), or overwrite
+ *  them with zeros (FORMAT_SECURE).
+ *
+ *  5. Flush Disk so the new metadata is durable in either mode.
+ *
+ * Note: Do not format a mounted Disk!
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       disk    Pointer to Disk structure.
+ * @param       options Pointer to FormatOptions structure.
+ * @return      Whether or not all disk operations were successful.
+ **/
+bool    fs_format_options(FileSystem *fs, Disk *disk, const FormatOptions *options) {
     if (!fs) return false;
     if (!disk) return false;
+    if (!options || (options->features & ~FS_FEATURES)) return false;
     if (fs->disk != 0) return false;
 
     if(fs->free_blocks != NULL) {
         return false;
     }
     Block format_block;
+    memset(&format_block, 0, sizeof(Block));
     format_block.super.magic_number = MAGIC_NUMBER;
     format_block.super.blocks = disk->blocks;
+    format_block.super.features = options->features;
 
     if (format_block.super.blocks % 10 == 0) {
         format_block.super.inode_blocks = disk->blocks / 10;
@@ -106,15 +462,51 @@ bool    fs_format(FileSystem *fs, Disk *disk) {
         format_block.super.inode_blocks = disk->blocks / 10 + 1;
     }
 
-    format_block.super.inodes = format_block.super.inode_blocks*INODES_PER_BLOCK;
+    format_block.super.inodes = format_block.super.inode_blocks*fs_inodes_per_block(&format_block.super);
 
-    char buffer[BLOCK_SIZE] = {0};
-    for (size_t i = 1; i < disk->blocks; i++) { 
-        if (!disk_write(disk, i, buffer)) return false;
+    size_t inode_blocks   = format_block.super.inode_blocks;
+    size_t bitmap_blocks  = 0;
+    size_t journal_blocks = 0;
+    size_t checksum_blocks = 0;
+    if (options->features & FS_FEATURE_BITMAP) {
+        bitmap_blocks = (disk->blocks + BITMAP_WORDS_PER_BLOCK*BITMAP_WORD_BITS - 1) / (BITMAP_WORDS_PER_BLOCK*BITMAP_WORD_BITS);
+    }
+    if (inode_blocks + 1 + bitmap_blocks > disk->blocks) return false;
+    if (options->features & FS_FEATURE_JOURNAL) {
+        journal_blocks = min((size_t)FS_JOURNAL_BLOCKS, (disk->blocks - inode_blocks - 1 - bitmap_blocks) / 4);
+        if (journal_blocks < FS_JOURNAL_MIN) return false;
     }
-    //fs->disk = 0;
+    if (options->features & FS_FEATURE_CHECKSUM) {
+        checksum_blocks = (disk->blocks + CHECKSUMS_PER_BLOCK - 1) / CHECKSUMS_PER_BLOCK;
+    }
+    format_block.super.bitmap_blocks   = bitmap_blocks;
+    format_block.super.journal_blocks  = journal_blocks;
+    format_block.super.checksum_blocks = checksum_blocks;
+    format_block.super.clean           = bitmap_blocks > 0;
 
-    return true;
+    size_t data_start  = fs_data_first(&format_block.super);
+    if (checksum_blocks && data_start >= disk->blocks) return false;
+    size_t data_blocks = disk->blocks - data_start;
+    if (bitmap_blocks) {
+        Bitmap *free_blocks = bitmap_create(disk->blocks, true);
+        if (!free_blocks) return false;
+        bitmap_clear_range(free_blocks, 0, data_start);
+        bool stored = fs_bitmap_store(disk, &format_block.super, free_blocks, NULL);
+        bitmap_delete(free_blocks);
+        if (!stored) return false;
+    }
+
+    if (disk_write(disk, 0, format_block.data) == DISK_FAILURE) return false;
+    if (!disk_zero(disk, 1, inode_blocks)) return false;
+    if (!disk_zero(disk, fs_journal_first(&format_block.super), journal_blocks)) return false;
+    if (!disk_zero(disk, fs_checksum_first(&format_block.super), checksum_blocks)) return false;
+
+    if (options->mode == FORMAT_SECURE) {
+        if (!disk_zero(disk, data_start, data_blocks)) return false;
+    } else if (!disk_discard(disk, data_start, data_blocks)) {
+        return false;
+    }
+    return disk_flush(disk);
 }
 
 /**
@@ -126,7 +518,7 @@ bool    fs_format(FileSystem *fs, Disk *disk) {
  *
  *  3. Copy SuperBlock to FileSystem meta data attribute
  *
- *  4. Initialize FileSystem free blocks bitmap.
+ *  4. Load Inode table and initialize FileSystem free blocks bitmap.
  *
  * Note: Do not mount a Disk that has already been mounted!
  *
@@ -135,6 +527,57 @@ bool    fs_format(FileSystem *fs, Disk *disk) {
  * @return      Whether or not the mount operation was successful.
  **/
 bool    fs_mount(FileSystem *fs, Disk *disk) {
+    return fs_mount_options(fs, disk, NULL);
+}
+
+/**
+ * Mount specified FileSystem to given Disk with the specified options (NULL
+ * for defaults) by doing the following:
+ *
+ *  1. Replay the journal, then read and check SuperBlock (verify
+ *  attributes).
+ *
+ *  2. Verify and record FileSystem disk attribute and options.
+ *
+ *  3. Copy SuperBlock to FileSystem meta data attribute
+ *
+ *  4. Load Inode table and initialize FileSystem free blocks bitmap (read
+ *  from disk if the file system was cleanly unmounted, otherwise scanned in
+ *  parallel if requested), load the block checksum table
+ *  (FS_FEATURE_CHECKSUM), then mark SuperBlock not clean.
+ *
+ *  5. Start the journal, and the reclaim thread if block reclamation is
+ *  deferred.
+ *
+ * Note: Do not mount a Disk that has already been mounted! Statistics are
+ * reset by every successful mount.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       disk    Pointer to Disk structure.
+ * @param       options Pointer to MountOptions structure (may be NULL).
+ * @return      Whether or not the mount operation was successful.
+ **/
+bool    fs_mount_options(FileSystem *fs, Disk *disk, const MountOptions *options) {
+    if (!fs) return false;
+
+    uint64_t start   = stats_now();
+    bool     mounted = fs_mount_disk(fs, disk, options);
+    if (mounted) {
+        memset(&fs->stats, 0, sizeof(FsStats));
+    }
+    stats_record(&fs->stats.mount, start, mounted ? 0 : -1);
+    return mounted;
+}
+
+/**
+ * Mount FileSystem to Disk (see fs_mount_options).
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       disk    Pointer to Disk structure.
+ * @param       options Pointer to MountOptions structure (may be NULL).
+ * @return      Whether or not the mount operation was successful.
+ **/
+bool    fs_mount_disk(FileSystem *fs, Disk *disk, const MountOptions *options) {
     //if (fs->disk != disk) return false;
     if (fs->disk == disk) return false;
     //if (fs->disk != 0) return false;
@@ -147,9 +590,21 @@ bool    fs_mount(FileSystem *fs, Disk *disk) {
     if (!sb) return false;
 
 
+    // replay journal first (transactions may update the superblock)
+    uint32_t sequence = 0;
+    if (sb->magic_number == MAGIC_NUMBER && (sb->features & FS_FEATURE_JOURNAL)) {
+        if (sb->journal_blocks < FS_JOURNAL_MIN || fs_data_first(sb) >= sb->blocks) return false;
+        if (!fs_journal_replay(disk, sb, &sequence)) return false;
+        if (disk_read(disk, 0, disk_super_block.data) == DISK_FAILURE) return false;
+    }
+
     // verify attributes of superblock
-    if (sb->magic_number != MAGIC_NUMBER) return false;
-    if (sb->inode_blocks*INODES_PER_BLOCK > sb->inodes) return false;
+    if (sb->magic_number != MAGIC_NUMBER && sb->magic_number != MAGIC_NUMBER_V1) return false;
+    if (sb->features & ~FS_FEATURES) return false;
+    if ((sb->features & FS_FEATURE_BITMAP) && (size_t)sb->bitmap_blocks*BITMAP_WORDS_PER_BLOCK*BITMAP_WORD_BITS < sb->blocks) return false;
+    if ((sb->features & FS_FEATURE_CHECKSUM) && (size_t)sb->checksum_blocks*CHECKSUMS_PER_BLOCK < sb->blocks) return false;
+    if (fs_data_first(sb) >= sb->blocks) return false;
+    if (sb->inode_blocks*fs_inodes_per_block(sb) > sb->inodes) return false;
     if (sb->blocks < 3) return false;
     if (sb->inode_blocks < sb->blocks / 10) return false;
 
@@ -158,412 +613,5017 @@ bool    fs_mount(FileSystem *fs, Disk *disk) {
     fs->meta_data.inode_blocks = sb->inode_blocks;
     fs->meta_data.blocks = sb->blocks;
     fs->meta_data.inodes = sb->inodes;
+    fs->meta_data.features = sb->features;
+    fs->meta_data.journal_blocks = (sb->features & FS_FEATURE_JOURNAL) ? sb->journal_blocks : 0;
+    fs->meta_data.bitmap_blocks = fs_bitmap_blocks(sb);
+    fs->meta_data.checksum_blocks = fs_checksum_blocks(sb);
+    fs->meta_data.clean = (sb->features & FS_FEATURE_BITMAP) && sb->clean;
 
     fs->disk = disk;
+    if (!fs->locked) {
+        pthread_mutex_init(&fs->alloc_lock, NULL);
+        pthread_mutex_init(&fs->table_lock, NULL);
+        pthread_mutex_init(&fs->stream_lock, NULL);
+        pthread_mutex_init(&fs->checksum_lock, NULL);
+        // writers (fs_write, fs_defrag) must not starve behind a stream of readers
+        pthread_rwlockattr_t attr;
+        pthread_rwlockattr_init(&attr);
+        pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+        for (size_t l = 0; l < FS_INODE_LOCKS; l++) {
+            pthread_rwlock_init(&fs->inode_locks[l], &attr);
+        }
+        pthread_rwlockattr_destroy(&attr);
+        fs->locked = true;
+    }
+    if (options) {
+        fs->options = *options;
+    } else {
+        memset(&fs->options, 0, sizeof(MountOptions));
+    }
+
+    fs->streams = calloc(FS_STREAMS, sizeof(ReadStream));
 
-    // Initializing FileSystem free blocks bitmap
-    fs_initialize_free_block_bitmap(fs); 
+    // Initializing FileSystem free blocks bitmap (and inode table)
+    if (!fs->streams || !fs_initialize_free_block_bitmap(fs, fs->options.threads)) {
+        fs_unmount(fs);
+        return false;
+    }
+    if ((fs->meta_data.features & FS_FEATURE_CHECKSUM) && !fs_checksum_load(fs)) {
+        fs_unmount(fs);
+        return false;
+    }
+    // stored bitmap goes stale from here on, so a crash makes the next mount scan
+    if (fs->meta_data.clean && !fs_mark_clean(fs, false)) {
+        fs_unmount(fs);
+        return false;
+    }
+    if ((fs->meta_data.features & FS_FEATURE_JOURNAL) && !fs_journal_start(fs, sequence)) {
+        fs_unmount(fs);
+        return false;
+    }
+    if (fs->options.deferred_reclaim && !fs_reclaim_start(fs)) {
+        fs_unmount(fs);
+        return false;
+    }
+    fs->clean = fs->meta_data.features & FS_FEATURE_BITMAP;
     return true;
 }
 
 /**
  * Unmount FileSystem from internal Disk by doing the following:
  *
- *  1. Set FileSystem disk attribute.
+ *  1. Stop the reclaim thread (blocks still queued are found free by the
+ *  next mount scan).
  *
- *  2. Release free blocks bitmap.
+ *  2. Write back dirty Inode and checksum table blocks and release Inode
+ *  table, then commit and release the journal and checksum table.
+ *
+ *  3. Release asynchronous I/O engine and write back and release block
+ *  cache.
+ *
+ *  4. Store changed free block bitmap blocks and mark SuperBlock clean, if
+ *  everything above reached the Disk (FS_FEATURE_BITMAP).
+ *
+ *  5. Set FileSystem disk attribute.
+ *
+ *  6. Release free blocks bitmap and block references.
  *
  * @param       fs      Pointer to FileSystem structure.
  **/
 void    fs_unmount(FileSystem *fs) {
     if (!fs) return;
+    fs_reclaim_stop(fs);
+    if (fs->inode_table) {
+        if (!fs_flush_inodes(fs)) fs->clean = false;
+        free(fs->inode_table);
+        fs->inode_table = NULL;
+    }
+    if (!fs_journal_commit(fs)) fs->clean = false;
+    fs_journal_stop(fs);
+    free(fs->checksums);
+    fs->checksums = NULL;
+    if (fs->dirty_checksums) bitmap_delete(fs->dirty_checksums);
+    fs->dirty_checksums = NULL;
+    if (fs->dirty_inodes) bitmap_delete(fs->dirty_inodes);
+    fs->dirty_inodes = NULL;
+    if (fs->free_inodes) bitmap_delete(fs->free_inodes);
+    fs->free_inodes = NULL;
+    fs->inode_hint = 0;
+    fs->defrag_next = 0;
+    free(fs->streams);
+    fs->streams = NULL;
+    fs_set_aio(fs, AIO_AUTO, 0);
+    if (!fs_set_cache(fs, 0)) fs->clean = false;
+    if (fs->clean && fs_bitmap_store(fs->disk, &fs->meta_data, fs->free_blocks, fs->stored_blocks)) {
+        fs_mark_clean(fs, true);
+    }
+    fs->clean = false;
     fs->disk = 0;
-    if (fs->free_blocks) free(fs->free_blocks);
+    if (fs->free_blocks) bitmap_delete(fs->free_blocks);
     fs->free_blocks = NULL; 
+    if (fs->stored_blocks) bitmap_delete(fs->stored_blocks);
+    fs->stored_blocks = NULL;
+    free(fs->shares);
+    fs->shares = NULL;
+    fs->free_hint = 0;
+    if (fs->locked) {
+        pthread_mutex_destroy(&fs->alloc_lock);
+        pthread_mutex_destroy(&fs->table_lock);
+        pthread_mutex_destroy(&fs->stream_lock);
+        pthread_mutex_destroy(&fs->checksum_lock);
+        for (size_t l = 0; l < FS_INODE_LOCKS; l++) {
+            pthread_rwlock_destroy(&fs->inode_locks[l]);
+        }
+        fs->locked = false;
+    }
 }
 
 /**
- * Allocate an Inode in the FileSystem Inode table by doing the following:
- *
- *  1. Search Inode table for free inode.
+ * Configure block cache of mounted FileSystem by doing the following:
  *
- *  2. Reserve free inode in Inode table.
+ *  1. Write back and release any existing cache.
  *
- * Note: Be sure to record updates to Inode table to Disk.
+ *  2. Allocate new cache with specified capacity (0 disables caching).
  *
- * @param       fs      Pointer to FileSystem structure.
- * @return      Inode number of allocated Inode.
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       capacity    Number of blocks to cache.
+ * @return      Whether or not the cache was configured.
  **/
-ssize_t fs_create(FileSystem *fs) {
-    ssize_t inode_count = 0;
-    for (int inode_block = 1; inode_block <= fs->meta_data.inode_blocks; inode_block++) {
-        Block block;
-        disk_read(fs->disk,inode_block,block.data);
-          // going through the inodes in a block
-        for (int inode = 0; inode < INODES_PER_BLOCK; inode++) {
-            if (!block.inodes[inode].valid) {// && !fs->free_blocks[inode_count]) { 
-                block.inodes[inode].valid = true;
-                //fs->free_blocks[inode_block] = false;
-                //for some reason ^ creates memory errors
-                disk_write(fs->disk,inode_block, block.data);
-             
-                return inode_count;
-            }
-            inode_count += 1;
-        }
+bool    fs_set_cache(FileSystem *fs, size_t capacity) {
+    if (!fs) return false;
+
+    if (fs->cache) {
+        if (!cache_flush(fs->cache)) return false;
+        cache_delete(fs->cache);
+        fs->cache = NULL;
     }
-    return -1;
+
+    if (capacity == 0) return true;
+    if (!fs->disk) return false;
+
+    fs->cache = cache_create(fs->disk, capacity);
+    return fs->cache != NULL;
 }
 
 /**
- * Remove Inode and associated data from FileSystem by doing the following:
- *
- *  1. Load and check status of Inode.
+ * Configure asynchronous I/O engine of mounted FileSystem by doing the
+ * following:
  *
- *  2. Release any direct blocks.
+ *  1. Wait for and release any existing engine.
  *
- *  3. Release any indirect blocks.
+ *  2. Create new engine with specified backend and queue depth (0 disables
+ *  asynchronous reads).
  *
- *  4. Mark Inode as free in Inode table.
- *
- * @param       fs              Pointer to FileSystem structure.
- * @param       inode_number    Inode to remove.
- * @return      Whether or not removing the specified Inode was successful.
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       backend     Backend to use (AIO_AUTO picks io_uring if available).
+ * @param       depth       Maximum number of requests in flight.
+ * @return      Whether or not the engine was configured.
  **/
-bool    fs_remove(FileSystem *fs, size_t inode_number) {
+bool    fs_set_aio(FileSystem *fs, AioBackend backend, size_t depth) {
+    if (!fs) return false;
 
-    // we need load inode and save inode here
-    size_t block_num = inode_number / INODES_PER_BLOCK + 1;
-    size_t inode_i = inode_number % INODES_PER_BLOCK;
-    Block blk;
-    disk_read(fs->disk, block_num, blk.data);
-    //Inode *node;
-    //fs_load_inode(fs,inode_number,node);
-    //size_t inode_i = node.
+    if (fs->aio) {
+        aio_delete(fs->aio);
+        fs->aio = NULL;
+    }
 
-    if (!blk.inodes[inode_i].valid) return false;
+    if (depth == 0) return true;
+    if (!fs->disk) return false;
 
-    // all direct inodes
-    for (int dp = 0; dp < POINTERS_PER_INODE; dp++) {
-        if (blk.inodes[inode_i].direct[dp] == 0) continue;
-        // RELEASE BLOCKS and mark as free in inode table
-        fs->free_blocks[blk.inodes[inode_i].direct[dp]] = true;
-        blk.inodes[inode_i].direct[dp] = 0;
-    }
+    fs->aio = aio_create(fs->disk, backend, depth);
+    return fs->aio != NULL;
+}
 
-    // all the blocks from the indirect inode
-    if (blk.inodes[inode_i].indirect != 0) {
-        Block ind_blk;
-        disk_read(fs->disk, blk.inodes[inode_i].indirect, ind_blk.data);
-        for (int ip = 0; ip < POINTERS_PER_BLOCK; ip++) {
-            if (ind_blk.pointers[ip] == 0) continue;
-            // RELEASE BLOCKS to dooooo and also free in inode table
-            fs->free_blocks[ind_blk.pointers[ip]] = true;
-            ind_blk.pointers[ip] = 0;
-            
-        }
-        // marking block pointed to by indrect pointer as free
-        fs->free_blocks[blk.inodes[inode_i].indirect] = true;
-        disk_write(fs->disk, blk.inodes[inode_i].indirect, ind_blk.data);
-        blk.inodes[inode_i].indirect = 0;
-        
-    }
-    blk.inodes[inode_i].size = 0;
-    blk.inodes[inode_i].valid = false;
-    disk_write(fs->disk, block_num, blk.data);
+/**
+ * Wait for deferred block reclamation to finish, and write back any dirty
+ * Inode blocks and cached blocks of mounted FileSystem to Disk (committing
+ * the running journal transaction first).
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @return      Whether or not all dirty blocks were written.
+ **/
+bool    fs_sync(FileSystem *fs) {
+    if (!fs || !fs->disk) return false;
+    fs_reclaim_wait(fs);
+    if (!fs_flush_inodes(fs)) return false;
+    if (!fs_journal_commit(fs)) return false;
+    if (!fs->cache) return true;
+    return cache_flush(fs->cache);
+}
 
+/**
+ * Return number of free data blocks in mounted FileSystem (blocks of removed
+ * Inodes still awaiting deferred reclamation are not counted; see fs_sync).
+ *
+ * Note: Blocks released by the running journal transaction are counted,
+ * although they are only reused once it commits.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @return      Number of free blocks (-1 if not mounted).
+ **/
+ssize_t fs_free_count(FileSystem *fs) {
+    if (!fs || !fs->free_blocks) return -1;
 
- 
-    return true;
+    pthread_mutex_lock(&fs->alloc_lock);
+    size_t count = bitmap_count(fs->free_blocks) + (fs->journal.freed ? bitmap_count(fs->journal.freed) : 0);
+    pthread_mutex_unlock(&fs->alloc_lock);
+    return count;
 }
 
 /**
- * Return size of specified Inode.
+ * Return snapshot of FileSystem statistics by doing the following:
  *
- * @param       fs              Pointer to FileSystem structure.
- * @param       inode_number    Inode to remove.
- * @return      Size of specified Inode (-1 if does not exist).
+ *  1. Copy operation counters and latency histograms recorded since mount.
+ *
+ *  2. Fill in Disk call statistics and block cache hits and misses.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @return      Statistics (all zero if not mounted).
  **/
-ssize_t fs_stat(FileSystem *fs, size_t inode_number) {
-    size_t block_num = inode_number / INODES_PER_BLOCK + 1;
-    size_t inode_i = inode_number % INODES_PER_BLOCK;
-    Block blk;
-    disk_read(fs->disk, block_num, blk.data);
-    if (blk.inodes[inode_i].valid) return blk.inodes[inode_i].size;
+FsStats fs_stats(FileSystem *fs) {
+    FsStats stats;
+    memset(&stats, 0, sizeof(FsStats));
+    if (!fs || !fs->disk) return stats;
 
-    return -1;
+    stats_snapshot(&stats.mount,  &fs->stats.mount);
+    stats_snapshot(&stats.create, &fs->stats.create);
+    stats_snapshot(&stats.remove, &fs->stats.remove);
+    stats_snapshot(&stats.stat,   &fs->stats.stat);
+    stats_snapshot(&stats.read,   &fs->stats.read);
+    stats_snapshot(&stats.write,  &fs->stats.write);
+    stats_snapshot(&stats.clone,  &fs->stats.clone);
+    stats_snapshot(&stats.disk_read,  &fs->disk->read_stats);
+    stats_snapshot(&stats.disk_write, &fs->disk->write_stats);
+    stats.alloc_calls     = __atomic_load_n(&fs->stats.alloc_calls, __ATOMIC_RELAXED);
+    stats.alloc_words     = __atomic_load_n(&fs->stats.alloc_words, __ATOMIC_RELAXED);
+    stats.commits         = __atomic_load_n(&fs->journal.commits, __ATOMIC_RELAXED);
+    stats.disk_flushes    = __atomic_load_n(&fs->disk->flushes, __ATOMIC_RELAXED);
+    stats.checksum_errors = __atomic_load_n(&fs->stats.checksum_errors, __ATOMIC_RELAXED);
+    if (fs->cache) {
+        stats.cache_hits   = __atomic_load_n(&fs->cache->hits, __ATOMIC_RELAXED);
+        stats.cache_misses = __atomic_load_n(&fs->cache->misses, __ATOMIC_RELAXED);
+    }
+    return stats;
 }
 
 /**
-    if (fs->disk == disk) return false;
-    if (fs->disk == 0) return false;
- * Read from the specified Inode into the data buffer exactly length bytes
- * beginning from the specified offset by doing the following:
+ * Allocate an Inode in the FileSystem Inode table by doing the following:
  *
- *  1. Load Inode information.
+ *  1. Take lowest free inode from free inode bitmap.
  *
- *  2. Continuously read blocks and copy data to buffer.
+ *  2. Reserve free inode in Inode table.
  *
- *  Note: Data is read from direct blocks first, and then from indirect blocks.
+ * Note: Be sure to record updates to Inode table to Disk.
  *
- * @param       fs              Pointer to FileSystem structure.
- * @param       inode_number    Inode to read data from.
- * @param       data            Buffer to copy data to.
- * @param       length          Number of bytes to read.
- * @param       offset          Byte offset from which to begin reading.
- * @return      Number of bytes read (-1 on error).
+ * @param       fs      Pointer to FileSystem structure.
+ * @return      Inode number of allocated Inode.
  **/
-ssize_t fs_read(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset) {
-    size_t block_num = inode_number / INODES_PER_BLOCK + 1;
-    size_t inode_i = inode_number % INODES_PER_BLOCK;
-    size_t ncopy;
-    Block blk;
-    disk_read(fs->disk, block_num, blk.data);
+ssize_t fs_create(FileSystem *fs) {
+    ssize_t inode_number;
+    if (fs_create_n(fs, 1, &inode_number) != 1) return -1;
+    return inode_number;
+}
 
-    // adjust length to account for offset
-    // change length if size of file is < length + offset
-    if (blk.inodes[inode_i].size < (length + offset)) {
-        length = blk.inodes[inode_i].size - offset;
-    }
+/**
+ * Allocate up to n Inodes in the FileSystem Inode table by doing the
+ * following:
+ *
+ *  1. Take lowest free inodes from free inode bitmap.
+ *
+ *  2. Reserve each inode in Inode table.
+ *
+ *  3. Write each Inode block touched once.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       n       Number of Inodes to allocate.
+ * @param       out     Where to store allocated Inode numbers.
+ * @return      Number of Inodes allocated (-1 on error).
+ **/
+ssize_t fs_create_n(FileSystem *fs, size_t n, ssize_t out[]) {
+    if (!fs || !fs->inode_table || !out) return -1;
 
-    size_t data_block = offset / BLOCK_SIZE;
-    ssize_t nread = 0;
-    size_t data_offset = offset % BLOCK_SIZE;
+    uint64_t start   = stats_now();
+    size_t   created = 0;
+    fs_journal_begin(fs);
+    while (created < n) {
+        pthread_mutex_lock(&fs->table_lock);
+        size_t inode_number = bitmap_find(fs->free_inodes, fs->inode_hint);
+        if (inode_number != BITMAP_NONE) {
+            bitmap_clear(fs->free_inodes, inode_number);
+            fs->inode_hint = inode_number + 1;
+        }
+        pthread_mutex_unlock(&fs->table_lock);
+        if (inode_number == BITMAP_NONE) break;
 
-    //size_t ncopy;
-    // if length < block size then ncopy is length - offset
-    if (length < BLOCK_SIZE) {
-        ncopy = length;
-        //ncopy = length - offset;
-    } else {
-        ncopy = BLOCK_SIZE - data_offset;
-        //ncopy = blk.inodes[inode_i].size - offset;
+        Inode node = {.valid = true};
+        pthread_rwlock_wrlock(fs_inode_lock(fs, inode_number));
+        fs_save_inode(fs, inode_number, &node);
+        pthread_rwlock_unlock(fs_inode_lock(fs, inode_number));
+        out[created++] = inode_number;
     }
-    
 
-    
-    while (nread < length) {
-        Block data_blk = {{0}};
-        Block indirect_blk = {{0}};
-        if (data_block < POINTERS_PER_INODE) {
-            if (disk_read(fs->disk, blk.inodes[inode_i].direct[data_block], data_blk.data) == DISK_FAILURE) return -1;
-        } else {
-            size_t indirect_offset = data_block - POINTERS_PER_INODE;
-            if (disk_read(fs->disk, blk.inodes[inode_i].indirect, indirect_blk.data) == DISK_FAILURE) return -1; 
-            if (disk_read(fs->disk, indirect_blk.pointers[indirect_offset], data_blk.data) == DISK_FAILURE) return -1;
-
-        }
+    bool flushed = fs_flush_inodes(fs);
+    fs_journal_end(fs);
+    stats_record(&fs->stats.create, start, flushed && created ? 0 : -1);
+    return flushed ? (ssize_t)created : -1;
+}
 
-        memcpy(data + nread, data_blk.data + data_offset, ncopy);
+/**
+ * Remove Inode and associated data from FileSystem (see fs_remove_many).
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to remove.
+ * @return      Whether or not removing the specified Inode was successful.
+ **/
+bool    fs_remove(FileSystem *fs, size_t inode_number) {
+    return fs_remove_many(fs, &inode_number, 1) == 1;
+}
 
-        data_offset = 0;
-        data_block++;
+/**
+ * Remove Inodes and associated data from FileSystem by doing the following:
+ *
+ *  1. Load and check status of each Inode.
+ *
+ *  2. Release its direct, indirect and double and triple indirect blocks (or
+ *  extents), or copy it to be released by the reclaim thread when
+ *  reclamation is deferred.
+ *
+ *  3. Mark each Inode as free in Inode table.
+ *
+ *  4. Write each Inode block touched once, and only then queue deferred
+ *  Inodes.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_numbers   Inodes to remove.
+ * @param       n               Number of Inodes to remove.
+ * @return      Number of Inodes removed (-1 on error).
+ **/
+ssize_t fs_remove_many(FileSystem *fs, const size_t inode_numbers[], size_t n) {
+    if (!fs || !fs->inode_table || !inode_numbers) return -1;
 
-        nread += ncopy;
+    uint64_t start    = stats_now();
+    Inode   *deferred = (fs->reclaim.started && n) ? malloc(n*sizeof(Inode)) : NULL;
+    size_t   removed  = 0;
+    size_t   queued   = 0;
+    fs_journal_begin(fs);
+    for (size_t i = 0; i < n; i++) {
+        pthread_rwlock_t *lock = fs_inode_lock(fs, inode_numbers[i]);
+        if (!lock) continue;
 
-        if ((length - nread) > BLOCK_SIZE) {
-            ncopy = BLOCK_SIZE;
-        } else {
-            ncopy = length - nread;
+        pthread_rwlock_wrlock(lock);
+        if (fs_release_inode(fs, inode_numbers[i], deferred ? &deferred[queued] : NULL)) {
+            removed++;
+            queued += deferred != NULL;
         }
+        pthread_rwlock_unlock(lock);
     }
 
-    return nread;
+    bool flushed = fs_flush_inodes(fs);
+    fs_journal_end(fs);
+    if (queued) {
+        fs_reclaim_queue(fs, deferred, queued);
+    }
+    free(deferred);
+    stats_record(&fs->stats.remove, start, flushed && removed == n ? 0 : -1);
+    return flushed ? (ssize_t)removed : -1;
 }
 
 /**
- * Write to the specified Inode from the data buffer exactly length bytes
- * beginning from the specified offset by doing the following:
- *
- *  1. Load Inode information.
+ * Release Inode (see fs_remove_many).
  *
- *  2. Continuously copy data from buffer to blocks.
+ * Note: Caller must hold the Inode lock for writing, and write the Inode
+ * block with fs_flush_inodes.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to remove.
+ * @param       deferred        Where to copy Inode for the reclaim thread
+ *                              (NULL to release its blocks now).
+ * @return      Whether or not removing the specified Inode was successful.
+ **/
+bool    fs_release_inode(FileSystem *fs, size_t inode_number, Inode *deferred) {
+    Inode node;
+    if (!fs_load_inode(fs, inode_number, &node)) return false;
+
+    if (deferred) {
+        *deferred = node;
+    } else if (!fs_release_blocks(fs, &node)) {
+        return false;
+    }
+
+    memset(node.direct, 0, sizeof(node.direct));
+    node.indirect = 0;
+    node.size = 0;
+    node.valid = false;
+    fs_save_inode(fs, inode_number, &node);
+    fs_stream_reset(fs, inode_number);
+
+    pthread_mutex_lock(&fs->table_lock);
+    bitmap_set(fs->free_inodes, inode_number);
+    fs->inode_hint = min(fs->inode_hint, inode_number);
+    pthread_mutex_unlock(&fs->table_lock);
+    return true;
+}
+
+/**
+ * Release blocks of a removed Inode (inline files have none).
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       node        Inode to release blocks of.
+ * @return      Whether or not every pointer block or extent leaf was read.
+ **/
+bool    fs_release_blocks(FileSystem *fs, Inode *node) {
+    if (fs_inline(&fs->meta_data, node)) return true;
+    if (fs->meta_data.features & FS_FEATURE_EXTENTS) return fs_release_extents(fs, node);
+    return fs_release_pointers(fs, node);
+}
+
+/**
+ * Release direct, indirect and double and triple indirect blocks of Inode.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       node        Inode to release blocks of (pointers are cleared).
+ * @return      Whether or not every pointer block was read.
+ **/
+bool    fs_release_pointers(FileSystem *fs, Inode *node) {
+    Block ind_blk;
+    if (node->indirect != 0) {
+        if (fs_read_block(fs, node->indirect, ind_blk.data) == DISK_FAILURE) return false;
+    }
+
+    // double and triple indirect trees
+    for (size_t ip = fs_indirect_pointers(&fs->meta_data); node->indirect != 0 && ip < POINTERS_PER_BLOCK; ip++) {
+        if (ind_blk.pointers[ip] == 0) continue;
+        if (!fs_release_tree(fs, ind_blk.pointers[ip], ip == INDIRECT_DOUBLE ? 1 : 2)) return false;
+    }
+
+    pthread_mutex_lock(&fs->alloc_lock);
+    // all direct inodes
+    for (int dp = 0; dp < POINTERS_PER_INODE; dp++) {
+        if (node->direct[dp] == 0) continue;
+        // RELEASE BLOCKS and mark as free in inode table (unless a clone still shares them)
+        fs_drop_block(fs, node->direct[dp]);
+        node->direct[dp] = 0;
+    }
+
+    // all the blocks from the indirect inode
+    if (node->indirect != 0) {
+        for (size_t ip = 0; ip < fs_indirect_pointers(&fs->meta_data); ip++) {
+            if (ind_blk.pointers[ip] == 0) continue;
+            // RELEASE BLOCKS to dooooo and also free in inode table
+            fs_drop_block(fs, ind_blk.pointers[ip]);
+        }
+        // marking block pointed to by indrect pointer as free (nothing points to it once the Inode is cleared)
+        fs_free_block(fs, node->indirect);
+    }
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+    node->indirect = 0;
+    return true;
+}
+
+/**
+ * Release extents, extent leaves and extent root of Inode with one bitmap
+ * operation per extent.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       node        Inode to release blocks of (extents are cleared).
+ * @return      Whether or not every extent leaf was read.
+ **/
+bool    fs_release_extents(FileSystem *fs, Inode *node) {
+    if (node->extent_root == 0) {
+        fs_release_runs(fs, node->extents, EXTENTS_PER_INODE);
+    } else {
+        Block root;
+        Block leaf;
+        if (fs_read_block(fs, node->extent_root, root.data) == DISK_FAILURE) return false;
+        for (size_t l = 0; l < EXTENTS_PER_BLOCK && root.leaves[l].block; l++) {
+            if (fs_read_block(fs, root.leaves[l].block, leaf.data) == DISK_FAILURE) return false;
+            fs_release_runs(fs, leaf.extents, EXTENTS_PER_BLOCK);
+        }
+
+        pthread_mutex_lock(&fs->alloc_lock);
+        for (size_t l = 0; l < EXTENTS_PER_BLOCK && root.leaves[l].block; l++) {
+            fs_free_block(fs, root.leaves[l].block);
+        }
+        fs_free_block(fs, node->extent_root);
+        pthread_mutex_unlock(&fs->alloc_lock);
+    }
+
+    memset(node->extents, 0, sizeof(node->extents));
+    node->nextents    = 0;
+    node->extent_root = 0;
+    return true;
+}
+
+/**
+ * Mark the blocks of every extent in a list as free (blocks shared with a
+ * clone lose one reference instead).
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       extents     Array of extents (ends at first unused extent).
+ * @param       capacity    Number of extents in array.
+ **/
+void    fs_release_runs(FileSystem *fs, const Extent *extents, size_t capacity) {
+    pthread_mutex_lock(&fs->alloc_lock);
+    for (size_t e = 0; e < capacity && extents[e].length; e++) {
+        if (extents[e].start) fs_drop_range(fs, extents[e].start, extents[e].length);
+    }
+    pthread_mutex_unlock(&fs->alloc_lock);
+}
+
+/**
+ * Release pointer block and every block below it by doing the following:
+ *
+ *  1. Read pointer block and release the pointer blocks it points to (depth
+ *  levels remain).
+ *
+ *  2. Mark the data blocks it points to (unless a clone still shares them)
+ *  and the pointer block itself as free.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       block       Pointer block to release.
+ * @param       depth       Levels of pointer blocks below block (0 if it
+ *                          points to data blocks).
+ * @return      Whether or not every pointer block was read.
+ **/
+bool    fs_release_tree(FileSystem *fs, size_t block, size_t depth) {
+    Block pointers;
+    if (fs_read_block(fs, block, pointers.data) == DISK_FAILURE) return false;
+
+    for (size_t p = 0; depth > 0 && p < POINTERS_PER_BLOCK; p++) {
+        if (pointers.pointers[p] == 0) continue;
+        if (!fs_release_tree(fs, pointers.pointers[p], depth - 1)) return false;
+    }
+
+    pthread_mutex_lock(&fs->alloc_lock);
+    for (size_t p = 0; depth == 0 && p < POINTERS_PER_BLOCK; p++) {
+        if (pointers.pointers[p] != 0) fs_drop_block(fs, pointers.pointers[p]);
+    }
+    fs_free_block(fs, block);
+    pthread_mutex_unlock(&fs->alloc_lock);
+    return true;
+}
+
+/**
+ * Start thread releasing blocks of Inodes removed with deferred reclamation.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @return      Whether or not the reclaim thread was started.
+ **/
+bool fs_reclaim_start(FileSystem *fs) {
+    ReclaimQueue *reclaim = &fs->reclaim;
+    memset(reclaim, 0, sizeof(ReclaimQueue));
+    pthread_mutex_init(&reclaim->lock, NULL);
+    pthread_cond_init(&reclaim->ready, NULL);
+    pthread_cond_init(&reclaim->drained, NULL);
+    reclaim->started = pthread_create(&reclaim->thread, NULL, fs_reclaim_worker, fs) == 0;
+    if (!reclaim->started) {
+        pthread_mutex_destroy(&reclaim->lock);
+        pthread_cond_destroy(&reclaim->ready);
+        pthread_cond_destroy(&reclaim->drained);
+    }
+    return reclaim->started;
+}
+
+/**
+ * Stop reclaim thread and drop its queue (the blocks of queued Inodes stay
+ * used until the next mount scan finds them free, so the stored free block
+ * bitmap is not marked clean).
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ **/
+void fs_reclaim_stop(FileSystem *fs) {
+    ReclaimQueue *reclaim = &fs->reclaim;
+    if (!reclaim->started) return;
+
+    pthread_mutex_lock(&reclaim->lock);
+    reclaim->stopping = true;
+    pthread_cond_broadcast(&reclaim->ready);
+    pthread_mutex_unlock(&reclaim->lock);
+    pthread_join(reclaim->thread, NULL);
+    if (reclaim->count) fs->clean = false;
+
+    pthread_mutex_destroy(&reclaim->lock);
+    pthread_cond_destroy(&reclaim->ready);
+    pthread_cond_destroy(&reclaim->drained);
+    free(reclaim->inodes);
+    memset(reclaim, 0, sizeof(ReclaimQueue));
+}
+
+/**
+ * Hand copies of removed Inodes to the reclaim thread (releasing their
+ * blocks right away if the queue cannot grow).
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       nodes   Removed Inodes.
+ * @param       n       Number of removed Inodes.
+ **/
+void fs_reclaim_queue(FileSystem *fs, const Inode *nodes, size_t n) {
+    ReclaimQueue *reclaim = &fs->reclaim;
+    pthread_mutex_lock(&reclaim->lock);
+    if (reclaim->count + n > reclaim->capacity) {
+        size_t capacity = max(2*reclaim->capacity, reclaim->count + n);
+        Inode *inodes   = realloc(reclaim->inodes, capacity*sizeof(Inode));
+        if (!inodes) {
+            pthread_mutex_unlock(&reclaim->lock);
+            for (size_t i = 0; i < n; i++) {
+                Inode node = nodes[i];
+                fs_release_blocks(fs, &node);
+            }
+            return;
+        }
+        reclaim->inodes   = inodes;
+        reclaim->capacity = capacity;
+    }
+    memcpy(reclaim->inodes + reclaim->count, nodes, n*sizeof(Inode));
+    reclaim->count += n;
+    pthread_cond_signal(&reclaim->ready);
+    pthread_mutex_unlock(&reclaim->lock);
+}
+
+/**
+ * Wait until reclaim thread has released the blocks of every queued Inode.
+ *
+ * Note: Must not be called with alloc_lock held.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @return      Whether or not any Inode was queued or being released.
+ **/
+bool fs_reclaim_wait(FileSystem *fs) {
+    ReclaimQueue *reclaim = &fs->reclaim;
+    if (!reclaim->started) return false;
+
+    pthread_mutex_lock(&reclaim->lock);
+    bool pending = reclaim->count || reclaim->busy;
+    while (reclaim->count || reclaim->busy) {
+        pthread_cond_wait(&reclaim->drained, &reclaim->lock);
+    }
+    pthread_mutex_unlock(&reclaim->lock);
+    return pending;
+}
+
+/**
+ * Release blocks of queued Inodes until reclaim thread is stopped.
+ *
+ * @param       arg     Pointer to FileSystem structure.
+ * @return      NULL.
+ **/
+void *fs_reclaim_worker(void *arg) {
+    FileSystem   *fs      = arg;
+    ReclaimQueue *reclaim = &fs->reclaim;
+
+    pthread_mutex_lock(&reclaim->lock);
+    while (true) {
+        while (!reclaim->count && !reclaim->stopping) {
+            pthread_cond_wait(&reclaim->ready, &reclaim->lock);
+        }
+        if (reclaim->stopping) break;
+
+        Inode node = reclaim->inodes[--reclaim->count];
+        reclaim->busy++;
+        pthread_mutex_unlock(&reclaim->lock);
+
+        // blocks of an Inode whose pointer blocks cannot be read stay used until next mount
+        fs_release_blocks(fs, &node);
+
+        pthread_mutex_lock(&reclaim->lock);
+        reclaim->busy--;
+        if (!reclaim->count && !reclaim->busy) {
+            pthread_cond_broadcast(&reclaim->drained);
+        }
+    }
+    pthread_mutex_unlock(&reclaim->lock);
+    return NULL;
+}
+
+/**
+ * Return size of specified Inode.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to remove.
+ * @return      Size of specified Inode (-1 if does not exist).
+ **/
+ssize_t fs_stat(FileSystem *fs, size_t inode_number) {
+    if (!fs) return -1;
+
+    uint64_t start = stats_now();
+    pthread_rwlock_t *lock = fs_inode_lock(fs, inode_number);
+    if (!lock) return stats_record(&fs->stats.stat, start, -1);
+
+    Inode node;
+    pthread_rwlock_rdlock(lock);
+    bool  loaded = fs_load_inode(fs, inode_number, &node);
+    pthread_rwlock_unlock(lock);
+
+    stats_record(&fs->stats.stat, start, loaded ? 0 : -1);
+    return loaded ? (ssize_t)node.size : -1;
+}
+
+/**
+ * Describe specified Inode by doing the following:
+ *
+ *  1. Load Inode information.
+ *
+ *  2. Record its logical size and whether its data is compressed.
+ *
+ *  3. Count the data blocks it maps, so sparse and compressed files report
+ *  the space they actually take on Disk.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to describe.
+ * @param       info            Where to store description.
+ * @return      Whether or not the Inode exists.
+ **/
+bool    fs_stat_info(FileSystem *fs, size_t inode_number, FsInfo *info) {
+    if (!fs || !info) return false;
+
+    uint64_t start = stats_now();
+    pthread_rwlock_t *lock = fs_inode_lock(fs, inode_number);
+    if (!lock) {
+        stats_record(&fs->stats.stat, start, -1);
+        return false;
+    }
+
+    Inode node;
+    pthread_rwlock_rdlock(lock);
+    bool  loaded = fs_load_inode(fs, inode_number, &node);
+    if (loaded) {
+        size_t mapped = 0;
+        size_t shared;
+        if (!fs_inline(&fs->meta_data, &node)) {
+            fs_fragments(fs, &node, &mapped, &shared);
+        }
+        *info = (FsInfo){
+            .size       = node.size,
+            .physical   = mapped*BLOCK_SIZE,
+            .compressed = fs_compressed(&node),
+        };
+    }
+    pthread_rwlock_unlock(lock);
+
+    stats_record(&fs->stats.stat, start, loaded ? 0 : -1);
+    return loaded;
+}
+
+/**
+ * Turn compression of specified Inode on or off by doing the following:
+ *
+ *  1. Check that compression is enabled and that the file is still empty
+ *  (existing data keeps the layout it was written with).
+ *
+ *  2. Record INODE_COMPRESSED in the Inode and write the Inode block.
+ *
+ * Note: Writes to a compressed file encode each FS_CLUSTER_SIZE cluster on
+ * its own and store it in the first blocks of the cluster, unmapping the
+ * rest; clusters that do not shrink by at least one block are stored as is.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to update.
+ * @param       compressed      Whether or not to compress file data.
+ * @return      Whether or not the Inode was updated.
+ **/
+bool    fs_set_compressed(FileSystem *fs, size_t inode_number, bool compressed) {
+    if (!fs || !(fs->meta_data.features & FS_FEATURE_COMPRESS)) return false;
+
+    pthread_rwlock_t *lock = fs_inode_lock(fs, inode_number);
+    if (!lock) return false;
+
+    Inode node;
+    fs_journal_begin(fs);
+    pthread_rwlock_wrlock(lock);
+    bool  updated = fs_load_inode(fs, inode_number, &node) && (node.size == 0 || fs_compressed(&node) == compressed);
+    if (updated && fs_compressed(&node) != compressed) {
+        node.valid ^= INODE_COMPRESSED;
+        fs_save_inode(fs, inode_number, &node);
+        fs_stream_reset(fs, inode_number);
+        updated = fs_flush_inodes(fs);
+    }
+    pthread_rwlock_unlock(lock);
+    fs_journal_end(fs);
+    return updated;
+}
+
+/**
+ * Clone specified Inode into a new Inode that shares its data blocks by
+ * doing the following:
+ *
+ *  1. Allocate the new Inode, then lock both Inodes for writing (in stripe
+ *  order, so concurrent clones cannot deadlock).
+ *
+ *  2. Copy inline data, or copy the pointer blocks (or extent root and
+ *  leaves) of the source and take another reference to each data block.
+ *
+ *  3. Write the Inode block of the clone, or remove the clone again if the
+ *  source could not be cloned.
+ *
+ * Note: Writes to a shared block go to a new block (see fs_bmap), so each
+ * file only sees its own writes; a block is freed with its last reference.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to clone.
+ * @return      Inode number of clone (-1 on error).
+ **/
+ssize_t fs_clone(FileSystem *fs, size_t inode_number) {
+    if (!fs) return -1;
+
+    uint64_t start = stats_now();
+    pthread_rwlock_t *lock = fs_inode_lock(fs, inode_number);
+    if (!lock || !fs->shares) return stats_record(&fs->stats.clone, start, -1);
+
+    ssize_t clone_number = fs_create(fs);
+    if (clone_number < 0) return stats_record(&fs->stats.clone, start, -1);
+
+    pthread_rwlock_t *clone_lock = fs_inode_lock(fs, clone_number);
+    pthread_rwlock_t *first      = min(lock, clone_lock);
+    pthread_rwlock_t *second     = max(lock, clone_lock);
+    fs_journal_begin(fs);
+    pthread_rwlock_wrlock(first);
+    if (second != first) pthread_rwlock_wrlock(second);
+
+    // a free source hands its own number to fs_create
+    Inode node;
+    bool  cloned  = (size_t)clone_number != inode_number && fs_load_inode(fs, inode_number, &node) &&
+                    fs_clone_inode(fs, inode_number, clone_number, &node);
+    bool  flushed = fs_flush_inodes(fs);
+
+    if (second != first) pthread_rwlock_unlock(second);
+    pthread_rwlock_unlock(first);
+    fs_journal_end(fs);
+
+    if (!cloned) {
+        fs_remove(fs, clone_number);
+        return stats_record(&fs->stats.clone, start, -1);
+    }
+    stats_record(&fs->stats.clone, start, flushed ? 0 : -1);
+    return flushed ? clone_number : -1;
+}
+
+/**
+ * Copy Inode into its clone (see fs_clone).
+ *
+ * Note: Caller must hold both Inode locks for writing, and write the Inode
+ * block with fs_flush_inodes. On failure the clone keeps what was cloned so
+ * far, so removing it releases exactly the references taken.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to clone.
+ * @param       clone_number    Newly allocated Inode to copy into.
+ * @param       node            Pointer to copy of source Inode.
+ * @return      Whether or not the whole file was cloned.
+ **/
+bool    fs_clone_inode(FileSystem *fs, size_t inode_number, size_t clone_number, const Inode *node) {
+    Inode copy     = *node;
+    bool  complete = true;
+
+    if (fs_inline(&fs->meta_data, node)) {
+        copy = (Inode){.valid = node->valid};
+        fs_save_inode(fs, clone_number, &copy);
+        return fs_write_inline(fs, clone_number, fs_inline_data(fs, inode_number), node->size, 0) == (ssize_t)node->size;
+    }
+
+    if (fs->meta_data.features & FS_FEATURE_EXTENTS) {
+        if (node->extent_root) {
+            copy.extent_root = fs_clone_extents(fs, node->extent_root, &complete);
+        } else {
+            fs_share_runs(fs, node->extents, EXTENTS_PER_INODE);
+        }
+    } else {
+        pthread_mutex_lock(&fs->alloc_lock);
+        for (size_t dp = 0; dp < POINTERS_PER_INODE; dp++) {
+            fs_share_block(fs, node->direct[dp]);
+        }
+        pthread_mutex_unlock(&fs->alloc_lock);
+        if (node->indirect) {
+            copy.indirect = fs_clone_tree(fs, node->indirect, 0, true, &complete);
+        }
+    }
+
+    fs_save_inode(fs, clone_number, &copy);
+    return complete;
+}
+
+/**
+ * Copy pointer block for a clone by doing the following:
+ *
+ *  1. Read pointer block and take another reference to each data block it
+ *  points to.
+ *
+ *  2. Copy the pointer blocks it points to (depth levels remain), starting
+ *  with the double and triple indirect trees of an Inode indirect block.
+ *
+ *  3. Write the copy to a newly allocated block.
+ *
+ * Note: Once complete is cleared, the remaining pointers to pointer blocks
+ * are cleared in the copy instead. A copy that cannot be written keeps its
+ * references until the next mount counts them again.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       block       Pointer block to copy.
+ * @param       depth       Levels of pointer blocks below block (0 if it
+ *                          points to data blocks).
+ * @param       root        Whether or not block is an Inode indirect block.
+ * @param       complete    Cleared if any part of the tree was not copied.
+ * @return      Block holding copy (0 on failure).
+ **/
+size_t  fs_clone_tree(FileSystem *fs, size_t block, size_t depth, bool root, bool *complete) {
+    Block  pointers;
+    size_t copy = find_free_block(fs);
+    if (copy == 0 || fs_read_block(fs, block, pointers.data) == DISK_FAILURE) {
+        pthread_mutex_lock(&fs->alloc_lock);
+        if (copy) bitmap_set(fs->free_blocks, copy);
+        pthread_mutex_unlock(&fs->alloc_lock);
+        *complete = false;
+        return 0;
+    }
+
+    size_t data = root ? fs_indirect_pointers(&fs->meta_data) : (depth == 0 ? POINTERS_PER_BLOCK : 0);
+    pthread_mutex_lock(&fs->alloc_lock);
+    for (size_t p = 0; p < data; p++) {
+        fs_share_block(fs, pointers.pointers[p]);
+    }
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+    for (size_t p = data; p < POINTERS_PER_BLOCK; p++) {
+        if (pointers.pointers[p] == 0) continue;
+        size_t below = root ? (p == INDIRECT_DOUBLE ? 1 : 2) : depth - 1;
+        pointers.pointers[p] = *complete ? fs_clone_tree(fs, pointers.pointers[p], below, false, complete) : 0;
+    }
+
+    if (fs_write_metadata(fs, copy, pointers.data) == DISK_FAILURE) {
+        *complete = false;
+        return 0;
+    }
+    return copy;
+}
+
+/**
+ * Copy extent root and leaves for a clone by doing the following:
+ *
+ *  1. Read extent root, then copy each leaf to a newly allocated block,
+ *  taking another reference to the blocks of its extents.
+ *
+ *  2. Drop the leaves that could not be copied from the copy of the root.
+ *
+ *  3. Write the copy of the root to a newly allocated block.
+ *
+ * Note: A leaf (or root) copy that cannot be written keeps its references
+ * until the next mount counts them again.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       block       Extent root to copy.
+ * @param       complete    Cleared if any leaf was not copied.
+ * @return      Block holding copy of extent root (0 on failure).
+ **/
+size_t  fs_clone_extents(FileSystem *fs, size_t block, bool *complete) {
+    Block  root;
+    Block  leaf;
+    size_t copy = fs_extent_alloc(fs);
+    if (copy == 0 || fs_read_block(fs, block, root.data) == DISK_FAILURE) {
+        pthread_mutex_lock(&fs->alloc_lock);
+        if (copy) bitmap_set(fs->free_blocks, copy);
+        pthread_mutex_unlock(&fs->alloc_lock);
+        *complete = false;
+        return 0;
+    }
+
+    size_t l = 0;
+    for (; l < EXTENTS_PER_BLOCK && root.leaves[l].block; l++) {
+        size_t leaf_copy = fs_extent_alloc(fs);
+        if (leaf_copy == 0 || fs_read_block(fs, root.leaves[l].block, leaf.data) == DISK_FAILURE) {
+            pthread_mutex_lock(&fs->alloc_lock);
+            if (leaf_copy) bitmap_set(fs->free_blocks, leaf_copy);
+            pthread_mutex_unlock(&fs->alloc_lock);
+            break;
+        }
+        fs_share_runs(fs, leaf.extents, EXTENTS_PER_BLOCK);
+        if (fs_write_metadata(fs, leaf_copy, leaf.data) == DISK_FAILURE) break;
+        root.leaves[l].block = leaf_copy;
+    }
+    if (l < EXTENTS_PER_BLOCK && root.leaves[l].block) {
+        memset(root.leaves + l, 0, (EXTENTS_PER_BLOCK - l)*sizeof(ExtentLeaf));
+        *complete = false;
+    }
+
+    if (fs_write_metadata(fs, copy, root.data) == DISK_FAILURE) {
+        *complete = false;
+        return 0;
+    }
+    return copy;
+}
+
+/**
+ * Take another reference to the blocks of every extent in a list.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       extents     Array of extents (ends at first unused extent).
+ * @param       capacity    Number of extents in array.
+ **/
+void    fs_share_runs(FileSystem *fs, const Extent *extents, size_t capacity) {
+    pthread_mutex_lock(&fs->alloc_lock);
+    for (size_t e = 0; e < capacity && extents[e].length; e++) {
+        for (size_t b = 0; extents[e].start && b < extents[e].length; b++) {
+            fs_share_block(fs, extents[e].start + b);
+        }
+    }
+    pthread_mutex_unlock(&fs->alloc_lock);
+}
+
+/**
+    if (fs->disk == disk) return false;
+    if (fs->disk == 0) return false;
+ * Read from the specified Inode into the data buffer exactly length bytes
+ * beginning from the specified offset by doing the following:
+ *
+ *  1. Load Inode information.
+ *
+ *  2. Continuously read blocks and copy data to buffer (submitting all
+ *  block reads at once when an asynchronous I/O engine is configured).
+ *
+ *  3. Track sequential streams to reuse the pinned indirect block and
+ *  prefetch upcoming blocks into the block cache.
+ *
+ *  Note: Data is read from direct blocks first, and then from indirect blocks
+ *  (inline files are copied straight from the Inode table).
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to read data from.
+ * @param       data            Buffer to copy data to.
+ * @param       length          Number of bytes to read.
+ * @param       offset          Byte offset from which to begin reading.
+ * @return      Number of bytes read (-1 on error).
+ **/
+ssize_t fs_read(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset) {
+    if (!fs) return -1;
+
+    uint64_t start = stats_now();
+    pthread_rwlock_t *lock = fs_inode_lock(fs, inode_number);
+    if (!lock) return stats_record(&fs->stats.read, start, -1);
+
+    pthread_rwlock_rdlock(lock);
+    BlockMap map   = {.inode = fs_inode(fs, inode_number)};
+    ssize_t  nread = map.inode->valid ? fs_read_inode(fs, inode_number, &map, data, length, offset) : -1;
+    pthread_rwlock_unlock(lock);
+    return stats_record(&fs->stats.read, start, nread);
+}
+
+/**
+ * Read data from Inode through its BlockMap (see fs_read).
+ *
+ * Note: Caller must hold the Inode lock, and map must describe a valid Inode.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to read data from.
+ * @param       map             Pointer to BlockMap of Inode.
+ * @param       data            Buffer to copy data to.
+ * @param       length          Number of bytes to read.
+ * @param       offset          Byte offset from which to begin reading.
+ * @return      Number of bytes read (-1 on error).
+ **/
+ssize_t fs_read_inode(FileSystem *fs, size_t inode_number, BlockMap *map, char *data, size_t length, size_t offset) {
+    // adjust length to account for offset
+    // change length if size of file is < length + offset
+    Inode  *node  = map->inode;
+    ssize_t nread = 0;
+    if (offset < node->size && fs_inline(&fs->meta_data, node)) {
+        nread = min(length, node->size - offset);
+        memcpy(data, fs_inline_data(fs, inode_number) + offset, nread);
+    } else if (offset < node->size) {
+        size_t count  = min(length, node->size - offset);
+        size_t window = fs_stream_begin(fs, inode_number, map, offset);
+        if (fs_compressed(node)) {
+            nread = fs_compress_read(fs, map, data, count, offset);
+        } else {
+            nread = fs->aio ? fs_read_async(fs, map, data, count, offset)
+                            : fs_transfer(fs, map, data, count, offset, false);
+        }
+        if (nread > 0) {
+            fs_stream_end(fs, inode_number, map, offset + nread, window);
+        }
+    }
+    return nread;
+}
+
+/**
+ * Hand contents of the specified Inode to callback without copying them
+ * into a caller buffer by doing the following:
+ *
+ *  1. Load Inode information and clamp length to the file size.
+ *
+ *  2. Map blocks into physically contiguous extents that point directly at
+ *  the memory mapped Disk, or at a staging buffer filled with one vectored
+ *  read per extent otherwise.
+ *
+ *  3. Pass batches of up to FS_ITER_EXTENTS extents to callback.
+ *
+ * Note: The vectors are only valid during the callback, which runs with the
+ * Inode locked for reading and must not modify the Inode.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to read data from.
+ * @param       offset          Byte offset from which to begin reading.
+ * @param       length          Number of bytes to read.
+ * @param       callback        Function called with each batch of extents
+ *                              (returns false to stop).
+ * @param       ctx             Caller data passed to callback.
+ * @return      Number of bytes handed to callback (-1 on error or if callback
+ *              stopped).
+ **/
+ssize_t fs_read_iter(FileSystem *fs, size_t inode_number, size_t offset, size_t length, FsReadIter callback, void *ctx) {
+    if (!fs || !callback) return -1;
+
+    uint64_t start = stats_now();
+    pthread_rwlock_t *lock = fs_inode_lock(fs, inode_number);
+    if (!lock) return stats_record(&fs->stats.read, start, -1);
+
+    pthread_rwlock_rdlock(lock);
+    BlockMap map   = {.inode = fs_inode(fs, inode_number)};
+    ssize_t  nread = map.inode->valid ? fs_iterate_inode(fs, inode_number, &map, offset, length, callback, ctx) : -1;
+    pthread_rwlock_unlock(lock);
+    return stats_record(&fs->stats.read, start, nread);
+}
+
+/**
+ * Hand contents of Inode to callback through its BlockMap (see
+ * fs_read_iter).
+ *
+ * Note: Caller must hold the Inode lock, and map must describe a valid Inode.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to read data from.
+ * @param       map             Pointer to BlockMap of Inode.
+ * @param       offset          Byte offset from which to begin reading.
+ * @param       length          Number of bytes to read.
+ * @param       callback        Function called with each batch of extents.
+ * @param       ctx             Caller data passed to callback.
+ * @return      Number of bytes handed to callback (-1 on error or if callback
+ *              stopped).
+ **/
+ssize_t fs_iterate_inode(FileSystem *fs, size_t inode_number, BlockMap *map, size_t offset, size_t length, FsReadIter callback, void *ctx) {
+    Inode *node = map->inode;
+    if (offset < node->size && fs_inline(&fs->meta_data, node)) {
+        struct iovec iov = {fs_inline_data(fs, inode_number) + offset, min(length, node->size - offset)};
+        return callback(&iov, 1, offset, ctx) ? (ssize_t)iov.iov_len : -1;
+    }
+    if (offset < node->size && fs_compressed(node)) {
+        return fs_compress_iterate(fs, map, offset, min(length, node->size - offset), callback, ctx);
+    }
+    if (offset < node->size) {
+        return fs_iterate(fs, map, offset, min(length, node->size - offset), callback, ctx);
+    }
+    return 0;
+}
+
+/**
+ * Write to the specified Inode from the data buffer exactly length bytes
+ * beginning from the specified offset by doing the following:
+ *
+ *  1. Load Inode information.
+ *
+ *  2. Continuously copy data from buffer to blocks in block order.
+ *
+ *  3. Write the indirect block and the Inode block at most once, and only
+ *  if the write mapped new blocks or grew the file.
+ *
+ *  4. If the disk filled up while the running journal transaction holds
+ *  released blocks, commit it and write the rest once more.
  *
  *  Note: Data is read from direct blocks first, and then from indirect blocks.
+ *  Files that fit in an inline data Inode record are written to the Inode
+ *  table, and move to blocks once they outgrow it.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to write data to.
+ * @param       data            Buffer with data to copy
+ * @param       length          Number of bytes to write.
+ * @param       offset          Byte offset from which to begin writing.
+ * @return      Number of bytes read (-1 on error).
+ **/
+ssize_t fs_write(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset) {
+    if (!fs) return -1;
+
+    uint64_t start = stats_now();
+    pthread_rwlock_t *lock = fs_inode_lock(fs, inode_number);
+    if (!lock) return stats_record(&fs->stats.write, start, -1);
+
+    // check if valid inode (work on a copy while fs_flush_inodes may run)
+    ssize_t nwrite  = -1;
+    size_t  written = 0;
+    for (bool retry = false; ; retry = true) {
+        Inode    node;
+        BlockMap map = {.inode = &node};
+        fs_journal_begin(fs);
+        pthread_rwlock_wrlock(lock);
+        nwrite = fs_load_inode(fs, inode_number, &node) ? fs_write_inode(fs, inode_number, &map, data + written, length - written, offset + written) : -1;
+        pthread_rwlock_unlock(lock);
+        fs_journal_end(fs);
+
+        // blocks released by the running transaction are free once it commits
+        written += max(nwrite, 0);
+        if (retry || written == length || !fs_journal_reclaim(fs)) break;
+    }
+    return stats_record(&fs->stats.write, start, written > 0 ? (ssize_t)written : nwrite);
+}
+
+/**
+ * Write data to Inode through its BlockMap and record updated Inode (see
+ * fs_write).
+ *
+ * Note: Caller must hold the Inode lock for writing, and map must describe
+ * a copy of the valid Inode (updated in place).
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to write data to.
+ * @param       map             Pointer to BlockMap of Inode copy.
+ * @param       data            Buffer with data to copy
+ * @param       length          Number of bytes to write.
+ * @param       offset          Byte offset from which to begin writing.
+ * @return      Number of bytes written (-1 on error).
+ **/
+ssize_t fs_write_inode(FileSystem *fs, size_t inode_number, BlockMap *map, char *data, size_t length, size_t offset) {
+    Inode *node     = map->inode;
+    Inode  original = *node;
+
+    // files end where the Inode size can no longer record them
+    size_t   count = (offset < FS_MAX_FILE_SIZE) ? min(length, FS_MAX_FILE_SIZE - offset) : 0;
+    if (count == 0) return (length > 0) ? -1 : 0;
+    bool     moved = fs_inline(&fs->meta_data, node);
+    if (moved && offset + count <= INLINE_DATA_SIZE) {
+        return fs_write_inline(fs, inode_number, data, count, offset);
+    }
+
+    // inline file outgrows its record: start over as an empty block file
+    char     contents[INLINE_DATA_SIZE];
+    size_t   ncontents = moved ? min((size_t)node->size, offset) : 0;
+    if (moved) {
+        memcpy(contents, fs_inline_data(fs, inode_number), ncontents);
+        memset(node->direct, 0, sizeof(node->direct));
+        node->indirect = 0;
+        node->size     = 0;
+        *map = (BlockMap){.inode = node};
+    }
+
+    // compressed files rewrite whole clusters (see fs_compress_write)
+    bool     compressed = fs_compressed(node);
+    fs_bmap_reserve(fs, map, count, offset);
+    ssize_t nwrite = 0;
+    if (ncontents == 0 || (compressed ? fs_compress_write(fs, map, contents, ncontents, 0)
+                                      : fs_transfer(fs, map, contents, ncontents, 0, true)) == (ssize_t)ncontents) {
+        node->size = moved ? ncontents : node->size;
+        nwrite     = compressed ? fs_compress_write(fs, map, data, count, offset)
+                                : fs_transfer(fs, map, data, count, offset, true);
+    }
+    fs_bmap_release(fs, map);
+
+    // update inode size and record any new pointers
+    if (nwrite > 0 && offset + nwrite > node->size) {
+        node->size = offset + nwrite;
+    }
+    // a file that failed to outgrow its record stays inline and gives back its blocks
+    if (moved && fs_inline(&fs->meta_data, node)) {
+        if (fs_bmap_sync(fs, map)) {
+            if (fs->meta_data.features & FS_FEATURE_EXTENTS) {
+                fs_release_extents(fs, node);
+            } else {
+                fs_release_pointers(fs, node);
+            }
+        }
+        return -1;
+    }
+    // overwrites that neither grow the file nor map blocks leave it clean
+    if (memcmp(node, &original, sizeof(Inode)) != 0) {
+        fs_save_inode(fs, inode_number, node);
+    }
+    fs_stream_reset(fs, inode_number);
+    if (!fs_bmap_sync(fs, map)) return -1;
+    if (!fs_flush_inodes(fs)) return -1;
+
+    return (nwrite == 0 && length > 0) ? -1 : nwrite;
+}
+
+/**
+ * Write data that fits in the Inode record of an inline file by doing the
+ * following:
+ *
+ *  1. Copy data into the record under the table lock (bytes between the old
+ *  end of file and offset are already zero).
+ *
+ *  2. Grow the file size and write the Inode block.
+ *
+ * Note: Caller must hold the Inode lock for writing.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inline Inode to write data to.
+ * @param       data            Buffer with data to copy
+ * @param       length          Number of bytes to write.
+ * @param       offset          Byte offset from which to begin writing.
+ * @return      Number of bytes written (-1 on error).
+ **/
+ssize_t fs_write_inline(FileSystem *fs, size_t inode_number, const char *data, size_t length, size_t offset) {
+    if (length == 0) return 0;
+
+    Inode *node = fs_inode(fs, inode_number);
+    pthread_mutex_lock(&fs->table_lock);
+    memcpy(fs_inline_data(fs, inode_number) + offset, data, length);
+    node->size = max((size_t)node->size, offset + length);
+    bitmap_set(fs->dirty_inodes, inode_number / INLINE_INODES_PER_BLOCK);
+    pthread_mutex_unlock(&fs->table_lock);
+
+    fs_stream_reset(fs, inode_number);
+    return fs_flush_inodes(fs) ? (ssize_t)length : -1;
+}
+
+/**
+ * Punch a hole into the specified Inode (see fs_punch_inode).
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to punch hole into.
+ * @param       offset          Byte offset of hole.
+ * @param       length          Number of bytes to punch.
+ * @return      Number of data blocks released (-1 on error).
+ **/
+ssize_t fs_punch_hole(FileSystem *fs, size_t inode_number, size_t offset, size_t length) {
+    if (!fs) return -1;
+
+    pthread_rwlock_t *lock = fs_inode_lock(fs, inode_number);
+    if (!lock) return -1;
+
+    Inode    node;
+    BlockMap map = {.inode = &node};
+    fs_journal_begin(fs);
+    pthread_rwlock_wrlock(lock);
+    ssize_t  punched = fs_load_inode(fs, inode_number, &node) ? fs_punch_inode(fs, inode_number, &map, offset, length) : -1;
+    pthread_rwlock_unlock(lock);
+    fs_journal_end(fs);
+    return punched;
+}
+
+/**
+ * Punch a hole into Inode through its BlockMap by doing the following:
+ *
+ *  1. Clamp the range to the end of file (the file size never changes).
+ *
+ *  2. Write zeros over the partial blocks (or clusters of a compressed
+ *  file) at either end of the range (holes there already read as zeros).
+ *
+ *  3. Unmap the blocks wholly inside the range (or past the end of file)
+ *  and release them, turning punched extent ranges into holes.
+ *
+ *  4. Record updated pointer blocks (or extent leaves) and Inode.
+ *
+ * Note: Caller must hold the Inode lock for writing, and map must describe
+ * a copy of the valid Inode (updated in place). Pointer blocks left empty
+ * are kept until the file is removed.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to punch hole into.
+ * @param       map             Pointer to BlockMap of Inode copy.
+ * @param       offset          Byte offset of hole.
+ * @param       length          Number of bytes to punch.
+ * @return      Number of data blocks released (-1 on error).
+ **/
+ssize_t fs_punch_inode(FileSystem *fs, size_t inode_number, BlockMap *map, size_t offset, size_t length) {
+    Inode *node     = map->inode;
+    Inode  original = *node;
+    Block  zeros[FS_CLUSTER_BLOCKS] = {{{0}}};
+
+    size_t end = (offset < node->size) ? offset + min(length, node->size - offset) : offset;
+    if (offset >= end) return 0;
+    if (fs_inline(&fs->meta_data, node)) {
+        return fs_write_inline(fs, inode_number, zeros[0].data, end - offset, offset) < 0 ? -1 : 0;
+    }
+
+    // bytes past the end of file need no zeros, so the last block (or cluster) goes whole
+    bool   compressed = fs_compressed(node);
+    size_t unit  = compressed ? FS_CLUSTER_SIZE : BLOCK_SIZE;
+    size_t first = (offset + unit - 1) / unit;
+    size_t last  = max(first, (end == node->size ? end + unit - 1 : end) / unit);
+    size_t edges[2][2] = {
+        {offset, min(end, first*unit)},
+        {max(offset, last*unit), end},
+    };
+    for (size_t e = 0; e < 2; e++) {
+        size_t count = edges[e][1] > edges[e][0] ? edges[e][1] - edges[e][0] : 0;
+        if (count == 0 || fs_bmap(fs, map, (edges[e][0] / unit)*(unit / BLOCK_SIZE), false) == 0) continue;
+        ssize_t nwrite = compressed ? fs_compress_write(fs, map, zeros[0].data, count, edges[e][0])
+                                    : fs_transfer(fs, map, zeros[0].data, count, edges[e][0], true);
+        if (nwrite != (ssize_t)count) return -1;
+    }
+
+    ssize_t punched = fs_punch_blocks(fs, map, first*(unit / BLOCK_SIZE), last*(unit / BLOCK_SIZE));
+
+    if (memcmp(node, &original, sizeof(Inode)) != 0) {
+        fs_save_inode(fs, inode_number, node);
+    }
+    fs_stream_reset(fs, inode_number);
+    if (!fs_bmap_sync(fs, map)) return -1;
+    if (!fs_flush_inodes(fs)) return -1;
+    return punched;
+}
+
+/**
+ * Unmap a range of logical blocks of an Inode (see fs_punch_pointers and
+ * fs_punch_extents).
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       map         Pointer to BlockMap of Inode.
+ * @param       first       First logical block to unmap.
+ * @param       last        One past last logical block to unmap.
+ * @return      Number of data blocks released (-1 on error).
+ **/
+ssize_t fs_punch_blocks(FileSystem *fs, BlockMap *map, size_t first, size_t last) {
+    if (fs->meta_data.features & FS_FEATURE_EXTENTS) {
+        return fs_punch_extents(fs, map, first, last);
+    }
+    return fs_punch_pointers(fs, map, first, last);
+}
+
+/**
+ * Clear the pointers to a range of logical blocks of a pointer Inode and
+ * release the blocks (blocks shared with a clone lose one reference
+ * instead).
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       map         Pointer to BlockMap of Inode.
+ * @param       first       First logical block to unmap.
+ * @param       last        One past last logical block to unmap.
+ * @return      Number of data blocks released.
+ **/
+ssize_t fs_punch_pointers(FileSystem *fs, BlockMap *map, size_t first, size_t last) {
+    ssize_t punched = 0;
+    for (size_t index = first; index < last; index++) {
+        bool     *dirty;
+        uint32_t *pointer = fs_bmap_pointer(fs, map, index, false, &dirty);
+        if (!pointer || *pointer == 0) continue;
+
+        pthread_mutex_lock(&fs->alloc_lock);
+        fs_drop_block(fs, *pointer);
+        pthread_mutex_unlock(&fs->alloc_lock);
+        *pointer = 0;
+        if (dirty) *dirty = true;
+        punched++;
+    }
+    return punched;
+}
+
+/**
+ * Turn the extents covering a range of logical blocks of an extent Inode
+ * into holes by doing the following:
+ *
+ *  1. Move the BlockMap cursor to each extent overlapping the range, and
+ *  skip holes.
+ *
+ *  2. Split the overlap out of the extent as a hole (merged with adjacent
+ *  holes), making room in the extent list first if needed.
+ *
+ *  3. Release the blocks of the overlap (blocks shared with a clone lose
+ *  one reference instead).
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       map         Pointer to BlockMap of Inode.
+ * @param       first       First logical block to unmap.
+ * @param       last        One past last logical block to unmap.
+ * @return      Number of data blocks released (-1 on error).
+ **/
+ssize_t fs_punch_extents(FileSystem *fs, BlockMap *map, size_t first, size_t last) {
+    ssize_t punched = 0;
+    for (size_t index = first; index < last;) {
+        size_t  capacity;
+        Extent *extents = fs_extent_seek(fs, map, index, &capacity);
+        if (!extents) return -1;
+        if (map->slot >= capacity || extents[map->slot].length == 0) break;
+
+        size_t start = extents[map->slot].start;
+        size_t count = min(map->first + extents[map->slot].length, last) - index;
+        if (start) {
+            size_t block = start + (index - map->first);
+            if (!fs_extent_punch(map, extents, capacity, index, count)) {
+                if (!fs_extent_grow(fs, map, extents, capacity) ||
+                    !(extents = fs_extent_seek(fs, map, index, &capacity)) ||
+                    !fs_extent_punch(map, extents, capacity, index, count)) {
+                    return -1;
+                }
+            }
+            pthread_mutex_lock(&fs->alloc_lock);
+            fs_drop_range(fs, block, count);
+            pthread_mutex_unlock(&fs->alloc_lock);
+            punched += count;
+        }
+        index += count;
+    }
+    return punched;
+}
+
+/**
+ * Open a handle on the specified Inode by doing the following:
+ *
+ *  1. Check that the Inode is valid.
+ *
+ *  2. Pin a copy of the Inode and keep its BlockMap, so pointer blocks (or
+ *  extent leaves) decoded by one call are reused by later calls until the
+ *  Inode's block pointers change.
+ *
+ * Note: A handle must not be used by several threads at once, and must be
+ * closed before the FileSystem is unmounted. Removing the Inode makes
+ * further calls on the handle fail.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to open.
+ * @return      Pointer to FsHandle (NULL on error).
+ **/
+FsHandle *fs_open(FileSystem *fs, size_t inode_number) {
+    pthread_rwlock_t *lock = fs_inode_lock(fs, inode_number);
+    if (!lock) return NULL;
+
+    FsHandle *handle = calloc(1, sizeof(FsHandle));
+    if (!handle) return NULL;
+    handle->fs           = fs;
+    handle->inode_number = inode_number;
+
+    pthread_rwlock_rdlock(lock);
+    bool mapped = fs_handle_map(fs, handle);
+    pthread_rwlock_unlock(lock);
+    if (!mapped) {
+        free(handle);
+        return NULL;
+    }
+    return handle;
+}
+
+/**
+ * Close handle and release its pinned Inode and BlockMap.
+ *
+ * @param       handle      Pointer to FsHandle structure (may be NULL).
+ **/
+void    fs_close(FsHandle *handle) {
+    free(handle);
+}
+
+/**
+ * Read from the Inode of handle into the data buffer exactly length bytes
+ * beginning from the specified offset (see fs_read), reusing the pinned
+ * Inode and BlockMap of handle. The cursor is left alone.
+ *
+ * @param       handle      Pointer to FsHandle structure.
+ * @param       data        Buffer to copy data to.
+ * @param       length      Number of bytes to read.
+ * @param       offset      Byte offset from which to begin reading.
+ * @return      Number of bytes read (-1 on error).
+ **/
+ssize_t fs_pread(FsHandle *handle, char *data, size_t length, size_t offset) {
+    if (!handle) return -1;
+
+    FileSystem *fs    = handle->fs;
+    uint64_t    start = stats_now();
+    pthread_rwlock_t *lock = fs_inode_lock(fs, handle->inode_number);
+    if (!lock) return stats_record(&fs->stats.read, start, -1);
+
+    pthread_rwlock_rdlock(lock);
+    ssize_t nread = -1;
+    if (fs_handle_map(fs, handle)) {
+        nread = fs_read_inode(fs, handle->inode_number, &handle->map, data, length, offset);
+    }
+    pthread_rwlock_unlock(lock);
+    return stats_record(&fs->stats.read, start, nread);
+}
+
+/**
+ * Hand contents of the Inode of handle to callback (see fs_read_iter),
+ * reusing the pinned Inode and BlockMap of handle. The cursor is left alone.
+ *
+ * @param       handle      Pointer to FsHandle structure.
+ * @param       offset      Byte offset from which to begin reading.
+ * @param       length      Number of bytes to read.
+ * @param       callback    Function called with each batch of extents
+ *                          (returns false to stop).
+ * @param       ctx         Caller data passed to callback.
+ * @return      Number of bytes handed to callback (-1 on error or if callback
+ *              stopped).
+ **/
+ssize_t fs_pread_iter(FsHandle *handle, size_t offset, size_t length, FsReadIter callback, void *ctx) {
+    if (!handle || !callback) return -1;
+
+    FileSystem *fs    = handle->fs;
+    uint64_t    start = stats_now();
+    pthread_rwlock_t *lock = fs_inode_lock(fs, handle->inode_number);
+    if (!lock) return stats_record(&fs->stats.read, start, -1);
+
+    pthread_rwlock_rdlock(lock);
+    ssize_t nread = -1;
+    if (fs_handle_map(fs, handle)) {
+        nread = fs_iterate_inode(fs, handle->inode_number, &handle->map, offset, length, callback, ctx);
+    }
+    pthread_rwlock_unlock(lock);
+    return stats_record(&fs->stats.read, start, nread);
+}
+
+/**
+ * Write to the Inode of handle from the data buffer exactly length bytes
+ * beginning from the specified offset (see fs_write), reusing the pinned
+ * Inode and BlockMap of handle. The cursor is left alone.
+ *
+ * @param       handle      Pointer to FsHandle structure.
+ * @param       data        Buffer with data to copy.
+ * @param       length      Number of bytes to write.
+ * @param       offset      Byte offset from which to begin writing.
+ * @return      Number of bytes written (-1 on error).
+ **/
+ssize_t fs_pwrite(FsHandle *handle, char *data, size_t length, size_t offset) {
+    return fs_write_handle(handle, data, length, offset, false);
+}
+
+/**
+ * Write data buffer to the end of the Inode of handle and move the cursor
+ * past it.
+ *
+ * @param       handle      Pointer to FsHandle structure.
+ * @param       data        Buffer with data to copy.
+ * @param       length      Number of bytes to write.
+ * @return      Number of bytes written (-1 on error).
+ **/
+ssize_t fs_append(FsHandle *handle, char *data, size_t length) {
+    return fs_write_handle(handle, data, length, 0, true);
+}
+
+/**
+ * Read from the cursor of handle and advance it past the bytes read.
+ *
+ * @param       handle      Pointer to FsHandle structure.
+ * @param       data        Buffer to copy data to.
+ * @param       length      Number of bytes to read.
+ * @return      Number of bytes read (-1 on error).
+ **/
+ssize_t fs_hread(FsHandle *handle, char *data, size_t length) {
+    if (!handle) return -1;
+
+    ssize_t nread = fs_pread(handle, data, length, handle->offset);
+    if (nread > 0) handle->offset += nread;
+    return nread;
+}
+
+/**
+ * Write at the cursor of handle and advance it past the bytes written.
+ *
+ * @param       handle      Pointer to FsHandle structure.
+ * @param       data        Buffer with data to copy.
+ * @param       length      Number of bytes to write.
+ * @return      Number of bytes written (-1 on error).
+ **/
+ssize_t fs_hwrite(FsHandle *handle, char *data, size_t length) {
+    if (!handle) return -1;
+
+    ssize_t nwrite = fs_pwrite(handle, data, length, handle->offset);
+    if (nwrite > 0) handle->offset += nwrite;
+    return nwrite;
+}
+
+/**
+ * Move cursor of handle.
+ *
+ * @param       handle      Pointer to FsHandle structure.
+ * @param       offset      Byte offset for next fs_hread or fs_hwrite.
+ * @return      New cursor of handle.
+ **/
+size_t  fs_seek(FsHandle *handle, size_t offset) {
+    if (!handle) return 0;
+    handle->offset = offset;
+    return offset;
+}
+
+/**
+ * Write to the Inode of handle (see fs_pwrite and fs_append) by doing the
+ * following:
+ *
+ *  1. Refresh the pinned Inode and BlockMap if the Inode changed since they
+ *  were loaded.
+ *
+ *  2. Write through the pinned BlockMap, which stays current afterwards
+ *  (the pinned Inode is reloaded, as inline writes update the Inode table).
+ *
+ *  3. Drop the pinned copies if the write failed part way.
+ *
+ *  4. If the disk filled up while the running journal transaction holds
+ *  released blocks, commit it and write the rest once more.
+ *
+ * @param       handle      Pointer to FsHandle structure.
+ * @param       data        Buffer with data to copy.
+ * @param       length      Number of bytes to write.
+ * @param       offset      Byte offset from which to begin writing.
+ * @param       append      Whether to write at the end of file instead of
+ *                          offset (and move cursor past the data).
+ * @return      Number of bytes written (-1 on error).
+ **/
+ssize_t fs_write_handle(FsHandle *handle, char *data, size_t length, size_t offset, bool append) {
+    if (!handle) return -1;
+
+    FileSystem *fs    = handle->fs;
+    uint64_t    start = stats_now();
+    pthread_rwlock_t *lock = fs_inode_lock(fs, handle->inode_number);
+    if (!lock) return stats_record(&fs->stats.write, start, -1);
+
+    ssize_t nwrite;
+    size_t  written = 0;
+    for (bool retry = false; ; retry = true) {
+        nwrite = -1;
+        fs_journal_begin(fs);
+        pthread_rwlock_wrlock(lock);
+        if (fs_handle_map(fs, handle)) {
+            // a retry continues where the first attempt stopped, even when appending
+            offset = (append && !retry) ? handle->node.size : offset;
+            nwrite = fs_write_inode(fs, handle->inode_number, &handle->map, data + written, length - written, offset + written);
+            handle->mapped  = nwrite >= 0 && fs_load_inode(fs, handle->inode_number, &handle->node);
+            handle->version = fs->inode_versions[handle->inode_number % FS_INODE_LOCKS];
+        }
+        pthread_rwlock_unlock(lock);
+        fs_journal_end(fs);
+
+        // blocks released by the running transaction are free once it commits
+        written += max(nwrite, 0);
+        if (retry || written == length || !fs_journal_reclaim(fs)) break;
+    }
+
+    nwrite = written > 0 ? (ssize_t)written : nwrite;
+    if (append && nwrite >= 0) handle->offset = offset + nwrite;
+    return stats_record(&fs->stats.write, start, nwrite);
+}
+
+/**
+ * Make pinned Inode and BlockMap of handle current, reloading them if any
+ * Inode of its lock stripe changed block pointers since they were loaded.
+ *
+ * Note: Caller must hold the Inode lock.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       handle      Pointer to FsHandle structure.
+ * @return      Whether or not the Inode is still valid.
+ **/
+bool    fs_handle_map(FileSystem *fs, FsHandle *handle) {
+    size_t version = fs->inode_versions[handle->inode_number % FS_INODE_LOCKS];
+    if (handle->mapped && handle->version == version) return true;
+
+    handle->mapped  = fs_load_inode(fs, handle->inode_number, &handle->node);
+    handle->version = version;
+    memset(&handle->map, 0, sizeof(BlockMap));
+    handle->map.inode = &handle->node;
+    return handle->mapped;
+}
+
+/**
+ * Return fragmentation score of Inode: the number of places where logically
+ * consecutive blocks of the file are not physically adjacent (apart from the
+ * pointer blocks a fresh sequential write places between them), so 0 means
+ * fs_read can coalesce every run of the file.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to examine.
+ * @return      Fragmentation score (-1 on error).
+ **/
+ssize_t fs_fragmentation(FileSystem *fs, size_t inode_number) {
+    if (!fs) return -1;
+
+    pthread_rwlock_t *lock = fs_inode_lock(fs, inode_number);
+    if (!lock) return -1;
+
+    pthread_rwlock_rdlock(lock);
+    Inode   node;
+    ssize_t score = -1;
+    if (fs_load_inode(fs, inode_number, &node)) {
+        size_t mapped;
+        size_t shared;
+        score = fs_fragments(fs, &node, &mapped, &shared);
+    }
+    pthread_rwlock_unlock(lock);
+    return score;
+}
+
+/**
+ * Relocate fragmented files into contiguous runs by doing the following:
+ *
+ *  1. Examine used Inodes round-robin, starting where the previous call
+ *  stopped, and score each one with only its read lock held.
+ *
+ *  2. Copy the data blocks of each fragmented file into a freshly reserved
+ *  run and rebuild its pointer blocks (or extents), with the Inode locked
+ *  for writing so concurrent reads and writes of it wait.
+ *
+ *  3. Switch the Inode over to the new blocks in one metadata update (a
+ *  single journal transaction when journaling), keeping the old layout if
+ *  the new one is not less fragmented, and release the old blocks.
+ *
+ *  4. Report the fragmentation score of each relocated file before and
+ *  after, and stop once the budget would be exceeded (files larger than the
+ *  whole budget are skipped) or every Inode was examined.
+ *
+ * Note: Run from one thread at a time (other threads may keep using the
+ * file system).
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       budget      Most data blocks to copy (each is one block read
+ *                          and one block write).
+ * @param       report      Function called for each relocated file (may be NULL).
+ * @param       ctx         Caller data passed to report.
+ * @return      Number of data blocks relocated (-1 on error).
+ **/
+ssize_t fs_defrag(FileSystem *fs, size_t budget, FsDefragReport report, void *ctx) {
+    if (!fs || !fs->inode_table) return -1;
+
+    char *buffer = malloc(FS_IOV_BLOCKS*BLOCK_SIZE);
+    if (!buffer) return -1;
+
+    size_t moved = 0;
+    for (size_t examined = 0; examined < fs->meta_data.inodes && moved < budget; examined++) {
+        size_t       inode_number = fs->defrag_next % fs->meta_data.inodes;
+        DefragResult result       = {0};
+
+        // score under the read lock first, so readers only wait for files that move
+        pthread_mutex_lock(&fs->table_lock);
+        bool free_inode = bitmap_test(fs->free_inodes, inode_number);
+        pthread_mutex_unlock(&fs->table_lock);
+        if (free_inode || fs_fragmentation(fs, inode_number) <= 0) {
+            fs->defrag_next = inode_number + 1;
+            continue;
+        }
+
+        fs_journal_begin(fs);
+        pthread_rwlock_t *lock = fs_inode_lock(fs, inode_number);
+        pthread_rwlock_wrlock(lock);
+        ssize_t relocated = fs_defrag_inode(fs, inode_number, budget - moved, buffer, &result);
+        pthread_rwlock_unlock(lock);
+        fs_journal_end(fs);
+
+        if (relocated < 0) {
+            free(buffer);
+            return -1;
+        }
+        // a file that does not fit what is left of the budget waits for the next call
+        if (result.needed && moved > 0) break;
+
+        fs->defrag_next = inode_number + 1;
+        if (relocated == 0) continue;
+        if (fs->reclaim.started) {
+            fs_reclaim_queue(fs, &result.old, 1);
+        }
+        if (report) report(inode_number, result.before, result.after, ctx);
+        moved += relocated;
+    }
+    free(buffer);
+    return moved;
+}
+
+/**
+ * Relocate blocks of one Inode (see fs_defrag) by doing the following:
+ *
+ *  1. Score the file, and leave it alone if it is inline, not fragmented,
+ *  shares blocks with a clone (relocating would copy them), or has more
+ *  data blocks than the budget.
+ *
+ *  2. Reserve a run for the whole file and copy its data blocks into it
+ *  (holes stay holes), then write the new pointer blocks.
+ *
+ *  3. Save the Inode with the new layout if it scores better and release
+ *  the old blocks (or hand the old Inode back when reclamation is
+ *  deferred); otherwise release the new blocks.
+ *
+ * Note: Caller must hold the Inode lock for writing.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to relocate.
+ * @param       budget          Most data blocks to copy.
+ * @param       buffer          Staging buffer of FS_IOV_BLOCKS blocks.
+ * @param       result          Where to store scores and old Inode.
+ * @return      Number of data blocks relocated (0 if left alone, -1 on error).
+ **/
+ssize_t fs_defrag_inode(FileSystem *fs, size_t inode_number, size_t budget, char *buffer, DefragResult *result) {
+    Inode node;
+    if (!fs_load_inode(fs, inode_number, &node) || fs_inline(&fs->meta_data, &node)) return 0;
+
+    size_t mapped;
+    size_t shared;
+    result->before = fs_fragments(fs, &node, &mapped, &shared);
+    if (result->before == 0 || shared > 0) return 0;
+    if (mapped > budget) {
+        result->needed = mapped;
+        return 0;
+    }
+
+    Inode fresh = node;
+    memset(fresh.direct, 0, sizeof(fresh.direct));
+    fresh.indirect = 0;
+
+    BlockMap source = {.inode = &node};
+    BlockMap target = {.inode = &fresh};
+    size_t   nblocks = (node.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    fs_bmap_reserve(fs, &target, node.size, 0);
+    bool copied = fs_defrag_copy(fs, &source, &target, nblocks, buffer);
+    fs_bmap_release(fs, &target);
+    if (!fs_bmap_sync(fs, &target)) return -1;
+
+    size_t remapped;
+    result->after = copied ? fs_fragments(fs, &fresh, &remapped, &shared) : result->before;
+    if (result->after >= result->before) {
+        fs_release_blocks(fs, &fresh);
+        return copied ? 0 : -1;
+    }
+
+    fs_save_inode(fs, inode_number, &fresh);
+    fs_stream_reset(fs, inode_number);
+    result->old = node;
+    if (!fs->reclaim.started && !fs_release_blocks(fs, &node)) return -1;
+    return fs_flush_inodes(fs) ? (ssize_t)mapped : -1;
+}
+
+/**
+ * Copy mapped data blocks of one BlockMap to newly allocated blocks of
+ * another, reading each physically contiguous source run (of at most
+ * FS_IOV_BLOCKS) at once and writing each contiguous target run at once
+ * (one BLOCK_SIZE buffer per block, as the block cache expects).
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       source      Pointer to BlockMap of file to copy.
+ * @param       target      Pointer to BlockMap of relocated file.
+ * @param       nblocks     Number of logical blocks in file.
+ * @param       buffer      Staging buffer of FS_IOV_BLOCKS blocks.
+ * @return      Whether or not every block was copied.
+ **/
+bool    fs_defrag_copy(FileSystem *fs, BlockMap *source, BlockMap *target, size_t nblocks, char *buffer) {
+    struct iovec iov[FS_IOV_BLOCKS];
+    for (size_t b = 0; b < FS_IOV_BLOCKS; b++) {
+        iov[b] = (struct iovec){buffer + b*BLOCK_SIZE, BLOCK_SIZE};
+    }
+
+    for (size_t index = 0; index < nblocks;) {
+        size_t start = fs_bmap(fs, source, index, false);
+        if (start == 0) {
+            index++;
+            continue;
+        }
+
+        size_t run = 1;
+        while (index + run < nblocks && run < FS_IOV_BLOCKS && fs_bmap(fs, source, index + run, false) == start + run) {
+            run++;
+        }
+        if (fs_readv_blocks(fs, start, iov, run) == DISK_FAILURE) return false;
+
+        for (size_t r = 0; r < run;) {
+            size_t block = fs_bmap(fs, target, index + r, true);
+            if (block == 0) return false;
+
+            size_t n = 1;
+            while (r + n < run && fs_bmap(fs, target, index + r + n, true) == block + n) {
+                n++;
+            }
+            if (fs_writev_blocks(fs, block, iov + r, n) == DISK_FAILURE) return false;
+            r += n;
+        }
+        index += run;
+    }
+    return true;
+}
+
+/**
+ * Count fragments of Inode (see fs_fragmentation) by doing the following:
+ *
+ *  1. Map every logical block of the file, skipping holes.
+ *
+ *  2. Count logically consecutive mapped blocks that are not physically
+ *  adjacent, except for short forward gaps where a fresh write places new
+ *  pointer blocks.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       node        Pointer to Inode.
+ * @param       mapped      Where to store number of mapped data blocks.
+ * @param       shared      Where to store number of data blocks shared with
+ *                          a clone.
+ * @return      Fragmentation score.
+ **/
+size_t  fs_fragments(FileSystem *fs, Inode *node, size_t *mapped, size_t *shared) {
+    BlockMap map       = {.inode = node};
+    size_t   nblocks   = (node->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    size_t   fragments = 0;
+    size_t   previous  = 0;
+
+    *mapped = 0;
+    *shared = 0;
+    for (size_t index = 0; index < nblocks; index++) {
+        size_t block = fs_bmap(fs, &map, index, false);
+        if (block && previous && block != previous + 1) {
+            bool gap = block > previous && block - previous - 1 <= FS_INDIRECT_DEPTH;
+            fragments += !(gap && fs_pointer_boundary(&fs->meta_data, index));
+        }
+        *mapped  += block != 0;
+        *shared  += block != 0 && fs_block_shared(fs, block);
+        previous  = block;
+    }
+    return fragments;
+}
+
+/**
+ * Return whether mapping a logical block of a pointer Inode for the first
+ * time also allocates pointer blocks (the indirect block, the roots of the
+ * double and triple indirect trees, and each pointer block below them).
+ *
+ * @param       sb          Pointer to SuperBlock of FileSystem.
+ * @param       index       Logical block index within file.
+ * @return      Whether or not a fresh write places pointer blocks before it.
+ **/
+bool    fs_pointer_boundary(const SuperBlock *sb, size_t index) {
+    if (sb->features & FS_FEATURE_EXTENTS) return false;
+
+    size_t trees = POINTERS_PER_INODE + fs_indirect_pointers(sb);
+    return index == POINTERS_PER_INODE || (index >= trees && (index - trees) % POINTERS_PER_BLOCK == 0);
+}
+
+/**
+ * Verify every data block of mounted FileSystem against its checksum by
+ * doing the following:
+ *
+ *  1. Sync the FileSystem, so blocks held by the block cache and the
+ *  journal are on the Disk.
+ *
+ *  2. Split the data blocks into contiguous ranges, one per thread; each
+ *  thread reads its range FS_SCRUB_BLOCKS at a time with large sequential
+ *  reads (or straight from the Disk memory mapping) and checksums the used
+ *  blocks that have a checksum (see fs_scrub_range).
+ *
+ *  3. Report corrupt blocks in block order once all threads are done.
+ *
+ * Note: Verification happens even if the FileSystem was mounted with
+ * MountOptions.skip_verify. Other threads may keep using the file system;
+ * a block that does not match is read again through the block cache before
+ * it is reported, so blocks rewritten during the scrub are not reported.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       threads     Number of threads to verify with (0 for
+ *                          FS_SCRUB_THREADS).
+ * @param       report      Function called for each corrupt block (may be NULL).
+ * @param       ctx         Caller data passed to report.
+ * @return      Number of blocks verified (-1 on error or if the FileSystem
+ *              has no checksums).
+ **/
+ssize_t fs_scrub(FileSystem *fs, size_t threads, FsScrubReport report, void *ctx) {
+    if (!fs || !fs->checksums) return -1;
+    if (!fs_sync(fs)) return -1;
+
+    size_t first  = fs_data_first(&fs->meta_data);
+    size_t chunks = (fs->meta_data.blocks - first + FS_SCRUB_BLOCKS - 1) / FS_SCRUB_BLOCKS;
+    threads = max(min(threads ? threads : FS_SCRUB_THREADS, chunks), (size_t)1);
+    ScrubTask *tasks = calloc(threads, sizeof(ScrubTask));
+    if (!tasks) return -1;
+
+    size_t per_task = (chunks + threads - 1) / threads * FS_SCRUB_BLOCKS;
+    for (size_t t = 0; t < threads; t++) {
+        tasks[t].fs    = fs;
+        tasks[t].first = min(first + t*per_task, (size_t)fs->meta_data.blocks);
+        tasks[t].last  = min(first + (t + 1)*per_task, (size_t)fs->meta_data.blocks);
+        tasks[t].ok    = true;
+    }
+
+    if (threads == 1) {
+        fs_scrub_range(&tasks[0]);
+    } else {
+        for (size_t t = 0; t < threads; t++) {
+            tasks[t].started = pthread_create(&tasks[t].thread, NULL, fs_scrub_range, &tasks[t]) == 0;
+            if (!tasks[t].started) tasks[t].ok = false;
+        }
+        for (size_t t = 0; t < threads; t++) {
+            if (tasks[t].started) pthread_join(tasks[t].thread, NULL);
+        }
+    }
+
+    bool   success  = true;
+    size_t verified = 0;
+    for (size_t t = 0; t < threads; t++) {
+        for (size_t c = 0; report && c < tasks[t].ncorrupt; c++) {
+            report(tasks[t].corrupt[c], ctx);
+        }
+        success  &= tasks[t].ok;
+        verified += tasks[t].verified;
+        free(tasks[t].corrupt);
+    }
+    free(tasks);
+    return success ? (ssize_t)verified : -1;
+}
+
+/**
+ * Verify range of data blocks (see fs_scrub) by doing the following:
+ *
+ *  1. Pick the blocks of each chunk of FS_SCRUB_BLOCKS that are in use and
+ *  have a checksum, skipping chunks without any.
+ *
+ *  2. Read the whole chunk with one range read (unless the Disk is memory
+ *  mapped) and checksum the picked blocks.
+ *
+ *  3. Read blocks that do not match again, and record them as corrupt if
+ *  they still do not match (see fs_scrub_recheck).
+ *
+ * @param       arg     Pointer to ScrubTask structure.
+ * @return      NULL (results are recorded in the task).
+ **/
+void   *fs_scrub_range(void *arg) {
+    ScrubTask  *task   = arg;
+    FileSystem *fs     = task->fs;
+    char       *buffer = fs->disk->map ? NULL : malloc(FS_SCRUB_BLOCKS*BLOCK_SIZE);
+    if (!fs->disk->map && !buffer) {
+        task->ok = false;
+        return NULL;
+    }
+
+    const char *blocks[FS_SCRUB_BLOCKS];
+    size_t      picked[FS_SCRUB_BLOCKS];
+    uint32_t    crcs[FS_SCRUB_BLOCKS];
+    Block       recheck;
+    for (size_t start = task->first; task->ok && start < task->last; start += FS_SCRUB_BLOCKS) {
+        size_t count = min(task->last - start, (size_t)FS_SCRUB_BLOCKS);
+        size_t n     = 0;
+        pthread_mutex_lock(&fs->alloc_lock);
+        for (size_t b = start; b < start + count; b++) {
+            if (!bitmap_test(fs->free_blocks, b) && __atomic_load_n(&fs->checksums[b], __ATOMIC_RELAXED)) {
+                picked[n++] = b;
+            }
+        }
+        pthread_mutex_unlock(&fs->alloc_lock);
+        if (n == 0) continue;
+
+        const char *data = disk_block(fs->disk, start);
+        if (!data) {
+            if (disk_read_range(fs->disk, start, count, buffer) == DISK_FAILURE) {
+                task->ok = false;
+                break;
+            }
+            data = buffer;
+        }
+        for (size_t p = 0; p < n; p++) {
+            blocks[p] = data + (picked[p] - start)*BLOCK_SIZE;
+        }
+        crc32c_many(blocks, n, BLOCK_SIZE, crcs);
+
+        for (size_t p = 0; task->ok && p < n; p++) {
+            if (crcs[p] != __atomic_load_n(&fs->checksums[picked[p]], __ATOMIC_RELAXED)) {
+                task->ok = fs_scrub_recheck(task, picked[p], recheck.data);
+            }
+        }
+        task->verified += n;
+    }
+    free(buffer);
+    return NULL;
+}
+
+/**
+ * Read block that did not match its checksum during a scrub again (through
+ * the block cache, which holds writes made since the scrub started), and
+ * record it as corrupt if it still does not match.
+ *
+ * @param       task        Pointer to ScrubTask structure.
+ * @param       block       Block number.
+ * @param       buffer      Buffer of BLOCK_SIZE bytes.
+ * @return      Whether or not the block was read (and recorded if corrupt).
+ **/
+bool    fs_scrub_recheck(ScrubTask *task, size_t block, char *buffer) {
+    FileSystem *fs = task->fs;
+    if (fs_read_block(fs, block, buffer) == DISK_FAILURE) return false;
+
+    uint32_t expected = __atomic_load_n(&fs->checksums[block], __ATOMIC_RELAXED);
+    if (!expected || crc32c(0, buffer, BLOCK_SIZE) == expected) return true;
+
+    if (task->ncorrupt == task->capacity) {
+        size_t  capacity = max(2*task->capacity, (size_t)16);
+        size_t *corrupt  = realloc(task->corrupt, capacity*sizeof(size_t));
+        if (!corrupt) return false;
+        task->corrupt  = corrupt;
+        task->capacity = capacity;
+    }
+    task->corrupt[task->ncorrupt++] = block;
+    __atomic_add_fetch(&fs->stats.checksum_errors, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+/**
+ * Allocate a run of up to count contiguous free blocks by doing the
+ * following:
+ *
+ *  1. Use the run starting at goal if it can hold all count blocks.
+ *
+ *  2. Otherwise use the best-fitting free run (or the largest run when no
+ *  run is long enough).
+ *
+ *  3. Mark the run as used and advance next-fit hint past it.
+ *
+ *  4. If no block is free, wait for the reclaim thread to release the
+ *  blocks of removed Inodes and search once more.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       count   Desired number of blocks.
+ * @param       goal    Preferred first block (e.g. just past previous block).
+ * @param       length  Where to store number of blocks allocated.
+ * @return      First allocated block number (0 if disk is full).
+ **/
+size_t  fs_allocate_run(FileSystem *fs, size_t count, size_t goal, size_t *length) {
+    *length = 0;
+    if (!fs || !fs->free_blocks || count == 0) return 0;
+
+    size_t start   = BITMAP_NONE;
+    bool   retried = false;
+    while (true) {
+        pthread_mutex_lock(&fs->alloc_lock);
+        start = goal;
+        size_t run = bitmap_run(fs->free_blocks, goal);
+        __atomic_add_fetch(&fs->stats.alloc_calls, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&fs->stats.alloc_words, 1 + run / BITMAP_WORD_BITS, __ATOMIC_RELAXED);
+        if (run < count) {
+            start = bitmap_find_run(fs->free_blocks, count, &run);
+            __atomic_add_fetch(&fs->stats.alloc_words, fs->free_blocks->nwords, __ATOMIC_RELAXED);
+        }
+
+        if (start != BITMAP_NONE) {
+            *length = min(run, count);
+            bitmap_clear_range(fs->free_blocks, start, *length);
+            if (fs->journal.allocated) bitmap_set_range(fs->journal.allocated, start, *length);
+            fs->free_hint = start + *length;
+        }
+        pthread_mutex_unlock(&fs->alloc_lock);
+
+        // blocks of removed Inodes may still wait in the reclaim queue
+        if (start != BITMAP_NONE || retried || !fs_reclaim_wait(fs)) break;
+        retried = true;
+    }
+    return (start == BITMAP_NONE) ? 0 : start;
+}
+
+/**
+ * Allocate a free block by doing the following:
+ *
+ *  1. Search free block bitmap word-at-a-time starting at the next-fit hint
+ *  (wrapping around to the beginning).
+ *
+ *  2. Mark block as used and advance hint past it so sequential allocations
+ *  are contiguous.
+ *
+ *  3. If no block is free, wait for the reclaim thread to release the
+ *  blocks of removed Inodes and search once more.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @return      Allocated block number (0 if disk is full).
+ **/
+size_t find_free_block(FileSystem *fs) {
+    pthread_mutex_lock(&fs->alloc_lock);
+    size_t block = bitmap_find(fs->free_blocks, fs->free_hint);
+    __atomic_add_fetch(&fs->stats.alloc_calls, 1, __ATOMIC_RELAXED);
+    if (block == BITMAP_NONE) {
+        __atomic_add_fetch(&fs->stats.alloc_words, fs->free_blocks->nwords, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&fs->alloc_lock);
+        // blocks of removed Inodes may still wait in the reclaim queue
+        if (!fs_reclaim_wait(fs)) return 0;
+
+        pthread_mutex_lock(&fs->alloc_lock);
+        block = bitmap_find(fs->free_blocks, fs->free_hint);
+        __atomic_add_fetch(&fs->stats.alloc_calls, 1, __ATOMIC_RELAXED);
+        if (block == BITMAP_NONE) {
+            pthread_mutex_unlock(&fs->alloc_lock);
+            return 0;
+        }
+    }
+
+    size_t hint     = min(fs->free_hint, fs->free_blocks->bits);
+    size_t distance = block >= hint ? block - hint : fs->free_blocks->bits - hint + block;
+    __atomic_add_fetch(&fs->stats.alloc_words, 1 + distance / BITMAP_WORD_BITS, __ATOMIC_RELAXED);
+
+    bitmap_clear(fs->free_blocks, block);
+    if (fs->journal.allocated) bitmap_set(fs->journal.allocated, block);
+    fs->free_hint = block + 1;
+    pthread_mutex_unlock(&fs->alloc_lock);
+    return block;
+}
+
+/**
+ * Return whether a block is shared with a clone (FS_FEATURE_CLONE).
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       block   Block number to check.
+ * @return      Whether or not another file references the block.
+ **/
+bool    fs_block_shared(FileSystem *fs, size_t block) {
+    if (!fs->shares) return false;
+
+    pthread_mutex_lock(&fs->alloc_lock);
+    bool shared = block < fs->meta_data.blocks && fs->shares[block] > 0;
+    pthread_mutex_unlock(&fs->alloc_lock);
+    return shared;
+}
+
+/**
+ * Return whether a data block must not be overwritten in place: it is
+ * shared with a clone, or the FileSystem journals checksums and committed
+ * metadata points to the block (its checksum only changes with the next
+ * commit, so a crash in between would leave new data with the old
+ * checksum).
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       block   Block number to check.
+ * @return      Whether or not a write must go to a new block (see fs_bmap_cow).
+ **/
+bool    fs_block_pinned(FileSystem *fs, size_t block) {
+    if (!fs->shares && !fs->journal.allocated) return false;
+
+    pthread_mutex_lock(&fs->alloc_lock);
+    bool pinned = block < fs->meta_data.blocks &&
+                  ((fs->shares && fs->shares[block] > 0) ||
+                   (fs->journal.allocated && !bitmap_test(fs->journal.allocated, block)));
+    pthread_mutex_unlock(&fs->alloc_lock);
+    return pinned;
+}
+
+/**
+ * Take another reference to a data block (caller holds the allocation lock).
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       block   Block number to share (0 is ignored).
+ **/
+void    fs_share_block(FileSystem *fs, size_t block) {
+    if (block && block < fs->meta_data.blocks) fs->shares[block]++;
+}
+
+/**
+ * Drop one reference to a data block, marking it free once no other file
+ * shares it (caller holds the allocation lock).
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       block   Block number to release.
+ **/
+void    fs_drop_block(FileSystem *fs, size_t block) {
+    if (fs->shares && block < fs->meta_data.blocks && fs->shares[block]) {
+        fs->shares[block]--;
+    } else {
+        fs_free_block(fs, block);
+    }
+}
+
+/**
+ * Drop one reference to each block of a run (see fs_drop_block).
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       start   First block to release.
+ * @param       count   Number of blocks to release.
+ **/
+void    fs_drop_range(FileSystem *fs, size_t start, size_t count) {
+    if (!fs->shares) {
+        fs_free_range(fs, start, count);
+        return;
+    }
+    for (size_t b = start; b < start + count; b++) {
+        fs_drop_block(fs, b);
+    }
+}
+
+/**
+ * Mark a block that committed metadata may still point to as free (caller
+ * holds the allocation lock).
+ *
+ * Note: When journaling, the block only returns to the free block bitmap
+ * once the running transaction commits, so replay after a crash never finds
+ * it overwritten by another file.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       block   Block number to release.
+ **/
+void    fs_free_block(FileSystem *fs, size_t block) {
+    bitmap_set(fs->journal.freed ? fs->journal.freed : fs->free_blocks, block);
+}
+
+/**
+ * Mark a run of blocks as free (see fs_free_block).
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       start   First block to release.
+ * @param       count   Number of blocks to release.
+ **/
+void    fs_free_range(FileSystem *fs, size_t start, size_t count) {
+    bitmap_set_range(fs->journal.freed ? fs->journal.freed : fs->free_blocks, start, count);
+}
+
+/**
+ * Drop the reference of a file to the shared block that copy-on-write
+ * replaced (see fs_bmap_cow).
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       block   Shared block no longer mapped by the file.
+ **/
+void    fs_unshare_block(FileSystem *fs, size_t block) {
+    pthread_mutex_lock(&fs->alloc_lock);
+    fs_drop_block(fs, block);
+    pthread_mutex_unlock(&fs->alloc_lock);
+}
+
+
+
+/**
+ * Load Inode table and initialize free block and inode bitmaps by doing the
+ * following:
+ *
+ *  1. Read all Inode blocks into memory with a single range read.
+ *
+ *  2. Mark every valid Inode as used in the free inode bitmap.
+ *
+ *  3. Read the stored free block bitmap if the file system was cleanly
+ *  unmounted, and stop there if it is sound. Otherwise, fall back to the
+ *  scan below (as fsck would). Clones always scan, since references to
+ *  shared blocks are only counted by the scan (FS_FEATURE_CLONE).
+ *
+ *  4. Split the Inode blocks across threads; each one marks the blocks
+ *  referenced by its Inodes (directly or through their indirect blocks) in a
+ *  partial map, counting blocks it finds again as shared.
+ *
+ *  5. Merge the partial maps into the free block bitmap, along with the
+ *  SuperBlock, Inode, bitmap, journal and checksum table blocks (blocks
+ *  marked by more than one map are shared as well).
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       threads Number of threads to scan with (0 or 1 for serial).
+ * @return      Whether or not the Inode table and bitmaps were initialized.
+ **/
+bool fs_initialize_free_block_bitmap(FileSystem *fs, size_t threads) { 
+    
+    Bitmap *free_blocks = bitmap_create(fs->meta_data.blocks, true);
+    if (!free_blocks) return false;
+    fs->free_blocks = free_blocks;
+    fs->free_hint = 0;
+    bitmap_clear_range(free_blocks, 0, fs_data_first(&fs->meta_data));
+    if (fs->meta_data.features & FS_FEATURE_CLONE) {
+        fs->shares = calloc(fs->meta_data.blocks, sizeof(uint32_t));
+        if (!fs->shares) return false;
+    }
+
+    fs->inode_table  = malloc(fs->meta_data.inode_blocks * sizeof(Block));
+    fs->dirty_inodes = bitmap_create(fs->meta_data.inode_blocks, false);
+    fs->free_inodes  = bitmap_create(fs->meta_data.inodes, true);
+    fs->inode_hint   = 0;
+    if (!fs->inode_table || !fs->dirty_inodes || !fs->free_inodes) return false;
+    if (disk_read_range(fs->disk, 1, fs->meta_data.inode_blocks, fs->inode_table->data) == DISK_FAILURE) return false;
+
+    for (size_t inode_number = 0; inode_number < fs->meta_data.inodes; inode_number++) {
+        if (fs_inode(fs, inode_number)->valid) {
+            bitmap_clear(fs->free_inodes, inode_number);
+        }
+    }
+    if (fs->meta_data.clean && !fs->shares && fs_bitmap_load(fs)) return true;
+
+    threads = max(min(threads, (size_t)fs->meta_data.inode_blocks), (size_t)1);
+    ScanTask *tasks = calloc(threads, sizeof(ScanTask));
+    if (!tasks) return false;
+
+    size_t per_task = (fs->meta_data.inode_blocks + threads - 1) / threads;
+    for (size_t t = 0; t < threads; t++) {
+        tasks[t].fs    = fs;
+        tasks[t].first = min(t*per_task, (size_t)fs->meta_data.inode_blocks);
+        tasks[t].last  = min((t + 1)*per_task, (size_t)fs->meta_data.inode_blocks);
+        tasks[t].used  = bitmap_create(fs->meta_data.blocks, false);
+        tasks[t].ok    = tasks[t].used != NULL;
+    }
+
+    if (threads == 1) {
+        fs_scan_inode_blocks(&tasks[0]);
+    } else {
+        for (size_t t = 0; t < threads; t++) {
+            tasks[t].started = tasks[t].ok && pthread_create(&tasks[t].thread, NULL, fs_scan_inode_blocks, &tasks[t]) == 0;
+            if (!tasks[t].started) tasks[t].ok = false;
+        }
+        for (size_t t = 0; t < threads; t++) {
+            if (tasks[t].started) pthread_join(tasks[t].thread, NULL);
+        }
+    }
+
+    bool success = true;
+    for (size_t t = 0; t < threads; t++) {
+        if (tasks[t].ok) {
+            // blocks an earlier task already marked are referenced once more
+            for (size_t w = 0; fs->shares && w < free_blocks->nwords; w++) {
+                uint64_t shared = ~free_blocks->words[w] & tasks[t].used->words[w];
+                for (; shared; shared &= shared - 1) {
+                    fs->shares[w*BITMAP_WORD_BITS + __builtin_ctzll(shared)]++;
+                }
+            }
+            bitmap_clear_bits(free_blocks, tasks[t].used);
+        } else {
+            success = false;
+        }
+        bitmap_delete(tasks[t].used);
+    }
+    free(tasks);
+    return success;
+}
+
+/**
+ * Load free block bitmap stored by a clean unmount by doing the following:
+ *
+ *  1. Read all bitmap blocks with a single range read.
+ *
+ *  2. Check that no block before the data blocks is marked free (otherwise
+ *  the stored bitmap is rejected and the caller scans instead).
+ *
+ *  3. Copy it into the free block bitmap, and keep it as the stored bitmap
+ *  that the next unmount compares against.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @return      Whether or not the stored bitmap was loaded.
+ **/
+bool    fs_bitmap_load(FileSystem *fs) {
+    size_t  bitmap_blocks = fs->meta_data.bitmap_blocks;
+    Block  *blocks        = malloc(bitmap_blocks * sizeof(Block));
+    Bitmap *stored        = bitmap_create(fs->meta_data.blocks, false);
+    bool    loaded        = false;
+    if (blocks && stored && disk_read_range(fs->disk, fs_bitmap_first(&fs->meta_data), bitmap_blocks, blocks->data) != DISK_FAILURE) {
+        bitmap_load(stored, (const uint64_t *)blocks->data);
+        loaded = bitmap_find(stored, 0) >= fs_data_first(&fs->meta_data);
+    }
+    free(blocks);
+
+    if (!loaded) {
+        bitmap_delete(stored);
+        return false;
+    }
+    bitmap_load(fs->free_blocks, stored->words);
+    fs->stored_blocks = stored;
+    return true;
+}
+
+/**
+ * Write free block bitmap to the bitmap blocks of Disk, skipping blocks whose
+ * words match the stored copy (every block is written if there is none).
+ *
+ * @param       disk    Pointer to Disk structure.
+ * @param       sb      Pointer to SuperBlock of FileSystem.
+ * @param       bitmap  Pointer to free block Bitmap structure.
+ * @param       stored  Pointer to Bitmap structure as stored on Disk (may be NULL).
+ * @return      Whether or not all changed bitmap blocks were written.
+ **/
+bool    fs_bitmap_store(Disk *disk, const SuperBlock *sb, const Bitmap *bitmap, const Bitmap *stored) {
+    for (size_t b = 0; b < sb->bitmap_blocks; b++) {
+        size_t first  = min(b*BITMAP_WORDS_PER_BLOCK, bitmap->nwords);
+        size_t nwords = min((size_t)BITMAP_WORDS_PER_BLOCK, bitmap->nwords - first);
+        if (stored && memcmp(bitmap->words + first, stored->words + first, nwords*sizeof(uint64_t)) == 0) continue;
+
+        Block block = {{0}};
+        memcpy(block.data, bitmap->words + first, nwords*sizeof(uint64_t));
+        if (disk_write(disk, fs_bitmap_first(sb) + b, block.data) == DISK_FAILURE) return false;
+    }
+    return true;
+}
+
+/**
+ * Write SuperBlock with the clean flag set or cleared, and flush the Disk
+ * (so the flag is never ahead of the blocks written before it).
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       clean   Whether or not the stored free block bitmap is current.
+ * @return      Whether or not the SuperBlock reached the Disk.
+ **/
+bool    fs_mark_clean(FileSystem *fs, bool clean) {
+    Block block = {{0}};
+    fs->meta_data.clean = clean;
+    block.super = fs->meta_data;
+    if (clean && !disk_flush(fs->disk)) return false;
+    if (disk_write(fs->disk, 0, block.data) == DISK_FAILURE) return false;
+    return disk_flush(fs->disk);
+}
+
+/**
+ * Mark blocks referenced by the Inodes of a range of Inode blocks in the
+ * task's partial map by doing the following:
+ *
+ *  1. Mark direct blocks and indirect blocks of each valid Inode.
+ *
+ *  2. Collect indirect blocks and read them in sorted batches of at most
+ *  FS_SCAN_BATCH, marking the data blocks they point to.
+ *
+ * @param       arg     Pointer to ScanTask structure.
+ * @return      NULL (success is recorded in the task).
+ **/
+void *fs_scan_inode_blocks(void *arg) {
+    ScanTask   *task = arg;
+    FileSystem *fs   = task->fs;
+    uint32_t    batch[FS_SCAN_BATCH];
+    size_t      nbatch = 0;
+
+    for (size_t inode_block = task->first; inode_block < task->last && task->ok; inode_block++) {
+        const Block *block = &fs->inode_table[inode_block];
+        // going through the inodes in a block
+        for (size_t inode = 0; inode < fs_inodes_per_block(&fs->meta_data); inode++) {
+            const Inode *node = fs_block_inode(&fs->meta_data, block, inode);
+            // inline files own no blocks
+            if (!node->valid || fs_inline(&fs->meta_data, node)) continue;
+            if (fs->meta_data.features & FS_FEATURE_EXTENTS) {
+                task->ok = fs_scan_extents(task, node);
+                continue;
+            }
+
+            // going through direct pointers in the inode
+            for (int dp = 0; dp < POINTERS_PER_INODE; dp++) {
+                // if an inode is not 0, mark that data block as being not free
+                if (node->direct[dp] != 0) {
+                    fs_scan_mark(task, node->direct[dp], 1);
+                }
+            }
+
+            // if there is a valid indirect block, mark it and queue it to be read
+            if (node->indirect != 0) {
+                bitmap_set(task->used, node->indirect);
+                batch[nbatch++] = node->indirect;
+                if (nbatch == FS_SCAN_BATCH) {
+                    task->ok = fs_scan_indirect_blocks(task, batch, nbatch, 0, true);
+                    nbatch = 0;
+                }
+            }
+        }
+    }
+
+    if (task->ok && nbatch) {
+        task->ok = fs_scan_indirect_blocks(task, batch, nbatch, 0, true);
+    }
+    return NULL;
+}
+
+/**
+ * Mark data blocks in the task's partial map, counting each further
+ * reference to a block already marked as a share (FS_FEATURE_CLONE).
+ *
+ * @param       task    Pointer to ScanTask structure.
+ * @param       start   First block to mark.
+ * @param       count   Number of blocks to mark.
+ **/
+void fs_scan_mark(ScanTask *task, size_t start, size_t count) {
+    uint32_t *shares = task->fs->shares;
+    if (!shares) {
+        bitmap_set_range(task->used, start, count);
+        return;
+    }
+
+    for (size_t b = start; b < start + count && b < task->used->bits; b++) {
+        if (bitmap_test(task->used, b)) {
+            // other tasks may count the same block
+            __atomic_add_fetch(&shares[b], 1, __ATOMIC_RELAXED);
+        } else {
+            bitmap_set(task->used, b);
+        }
+    }
+}
+
+/**
+ * Mark blocks of an extent Inode in the task's partial map by doing the
+ * following:
+ *
+ *  1. Mark the extents held by the Inode.
+ *
+ *  2. Otherwise mark the extent root and each leaf, and the extents held by
+ *  each leaf.
+ *
+ * @param       task    Pointer to ScanTask structure.
+ * @param       node    Pointer to valid extent Inode.
+ * @return      Whether or not every leaf was read and every extent is on Disk.
+ **/
+bool fs_scan_extents(ScanTask *task, const Inode *node) {
+    Disk *disk = task->fs->disk;
+    if (node->extent_root == 0) {
+        return fs_scan_runs(task, node->extents, EXTENTS_PER_INODE);
+    }
+
+    Block        root_buffer;
+    Block        leaf_buffer;
+    const Block *root = fs_disk_block(disk, node->extent_root, &root_buffer);
+    if (!root || node->extent_root >= disk->blocks) return false;
+    bitmap_set(task->used, node->extent_root);
+
+    for (size_t l = 0; l < EXTENTS_PER_BLOCK && root->leaves[l].block; l++) {
+        const Block *leaf = fs_disk_block(disk, root->leaves[l].block, &leaf_buffer);
+        if (!leaf || root->leaves[l].block >= disk->blocks) return false;
+        bitmap_set(task->used, root->leaves[l].block);
+        if (!fs_scan_runs(task, leaf->extents, EXTENTS_PER_BLOCK)) return false;
+    }
+    return true;
+}
+
+/**
+ * Mark the blocks of every extent in a list in the task's partial map.
+ *
+ * @param       task        Pointer to ScanTask structure.
+ * @param       extents     Array of extents (ends at first unused extent).
+ * @param       capacity    Number of extents in array.
+ * @return      Whether or not every extent is on Disk.
+ **/
+bool fs_scan_runs(ScanTask *task, const Extent *extents, size_t capacity) {
+    for (size_t e = 0; e < capacity && extents[e].length; e++) {
+        if (extents[e].start == 0) continue;
+        if ((size_t)extents[e].start + extents[e].length > task->fs->meta_data.blocks) return false;
+        fs_scan_mark(task, extents[e].start, extents[e].length);
+    }
+    return true;
+}
+
+/**
+ * Read a batch of pointer blocks and mark the blocks they point to by doing
+ * the following:
+ *
+ *  1. Sort batch so physically contiguous pointer blocks become one range
+ *  read (in place for memory mapped Disks).
+ *
+ *  2. Mark every non-zero pointer in each pointer block.
+ *
+ *  3. Scan the pointer blocks they point to (depth levels remain), starting
+ *  with the double and triple indirect trees of Inode indirect blocks.
+ *
+ * @param       task    Pointer to ScanTask structure.
+ * @param       batch   Array of pointer block numbers.
+ * @param       nbatch  Number of pointer blocks in batch.
+ * @param       depth   Levels of pointer blocks below batch (0 if batch
+ *                      points to data blocks).
+ * @param       root    Whether or not batch holds Inode indirect blocks.
+ * @return      Whether or not every pointer block was read.
+ **/
+bool fs_scan_indirect_blocks(ScanTask *task, uint32_t *batch, size_t nbatch, size_t depth, bool root) {
+    Disk    *disk     = task->fs->disk;
+    Block   *buffer   = malloc(nbatch * sizeof(Block));
+    size_t   pointers = root ? fs_indirect_pointers(&task->fs->meta_data) : POINTERS_PER_BLOCK;
+    uint32_t children[FS_SCAN_BATCH];
+    size_t   nchildren = 0;
+    if (!buffer) return false;
+
+    qsort(batch, nbatch, sizeof(uint32_t), fs_compare_blocks);
+
+    bool   success = true;
+    size_t i = 0;
+    while (i < nbatch && success) {
+        size_t run = 1;
+        while (i + run < nbatch && batch[i + run] == batch[i] + run) run++;
+
+        if (!disk->map && disk_read_range(disk, batch[i], run, buffer->data) == DISK_FAILURE) {
+            success = false;
+            break;
+        }
+
+        // go through all the pointers in each block (separate block with all direct pointers)
+        for (size_t r = 0; r < run && success; r++) {
+            const Block *block = disk->map ? (const Block *)disk_block(disk, batch[i] + r) : &buffer[r];
+            if (!block) {
+                success = false;
+                break;
+            }
+            for (size_t p = 0; p < pointers && success; p++) {
+                if (block->pointers[p] == 0) continue;
+                if (depth == 0) {
+                    fs_scan_mark(task, block->pointers[p], 1);
+                    continue;
+                }
+                bitmap_set(task->used, block->pointers[p]);
+
+                children[nchildren++] = block->pointers[p];
+                if (nchildren == FS_SCAN_BATCH) {
+                    success   = fs_scan_indirect_blocks(task, children, nchildren, depth - 1, false);
+                    nchildren = 0;
+                }
+            }
+
+            // double and triple indirect trees hang off the last slots
+            for (size_t p = pointers; root && p < POINTERS_PER_BLOCK && success; p++) {
+                uint32_t tree = block->pointers[p];
+                if (tree == 0) continue;
+                bitmap_set(task->used, tree);
+                success = fs_scan_indirect_blocks(task, &tree, 1, p == INDIRECT_DOUBLE ? 1 : 2, false);
+            }
+        }
+
+        // skip duplicate pointer blocks
+        i += run;
+        while (i < nbatch && batch[i] == batch[i - 1]) i++;
+    }
+
+    if (success && nchildren) {
+        success = fs_scan_indirect_blocks(task, children, nchildren, depth - 1, false);
+    }
+    free(buffer);
+    return success;
+}
+
+/**
+ * Compare block numbers for qsort.
+ *
+ * @param       a       Pointer to first block number.
+ * @param       b       Pointer to second block number.
+ * @return      Negative, zero, or positive as a is less, equal or greater.
+ **/
+int fs_compare_blocks(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Return a read-only view of a Disk block, pointing into the memory mapping
+ * when available and otherwise reading into the supplied buffer.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       Block number to access.
+ * @param       buffer      Buffer used when the block must be copied.
+ * @return      Pointer to block contents (NULL on failure).
+ **/
+const Block *fs_disk_block(Disk *disk, size_t block, Block *buffer) {
+    const char *mapped = disk_block(disk, block);
+    if (mapped) return (const Block *)mapped;
+    if (disk_read(disk, block, buffer->data) == DISK_FAILURE) return NULL;
+    return buffer;
+}
+
+/**
+ * Read block from FileSystem Disk, going through block cache if enabled
+ * (metadata blocks of the running journal transaction are read from it).
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       block       Block number to perform operation on.
+ * @param       data        Data buffer.
+ * @return      Number of bytes read (DISK_FAILURE on failure).
+ **/
+ssize_t fs_read_block(FileSystem *fs, size_t block, char *data) {
+    if (fs->journal.capacity && fs_journal_read(fs, block, data)) return BLOCK_SIZE;
+    if (fs->cache) return cache_read(fs->cache, block, data);
+    return disk_read(fs->disk, block, data);
+}
+
+/**
+ * Write block to FileSystem Disk, going through block cache if enabled.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       block       Block number to perform operation on.
+ * @param       data        Data buffer.
+ * @return      Number of bytes written (DISK_FAILURE on failure).
+ **/
+ssize_t fs_write_block(FileSystem *fs, size_t block, char *data) {
+    if (fs->cache) return cache_write(fs->cache, block, data);
+    return disk_write(fs->disk, block, data);
+}
+
+/**
+ * Write Inode, pointer or extent block, adding it to the running journal
+ * transaction if the FileSystem is journaled (see fs_write_block). A data
+ * checksum the block had is dropped, since it no longer holds file data.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       block       Block number to perform operation on.
+ * @param       data        Data buffer.
+ * @return      Number of bytes written (DISK_FAILURE on failure).
+ **/
+ssize_t fs_write_metadata(FileSystem *fs, size_t block, char *data) {
+    fs_checksum_clear(fs, block);
+    if (!fs->journal.capacity) return fs_write_block(fs, block, data);
+    return fs_journal_write(fs, block, data) ? BLOCK_SIZE : DISK_FAILURE;
+}
+
+/**
+ * Read contiguous data blocks into scattered block buffers, going through
+ * block cache if enabled, and verify their checksums (see
+ * fs_checksum_verify).
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       start       First block number to perform operation on.
+ * @param       iov         Array of block buffers (BLOCK_SIZE each).
+ * @param       iovcnt      Number of block buffers.
+ * @return      Number of bytes read (DISK_FAILURE on failure or checksum
+ *              mismatch).
+ **/
+ssize_t fs_readv_blocks(FileSystem *fs, size_t start, const struct iovec *iov, int iovcnt) {
+    ssize_t result = fs->cache ? cache_readv(fs->cache, start, iov, iovcnt)
+                               : disk_readv(fs->disk, start, iov, iovcnt);
+    if (result != DISK_FAILURE && !fs_checksum_verify(fs, start, iov, iovcnt)) return DISK_FAILURE;
+    return result;
+}
+
+/**
+ * Write contiguous blocks from gathered block buffers, going through block
+ * cache if enabled (the blocks now hold data, so older metadata images of
+ * them are dropped from the running journal transaction), and record their
+ * new checksums.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       start       First block number to perform operation on.
+ * @param       iov         Array of block buffers (BLOCK_SIZE each).
+ * @param       iovcnt      Number of block buffers.
+ * @return      Number of bytes written (DISK_FAILURE on failure).
+ **/
+ssize_t fs_writev_blocks(FileSystem *fs, size_t start, const struct iovec *iov, int iovcnt) {
+    if (fs->journal.capacity) fs_journal_revoke(fs, start, fs_iov_blocks(iov, iovcnt));
+    ssize_t result = fs->cache ? cache_writev(fs->cache, start, iov, iovcnt)
+                               : disk_writev(fs->disk, start, iov, iovcnt);
+    if (result != DISK_FAILURE) fs_checksum_update(fs, start, iov, iovcnt);
+    return result;
+}
+
+/**
+ * Load block checksum table of mounted FileSystem with a single range read
+ * (FS_FEATURE_CHECKSUM).
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @return      Whether or not the checksum table was loaded.
+ **/
+bool    fs_checksum_load(FileSystem *fs) {
+    size_t nblocks = fs->meta_data.checksum_blocks;
+    fs->checksums       = malloc(nblocks*BLOCK_SIZE);
+    fs->dirty_checksums = bitmap_create(nblocks, false);
+    if (!fs->checksums || !fs->dirty_checksums) return false;
+    return disk_read_range(fs->disk, fs_checksum_first(&fs->meta_data), nblocks, (char *)fs->checksums) != DISK_FAILURE;
+}
+
+/**
+ * Write dirty blocks of checksum table as metadata (so a journaled
+ * FileSystem commits them together with the pointer blocks of the data).
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @return      Whether or not all dirty checksum blocks were written.
+ **/
+bool    fs_flush_checksums(FileSystem *fs) {
+    if (!fs->checksums) return true;
+
+    bool   success = true;
+    size_t index   = 0;
+    pthread_mutex_lock(&fs->checksum_lock);
+    while ((index = bitmap_find(fs->dirty_checksums, index)) != BITMAP_NONE) {
+        char *data = (char *)(fs->checksums + index*CHECKSUMS_PER_BLOCK);
+        if (fs_write_metadata(fs, fs_checksum_first(&fs->meta_data) + index, data) == DISK_FAILURE) {
+            success = false;
+            break;
+        }
+        bitmap_clear(fs->dirty_checksums, index);
+    }
+    pthread_mutex_unlock(&fs->checksum_lock);
+    return success;
+}
+
+/**
+ * Compute CRC32C checksums of a range of the blocks held by gathered
+ * buffers (three blocks at a time, see crc32c_many).
+ *
+ * @param       iov         Array of buffers (multiples of BLOCK_SIZE each).
+ * @param       iovcnt      Number of buffers.
+ * @param       skip        Number of blocks to skip.
+ * @param       count       Number of blocks to checksum (at most FS_IOV_BLOCKS).
+ * @param       crcs        Where to store checksum of each block.
+ * @return      Number of blocks checksummed.
+ **/
+size_t  fs_checksum_compute(const struct iovec *iov, int iovcnt, size_t skip, size_t count, uint32_t crcs[]) {
+    const char *blocks[FS_IOV_BLOCKS];
+    size_t      n = 0;
+    for (int i = 0; i < iovcnt && n < count; i++) {
+        for (size_t offset = 0; offset < iov[i].iov_len && n < count; offset += BLOCK_SIZE) {
+            if (skip) {
+                skip--;
+                continue;
+            }
+            blocks[n++] = (const char *)iov[i].iov_base + offset;
+        }
+    }
+    crc32c_many(blocks, n, BLOCK_SIZE, crcs);
+    return n;
+}
+
+/**
+ * Record checksums of contiguous blocks just written from gathered buffers
+ * (FS_FEATURE_CHECKSUM), marking the checksum table blocks that changed.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       start       First block written.
+ * @param       iov         Array of buffers (multiples of BLOCK_SIZE each).
+ * @param       iovcnt      Number of buffers.
+ **/
+void    fs_checksum_update(FileSystem *fs, size_t start, const struct iovec *iov, int iovcnt) {
+    if (!fs->checksums) return;
+
+    uint32_t crcs[FS_IOV_BLOCKS];
+    size_t   nblocks = fs_iov_blocks(iov, iovcnt);
+    for (size_t done = 0; done < nblocks; done += FS_IOV_BLOCKS) {
+        size_t n = fs_checksum_compute(iov, iovcnt, done, min(nblocks - done, (size_t)FS_IOV_BLOCKS), crcs);
+        pthread_mutex_lock(&fs->checksum_lock);
+        for (size_t r = 0; r < n; r++) {
+            size_t block = start + done + r;
+            if (fs->checksums[block] == crcs[r]) continue;
+            __atomic_store_n(&fs->checksums[block], crcs[r], __ATOMIC_RELAXED);
+            bitmap_set(fs->dirty_checksums, block / CHECKSUMS_PER_BLOCK);
+        }
+        pthread_mutex_unlock(&fs->checksum_lock);
+    }
+}
+
+/**
+ * Forget checksum of a block that no longer holds file data.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       block       Block number.
+ **/
+void    fs_checksum_clear(FileSystem *fs, size_t block) {
+    if (!fs->checksums || !__atomic_load_n(&fs->checksums[block], __ATOMIC_RELAXED)) return;
+
+    pthread_mutex_lock(&fs->checksum_lock);
+    __atomic_store_n(&fs->checksums[block], 0, __ATOMIC_RELAXED);
+    bitmap_set(fs->dirty_checksums, block / CHECKSUMS_PER_BLOCK);
+    pthread_mutex_unlock(&fs->checksum_lock);
+}
+
+/**
+ * Verify contiguous blocks read into gathered buffers against the checksum
+ * table, unless the FileSystem was mounted with MountOptions.skip_verify
+ * (blocks without a checksum always pass). Mismatches are counted in
+ * FsStats.checksum_errors.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       start       First block read.
+ * @param       iov         Array of buffers (multiples of BLOCK_SIZE each).
+ * @param       iovcnt      Number of buffers.
+ * @return      Whether or not every block matched its checksum.
+ **/
+bool    fs_checksum_verify(FileSystem *fs, size_t start, const struct iovec *iov, int iovcnt) {
+    if (!fs->checksums || fs->options.skip_verify) return true;
+
+    uint32_t crcs[FS_IOV_BLOCKS];
+    size_t   nblocks = fs_iov_blocks(iov, iovcnt);
+    size_t   errors  = 0;
+    for (size_t done = 0; done < nblocks; done += FS_IOV_BLOCKS) {
+        size_t n = fs_checksum_compute(iov, iovcnt, done, min(nblocks - done, (size_t)FS_IOV_BLOCKS), crcs);
+        for (size_t r = 0; r < n; r++) {
+            uint32_t expected = __atomic_load_n(&fs->checksums[start + done + r], __ATOMIC_RELAXED);
+            if (expected && expected != crcs[r]) errors++;
+        }
+    }
+    if (errors) {
+        __atomic_add_fetch(&fs->stats.checksum_errors, errors, __ATOMIC_RELAXED);
+    }
+    return errors == 0;
+}
+
+/**
+ * Return number of whole blocks held by gathered buffers.
+ *
+ * @param       iov         Array of buffers (multiples of BLOCK_SIZE each).
+ * @param       iovcnt      Number of buffers.
+ * @return      Number of blocks.
+ **/
+size_t  fs_iov_blocks(const struct iovec *iov, int iovcnt) {
+    size_t nblocks = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        nblocks += iov[i].iov_len / BLOCK_SIZE;
+    }
+    return nblocks;
+}
+
+/**
+ * Map logical block index of an Inode to a physical block by doing the
+ * following:
+ *
+ *  0. Use the extents of the Inode instead if the FileSystem has the
+ *  FS_FEATURE_EXTENTS feature (see fs_bmap_extent).
+ *
+ *  1. Use direct pointers for the first POINTERS_PER_INODE blocks.
+ *
+ *  2. Otherwise load (or allocate) the indirect block into the BlockMap once
+ *  and use its pointers.
+ *
+ *  3. Past the indirect pointers, walk the double (then triple) indirect
+ *  tree rooted in the indirect block, keeping the pointer blocks on the path
+ *  in the BlockMap so consecutive blocks do not walk the tree again.
+ *
+ *  4. Allocate missing pointer and data blocks if requested (from the
+ *  BlockMap reservation when one was made), recording in fresh whether the
+ *  returned data block was just allocated. A shared or pinned data block is
+ *  replaced by a new one (copy-on-write, see fs_bmap_cow).
+ *
+ * Note: Updates are only made in memory; use fs_bmap_sync to record the
+ * pointer blocks and save the Inode separately.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       map         Pointer to BlockMap of Inode.
+ * @param       index       Logical block index within file.
+ * @param       allocate    Whether or not to allocate missing blocks.
+ * @return      Physical block number (0 if unmapped or allocation failed).
+ **/
+size_t  fs_bmap(FileSystem *fs, BlockMap *map, size_t index, bool allocate) {
+    map->fresh  = false;
+    map->copied = 0;
+    if (fs->meta_data.features & FS_FEATURE_EXTENTS) {
+        return fs_bmap_extent(fs, map, index, allocate);
+    }
+
+    bool     *dirty;
+    uint32_t *pointer = fs_bmap_pointer(fs, map, index, allocate, &dirty);
+    if (!pointer) return 0;
+
+    if (*pointer == 0 && allocate) {
+        if ((*pointer = fs_bmap_alloc(fs, map)) != 0) {
+            if (dirty) *dirty = true;
+            map->fresh = true;
+        }
+    } else if (allocate) {
+        if (!fs_bmap_cow(fs, map, pointer)) return 0;
+        if (map->copied && dirty) *dirty = true;
+    }
+    return *pointer;
+}
+
+/**
+ * Find the pointer to a logical block of a pointer Inode (see fs_bmap),
+ * loading the pointer blocks on its path into the BlockMap (and allocating
+ * missing ones if requested).
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       map         Pointer to BlockMap of Inode.
+ * @param       index       Logical block index within file.
+ * @param       allocate    Whether or not to allocate missing pointer blocks.
+ * @param       dirty       Where to store the modified flag of the pointer
+ *                          block holding the pointer (NULL for direct pointers).
+ * @return      Pointer to block pointer (NULL if its pointer block is
+ *              missing, past the largest file, or could not be read).
+ **/
+uint32_t *fs_bmap_pointer(FileSystem *fs, BlockMap *map, size_t index, bool allocate, bool **dirty) {
+    Inode *node = map->inode;
+
+    *dirty = NULL;
+    if (index < POINTERS_PER_INODE) {
+        return &node->direct[index];
+    }
+
+    index -= POINTERS_PER_INODE;
+    size_t    pointers = fs_indirect_pointers(&fs->meta_data);
+    size_t    depth    = 0;
+    size_t    span     = 1;
+    uint32_t *pointer  = NULL;
+    if (index >= pointers) {
+        if (pointers == POINTERS_PER_BLOCK) return NULL;
+
+        /* Find tree holding block: double (span P^2) or triple (span P^3) */
+        index -= pointers;
+        span   = POINTERS_PER_BLOCK*POINTERS_PER_BLOCK;
+        depth  = 2;
+        if (index >= span) {
+            index -= span;
+            span  *= POINTERS_PER_BLOCK;
+            depth  = 3;
+        }
+        if (index >= span) return NULL;
+    }
+
+    if (!fs_bmap_load(fs, map, allocate)) return NULL;
+    *dirty = &map->dirty;
+    if (depth == 0) {
+        pointer = &map->indirect.pointers[index];
+    } else {
+        pointer = &map->indirect.pointers[depth == 2 ? INDIRECT_DOUBLE : INDIRECT_TRIPLE];
+    }
+
+    for (size_t level = 0; level < depth; level++) {
+        bool fresh = false;
+        if (*pointer == 0) {
+            if (!allocate || (*pointer = fs_bmap_alloc(fs, map)) == 0) return NULL;
+            **dirty = true;
+            fresh   = true;
+        }
+        if (!fs_bmap_path(fs, map, level, *pointer, fresh)) return NULL;
+
+        span   /= POINTERS_PER_BLOCK;
+        pointer = &map->path[level].pointers.pointers[index / span];
+        *dirty  = &map->path[level].dirty;
+        index  %= span;
+    }
+    return pointer;
+}
+
+/**
+ * Give file its own block in place of a shared (or otherwise pinned, see
+ * fs_block_pinned) data block about to be written, recording the replaced
+ * block in copied (its contents are still needed for read-modify-write, and
+ * the file's reference to it must be dropped once the write is staged).
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       map         Pointer to BlockMap of Inode.
+ * @param       pointer     Pointer to mapped data block (updated in place).
+ * @return      Whether or not the block may be written (false if allocation failed).
+ **/
+bool    fs_bmap_cow(FileSystem *fs, BlockMap *map, uint32_t *pointer) {
+    if (!fs_block_pinned(fs, *pointer)) return true;
+
+    size_t block = fs_bmap_alloc(fs, map);
+    if (block == 0) return false;
+    map->copied = *pointer;
+    *pointer    = block;
+    return true;
+}
+
+/**
+ * Hold pointer block at specified level of the BlockMap path, writing back
+ * the modified block it replaces.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       map         Pointer to BlockMap of Inode.
+ * @param       level       Distance of pointer block below the indirect block.
+ * @param       block       Pointer block to hold.
+ * @param       fresh       Whether or not block was just allocated (start empty).
+ * @return      Whether or not the pointer block is available.
+ **/
+bool    fs_bmap_path(FileSystem *fs, BlockMap *map, size_t level, size_t block, bool fresh) {
+    BlockPath *path = &map->path[level];
+    if (path->block == block) return true;
+
+    if (path->dirty && fs_write_metadata(fs, path->block, path->pointers.data) == DISK_FAILURE) return false;
+    path->block = 0;
+    path->dirty = false;
+
+    if (fresh) {
+        memset(path->pointers.data, 0, BLOCK_SIZE);
+        path->dirty = true;
+    } else if (fs_read_block(fs, block, path->pointers.data) == DISK_FAILURE) {
+        return false;
+    }
+    path->block = block;
+    return true;
+}
+
+/**
+ * Map logical block index of an extent Inode to a physical block by doing
+ * the following:
+ *
+ *  1. Move the BlockMap cursor to the extent holding the block (or to the
+ *  end of the file).
+ *
+ *  2. Offset into the extent when it is not a hole.
+ *
+ *  3. Allocate a missing block if requested, make room for the extents it
+ *  may add, and record it by growing a physically adjacent extent or by
+ *  splitting the hole (or extending the file) around it. A shared or pinned
+ *  block is replaced the same way, splitting its extent (copy-on-write).
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       map         Pointer to BlockMap of Inode.
+ * @param       index       Logical block index within file.
+ * @param       allocate    Whether or not to allocate missing blocks.
+ * @return      Physical block number (0 if unmapped or allocation failed).
+ **/
+size_t  fs_bmap_extent(FileSystem *fs, BlockMap *map, size_t index, bool allocate) {
+    size_t  capacity;
+    Extent *extents = fs_extent_seek(fs, map, index, &capacity);
+    if (!extents) return 0;
+
+    size_t shared = 0;
+    if (map->slot < capacity && extents[map->slot].length && extents[map->slot].start) {
+        size_t block = extents[map->slot].start + (index - map->first);
+        if (!allocate || !fs_block_pinned(fs, block)) return block;
+        shared = block;
+    }
+    if (!allocate) return 0;
+
+    /* Reserve data run first so extent blocks are placed outside of it */
+    size_t block = fs_bmap_alloc(fs, map);
+    if (block == 0) return 0;
+
+    /* Adding a block adds at most two extents, so one split makes room */
+    if (!fs_extent_insert(map, extents, capacity, index, block)) {
+        if (!fs_extent_grow(fs, map, extents, capacity) ||
+            !(extents = fs_extent_seek(fs, map, index, &capacity)) ||
+            !fs_extent_insert(map, extents, capacity, index, block)) {
+            pthread_mutex_lock(&fs->alloc_lock);
+            bitmap_set(fs->free_blocks, block);
+            pthread_mutex_unlock(&fs->alloc_lock);
+            return 0;
+        }
+    }
+    map->fresh  = shared == 0;
+    map->copied = shared;
+    return block;
+}
+
+/**
+ * Move BlockMap cursor to the extent holding the specified logical block by
+ * doing the following:
+ *
+ *  1. Use the extents in the Inode unless it has an extent root.
+ *
+ *  2. Otherwise load the extent root and hold the leaf covering the block
+ *  (the last leaf for blocks past the end of the file).
+ *
+ *  3. Scan forward from the cursor (or the start of the leaf when the block
+ *  lies before it) to the extent holding the block.
+ *
+ * Note: Leaves map consecutive ranges of logical blocks, so a cursor past
+ * the last extent of a leaf means the block is past the end of the file.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       map         Pointer to BlockMap of Inode.
+ * @param       index       Logical block index within file.
+ * @param       capacity    Where to store number of extents in list.
+ * @return      Extent list holding cursor (NULL on failure).
+ **/
+Extent *fs_extent_seek(FileSystem *fs, BlockMap *map, size_t index, size_t *capacity) {
+    Inode  *node    = map->inode;
+    Extent *extents = node->extents;
+    size_t  first   = 0;
+
+    *capacity = EXTENTS_PER_INODE;
+    if (node->extent_root) {
+        if (!fs_bmap_load(fs, map, false)) return NULL;
+
+        const ExtentLeaf *leaves = map->indirect.leaves;
+        size_t leaf = map->leaf;
+        if (index < leaves[leaf].first || (leaf + 1 < EXTENTS_PER_BLOCK && leaves[leaf + 1].block && index >= leaves[leaf + 1].first)) {
+            leaf = 0;
+            while (leaf + 1 < EXTENTS_PER_BLOCK && leaves[leaf + 1].block && index >= leaves[leaf + 1].first) leaf++;
+        }
+        if (leaf != map->leaf || map->path[0].block != leaves[leaf].block) {
+            if (!fs_bmap_path(fs, map, 0, leaves[leaf].block, false)) return NULL;
+            map->leaf  = leaf;
+            map->slot  = 0;
+            map->first = leaves[leaf].first;
+        }
+        extents   = map->path[0].pointers.extents;
+        first     = leaves[leaf].first;
+        *capacity = EXTENTS_PER_BLOCK;
+    }
+
+    if (index < map->first) {
+        map->slot  = 0;
+        map->first = first;
+    }
+    while (map->slot < *capacity && extents[map->slot].length && index >= map->first + extents[map->slot].length) {
+        map->first += extents[map->slot].length;
+        map->slot++;
+    }
+    return extents;
+}
+
+/**
+ * Make room in the extent list holding the BlockMap cursor by doing the
+ * following:
+ *
+ *  1. Move the extents of the Inode into a new leaf below a new extent root
+ *  if they are still held by the Inode.
+ *
+ *  2. Otherwise move the upper half of the full leaf into a new leaf that
+ *  follows it in the extent root.
+ *
+ * Note: The cursor is reset; seek again before using it. Extent blocks are
+ * taken from the best-fitting free gap so they do not split the runs file
+ * data is reserved from.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       map         Pointer to BlockMap of Inode.
+ * @param       extents     Extent list holding cursor.
+ * @param       capacity    Number of extents in list.
+ * @return      Whether or not room was made.
+ **/
+bool    fs_extent_grow(FileSystem *fs, BlockMap *map, Extent *extents, size_t capacity) {
+    Inode      *node   = map->inode;
+    ExtentLeaf *leaves = map->indirect.leaves;
+
+    if (node->extent_root == 0) {
+        size_t root = fs_extent_alloc(fs);
+        size_t leaf = root ? fs_extent_alloc(fs) : 0;
+        if (!leaf || !fs_bmap_path(fs, map, 0, leaf, true)) {
+            pthread_mutex_lock(&fs->alloc_lock);
+            if (root) bitmap_set(fs->free_blocks, root);
+            if (leaf) bitmap_set(fs->free_blocks, leaf);
+            pthread_mutex_unlock(&fs->alloc_lock);
+            return false;
+        }
+
+        memcpy(map->path[0].pointers.extents, node->extents, sizeof(node->extents));
+        memset(node->extents, 0, sizeof(node->extents));
+        memset(map->indirect.data, 0, BLOCK_SIZE);
+        leaves[0]         = (ExtentLeaf){.block = leaf, .first = 0};
+        node->extent_root = root;
+        map->loaded       = true;
+        map->dirty        = true;
+        map->leaf         = 0;
+        map->slot         = 0;
+        map->first        = 0;
+        return true;
+    }
+
+    size_t nleaves = 0;
+    while (nleaves < EXTENTS_PER_BLOCK && leaves[nleaves].block) nleaves++;
+    if (nleaves == EXTENTS_PER_BLOCK) return false;
+
+    size_t leaf  = map->leaf;
+    size_t count = fs_extent_count(extents, capacity);
+    size_t half  = count / 2;
+    size_t first = leaves[leaf].first;
+    for (size_t e = 0; e < half; e++) {
+        first += extents[e].length;
+    }
+
+    Block  upper = {{0}};
+    size_t block = fs_extent_alloc(fs);
+    memcpy(upper.extents, extents + half, (count - half)*sizeof(Extent));
+    if (!block || fs_write_metadata(fs, block, upper.data) == DISK_FAILURE) {
+        if (block) {
+            pthread_mutex_lock(&fs->alloc_lock);
+            bitmap_set(fs->free_blocks, block);
+            pthread_mutex_unlock(&fs->alloc_lock);
+        }
+        return false;
+    }
+
+    memset(extents + half, 0, (count - half)*sizeof(Extent));
+    memmove(leaves + leaf + 2, leaves + leaf + 1, (nleaves - leaf - 1)*sizeof(ExtentLeaf));
+    leaves[leaf + 1]    = (ExtentLeaf){.block = block, .first = first};
+    map->path[0].dirty  = true;
+    map->dirty          = true;
+    map->slot           = 0;
+    map->first          = leaves[leaf].first;
+    return true;
+}
+
+/**
+ * Allocate block for extent root or leaf from the best-fitting free run.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @return      Allocated block number (0 if disk is full).
+ **/
+size_t  fs_extent_alloc(FileSystem *fs) {
+    size_t length;
+    return fs_allocate_run(fs, 1, 0, &length);
+}
+
+/**
+ * Record newly allocated block at the BlockMap cursor by doing the
+ * following:
+ *
+ *  1. Inside a hole (or an extent whose block is being replaced), grow the
+ *  physically adjacent extent before or after the block, or split the
+ *  extent around a new extent.
+ *
+ *  2. Past the end of the file, cover any gap with a hole and then grow the
+ *  last extent or append a new one.
+ *
+ *  3. Move the cursor back to the extent before the change (whose logical
+ *  start never moves).
+ *
+ * @param       map         Pointer to BlockMap of Inode.
+ * @param       extents     Extent list holding cursor.
+ * @param       capacity    Number of extents in list.
+ * @param       index       Logical block index of block.
+ * @param       block       Physical block allocated for index.
+ * @return      Whether or not the list had room for the change (nothing is
+ *              modified otherwise).
+ **/
+bool    fs_extent_insert(BlockMap *map, Extent *extents, size_t capacity, size_t index, size_t block) {
+    size_t  slot    = map->slot;
+    size_t  count   = fs_extent_count(extents, capacity);
+    Extent *prev    = slot > 0 ? &extents[slot - 1] : NULL;
+    Extent *grow    = NULL;
+    size_t  back    = prev ? prev->length : 0;
+    Extent  insert[3];
+    size_t  ninsert = 0;
+    size_t  remove  = 0;
+
+    if (slot < count) {
+        Extent *next   = (slot + 1 < count) ? &extents[slot + 1] : NULL;
+        size_t  before = index - map->first;
+        size_t  after  = extents[slot].length - before - 1;
+        size_t  start  = extents[slot].start;
+
+        remove = 1;
+        if (before == 0 && prev && prev->start && prev->start + prev->length == block) {
+            grow = prev;
+        } else if (after == 0 && next && next->start == block + 1) {
+            grow = next;
+        }
+        if (before) insert[ninsert++] = (Extent){.start = start, .length = before};
+        if (!grow)  insert[ninsert++] = (Extent){.start = block, .length = 1};
+        if (after)  insert[ninsert++] = (Extent){.start = start ? start + before + 1 : 0, .length = after};
+    } else {
+        size_t gap = index - map->first;
+        if (gap && prev && !prev->start) {
+            insert[ninsert++] = (Extent){.start = 0, .length = prev->length + gap};
+            insert[ninsert++] = (Extent){.start = block, .length = 1};
+            remove = 1;
+            slot--;
+        } else if (gap) {
+            insert[ninsert++] = (Extent){.start = 0, .length = gap};
+            insert[ninsert++] = (Extent){.start = block, .length = 1};
+        } else if (prev && prev->start && prev->start + prev->length == block) {
+            grow = prev;
+        } else {
+            insert[ninsert++] = (Extent){.start = block, .length = 1};
+        }
+    }
+
+    if (count - remove + ninsert > capacity) return false;
+
+    if (grow == prev && grow) {
+        prev->length++;
+    } else if (grow) {
+        grow->start--;
+        grow->length++;
+    }
+    memmove(extents + slot + ninsert, extents + slot + remove, (count - slot - remove)*sizeof(Extent));
+    memcpy(extents + slot, insert, ninsert*sizeof(Extent));
+    if (ninsert < remove) {
+        memset(extents + count - (remove - ninsert), 0, (remove - ninsert)*sizeof(Extent));
+    }
+
+    map->inode->nextents = map->inode->nextents + ninsert - remove;
+    if (map->inode->extent_root) map->path[0].dirty = true;
+    if (map->slot > 0) {
+        map->slot  -= 1;
+        map->first -= back;
+    }
+    return true;
+}
+
+/**
+ * Replace blocks of the extent at the BlockMap cursor with a hole by doing
+ * the following:
+ *
+ *  1. Keep the parts of the extent before and after the blocks.
+ *
+ *  2. Merge the hole with the holes before and after it.
+ *
+ *  3. Move the cursor back to the extent before the change (whose logical
+ *  start never moves).
+ *
+ * @param       map         Pointer to BlockMap of Inode.
+ * @param       extents     Extent list holding cursor.
+ * @param       capacity    Number of extents in list.
+ * @param       index       Logical block index of first block to unmap.
+ * @param       count       Number of blocks to unmap (within the extent).
+ * @return      Whether or not the list had room for the change (nothing is
+ *              modified otherwise).
+ **/
+bool    fs_extent_punch(BlockMap *map, Extent *extents, size_t capacity, size_t index, size_t count) {
+    size_t  slot    = map->slot;
+    size_t  total   = fs_extent_count(extents, capacity);
+    Extent *prev    = slot > 0 ? &extents[slot - 1] : NULL;
+    Extent *next    = (slot + 1 < total) ? &extents[slot + 1] : NULL;
+    size_t  back    = prev ? prev->length : 0;
+    size_t  start   = extents[slot].start;
+    size_t  before  = index - map->first;
+    size_t  after   = extents[slot].length - before - count;
+    size_t  hole    = count;
+    Extent  insert[3];
+    size_t  ninsert = 0;
+    size_t  remove  = 1;
+
+    if (before == 0 && prev && !prev->start) {
+        hole += prev->length;
+        remove++;
+        slot--;
+    }
+    if (after == 0 && next && !next->start) {
+        hole += next->length;
+        remove++;
+    }
+    if (before) insert[ninsert++] = (Extent){.start = start, .length = before};
+    insert[ninsert++] = (Extent){.start = 0, .length = hole};
+    if (after)  insert[ninsert++] = (Extent){.start = start + before + count, .length = after};
+
+    if (total - remove + ninsert > capacity) return false;
+
+    memmove(extents + slot + ninsert, extents + slot + remove, (total - slot - remove)*sizeof(Extent));
+    memcpy(extents + slot, insert, ninsert*sizeof(Extent));
+    if (ninsert < remove) {
+        memset(extents + total - (remove - ninsert), 0, (remove - ninsert)*sizeof(Extent));
+    }
+
+    map->inode->nextents = map->inode->nextents + ninsert - remove;
+    if (map->inode->extent_root) map->path[0].dirty = true;
+    if (map->slot > 0) {
+        map->slot  -= 1;
+        map->first -= back;
+    }
+    return true;
+}
+
+/**
+ * Return number of extents in use in an extent list.
+ *
+ * @param       extents     Array of extents (ends at first unused extent).
+ * @param       capacity    Number of extents in array.
+ * @return      Number of extents in use.
+ **/
+size_t  fs_extent_count(const Extent *extents, size_t capacity) {
+    size_t count = 0;
+    while (count < capacity && extents[count].length) count++;
+    return count;
+}
+
+/**
+ * Load indirect block of BlockMap, allocating an empty one if requested.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       map         Pointer to BlockMap of Inode.
+ * @param       allocate    Whether or not to allocate a missing indirect block.
+ * @return      Whether or not the indirect block is available.
+ **/
+bool    fs_bmap_load(FileSystem *fs, BlockMap *map, bool allocate) {
+    if (map->loaded) return true;
+
+    Inode *node = map->inode;
+    if (node->indirect == 0) {
+        if (!allocate) return false;
+        if ((node->indirect = fs_bmap_alloc(fs, map)) == 0) return false;
+        memset(map->indirect.data, 0, BLOCK_SIZE);
+        map->dirty = true;
+    } else if (fs_read_block(fs, node->indirect, map->indirect.data) == DISK_FAILURE) {
+        return false;
+    }
+    map->loaded = true;
+    return true;
+}
+
+/**
+ * Reserve contiguous blocks for a write of length bytes at offset by doing
+ * the following:
+ *
+ *  1. Count unmapped and shared blocks in the range (plus missing pointer
+ *  blocks).
+ *
+ *  2. Aim the reservation just past the block preceding the range so files
+ *  grow in place.
+ *
+ * Note: Blocks are taken from the reservation by fs_bmap; release unused
+ * blocks with fs_bmap_release.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       map         Pointer to BlockMap of Inode.
+ * @param       length      Number of bytes to be written.
+ * @param       offset      Byte offset of write.
+ **/
+void    fs_bmap_reserve(FileSystem *fs, BlockMap *map, size_t length, size_t offset) {
+    if (length == 0) return;
+
+    size_t first = offset / BLOCK_SIZE;
+    size_t last  = min((offset + length - 1) / BLOCK_SIZE, fs_max_blocks(&fs->meta_data) - 1);
+    if (first > last) return;
+
+    bool indirect = last >= POINTERS_PER_INODE;
+    bool extents  = fs->meta_data.features & FS_FEATURE_EXTENTS;
+    if (indirect && !extents && map->inode->indirect != 0 && !fs_bmap_load(fs, map, false)) return;
+
+    map->want = (indirect && !extents && map->inode->indirect == 0) ? 1 : 0;
+    for (size_t index = first; index <= last; index++) {
+        if (!extents && index >= POINTERS_PER_INODE && !map->loaded) {
+            map->want += last - index + 1;
+            break;
+        }
+        // shared and committed checksummed blocks are copied on write, so they need new blocks too
+        size_t block = fs_bmap(fs, map, index, false);
+        if (block == 0 || fs_block_pinned(fs, block)) map->want++;
+    }
+
+    /* Allow for pointer blocks of double and triple indirect trees */
+    if (!extents && last >= POINTERS_PER_INODE + fs_indirect_pointers(&fs->meta_data)) {
+        map->want += (last - first) / POINTERS_PER_BLOCK + FS_INDIRECT_DEPTH;
+    }
+
+    size_t previous = (first > 0) ? fs_bmap(fs, map, first - 1, false) : 0;
+    pthread_mutex_lock(&fs->alloc_lock);
+    map->goal = previous ? previous + 1 : fs->free_hint;
+    pthread_mutex_unlock(&fs->alloc_lock);
+}
+
+/**
+ * Return unused reserved blocks of BlockMap to the free block bitmap.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       map         Pointer to BlockMap of Inode.
+ **/
+void    fs_bmap_release(FileSystem *fs, BlockMap *map) {
+    if (map->left) {
+        pthread_mutex_lock(&fs->alloc_lock);
+        bitmap_set_range(fs->free_blocks, map->next, map->left);
+        pthread_mutex_unlock(&fs->alloc_lock);
+    }
+    map->left = 0;
+    map->want = 0;
+}
+
+/**
+ * Allocate next block for BlockMap by doing the following:
+ *
+ *  1. Reserve a new contiguous run near the goal when the reservation is
+ *  exhausted but more blocks are expected.
+ *
+ *  2. Take the next reserved block (or fall back to a single next-fit block).
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       map         Pointer to BlockMap of Inode.
+ * @return      Allocated block number (0 if disk is full).
+ **/
+size_t  fs_bmap_alloc(FileSystem *fs, BlockMap *map) {
+    if (map->left == 0 && map->want > 0) {
+        map->next = fs_allocate_run(fs, map->want, map->goal, &map->left);
+    }
+
+    if (map->left == 0) return find_free_block(fs);
+
+    size_t block = map->next++;
+    map->left--;
+    if (map->want) map->want--;
+    map->goal = block + 1;
+    return block;
+}
+
+/**
+ * Write pointer blocks of BlockMap to disk if they were modified (deepest
+ * first, so no block points to one not yet written).
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       map         Pointer to BlockMap of Inode.
+ * @return      Whether or not the pointer blocks are up to date on disk.
+ **/
+bool    fs_bmap_sync(FileSystem *fs, BlockMap *map) {
+    for (size_t level = FS_INDIRECT_DEPTH; level-- > 0;) {
+        BlockPath *path = &map->path[level];
+        if (!path->dirty) continue;
+        if (fs_write_metadata(fs, path->block, path->pointers.data) == DISK_FAILURE) return false;
+        path->dirty = false;
+    }
+
+    if (!map->dirty) return true;
+    if (fs_write_metadata(fs, map->inode->indirect, map->indirect.data) == DISK_FAILURE) return false;
+    map->dirty = false;
+    return true;
+}
+
+/**
+ * Transfer bytes between data buffer and file blocks by doing the following:
+ *
+ *  1. Map consecutive logical blocks (allocating them when writing) and group
+ *  physically contiguous blocks into runs of at most FS_IOV_BLOCKS.
+ *
+ *  2. Point full blocks directly at the data buffer and stage the partial
+ *  first and last blocks in bounce buffers (read-modify-write when writing
+ *  over existing file data, zero-filled for new blocks or past end of file).
+ *  Blocks copied on write are staged from the shared block they replace,
+ *  whose reference is dropped once staged.
+ *
+ *  3. Issue one vectored read or write per run (holes read as zeros
+ *  without any I/O).
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       map         Pointer to BlockMap of Inode.
+ * @param       data        Data buffer.
+ * @param       length      Number of bytes to transfer.
+ * @param       offset      Byte offset within file.
+ * @param       write       Whether to write (true) or read (false).
+ * @return      Number of bytes transferred (-1 on disk failure).
+ **/
+ssize_t fs_transfer(FileSystem *fs, BlockMap *map, char *data, size_t length, size_t offset, bool write) {
+    if (length == 0) return 0;
+
+    size_t first = offset / BLOCK_SIZE;
+    size_t last  = (offset + length - 1) / BLOCK_SIZE;
+    size_t head  = offset % BLOCK_SIZE;
+    size_t tail  = (offset + length - 1) % BLOCK_SIZE + 1;
+
+    Block  bounce[2];
+    struct iovec iov[FS_IOV_BLOCKS];
+
+    size_t index   = first;
+    size_t pending = fs_bmap(fs, map, index, write);
+    bool   fresh   = map->fresh;
+    size_t copied  = map->copied;
+    while (index <= last) {
+        if (write && pending == 0) break;
+        if (pending == 0) {
+            /* Holes read as zeros without touching the Disk */
+            size_t lo = (index == first) ? head : 0;
+            size_t hi = (index == last)  ? tail : BLOCK_SIZE;
+            memset(data + (index*BLOCK_SIZE + lo - offset), 0, hi - lo);
+            if (++index <= last) pending = fs_bmap(fs, map, index, false);
+            continue;
+        }
+
+        size_t start = pending;
+        int    run   = 0;
+        while (true) {
+            size_t b  = index + run;
+            size_t lo = (b == first) ? head : 0;
+            size_t hi = (b == last)  ? tail : BLOCK_SIZE;
+
+            iov[run].iov_len = BLOCK_SIZE;
+            if (lo == 0 && hi == BLOCK_SIZE) {
+                iov[run].iov_base = data + (b*BLOCK_SIZE - offset);
+            } else {
+                Block *staged = &bounce[b == first ? 0 : 1];
+                iov[run].iov_base = staged->data;
+                if (write) {
+                    /* Only blocks holding file data need read-modify-write */
+                    if (fresh || b*BLOCK_SIZE >= map->inode->size) {
+                        memset(staged->data, 0, BLOCK_SIZE);
+                    } else if (fs_readv_blocks(fs, copied ? copied : start + run, &(struct iovec){staged->data, BLOCK_SIZE}, 1) == DISK_FAILURE) {
+                        if (copied) fs_unshare_block(fs, copied);
+                        return -1;
+                    }
+                    memcpy(staged->data + lo, data + (b*BLOCK_SIZE + lo - offset), hi - lo);
+                }
+            }
+            if (copied) {
+                fs_unshare_block(fs, copied);
+                copied = 0;
+            }
+            run++;
+
+            if (index + run > last) break;
+            pending = fs_bmap(fs, map, index + run, write);
+            fresh   = map->fresh;
+            copied  = map->copied;
+            if (run == FS_IOV_BLOCKS || pending != start + run) break;
+        }
+
+        if (write) {
+            if (fs_writev_blocks(fs, start, iov, run) == DISK_FAILURE) {
+                if (copied) fs_unshare_block(fs, copied);
+                return -1;
+            }
+        } else {
+            if (fs_readv_blocks(fs, start, iov, run) == DISK_FAILURE) return -1;
+            for (int r = 0; r < run; r++) {
+                size_t b  = index + r;
+                size_t lo = (b == first) ? head : 0;
+                size_t hi = (b == last)  ? tail : BLOCK_SIZE;
+                if (lo != 0 || hi != BLOCK_SIZE) {
+                    memcpy(data + (b*BLOCK_SIZE + lo - offset), (char *)iov[r].iov_base + lo, hi - lo);
+                }
+            }
+        }
+        index += run;
+    }
+
+    if (index > last) return length;
+    return (index == first) ? 0 : index*BLOCK_SIZE - offset;
+}
+
+/**
+ * Read bytes from file blocks with a single batch of asynchronous requests by
+ * doing the following:
+ *
+ *  1. Map every logical block and serve already cached blocks (and holes)
+ *  from memory.
+ *
+ *  2. Point full blocks directly at the data buffer and stage the partial
+ *  first and last blocks in bounce buffers, merging physically and
+ *  buffer-contiguous blocks into one request.
+ *
+ *  3. Submit all requests, wait for them, verify the checksums of all
+ *  blocks read (see fs_checksum_verify), and copy out the partial blocks.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       map         Pointer to BlockMap of Inode.
+ * @param       data        Data buffer.
+ * @param       length      Number of bytes to read.
+ * @param       offset      Byte offset within file.
+ * @return      Number of bytes read (-1 on disk failure or checksum mismatch).
+ **/
+ssize_t fs_read_async(FileSystem *fs, BlockMap *map, char *data, size_t length, size_t offset) {
+    if (length == 0) return 0;
+
+    size_t first = offset / BLOCK_SIZE;
+    size_t last  = (offset + length - 1) / BLOCK_SIZE;
+    size_t head  = offset % BLOCK_SIZE;
+    size_t tail  = (offset + length - 1) % BLOCK_SIZE + 1;
+
+    AioRequest *requests = calloc(last - first + 1, sizeof(AioRequest));
+    if (!requests) return -1;
+
+    Block  bounce[2];
+    size_t n        = 0;
+    bool   verified = true;
+    for (size_t b = first; b <= last; b++) {
+        size_t lo = (b == first) ? head : 0;
+        size_t hi = (b == last)  ? tail : BLOCK_SIZE;
+        char  *target = (lo == 0 && hi == BLOCK_SIZE) ? data + (b*BLOCK_SIZE - offset)
+                                                      : bounce[b == first ? 0 : 1].data;
+
+        size_t block = fs_bmap(fs, map, b, false);
+        if (block == 0) {
+            memset(target, 0, BLOCK_SIZE);
+            continue;
+        }
+        if (fs->cache && cache_probe(fs->cache, block, target)) {
+            verified &= fs_checksum_verify(fs, block, &(struct iovec){target, BLOCK_SIZE}, 1);
+            continue;
+        }
+
+        AioRequest *previous = n ? &requests[n - 1] : NULL;
+        if (previous && previous->count < FS_IOV_BLOCKS &&
+            previous->block + previous->count == block &&
+            previous->data + previous->count*BLOCK_SIZE == target) {
+            previous->count++;
+            continue;
+        }
+        requests[n++] = (AioRequest){.block = block, .count = 1, .data = target};
+    }
+
+    bool success = aio_submit(fs->aio, requests, n) && aio_wait_all(fs->aio, requests, n);
+    for (size_t r = 0; success && r < n; r++) {
+        verified &= fs_checksum_verify(fs, requests[r].block, &(struct iovec){requests[r].data, requests[r].count*BLOCK_SIZE}, 1);
+    }
+    free(requests);
+    if (!success || !verified) return -1;
+
+    if (head != 0 || (first == last && tail != BLOCK_SIZE)) {
+        memcpy(data, bounce[0].data + head, (first == last ? tail : BLOCK_SIZE) - head);
+    }
+    if (first != last && tail != BLOCK_SIZE) {
+        memcpy(data + (last*BLOCK_SIZE - offset), bounce[1].data, tail);
+    }
+    return length;
+}
+
+/**
+ * Walk file blocks as extents for fs_read_iter by doing the following:
+ *
+ *  1. Group physically contiguous blocks into runs of at most FS_IOV_BLOCKS
+ *  (unmapped blocks become extents of FsZeroBlock).
+ *
+ *  2. Point runs directly into the memory mapped Disk unless the block cache
+ *  holds newer contents (verifying their checksums in place); otherwise
+ *  read them into the staging buffer.
+ *
+ *  3. Call back whenever the extent batch or staging buffer is full, and
+ *  once more for the remainder.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       map         Pointer to BlockMap of Inode.
+ * @param       offset      Byte offset within file.
+ * @param       length      Number of bytes to hand out.
+ * @param       callback    Function called with each batch of extents.
+ * @param       ctx         Caller data passed to callback.
+ * @return      Number of bytes handed out (-1 on failure or if stopped).
+ **/
+ssize_t fs_iterate(FileSystem *fs, BlockMap *map, size_t offset, size_t length, FsReadIter callback, void *ctx) {
+    if (length == 0) return 0;
+
+    size_t first = offset / BLOCK_SIZE;
+    size_t last  = (offset + length - 1) / BLOCK_SIZE;
+    size_t end   = offset + length;
+
+    struct iovec extents[FS_ITER_EXTENTS];
+    struct iovec blocks[FS_IOV_BLOCKS];
+    char  *staging = NULL;
+    size_t staged  = 0;
+    int    n       = 0;
+    size_t batch   = offset;
+    size_t total   = 0;
+    bool   success = true;
+
+    size_t index = first;
+    while (success && index <= last) {
+        size_t start = fs_bmap(fs, map, index, false);
+        size_t run   = 1;
+        while (start && index + run <= last && run < FS_IOV_BLOCKS && fs_bmap(fs, map, index + run, false) == start + run) {
+            run++;
+        }
+
+        bool mapped = start && fs->disk->map && !cache_dirty(fs->cache, start, run);
+        if (n == FS_ITER_EXTENTS || (start && !mapped && staged + run > FS_IOV_BLOCKS)) {
+            success = callback(extents, n, batch, ctx);
+            batch   = offset + total;
+            staged  = 0;
+            n       = 0;
+            if (!success) break;
+        }
+
+        const char *base;
+        if (!start) {
+            base = FsZeroBlock.data;
+        } else if (mapped) {
+            base = disk_block(fs->disk, start);
+            if (!fs_checksum_verify(fs, start, &(struct iovec){(char *)base, run*BLOCK_SIZE}, 1)) {
+                success = false;
+                break;
+            }
+        } else {
+            if (!staging && !(staging = malloc(FS_IOV_BLOCKS*BLOCK_SIZE))) {
+                success = false;
+                break;
+            }
+            for (size_t r = 0; r < run; r++) {
+                blocks[r].iov_base = staging + (staged + r)*BLOCK_SIZE;
+                blocks[r].iov_len  = BLOCK_SIZE;
+            }
+            if (fs_readv_blocks(fs, start, blocks, run) == DISK_FAILURE) {
+                success = false;
+                break;
+            }
+            base    = staging + staged*BLOCK_SIZE;
+            staged += run;
+        }
+
+        size_t lo = (index == first) ? offset % BLOCK_SIZE : 0;
+        size_t hi = min((index + run)*BLOCK_SIZE, end) - index*BLOCK_SIZE;
+        extents[n].iov_base = (char *)base + lo;
+        extents[n].iov_len  = hi - lo;
+        total += hi - lo;
+        index += run;
+        n++;
+    }
+
+    if (success && n) {
+        success = callback(extents, n, batch, ctx);
+    }
+    free(staging);
+    return success ? (ssize_t)total : -1;
+}
+
+/**
+ * Read bytes from compressed file data by doing the following:
+ *
+ *  1. Classify each cluster overlapping the range by the blocks it maps
+ *  (see fs_cluster_blocks).
+ *
+ *  2. Fill holes with zeros and read clusters stored as is straight into
+ *  the data buffer.
+ *
+ *  3. Decompress the other clusters into a staging buffer and copy out the
+ *  requested bytes.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       map         Pointer to BlockMap of compressed Inode.
+ * @param       data        Data buffer.
+ * @param       length      Number of bytes to read (within file size).
+ * @param       offset      Byte offset within file.
+ * @return      Number of bytes read (-1 on disk failure or damaged cluster).
+ **/
+ssize_t fs_compress_read(FileSystem *fs, BlockMap *map, char *data, size_t length, size_t offset) {
+    size_t end     = offset + length;
+    char  *staging = NULL;
+    bool   success = true;
+
+    for (size_t cluster = offset / FS_CLUSTER_SIZE; success && cluster*FS_CLUSTER_SIZE < end; cluster++) {
+        size_t lo = max(offset, cluster*FS_CLUSTER_SIZE);
+        size_t hi = min(end, (cluster + 1)*FS_CLUSTER_SIZE);
+        size_t slots;
+        size_t stored = fs_cluster_blocks(fs, map, cluster, map->inode->size, &slots);
+        if (stored == 0) {
+            memset(data + (lo - offset), 0, hi - lo);
+        } else if (stored == slots) {
+            success = fs_transfer(fs, map, data + (lo - offset), hi - lo, lo, false) == (ssize_t)(hi - lo);
+        } else {
+            success = (staging || (staging = malloc(2*FS_CLUSTER_SIZE))) &&
+                      fs_cluster_load(fs, map, cluster, map->inode->size, staging, staging + FS_CLUSTER_SIZE);
+            if (success) {
+                memcpy(data + (lo - offset), staging + (lo - cluster*FS_CLUSTER_SIZE), hi - lo);
+            }
+        }
+    }
+    free(staging);
+    return success ? (ssize_t)length : -1;
+}
+
+/**
+ * Write bytes to compressed file data by doing the following:
+ *
+ *  1. Re-encode the old last cluster first if the write grows the file
+ *  past it without touching it (its number of blocks changes).
+ *
+ *  2. Decompress each cluster the range only partly covers, and copy the
+ *  new bytes over it.
+ *
+ *  3. Store each cluster compressed, as is, or as a hole (see
+ *  fs_cluster_store).
+ *
+ * Note: The Inode size must still be the size before the write (the
+ * caller grows it afterwards).
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       map         Pointer to BlockMap of compressed Inode.
+ * @param       data        Data buffer.
+ * @param       length      Number of bytes to write.
+ * @param       offset      Byte offset within file.
+ * @return      Number of bytes written (-1 on failure before any cluster
+ *              was stored).
+ **/
+ssize_t fs_compress_write(FileSystem *fs, BlockMap *map, char *data, size_t length, size_t offset) {
+    if (length == 0) return 0;
+
+    char *staging = malloc(2*FS_CLUSTER_SIZE);
+    if (!staging) return -1;
+    char *packed  = staging + FS_CLUSTER_SIZE;
+
+    size_t size  = map->inode->size;
+    size_t end   = max(size, offset + length);
+    size_t first = offset / FS_CLUSTER_SIZE;
+    size_t last  = (offset + length - 1) / FS_CLUSTER_SIZE;
+    size_t tail  = size ? (size - 1) / FS_CLUSTER_SIZE : first;
+    if (tail < first && fs_cluster_slots(size, tail) < fs_cluster_slots(end, tail)) {
+        if (!fs_cluster_load(fs, map, tail, size, staging, packed) ||
+            !fs_cluster_store(fs, map, tail, end, staging, packed)) {
+            free(staging);
+            return -1;
+        }
+    }
+
+    size_t cluster = first;
+    for (; cluster <= last; cluster++) {
+        size_t lo = max(offset, cluster*FS_CLUSTER_SIZE);
+        size_t hi = min(offset + length, (cluster + 1)*FS_CLUSTER_SIZE);
+        if (hi - lo < FS_CLUSTER_SIZE && !fs_cluster_load(fs, map, cluster, size, staging, packed)) break;
+
+        memcpy(staging + (lo - cluster*FS_CLUSTER_SIZE), data + (lo - offset), hi - lo);
+        if (!fs_cluster_store(fs, map, cluster, end, staging, packed)) break;
+    }
+    free(staging);
+
+    if (cluster > last) return length;
+    return (cluster == first) ? -1 : (ssize_t)(cluster*FS_CLUSTER_SIZE - offset);
+}
+
+/**
+ * Hand contents of compressed file data to callback, decompressed into a
+ * staging buffer of FS_IOV_BLOCKS blocks at a time (see fs_iterate).
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       map         Pointer to BlockMap of compressed Inode.
+ * @param       offset      Byte offset within file.
+ * @param       length      Number of bytes to read (within file size).
+ * @param       callback    Function called with each staged range.
+ * @param       ctx         Caller data passed to callback.
+ * @return      Number of bytes handed to callback (-1 on error or if callback
+ *              stopped).
+ **/
+ssize_t fs_compress_iterate(FileSystem *fs, BlockMap *map, size_t offset, size_t length, FsReadIter callback, void *ctx) {
+    char *staging = malloc(FS_IOV_BLOCKS*BLOCK_SIZE);
+    if (!staging) return -1;
+
+    bool success = true;
+    for (size_t done = 0; success && done < length;) {
+        struct iovec iov = {staging, min(length - done, FS_IOV_BLOCKS*BLOCK_SIZE)};
+        success = fs_compress_read(fs, map, staging, iov.iov_len, offset + done) == (ssize_t)iov.iov_len &&
+                  callback(&iov, 1, offset + done, ctx);
+        done   += iov.iov_len;
+    }
+    free(staging);
+    return success ? (ssize_t)length : -1;
+}
+
+/**
+ * Return how a cluster of a compressed file is stored: as a hole (its first
+ * block is unmapped), as is (its last block below the end of file is
+ * mapped), or compressed into its first blocks (the rest are unmapped).
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       map         Pointer to BlockMap of compressed Inode.
+ * @param       cluster     Cluster index within file.
+ * @param       size        File size the cluster was stored for.
+ * @param       slots       Where to store number of file blocks in cluster.
+ * @return      Number of blocks holding cluster (0 for a hole, slots if
+ *              stored as is).
+ **/
+size_t  fs_cluster_blocks(FileSystem *fs, BlockMap *map, size_t cluster, size_t size, size_t *slots) {
+    size_t first = cluster*FS_CLUSTER_BLOCKS;
+    *slots = fs_cluster_slots(size, cluster);
+    if (*slots == 0 || fs_bmap(fs, map, first, false) == 0) return 0;
+    if (fs_bmap(fs, map, first + *slots - 1, false)) return *slots;
+
+    size_t stored = 1;
+    while (stored < *slots && fs_bmap(fs, map, first + stored, false)) {
+        stored++;
+    }
+    return stored;
+}
+
+/**
+ * Decode a cluster of a compressed file into a buffer of FS_CLUSTER_SIZE
+ * bytes (zero past the data of the cluster).
+ *
+ * Note: A compressed cluster begins with the length of its compressed
+ * bytes as a 32-bit word.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       map         Pointer to BlockMap of compressed Inode.
+ * @param       cluster     Cluster index within file.
+ * @param       size        File size the cluster was stored for.
+ * @param       buffer      Where to decode cluster.
+ * @param       packed      Staging buffer of FS_CLUSTER_SIZE bytes.
+ * @return      Whether or not the cluster was read and decoded.
+ **/
+bool    fs_cluster_load(FileSystem *fs, BlockMap *map, size_t cluster, size_t size, char *buffer, char *packed) {
+    size_t  slots;
+    size_t  stored = fs_cluster_blocks(fs, map, cluster, size, &slots);
+    size_t  start  = cluster*FS_CLUSTER_SIZE;
+    ssize_t nbytes = 0;
+
+    if (stored == 0) {
+        nbytes = 0;
+    } else if (stored == slots) {
+        nbytes = stored*BLOCK_SIZE;
+        if (fs_transfer(fs, map, buffer, nbytes, start, false) != nbytes) return false;
+    } else {
+        uint32_t packed_length;
+        if (fs_transfer(fs, map, packed, stored*BLOCK_SIZE, start, false) != (ssize_t)(stored*BLOCK_SIZE)) return false;
+        memcpy(&packed_length, packed, sizeof(packed_length));
+        if (packed_length > stored*BLOCK_SIZE - sizeof(packed_length)) return false;
+        nbytes = lz_decompress(packed + sizeof(packed_length), packed_length, buffer, FS_CLUSTER_SIZE);
+        if (nbytes < 0) return false;
+    }
+    memset(buffer + nbytes, 0, FS_CLUSTER_SIZE - nbytes);
+    return true;
+}
+
+/**
+ * Encode a cluster of a compressed file by doing the following:
+ *
+ *  1. Unmap the whole cluster if it holds only zeros.
+ *
+ *  2. Compress the file blocks of the cluster, and write the result into
+ *  its first blocks and unmap the rest if that saves at least one block.
+ *
+ *  3. Otherwise write the file blocks of the cluster as is.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       map         Pointer to BlockMap of compressed Inode.
+ * @param       cluster     Cluster index within file.
+ * @param       size        File size once the write completes.
+ * @param       buffer      Contents of cluster (FS_CLUSTER_SIZE bytes).
+ * @param       packed      Staging buffer of FS_CLUSTER_SIZE bytes.
+ * @return      Whether or not the cluster was stored.
+ **/
+bool    fs_cluster_store(FileSystem *fs, BlockMap *map, size_t cluster, size_t size, char *buffer, char *packed) {
+    size_t slots = fs_cluster_slots(size, cluster);
+    size_t first = cluster*FS_CLUSTER_BLOCKS;
+    size_t start = cluster*FS_CLUSTER_SIZE;
+
+    size_t zeros = 0;
+    while (zeros < slots && memcmp(buffer + zeros*BLOCK_SIZE, FsZeroBlock.data, BLOCK_SIZE) == 0) {
+        zeros++;
+    }
+    if (zeros == slots) {
+        return fs_punch_blocks(fs, map, first, first + FS_CLUSTER_BLOCKS) >= 0;
+    }
+
+    uint32_t packed_length = 0;
+    if (slots > 1) {
+        packed_length = lz_compress(buffer, slots*BLOCK_SIZE, packed + sizeof(packed_length),
+                                    (slots - 1)*BLOCK_SIZE - sizeof(packed_length));
+    }
+    if (packed_length == 0) {
+        return fs_transfer(fs, map, buffer, slots*BLOCK_SIZE, start, true) == (ssize_t)(slots*BLOCK_SIZE);
+    }
+
+    size_t stored = (sizeof(packed_length) + packed_length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    memcpy(packed, &packed_length, sizeof(packed_length));
+    memset(packed + sizeof(packed_length) + packed_length, 0, stored*BLOCK_SIZE - sizeof(packed_length) - packed_length);
+    return fs_transfer(fs, map, packed, stored*BLOCK_SIZE, start, true) == (ssize_t)(stored*BLOCK_SIZE) &&
+           fs_punch_blocks(fs, map, first + stored, first + slots) >= 0;
+}
+
+/**
+ * Return number of file blocks in a cluster (blocks past the end of file
+ * are not part of it).
+ *
+ * @param       size        File size.
+ * @param       cluster     Cluster index within file.
+ * @return      Number of blocks (0 if cluster lies past the end of file).
+ **/
+size_t  fs_cluster_slots(size_t size, size_t cluster) {
+    size_t nblocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    size_t first   = cluster*FS_CLUSTER_BLOCKS;
+    return nblocks > first ? min(nblocks - first, FS_CLUSTER_BLOCKS) : 0;
+}
+
+/**
+ * Begin read of Inode by doing the following:
+ *
+ *  1. Claim the read stream slot of the Inode (resetting it if it tracked
+ *  another Inode).
+ *
+ *  2. Grow the read-ahead window if the read continues where the previous
+ *  one stopped, otherwise drop it.
+ *
+ *  3. Copy the pinned indirect block into the BlockMap (unless it already
+ *  holds one, as the BlockMap of an FsHandle may).
+ *
+ * Note: Caller must hold the Inode lock.
  *
  * @param       fs              Pointer to FileSystem structure.
- * @param       inode_number    Inode to write data to.
- * @param       data            Buffer with data to copy
- * @param       length          Number of bytes to write.
- * @param       offset          Byte offset from which to begin writing.
- * @return      Number of bytes read (-1 on error).
+ * @param       inode_number    Inode being read.
+ * @param       map             Pointer to BlockMap of Inode.
+ * @param       offset          Byte offset read begins at.
+ * @return      Read-ahead window in blocks (0 if not sequential).
  **/
-ssize_t fs_write(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset) {
+size_t  fs_stream_begin(FileSystem *fs, size_t inode_number, BlockMap *map, size_t offset) {
+    ReadStream *stream = &fs->streams[inode_number % FS_STREAMS];
 
-    size_t block_num = inode_number / INODES_PER_BLOCK + 1;
-    size_t inode_i = inode_number % INODES_PER_BLOCK;
-    Block blk;
-    disk_read(fs->disk, block_num, blk.data);
+    pthread_mutex_lock(&fs->stream_lock);
+    if (!stream->active || stream->inode_number != inode_number) {
+        memset(stream, 0, offsetof(ReadStream, indirect));
+        stream->inode_number = inode_number;
+        stream->active       = true;
+    }
 
-    //if (blk.inodes[inode_i].size < (length + offset)) {
-    //    length = blk.inodes[inode_i].size - offset;
-    //}
+    size_t window = 0;
+    if (offset == stream->next) {
+        window = stream->window ? min(2*stream->window, FS_READAHEAD_MAX) : FS_READAHEAD_MIN;
+    }
+    if (stream->pinned && !map->loaded) {
+        memcpy(map->indirect.data, stream->indirect.data, BLOCK_SIZE);
+        map->loaded = true;
+    }
+    pthread_mutex_unlock(&fs->stream_lock);
+    return window;
+}
 
-    size_t data_block = offset / BLOCK_SIZE;
-    ssize_t nwrite = 0;
-    size_t data_offset = offset % BLOCK_SIZE;
+/**
+ * End read of Inode by doing the following:
+ *
+ *  1. Prefetch the next window of blocks into the block cache once fewer
+ *  than half a window of prefetched blocks remain (contiguous blocks are
+ *  read with one disk request).
+ *
+ *  2. Record where the next sequential read should begin and pin the
+ *  indirect block for the rest of the stream.
+ *
+ * Note: Caller must hold the Inode lock.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode being read.
+ * @param       map             Pointer to BlockMap of Inode.
+ * @param       end             Byte offset read stopped at.
+ * @param       window          Read-ahead window in blocks (0 if not sequential).
+ **/
+void    fs_stream_end(FileSystem *fs, size_t inode_number, BlockMap *map, size_t end, size_t window) {
+    ReadStream *stream = &fs->streams[inode_number % FS_STREAMS];
 
-    size_t ncopy;
-    // adjust length to account for offset
-    if (length < BLOCK_SIZE) {
-        ncopy = length;
-    } else {
-        ncopy = BLOCK_SIZE - data_offset;
-    } 
+    pthread_mutex_lock(&fs->stream_lock);
+    size_t ahead = (stream->active && stream->inode_number == inode_number && window) ? stream->ahead : 0;
+    pthread_mutex_unlock(&fs->stream_lock);
 
-    // check if valid inode
-    if (!blk.inodes[inode_i].valid) return -1;
-    
-    while (nwrite < length) {
-        Block data_blk = {{0}};
-        Block indirect_blk = {{0}};
-        
-        size_t new_block = 0;
-
-        if (data_block < POINTERS_PER_INODE) {
-
-            // allocate new block if not allocated (direct pointer)
-            if (blk.inodes[inode_i].direct[data_block] == 0) {
-                new_block = find_free_block(fs);
-                if (new_block == 0) return -1; // if there was no free block found
-                blk.inodes[inode_i].direct[data_block] = new_block;
-            }
-
-            // read dirptr to data block
-            if (disk_read(fs->disk, blk.inodes[inode_i].direct[data_block], data_blk.data) == DISK_FAILURE) return -1;
-            // copy new data into data block
-            memcpy(data_blk.data + data_offset, data + nwrite, ncopy);
-            // write the updated data block to disk
-            if (disk_write(fs->disk, blk.inodes[inode_i].direct[data_block], data_blk.data) == DISK_FAILURE) return -1;
-            
-        } else {
-            size_t indirect_offset = data_block - POINTERS_PER_INODE;
-            
-            // allocate new block if not allocated (indirect pointer)
-            if (blk.inodes[inode_i].indirect == 0) {
-                new_block = find_free_block(fs);
-                if (new_block == 0) return -1;
-                blk.inodes[inode_i].indirect = new_block;
-            } else {
-                // read indirect pointer
-                if (disk_read(fs->disk, blk.inodes[inode_i].indirect, indirect_blk.data) == DISK_FAILURE) return -1; 
-            }
+    size_t next = end / BLOCK_SIZE;
+    if (window && fs->cache) {
+        window = min(window, fs->cache->capacity / 2);
 
-            // allocate new block if not allocated (direct pointers in indirect pointer)
-            if (indirect_blk.pointers[indirect_offset] == 0) {
-                new_block = find_free_block(fs);
-                if (new_block == 0) return -1;
-                indirect_blk.pointers[indirect_offset] = new_block;
-                if (disk_write(fs->disk, blk.inodes[inode_i].indirect, indirect_blk.data) == DISK_FAILURE) return -1;
-            } else {
-                // read direct pointers from indirect pointer into data block
-                if (disk_read(fs->disk, indirect_blk.pointers[indirect_offset], data_blk.data) == DISK_FAILURE) return -1;
+        size_t blocks = (map->inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        size_t from   = max(next, ahead);
+        size_t to     = min(next + window, blocks);
+        if (from < to && from - next < window / 2) {
+            size_t start = 0;
+            size_t count = 0;
+            for (size_t b = from; b < to; b++) {
+                size_t block = fs_bmap(fs, map, b, false);
+                if (count && block == start + count) {
+                    count++;
+                    continue;
+                }
+                if (count) cache_prefetch(fs->cache, start, count);
+                start = block;
+                count = block ? 1 : 0;
             }
+            if (count) cache_prefetch(fs->cache, start, count);
+            ahead = to;
+        }
+    }
+
+    pthread_mutex_lock(&fs->stream_lock);
+    if (stream->active && stream->inode_number == inode_number) {
+        stream->next   = end;
+        stream->window = window;
+        stream->ahead  = ahead;
+        if (window && map->loaded && !stream->pinned) {
+            memcpy(stream->indirect.data, map->indirect.data, BLOCK_SIZE);
+            stream->pinned = true;
+        }
+    }
+    pthread_mutex_unlock(&fs->stream_lock);
+}
+
+/**
+ * Forget read stream of Inode and invalidate FsHandles of its lock stripe
+ * (its block pointers changed).
+ *
+ * Note: Caller must hold the Inode lock for writing.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode that was modified.
+ **/
+void    fs_stream_reset(FileSystem *fs, size_t inode_number) {
+    ReadStream *stream = &fs->streams[inode_number % FS_STREAMS];
+
+    fs->inode_versions[inode_number % FS_INODE_LOCKS]++;
+    pthread_mutex_lock(&fs->stream_lock);
+    if (stream->active && stream->inode_number == inode_number) {
+        stream->active = false;
+        stream->pinned = false;
+    }
+    pthread_mutex_unlock(&fs->stream_lock);
+}
+
+/**
+ * Return pointer to Inode in the in-memory Inode table.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to access.
+ * @return      Pointer to Inode (NULL if not mounted or out of range).
+ **/
+Inode *fs_inode(FileSystem *fs, size_t inode_number) {
+    if (!fs || !fs->inode_table || inode_number >= fs->meta_data.inodes) return NULL;
+    size_t per_block = fs_inodes_per_block(&fs->meta_data);
+    return (Inode *)fs_block_inode(&fs->meta_data, &fs->inode_table[inode_number / per_block], inode_number % per_block);
+}
+
+/**
+ * Return contents of inline file in the in-memory Inode table (they begin
+ * where the pointers of the Inode would and fill the rest of its record).
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inline Inode to access.
+ * @return      Pointer to INLINE_DATA_SIZE bytes of file data.
+ **/
+char  *fs_inline_data(FileSystem *fs, size_t inode_number) {
+    return (char *)fs_inode(fs, inode_number) + offsetof(Inode, direct);
+}
+
+/**
+ * Copy Inode from the in-memory Inode table.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to load.
+ * @param       node            Where to store Inode.
+ * @return      Whether or not the Inode exists and is valid.
+ **/
+bool fs_load_inode(FileSystem *fs, size_t inode_number, Inode *node) {   
+    Inode *cached = fs_inode(fs, inode_number);
+    if (!cached || !cached->valid) return false;
+    *node = *cached;
+    return true;
+}
+
+/**
+ * Store Inode in the in-memory Inode table and mark its block dirty (the
+ * rest of an inline data record is cleared, so file data must be written
+ * with fs_write_inline).
+ *
+ * Note: Use fs_flush_inodes to record the update on Disk.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to save.
+ * @param       node            Inode contents.
+ * @return      Whether or not the Inode was saved.
+ **/
+bool fs_save_inode(FileSystem *fs, size_t inode_number, Inode *node) {
+    Inode *cached = fs_inode(fs, inode_number);
+    if (!cached) return false;
+    // copy under table lock so fs_flush_inodes never writes a torn Inode block
+    pthread_mutex_lock(&fs->table_lock);
+    *cached = *node;
+    if (fs->meta_data.features & FS_FEATURE_INLINE) {
+        memset(((InlineInode *)cached)->tail, 0, sizeof(((InlineInode *)cached)->tail));
+    }
+    bitmap_set(fs->dirty_inodes, inode_number / fs_inodes_per_block(&fs->meta_data));
+    pthread_mutex_unlock(&fs->table_lock);
+    return true;
+}
+
+/**
+ * Mark Inode block holding specified Inode as dirty.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode that was modified.
+ **/
+void fs_dirty_inode(FileSystem *fs, size_t inode_number) {
+    pthread_mutex_lock(&fs->table_lock);
+    bitmap_set(fs->dirty_inodes, inode_number / fs_inodes_per_block(&fs->meta_data));
+    pthread_mutex_unlock(&fs->table_lock);
+}
 
-            // copy data into data block
-            memcpy(data_blk.data + data_offset, data + nwrite, ncopy);
-            // write the updated data block to disk
-            if (disk_write(fs->disk, indirect_blk.pointers[indirect_offset], data_blk.data) == DISK_FAILURE) return -1;
+/**
+ * Write dirty Inode blocks of in-memory Inode table to Disk, followed by
+ * dirty blocks of the checksum table (see fs_flush_checksums).
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @return      Whether or not all dirty Inode blocks were written.
+ **/
+bool fs_flush_inodes(FileSystem *fs) {
+    if (!fs->inode_table) return true;
 
+    bool   success = true;
+    size_t index   = 0;
+    pthread_mutex_lock(&fs->table_lock);
+    while ((index = bitmap_find(fs->dirty_inodes, index)) != BITMAP_NONE) {
+        if (fs_write_metadata(fs, index + 1, fs->inode_table[index].data) == DISK_FAILURE) {
+            success = false;
+            break;
         }
+        bitmap_clear(fs->dirty_inodes, index);
+    }
+    pthread_mutex_unlock(&fs->table_lock);
+    return success && fs_flush_checksums(fs);
+}
+
+/**
+ * Return lock guarding specified Inode (Inodes share FS_INODE_LOCKS locks).
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to lock.
+ * @return      Pointer to reader/writer lock (NULL if not mounted or out of range).
+ **/
+pthread_rwlock_t *fs_inode_lock(FileSystem *fs, size_t inode_number) {
+    if (!fs || !fs->locked || !fs->inode_table || inode_number >= fs->meta_data.inodes) return NULL;
+    return &fs->inode_locks[inode_number % FS_INODE_LOCKS];
+}
+
+/**
+ * Start journal of mounted FileSystem by doing the following:
+ *
+ *  1. Size the running transaction to what one journal record (half of the
+ *  journal) can hold.
+ *
+ *  2. Create the bitmap of blocks released by the running transaction (and
+ *  of blocks allocated since the last record when checksumming data).
+ *
+ *  3. Initialize the transaction lock and the update handle lock (which
+ *  prefers the committing writer so it cannot be starved).
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       sequence    Sequence number of first transaction.
+ * @return      Whether or not the journal was started.
+ **/
+bool    fs_journal_start(FileSystem *fs, uint32_t sequence) {
+    Journal *journal  = &fs->journal;
+    size_t   capacity = min((size_t)fs->meta_data.journal_blocks / 2 - 1, (size_t)JOURNAL_RECORD_BLOCKS);
+
+    memset(journal, 0, sizeof(Journal));
+    journal->blocks = calloc(capacity, sizeof(uint32_t));
+    journal->images = malloc(capacity*sizeof(Block));
+    journal->freed  = bitmap_create(fs->meta_data.blocks, false);
+    journal->allocated = fs->checksums ? bitmap_create(fs->meta_data.blocks, false) : NULL;
+    if (!journal->blocks || !journal->images || !journal->freed || (fs->checksums && !journal->allocated)) {
+        free(journal->blocks);
+        free(journal->images);
+        if (journal->freed) bitmap_delete(journal->freed);
+        if (journal->allocated) bitmap_delete(journal->allocated);
+        memset(journal, 0, sizeof(Journal));
+        return false;
+    }
+
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&journal->handles, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    pthread_mutex_init(&journal->lock, NULL);
+
+    journal->capacity = capacity;
+    journal->sequence = sequence;
+    journal->window   = (uint64_t)(fs->options.commit_ms ? fs->options.commit_ms : FS_COMMIT_MS) * 1000000;
+    return true;
+}
+
+/**
+ * Commit running transaction and release journal.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ **/
+void    fs_journal_stop(FileSystem *fs) {
+    Journal *journal = &fs->journal;
+    if (!journal->capacity) return;
+
+    fs_journal_commit(fs);
+    pthread_rwlock_destroy(&journal->handles);
+    pthread_mutex_destroy(&journal->lock);
+    free(journal->blocks);
+    free(journal->images);
+    bitmap_delete(journal->freed);
+    if (journal->allocated) bitmap_delete(journal->allocated);
+    memset(journal, 0, sizeof(Journal));
+}
 
-        data_offset = 0;
-        data_block++;
+/**
+ * Begin metadata update, keeping journal commits out until fs_journal_end.
+ *
+ * Note: Take before any Inode lock.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ **/
+void    fs_journal_begin(FileSystem *fs) {
+    if (fs->journal.capacity) pthread_rwlock_rdlock(&fs->journal.handles);
+}
+
+/**
+ * End metadata update and commit running transaction once its group
+ * commit window has passed or it fills half of a journal record.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ **/
+void    fs_journal_end(FileSystem *fs) {
+    Journal *journal = &fs->journal;
+    if (!journal->capacity) return;
+    pthread_rwlock_unlock(&journal->handles);
+
+    pthread_mutex_lock(&journal->lock);
+    bool due = journal->count && (2*journal->count >= journal->capacity || stats_now() - journal->started >= journal->window);
+    pthread_mutex_unlock(&journal->lock);
+    if (due) {
+        fs_journal_commit(fs);
+    }
+}
 
-        nwrite += ncopy;
+/**
+ * Add latest contents of metadata block to running transaction (a full
+ * transaction is committed first, splitting any update in progress).
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       block       Home block of metadata.
+ * @param       data        Contents of block.
+ * @return      Whether or not the block joined the transaction.
+ **/
+bool    fs_journal_write(FileSystem *fs, size_t block, const char *data) {
+    Journal *journal = &fs->journal;
+    bool     success = true;
 
-        if ((length - nwrite) > BLOCK_SIZE) {
-            ncopy = BLOCK_SIZE;
+    pthread_mutex_lock(&journal->lock);
+    size_t slot = 0;
+    while (slot < journal->count && journal->blocks[slot] != block) slot++;
+    if (slot == journal->count) {
+        if (journal->count == journal->capacity && !fs_journal_flush(fs)) {
+            success = false;
         } else {
-            ncopy = length - nwrite;
+            slot = journal->count++;
+            journal->blocks[slot] = block;
+            if (slot == 0) journal->started = stats_now();
         }
+    }
+    if (success) {
+        memcpy(journal->images[slot].data, data, BLOCK_SIZE);
+    }
+    pthread_mutex_unlock(&journal->lock);
+    return success;
+}
+
+/**
+ * Copy block from running transaction.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       block       Block number to read.
+ * @param       data        Data buffer.
+ * @return      Whether or not the block is part of the running transaction.
+ **/
+bool    fs_journal_read(FileSystem *fs, size_t block, char *data) {
+    Journal *journal = &fs->journal;
+    bool     found   = false;
 
-        // updating inode in here?
-        if (offset + nwrite > blk.inodes[inode_i].size) {
-            blk.inodes[inode_i].size = offset + nwrite;
+    pthread_mutex_lock(&journal->lock);
+    for (size_t slot = 0; slot < journal->count && !found; slot++) {
+        if (journal->blocks[slot] == block) {
+            memcpy(data, journal->images[slot].data, BLOCK_SIZE);
+            found = true;
         }
+    }
+    pthread_mutex_unlock(&journal->lock);
+    return found;
+}
 
-        disk_write(fs->disk, block_num, blk.data);
+/**
+ * Drop blocks of a range from running transaction (they were released and
+ * now hold file data, which a later checkpoint must not overwrite).
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       start       First block of range.
+ * @param       count       Number of blocks in range.
+ **/
+void    fs_journal_revoke(FileSystem *fs, size_t start, size_t count) {
+    Journal *journal = &fs->journal;
+
+    pthread_mutex_lock(&journal->lock);
+    for (size_t slot = 0; slot < journal->count; slot++) {
+        if (journal->blocks[slot] < start || journal->blocks[slot] >= start + count) continue;
+        journal->count--;
+        journal->blocks[slot] = journal->blocks[journal->count];
+        memcpy(journal->images[slot].data, journal->images[journal->count].data, BLOCK_SIZE);
+        slot--;
     }
+    pthread_mutex_unlock(&journal->lock);
+}
 
-    // update inode size !!!!
-    //if (offset + nwrite > blk.inodes[inode_i].size) {
-    //    blk.inodes[inode_i].size = offset + nwrite;
-    //}
-    //disk_write(fs->disk, block_num, blk.data);
-    return nwrite;
+/**
+ * Commit running transaction once updates in progress have ended by doing
+ * the following:
+ *
+ *  1. Wait for updates in progress to end and write the transaction to the
+ *  journal.
+ *
+ *  2. Return the blocks released by the committed updates to the free block
+ *  bitmap (a transaction split when it filled up may hold half an update,
+ *  so only a commit between updates does).
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @return      Whether or not the transaction was committed (true if not
+ *              journaling).
+ **/
+bool    fs_journal_commit(FileSystem *fs) {
+    Journal *journal = &fs->journal;
+    if (!journal->capacity) return true;
 
+    pthread_rwlock_wrlock(&journal->handles);
+    pthread_mutex_lock(&journal->lock);
+    bool success = fs_journal_flush(fs);
+    pthread_mutex_unlock(&journal->lock);
+    if (success) {
+        pthread_mutex_lock(&fs->alloc_lock);
+        bitmap_set_bits(fs->free_blocks, journal->freed);
+        bitmap_clear_range(journal->freed, 0, journal->freed->bits);
+        pthread_mutex_unlock(&fs->alloc_lock);
+    }
+    pthread_rwlock_unlock(&journal->handles);
+    return success;
 }
 
-size_t find_free_block(FileSystem *fs) {
-    bool *free_blocks = fs->free_blocks;
-    for (int i = 0; i < fs->meta_data.blocks; i++) {
-        if (free_blocks[i]) {
-            free_blocks[i] = false;
-            return i;
-        }
+/**
+ * Commit running transaction if it released blocks, so a write that ran out
+ * of free blocks can retry with them.
+ *
+ * Note: Call outside of any metadata update.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @return      Whether or not released blocks were returned to the free
+ *              block bitmap.
+ **/
+bool    fs_journal_reclaim(FileSystem *fs) {
+    Journal *journal = &fs->journal;
+    if (!journal->capacity) return false;
+
+    pthread_mutex_lock(&fs->alloc_lock);
+    bool pending = bitmap_count(journal->freed) > 0;
+    pthread_mutex_unlock(&fs->alloc_lock);
+    return pending && fs_journal_commit(fs);
+}
+
+/**
+ * Write running transaction to the journal by doing the following:
+ *
+ *  1. Write back cached blocks, so file data and checkpoints of earlier
+ *  transactions reach the Disk before this record.
+ *
+ *  2. Write record header and block images to the journal half picked by
+ *  the sequence number (the other half holds the previous transaction).
+ *
+ *  3. Flush Disk once, making the transaction durable (blocks allocated
+ *  before it are copied on write from now on, see fs_block_pinned).
+ *
+ *  4. Checkpoint the images to their home blocks.
+ *
+ * Note: Caller must hold the journal lock.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @return      Whether or not the transaction was committed and checkpointed.
+ **/
+bool    fs_journal_flush(FileSystem *fs) {
+    Journal *journal = &fs->journal;
+    if (!journal->count) return true;
+    if (fs->cache && !cache_flush(fs->cache)) return false;
+
+    Block header = {{0}};
+    header.journal.magic    = JOURNAL_MAGIC;
+    header.journal.sequence = journal->sequence;
+    header.journal.count    = journal->count;
+    memcpy(header.journal.blocks, journal->blocks, journal->count*sizeof(uint32_t));
+    header.journal.checksum = fs_journal_checksum(&header.journal, journal->images->data);
+
+    size_t half  = fs->meta_data.journal_blocks / 2;
+    size_t first = fs_journal_first(&fs->meta_data) + (journal->sequence % 2)*half;
+    if (disk_write(fs->disk, first, header.data) == DISK_FAILURE) return false;
+    if (disk_write_range(fs->disk, first + 1, journal->count, journal->images->data) == DISK_FAILURE) return false;
+    if (!disk_flush(fs->disk)) return false;
+    journal->sequence++;
+    __atomic_add_fetch(&journal->commits, 1, __ATOMIC_RELAXED);
+
+    // the record may point to any block allocated so far, so none is overwritten in place
+    if (journal->allocated) {
+        pthread_mutex_lock(&fs->alloc_lock);
+        bitmap_clear_range(journal->allocated, 0, journal->allocated->bits);
+        pthread_mutex_unlock(&fs->alloc_lock);
     }
-    return 0;
+
+    // a failed checkpoint keeps the transaction so the next record repeats it
+    for (size_t slot = 0; slot < journal->count; slot++) {
+        if (fs_write_block(fs, journal->blocks[slot], journal->images[slot].data) == DISK_FAILURE) return false;
+    }
+    journal->count = 0;
+    return true;
 }
 
+/**
+ * Replay journal of unmounted Disk by doing the following:
+ *
+ *  1. Read the record header of both journal halves, newest first.
+ *
+ *  2. Write the block images of the newest record whose checksum matches
+ *  to their home blocks (older records were checkpointed before the newer
+ *  one was flushed), and flush the Disk.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       sb          Pointer to SuperBlock read from Disk.
+ * @param       sequence    Where to store sequence number of next transaction.
+ * @return      Whether or not the journal could be read and replayed.
+ **/
+bool    fs_journal_replay(Disk *disk, const SuperBlock *sb, uint32_t *sequence) {
+    size_t half     = sb->journal_blocks / 2;
+    size_t capacity = min(half - 1, (size_t)JOURNAL_RECORD_BLOCKS);
+    size_t first    = fs_journal_first(sb);
+    Block  headers[2];
+    bool   plausible[2];
 
+    *sequence = 0;
+    for (size_t h = 0; h < 2; h++) {
+        if (disk_read(disk, first + h*half, headers[h].data) == DISK_FAILURE) return false;
+        const JournalHeader *header = &headers[h].journal;
+        plausible[h] = header->magic == JOURNAL_MAGIC && header->count > 0 && header->count <= capacity;
+        if (plausible[h]) *sequence = max(*sequence, header->sequence + 1);
+    }
 
-void fs_initialize_free_block_bitmap(FileSystem *fs) { 
-    
-    bool *free_blocks = calloc(fs->meta_data.blocks, sizeof(bool));
-    for (int i = 0; i < fs->meta_data.blocks; i++) {
-        free_blocks[i] = true;
+    size_t order[2] = {0, 1};
+    if (plausible[1] && (!plausible[0] || headers[1].journal.sequence > headers[0].journal.sequence)) {
+        order[0] = 1;
+        order[1] = 0;
     }
-    fs->free_blocks = free_blocks;
-    fs->free_blocks[0] = false;
-
-    for (int inode_block = 1; inode_block <= fs->meta_data.inode_blocks; inode_block++) {
-        Block block;
-        if (disk_read(fs->disk,inode_block,block.data) == DISK_FAILURE) return;
-          // going through the inodes in a block
-        for (int inode = 0; inode < INODES_PER_BLOCK; inode++) {
-            if (block.inodes[inode].valid) { //what does valid even mean
-
-                // going through direct pointers in the inode
-                for (int dp = 0; dp < POINTERS_PER_INODE; dp++) {
-                    // if an inode is not 0, mark that data block as being not free
-                    if (block.inodes[inode].direct[dp] != 0) {
-                         free_blocks[block.inodes[inode].direct[dp]] = false;
-                    }
-                }
-                // if there is a valid indirect block
-                if (block.inodes[inode].indirect != 0) {
-                    free_blocks[block.inodes[inode].indirect] = false; // mark the indirect data block as not free
-                    Block indirect_block;
-
-                    // reading from the indirect pointer
-                    if (disk_read(fs->disk, block.inodes[inode].indirect, indirect_block.data) == DISK_FAILURE) return;
-
-                    // go through all the pointers in the block (separate block with all direct pointers)
-                    for (int p = 0; p < POINTERS_PER_BLOCK; p++) {
-                        //accessing all the indirect block pointers to things
-                        if (indirect_block.pointers[p] != 0) {
-                            free_blocks[indirect_block.pointers[p]] = false; // mark all the data blocks pointed to from the indirect one as not free
-                        }
-                    }
-                }
-            }
+
+    char *images = malloc(capacity*BLOCK_SIZE);
+    if (!images) return false;
+
+    bool success = true;
+    for (size_t o = 0; o < 2; o++) {
+        const JournalHeader *header = &headers[order[o]].journal;
+        if (!plausible[order[o]]) continue;
+        if (disk_read_range(disk, first + order[o]*half + 1, header->count, images) == DISK_FAILURE) {
+            success = false;
+            break;
         }
-        free_blocks[inode_block] = false;
+        if (fs_journal_checksum(header, images) != header->checksum) continue;
+
+        for (size_t i = 0; success && i < header->count; i++) {
+            success = header->blocks[i] < sb->blocks && disk_write(disk, header->blocks[i], images + i*BLOCK_SIZE) != DISK_FAILURE;
+        }
+        success = success && disk_flush(disk);
+        *sequence = header->sequence + 1;
+        break;
     }
+    free(images);
+    return success;
+}
+
+/**
+ * Return FNV-1a checksum of the header fields, block numbers and block
+ * images of a journal record.
+ *
+ * @param       header      Pointer to journal record header.
+ * @param       images      Block images of record (header->count blocks).
+ * @return      Checksum of record.
+ **/
+uint32_t fs_journal_checksum(const JournalHeader *header, const char *images) {
+    const unsigned char *parts[] = {
+        (const unsigned char *)header,
+        (const unsigned char *)header->blocks,
+        (const unsigned char *)images,
+    };
+    const size_t lengths[] = {
+        offsetof(JournalHeader, checksum),
+        header->count*sizeof(uint32_t),
+        header->count*BLOCK_SIZE,
+    };
+
+    uint32_t hash = 2166136261u;
+    for (size_t p = 0; p < 3; p++) {
+        for (size_t i = 0; i < lengths[p]; i++) {
+            hash = (hash ^ parts[p][i]) * 16777619u;
+        }
+    }
+    return hash;
+}
+
+/**
+ * Return number of data block pointers in the indirect block of an Inode
+ * (later formats keep the double and triple indirect pointers in its last
+ * slots).
+ *
+ * @param       sb          Pointer to SuperBlock of FileSystem.
+ * @return      Number of indirect data block pointers.
+ **/
+size_t  fs_indirect_pointers(const SuperBlock *sb) {
+    return (sb->magic_number == MAGIC_NUMBER_V1) ? POINTERS_PER_BLOCK : INDIRECT_DOUBLE;
+}
+
+/**
+ * Return number of blocks an Inode can map (limited by the Inode size, and
+ * for pointer Inodes by the pointer trees).
+ *
+ * @param       sb          Pointer to SuperBlock of FileSystem.
+ * @return      Maximum number of blocks in a file.
+ **/
+size_t  fs_max_blocks(const SuperBlock *sb) {
+    size_t blocks = POINTERS_PER_INODE + fs_indirect_pointers(sb);
+    if (sb->features & FS_FEATURE_EXTENTS) {
+        blocks = SIZE_MAX;
+    } else if (sb->magic_number != MAGIC_NUMBER_V1) {
+        blocks += (size_t)POINTERS_PER_BLOCK*POINTERS_PER_BLOCK*(1 + POINTERS_PER_BLOCK);
+    }
+    return min(blocks, ((size_t)FS_MAX_FILE_SIZE + BLOCK_SIZE - 1) / BLOCK_SIZE);
+}
+
+/**
+ * Return number of Inodes per Inode block (inline data Inodes use larger
+ * records).
+ *
+ * @param       sb          Pointer to SuperBlock of FileSystem.
+ * @return      Number of Inodes in each Inode block.
+ **/
+size_t  fs_inodes_per_block(const SuperBlock *sb) {
+    return (sb->features & FS_FEATURE_INLINE) ? INLINE_INODES_PER_BLOCK : INODES_PER_BLOCK;
+}
+
+/**
+ * Return Inode held in the specified slot of an Inode block.
+ *
+ * @param       sb          Pointer to SuperBlock of FileSystem.
+ * @param       block       Pointer to Inode block.
+ * @param       slot        Index of Inode within block.
+ * @return      Pointer to Inode.
+ **/
+const Inode *fs_block_inode(const SuperBlock *sb, const Block *block, size_t slot) {
+    return (sb->features & FS_FEATURE_INLINE) ? &block->inline_inodes[slot].inode : &block->inodes[slot];
+}
+
+/**
+ * Return whether Inode keeps its data in its Inode record (every file that
+ * fits does once inline data is enabled).
+ *
+ * @param       sb          Pointer to SuperBlock of FileSystem.
+ * @param       node        Pointer to valid Inode.
+ * @return      Whether or not file data is inline.
+ **/
+bool    fs_inline(const SuperBlock *sb, const Inode *node) {
+    return (sb->features & FS_FEATURE_INLINE) && node->size <= INLINE_DATA_SIZE;
+}
+
+/**
+ * Return whether file data of Inode is stored in compressed clusters.
+ *
+ * @param       node        Pointer to valid Inode.
+ * @return      Whether or not INODE_COMPRESSED is set.
+ **/
+bool    fs_compressed(const Inode *node) {
+    return (node->valid & INODE_COMPRESSED) != 0;
+}
+
+/**
+ * Return number of blocks holding the stored free block bitmap.
+ *
+ * @param       sb          Pointer to SuperBlock of FileSystem.
+ * @return      Number of bitmap blocks (0 if the bitmap is not stored).
+ **/
+size_t  fs_bitmap_blocks(const SuperBlock *sb) {
+    return (sb->features & FS_FEATURE_BITMAP) ? sb->bitmap_blocks : 0;
+}
+
+/**
+ * Return first block of the stored free block bitmap (right after the Inode
+ * table).
+ *
+ * @param       sb          Pointer to SuperBlock of FileSystem.
+ * @return      Block number of first bitmap block.
+ **/
+size_t  fs_bitmap_first(const SuperBlock *sb) {
+    return (size_t)sb->inode_blocks + 1;
 }
-/*
-bool fs_load_inode(FileSystem *fs, size_t inode_number, Inode *node) {   
-    size_t block_num = inode_number / INODES_PER_BLOCK + 1;
-    size_t inode_i = inode_number % INODES_PER_BLOCK;
-    Block blk;
 
-    disk_read(fs->disk, block_num, blk.data);
+/**
+ * Return first block of the journal (right after the stored free block
+ * bitmap).
+ *
+ * @param       sb          Pointer to SuperBlock of FileSystem.
+ * @return      Block number of first journal block.
+ **/
+size_t  fs_journal_first(const SuperBlock *sb) {
+    return fs_bitmap_first(sb) + fs_bitmap_blocks(sb);
+}
 
-}*/
+/**
+ * Return number of blocks reserved for the block checksum table.
+ *
+ * @param       sb          Pointer to SuperBlock of FileSystem.
+ * @return      Number of checksum blocks (0 if checksums are not stored).
+ **/
+size_t  fs_checksum_blocks(const SuperBlock *sb) {
+    return (sb->features & FS_FEATURE_CHECKSUM) ? sb->checksum_blocks : 0;
+}
 
-/*bool fs_save_inode(FileSystem *fs, size_t inode_number, Inode *node) {
-}*/
+/**
+ * Return first block of the block checksum table (right after the journal).
+ *
+ * @param       sb          Pointer to SuperBlock of FileSystem.
+ * @return      Block number of first checksum block.
+ **/
+size_t  fs_checksum_first(const SuperBlock *sb) {
+    return fs_journal_first(sb) + ((sb->features & FS_FEATURE_JOURNAL) ? sb->journal_blocks : 0);
+}
 
+/**
+ * Return first block available for file data (every block before it holds
+ * file system meta data).
+ *
+ * @param       sb          Pointer to SuperBlock of FileSystem.
+ * @return      Block number of first data block.
+ **/
+size_t  fs_data_first(const SuperBlock *sb) {
+    return fs_checksum_first(sb) + fs_checksum_blocks(sb);
+}
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
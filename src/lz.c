@@ -0,0 +1,236 @@
+/* lz.c: SimpleFS LZ4 block codec */
+
+#include "sfs/lz.h"
+#include "sfs/utils.h"
+
+#include <string.h>
+
+/* Internal Prototyes */
+
+uint32_t lz_read32(const uint8_t *p);
+uint32_t lz_hash(uint32_t sequence);
+uint8_t *lz_length(uint8_t *op, size_t length);
+uint8_t *lz_sequence(uint8_t *op, uint8_t *oend, const uint8_t *literals, size_t nliterals, size_t offset, size_t match);
+
+/* External Functions */
+
+/**
+ * Return most bytes lz_compress may produce for input of specified length
+ * (incompressible input grows by one length byte per 255 literals).
+ *
+ * @param       length      Number of input bytes.
+ *
+ * @return      Capacity that always fits compressed output.
+ **/
+size_t  lz_bound(size_t length) {
+    return length + length / 255 + 16;
+}
+
+/**
+ * Compress input into the LZ4 block format by doing the following:
+ *
+ *  1. Hash every 4-byte sequence into a table of its latest position, and
+ *  take the previous position as a match candidate if it holds the same
+ *  bytes and is at most LZ_MAX_OFFSET back.
+ *
+ *  2. Extend each match forward and emit the literals before it together
+ *  with its offset and length as one sequence.
+ *
+ *  3. Emit the remaining input as a final sequence of literals (matches end
+ *  LZ_LAST_LITERALS bytes before the end, as the format requires).
+ *
+ * @param       source      Input bytes.
+ * @param       length      Number of input bytes.
+ * @param       dest        Buffer for compressed bytes.
+ * @param       capacity    Size of dest.
+ *
+ * @return      Number of compressed bytes (0 if they do not fit capacity).
+ **/
+size_t  lz_compress(const char *source, size_t length, char *dest, size_t capacity) {
+    const uint8_t *src    = (const uint8_t *)source;
+    const uint8_t *end    = src + length;
+    const uint8_t *anchor = src;
+    const uint8_t *ip     = src;
+    uint8_t       *op     = (uint8_t *)dest;
+    uint8_t       *oend   = op + capacity;
+    uint32_t       table[1 << LZ_HASH_LOG] = {0};
+
+    if (length > LZ_MATCH_LIMIT) {
+        const uint8_t *mflimit = end - LZ_MATCH_LIMIT;
+        const uint8_t *mlimit  = end - LZ_LAST_LITERALS;
+        while (ip < mflimit) {
+            uint32_t       sequence = lz_read32(ip);
+            uint32_t       h        = lz_hash(sequence);
+            const uint8_t *ref      = src + table[h];
+            table[h] = ip - src;
+
+            if (ref >= ip || ip - ref > LZ_MAX_OFFSET || lz_read32(ref) != sequence) {
+                ip++;
+                continue;
+            }
+
+            size_t match = LZ_MIN_MATCH;
+            while (ip + match < mlimit && ref[match] == ip[match]) {
+                match++;
+            }
+            op = lz_sequence(op, oend, anchor, ip - anchor, ip - ref, match);
+            if (!op) return 0;
+            ip    += match;
+            anchor = ip;
+        }
+    }
+
+    op = lz_sequence(op, oend, anchor, end - anchor, 0, 0);
+    return op ? op - (uint8_t *)dest : 0;
+}
+
+/**
+ * Decompress LZ4 block format input by doing the following:
+ *
+ *  1. Read the token of each sequence and copy its literals.
+ *
+ *  2. Copy the match of the sequence from the output already produced
+ *  (byte by byte when it overlaps itself), unless the input ends after the
+ *  literals.
+ *
+ * Note: Every length and offset is checked against both buffers, so damaged
+ * input fails instead of reading or writing out of bounds.
+ *
+ * @param       source      Compressed bytes.
+ * @param       length      Number of compressed bytes.
+ * @param       dest        Buffer for decompressed bytes.
+ * @param       capacity    Size of dest.
+ *
+ * @return      Number of decompressed bytes (-1 if input is malformed or
+ *              does not fit capacity).
+ **/
+ssize_t lz_decompress(const char *source, size_t length, char *dest, size_t capacity) {
+    const uint8_t *ip   = (const uint8_t *)source;
+    const uint8_t *iend = ip + length;
+    uint8_t       *op   = (uint8_t *)dest;
+    uint8_t       *oend = op + capacity;
+
+    while (ip < iend) {
+        uint8_t token     = *ip++;
+        size_t  nliterals = token >> 4;
+        if (nliterals == 15) {
+            uint8_t byte;
+            do {
+                if (ip >= iend) return -1;
+                byte       = *ip++;
+                nliterals += byte;
+            } while (byte == 255);
+        }
+        if (nliterals > (size_t)(iend - ip) || nliterals > (size_t)(oend - op)) return -1;
+        memcpy(op, ip, nliterals);
+        ip += nliterals;
+        op += nliterals;
+        if (ip == iend) break;
+
+        if (iend - ip < 2) return -1;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - (uint8_t *)dest)) return -1;
+
+        size_t match = token & 15;
+        if (match == 15) {
+            uint8_t byte;
+            do {
+                if (ip >= iend) return -1;
+                byte   = *ip++;
+                match += byte;
+            } while (byte == 255);
+        }
+        match += LZ_MIN_MATCH;
+        if (match > (size_t)(oend - op)) return -1;
+
+        const uint8_t *ref = op - offset;
+        if (offset >= match) {
+            memcpy(op, ref, match);
+            op += match;
+        } else {
+            for (size_t m = 0; m < match; m++) {
+                *op++ = *ref++;
+            }
+        }
+    }
+    return op - (uint8_t *)dest;
+}
+
+/* Internal Functions */
+
+/**
+ * Read 4 bytes from any alignment.
+ *
+ * @param       p           Pointer to bytes.
+ *
+ * @return      Bytes as a native endian word.
+ **/
+uint32_t lz_read32(const uint8_t *p) {
+    uint32_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+/**
+ * Hash 4-byte sequence into a match finder slot (multiplicative hashing).
+ *
+ * @param       sequence    Sequence read with lz_read32.
+ *
+ * @return      Slot within table of 2^LZ_HASH_LOG entries.
+ **/
+uint32_t lz_hash(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - LZ_HASH_LOG);
+}
+
+/**
+ * Write the part of a length that does not fit its 4-bit token field.
+ *
+ * @param       op          Where to write length bytes.
+ * @param       length      Length minus 15.
+ *
+ * @return      Pointer past length bytes written.
+ **/
+uint8_t *lz_length(uint8_t *op, size_t length) {
+    for (; length >= 255; length -= 255) {
+        *op++ = 255;
+    }
+    *op++ = length;
+    return op;
+}
+
+/**
+ * Emit one sequence: token, literals and (unless match is 0) the offset and
+ * length of the match that follows them.
+ *
+ * @param       op          Where to write sequence.
+ * @param       oend        End of output buffer.
+ * @param       literals    Literal bytes.
+ * @param       nliterals   Number of literal bytes.
+ * @param       offset      Distance back to match.
+ * @param       match       Length of match (at least LZ_MIN_MATCH, or 0
+ *                          for the final sequence).
+ *
+ * @return      Pointer past sequence written (NULL if it does not fit).
+ **/
+uint8_t *lz_sequence(uint8_t *op, uint8_t *oend, const uint8_t *literals, size_t nliterals, size_t offset, size_t match) {
+    size_t extra = match ? match - LZ_MIN_MATCH : 0;
+    size_t need  = 1 + (nliterals >= 15 ? nliterals / 255 + 1 : 0) + nliterals +
+                   (match ? 2 + (extra >= 15 ? extra / 255 + 1 : 0) : 0);
+    if (need > (size_t)(oend - op)) return NULL;
+
+    uint8_t *token = op++;
+    *token = (min(nliterals, 15) << 4) | (match ? min(extra, 15) : 0);
+    if (nliterals >= 15) op = lz_length(op, nliterals - 15);
+    memcpy(op, literals, nliterals);
+    op += nliterals;
+
+    if (match) {
+        *op++ = offset & 0xff;
+        *op++ = offset >> 8;
+        if (extra >= 15) op = lz_length(op, extra - 15);
+    }
+    return op;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -2,16 +2,76 @@
 
 #include "sfs/disk.h"
 #include "sfs/fs.h"
+#include "sfs/utils.h"
 
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
 /* Macros */
 
 #define streq(a, b)	(strcmp((a), (b)) == 0)
 
+/* Constants */
+
+#define COPY_WORKERS    (4)                     /* Default pipelines of copyin-batch and copyout-batch */
+#define COPY_CHUNK      (FS_IOV_BLOCKS*BLOCK_SIZE)  /* Bytes moved per pipeline buffer */
+
+/* Structures */
+
+typedef struct CopyOut CopyOut;
+struct CopyOut {
+    int     fd;         /* Output file descriptor */
+    size_t  bytes;      /* Number of bytes written */
+    bool    failed;     /* Whether or not a write failed */
+};
+
+typedef struct CopyJob CopyJob;
+struct CopyJob {
+    size_t  inode_number;   /* Inode copied to or from */
+    char   *path;           /* Host file copied from or to */
+    size_t  bytes;          /* Number of bytes copied */
+    bool    failed;         /* Whether or not copy failed */
+};
+
+typedef struct CopySlot CopySlot;
+struct CopySlot {
+    CopyJob *job;           /* Job chunk belongs to (NULL once producer ran out of jobs) */
+    char    *data;          /* Chunk buffer (COPY_CHUNK bytes) */
+    size_t   length;        /* Number of bytes in chunk */
+    bool     last;          /* Whether or not chunk ends job */
+    bool     failed;        /* Whether or not reading chunk failed */
+    bool     full;          /* Whether or not chunk waits for consumer */
+};
+
+typedef struct CopyBatch CopyBatch;
+struct CopyBatch {
+    FileSystem *fs;         /* FileSystem copied to or from */
+    bool        in;         /* Whether copying into image (copyin-batch) or out of it */
+    CopyJob    *jobs;       /* Files to copy */
+    size_t      njobs;      /* Number of files to copy */
+    size_t      next;       /* Next job claimed by a producer */
+};
+
+typedef struct CopyPipe CopyPipe;
+struct CopyPipe {
+    CopyBatch  *batch;      /* Batch pipeline works on */
+    CopySlot    slots[2];   /* Chunk buffers passed between producer and consumer */
+    pthread_mutex_t lock;   /* Protects full flags of slots */
+    pthread_cond_t  changed;    /* Signalled when a slot is filled or drained */
+    pthread_t   producer;   /* Thread reading source files into slots */
+    pthread_t   consumer;   /* Thread writing slots to destination files */
+};
+
 /* Command Prototyes */
 
 void do_debug(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
@@ -20,25 +80,60 @@ void do_mount(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_create(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_remove(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_stat(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_clone(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_compress(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_copyout(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_cat(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_copyin(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_copyin_batch(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_copyout_batch(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_cache(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_aio(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_sync(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_defrag(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_scrub(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_stats(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_help(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 
 /* Utility Prototypes */
 
 bool copyout(FileSystem *fs, size_t inode_number, const char *path);
+bool copyout_extents(const struct iovec *iov, int iovcnt, size_t offset, void *ctx);
 bool copyin(FileSystem *fs, const char *path, size_t inode_number);
+void copy_batch_command(FileSystem *fs, int args, char *arg1, char *arg2, bool in);
+bool copy_manifest(const char *path, CopyJob **jobs, size_t *njobs);
+void copy_free(CopyJob *jobs, size_t njobs);
+bool copy_batch(FileSystem *fs, CopyJob *jobs, size_t njobs, size_t workers, bool in);
+CopyJob  *copy_claim(CopyBatch *batch);
+CopySlot *copy_acquire(CopyPipe *pipeline, size_t slot, bool full);
+void copy_release(CopyPipe *pipeline, CopySlot *slot, bool full);
+void *copy_produce(void *arg);
+void *copy_consume(void *arg);
+ssize_t copy_read(int fd, char *data, size_t length);
+ssize_t copy_write(int fd, const char *data, size_t length);
+void print_op_stats(const char *name, const OpStats *stats);
+void print_defrag(size_t inode_number, size_t before, size_t after, void *ctx);
+void print_corrupt(size_t block, void *ctx);
 
 /* Main Execution */
 
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-	fprintf(stderr, "Usage: %s <diskfile> <nblocks>\n", argv[0]);
+    if (argc != 3 && argc != 4) {
+	fprintf(stderr, "Usage: %s <diskfile> <nblocks> [fd|mmap]\n", argv[0]);
 	return EXIT_FAILURE;
     }
 
-    Disk *disk = disk_open(argv[1], atoi(argv[2]));
+    DiskMode mode = DISK_FD;
+    if (argc == 4) {
+        if (streq(argv[3], "mmap")) {
+            mode = DISK_MMAP;
+        } else if (!streq(argv[3], "fd")) {
+	    fprintf(stderr, "Unknown disk mode: %s\n", argv[3]);
+	    return EXIT_FAILURE;
+        }
+    }
+
+    Disk *disk = disk_open_mode(argv[1], atoi(argv[2]), mode);
     if (!disk) {
     	return EXIT_FAILURE;
     }
@@ -71,12 +166,32 @@ int main(int argc, char *argv[]) {
 	    do_remove(disk, &fs, args, arg1, arg2);
         } else if (streq(cmd, "stat")) {
 	    do_stat(disk, &fs, args, arg1, arg2);
+        } else if (streq(cmd, "clone")) {
+	    do_clone(disk, &fs, args, arg1, arg2);
+        } else if (streq(cmd, "compress")) {
+	    do_compress(disk, &fs, args, arg1, arg2);
         } else if (streq(cmd, "copyout")) {
 	    do_copyout(disk, &fs, args, arg1, arg2);
         } else if (streq(cmd, "cat")) {
 	    do_cat(disk, &fs, args, arg1, arg2);
         } else if (streq(cmd, "copyin")) {
 	    do_copyin(disk, &fs, args, arg1, arg2);
+        } else if (streq(cmd, "copyin-batch")) {
+	    do_copyin_batch(disk, &fs, args, arg1, arg2);
+        } else if (streq(cmd, "copyout-batch")) {
+	    do_copyout_batch(disk, &fs, args, arg1, arg2);
+        } else if (streq(cmd, "cache")) {
+	    do_cache(disk, &fs, args, arg1, arg2);
+        } else if (streq(cmd, "aio")) {
+	    do_aio(disk, &fs, args, arg1, arg2);
+        } else if (streq(cmd, "sync")) {
+	    do_sync(disk, &fs, args, arg1, arg2);
+        } else if (streq(cmd, "defrag")) {
+	    do_defrag(disk, &fs, args, arg1, arg2);
+        } else if (streq(cmd, "scrub")) {
+	    do_scrub(disk, &fs, args, arg1, arg2);
+        } else if (streq(cmd, "stats")) {
+	    do_stats(disk, &fs, args, arg1, arg2);
         } else if (streq(cmd, "help")) {
 	    do_help(disk, &fs, args, arg1, arg2);
 	} else if (streq(cmd, "exit") || streq(cmd, "quit")) {
@@ -90,6 +205,8 @@ int main(int argc, char *argv[]) {
     fs_unmount(&fs);
     assert(fs.disk == NULL);
     assert(fs.free_blocks == NULL);
+    assert(fs.cache == NULL);
+    assert(fs.inode_table == NULL);
     disk_close(disk);
     return EXIT_SUCCESS;
 }
@@ -101,16 +218,51 @@ void do_debug(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
 	printf("Usage: debug\n");
 	return;
     }
+    if (fs->disk) {
+        fs_sync(fs);
+    }
     fs_debug(disk);
 }
 
 void do_format(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
-    if (args != 1) {
-	printf("Usage: format\n");
+    FormatOptions options = {.mode = FORMAT_FAST};
+    bool          valid   = args >= 1 && args <= 3;
+    for (int a = 1; valid && a < args; a++) {
+        char *arg = (a == 1) ? arg1 : arg2;
+        if (a == 1 && streq(arg, "fast")) {
+            options.mode = FORMAT_FAST;
+        } else if (a == 1 && streq(arg, "secure")) {
+            options.mode = FORMAT_SECURE;
+        } else if (a == args - 1) {
+            for (char *feature = strtok(arg, ","); valid && feature; feature = strtok(NULL, ",")) {
+                if (streq(feature, "extents")) {
+                    options.features |= FS_FEATURE_EXTENTS;
+                } else if (streq(feature, "inline")) {
+                    options.features |= FS_FEATURE_INLINE;
+                } else if (streq(feature, "journal")) {
+                    options.features |= FS_FEATURE_JOURNAL;
+                } else if (streq(feature, "bitmap")) {
+                    options.features |= FS_FEATURE_BITMAP;
+                } else if (streq(feature, "clone")) {
+                    options.features |= FS_FEATURE_CLONE;
+                } else if (streq(feature, "compress")) {
+                    options.features |= FS_FEATURE_COMPRESS;
+                } else if (streq(feature, "checksum")) {
+                    options.features |= FS_FEATURE_CHECKSUM;
+                } else {
+                    valid = false;
+                }
+            }
+        } else {
+            valid = false;
+        }
+    }
+    if (!valid) {
+	printf("Usage: format [fast|secure] [extents,inline,journal,bitmap,clone,compress,checksum]\n");
 	return;
     }
 
-    if (fs_format(fs, disk)) {
+    if (fs_format_options(fs, disk, &options)) {
         printf("disk formatted.\n");
     } else {
         printf("format failed!\n");
@@ -118,12 +270,34 @@ void do_format(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
 }
 
 void do_mount(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
-    if (args != 1) {
-	printf("Usage: mount\n");
+    MountOptions options = {.threads = 1};
+    bool         valid   = args >= 1 && args <= 3;
+    for (int a = 1; valid && a < args; a++) {
+        char *arg = (a == 1) ? arg1 : arg2;
+        if (a == args - 1 && !isdigit(arg[0])) {
+            for (char *flag = strtok(arg, ","); valid && flag; flag = strtok(NULL, ",")) {
+                if (streq(flag, "deferred")) {
+                    options.deferred_reclaim = true;
+                } else if (streq(flag, "noverify")) {
+                    options.skip_verify = true;
+                } else {
+                    valid = false;
+                }
+            }
+        } else if (a == 1) {
+            options.threads = strtoul(arg, NULL, 10);
+        } else {
+            valid = false;
+        }
+    }
+    if (!valid) {
+	printf("Usage: mount [threads] [deferred,noverify]\n");
 	return;
     }
 
-    if (fs_mount(fs, disk)) {
+    if (fs_mount_options(fs, disk, &options)) {
+        fs_set_cache(fs, CACHE_DEFAULT_BLOCKS);
+        fs_set_aio(fs, AIO_AUTO, AIO_DEFAULT_DEPTH);
         printf("disk mounted.\n");
     } else {
         printf("mount failed!\n");
@@ -165,11 +339,42 @@ void do_stat(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
     }
 
     ssize_t inode_number = atoi(arg1);
-    ssize_t bytes        = fs_stat(fs, inode_number);
-    if (bytes >= 0) {
-        printf("inode %ld has size %ld bytes.\n", inode_number, bytes);
-    } else {
+    FsInfo  info;
+    if (!fs_stat_info(fs, inode_number, &info)) {
         printf("stat failed!\n");
+    } else if (info.compressed) {
+        printf("inode %ld has size %lu bytes (%lu bytes on disk).\n", inode_number, info.size, info.physical);
+    } else {
+        printf("inode %ld has size %lu bytes.\n", inode_number, info.size);
+    }
+}
+
+void do_clone(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    if (args != 2) {
+        printf("Usage: clone <inode>\n");
+        return;
+    }
+
+    ssize_t inode_number = atoi(arg1);
+    ssize_t clone_number = fs_clone(fs, inode_number);
+    if (clone_number >= 0) {
+        printf("cloned inode %ld to inode %ld.\n", inode_number, clone_number);
+    } else {
+        printf("clone failed!\n");
+    }
+}
+
+void do_compress(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    if (args != 2) {
+        printf("Usage: compress <inode>\n");
+        return;
+    }
+
+    ssize_t inode_number = atoi(arg1);
+    if (fs_set_compressed(fs, inode_number, true)) {
+        printf("inode %ld compressed.\n", inode_number);
+    } else {
+        printf("compress failed!\n");
     }
 }
 
@@ -206,17 +411,164 @@ void do_copyin(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
     }
 }
 
+void do_copyin_batch(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    copy_batch_command(fs, args, arg1, arg2, true);
+}
+
+void do_copyout_batch(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    copy_batch_command(fs, args, arg1, arg2, false);
+}
+
+void do_cache(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    if (args != 1 && args != 2) {
+        printf("Usage: cache [blocks]\n");
+        return;
+    }
+
+    if (args == 2) {
+        if (!fs_set_cache(fs, atoi(arg1))) {
+            printf("cache failed!\n");
+            return;
+        }
+    }
+
+    if (fs->cache) {
+        size_t lookups = fs->cache->hits + fs->cache->misses;
+        printf("cache has %lu blocks, %lu hits, %lu misses (%.1f%% hit rate).\n",
+            fs->cache->capacity, fs->cache->hits, fs->cache->misses,
+            lookups ? 100.0 * fs->cache->hits / lookups : 0.0);
+    } else {
+        printf("cache disabled.\n");
+    }
+}
+
+void do_aio(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    if (args != 1 && args != 2) {
+        printf("Usage: aio [uring|threads|off]\n");
+        return;
+    }
+
+    if (args == 2) {
+        bool success;
+        if (streq(arg1, "uring")) {
+            success = fs_set_aio(fs, AIO_URING, AIO_DEFAULT_DEPTH);
+        } else if (streq(arg1, "threads")) {
+            success = fs_set_aio(fs, AIO_THREADS, AIO_DEFAULT_DEPTH);
+        } else if (streq(arg1, "off")) {
+            success = fs_set_aio(fs, AIO_AUTO, 0);
+        } else {
+            printf("Usage: aio [uring|threads|off]\n");
+            return;
+        }
+
+        if (!success) {
+            printf("aio failed!\n");
+            return;
+        }
+    }
+
+    if (fs->aio) {
+        printf("aio uses %s with depth %lu.\n",
+            fs->aio->backend == AIO_URING ? "io_uring" : "threads", fs->aio->depth);
+    } else {
+        printf("aio disabled.\n");
+    }
+}
+
+void do_sync(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    if (args != 1) {
+        printf("Usage: sync\n");
+        return;
+    }
+
+    if (fs_sync(fs)) {
+        printf("disk synced.\n");
+    } else {
+        printf("sync failed!\n");
+    }
+}
+
+void do_defrag(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    if (args != 1 && args != 2) {
+        printf("Usage: defrag [blocks]\n");
+        return;
+    }
+
+    size_t  budget = (args == 2) ? (size_t)atoi(arg1) : SIZE_MAX;
+    ssize_t moved  = fs_defrag(fs, budget, print_defrag, NULL);
+    if (moved >= 0) {
+        printf("defrag relocated %ld blocks.\n", moved);
+    } else {
+        printf("defrag failed!\n");
+    }
+}
+
+void do_scrub(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    if (args != 1 && args != 2) {
+        printf("Usage: scrub [threads]\n");
+        return;
+    }
+
+    size_t  threads  = (args == 2) ? (size_t)atoi(arg1) : 0;
+    size_t  corrupt  = 0;
+    ssize_t verified = fs_scrub(fs, threads, print_corrupt, &corrupt);
+    if (verified >= 0) {
+        printf("scrub verified %ld blocks, found %lu corrupt.\n", verified, corrupt);
+    } else {
+        printf("scrub failed!\n");
+    }
+}
+
+void do_stats(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    if (args != 1) {
+        printf("Usage: stats\n");
+        return;
+    }
+
+    if (!fs->disk) {
+        printf("stats failed!\n");
+        return;
+    }
+
+    FsStats stats = fs_stats(fs);
+    printf("%-12s %10s %8s %14s %10s %10s %10s\n",
+        "operation", "calls", "errors", "bytes", "avg(us)", "p50(us)", "p99(us)");
+    print_op_stats("mount",      &stats.mount);
+    print_op_stats("create",     &stats.create);
+    print_op_stats("remove",     &stats.remove);
+    print_op_stats("stat",       &stats.stat);
+    print_op_stats("read",       &stats.read);
+    print_op_stats("write",      &stats.write);
+    print_op_stats("clone",      &stats.clone);
+    print_op_stats("disk_read",  &stats.disk_read);
+    print_op_stats("disk_write", &stats.disk_write);
+    printf("cache has %lu hits, %lu misses.\n", stats.cache_hits, stats.cache_misses);
+    printf("allocator made %lu calls, searched %lu bitmap words.\n", stats.alloc_calls, stats.alloc_words);
+    printf("journal committed %lu transactions, disk flushed %lu times.\n", stats.commits, stats.disk_flushes);
+    printf("checksums did not match for %lu blocks.\n", stats.checksum_errors);
+}
+
 void do_help(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
     printf("Commands are:\n");
-    printf("    format\n");
-    printf("    mount\n");
+    printf("    format  [fast|secure] [extents,inline,journal,bitmap,clone,compress,checksum]\n");
+    printf("    mount   [threads] [deferred,noverify]\n");
     printf("    debug\n");
     printf("    create\n");
     printf("    remove  <inode>\n");
     printf("    cat     <inode>\n");
     printf("    stat    <inode>\n");
+    printf("    clone   <inode>\n");
+    printf("    compress <inode>\n");
     printf("    copyin  <file> <inode>\n");
     printf("    copyout <inode> <file>\n");
+    printf("    copyin-batch  <manifest> [threads]\n");
+    printf("    copyout-batch <manifest> [threads]\n");
+    printf("    cache   [blocks]\n");
+    printf("    aio     [uring|threads|off]\n");
+    printf("    sync\n");
+    printf("    defrag  [blocks]\n");
+    printf("    scrub   [threads]\n");
+    printf("    stats\n");
     printf("    help\n");
     printf("    quit\n");
     printf("    exit\n");
@@ -231,49 +583,401 @@ bool copyin(FileSystem *fs, const char *path, size_t inode_number) {
         return false;
     }
 
-    char buffer[4*BUFSIZ] = {0};
-    size_t offset = 0;
+    /* A handle keeps the Inode and its pointer blocks between writes */
+    FsHandle *handle = fs_open(fs, inode_number);
+    if (!handle) {
+        fprintf(stderr, "Unable to open inode %lu\n", inode_number);
+        fclose(stream);
+        return false;
+    }
+
+    /* Large writes let fs_write record metadata once per many data blocks */
+    char  *buffer = malloc(FS_IOV_BLOCKS*BLOCK_SIZE);
+    if (!buffer) {
+        fprintf(stderr, "Unable to allocate buffer: %s\n", strerror(errno));
+        fs_close(handle);
+        fclose(stream);
+        return false;
+    }
+
     while (true) {
-        ssize_t result = fread(buffer, 1, sizeof(buffer), stream);
+        ssize_t result = fread(buffer, 1, FS_IOV_BLOCKS*BLOCK_SIZE, stream);
         if (result <= 0) {
             break;
         }
-        ssize_t actual = fs_write(fs, inode_number, buffer, result, offset);
+        ssize_t actual = fs_hwrite(handle, buffer, result);
         if (actual < 0) {
-            fprintf(stderr, "fs_write returned invalid result %ld\n", actual);
+            fprintf(stderr, "fs_hwrite returned invalid result %ld\n", actual);
             break;
         }
-        offset += actual;
         if (actual != result) {
-            fprintf(stderr, "fs_write only wrote %ld bytes, not %ld bytes\n", actual, result);
+            fprintf(stderr, "fs_hwrite only wrote %ld bytes, not %ld bytes\n", actual, result);
             break;
         }
     }
-    printf("%lu bytes copied\n", offset);
+    printf("%lu bytes copied\n", handle->offset);
+    free(buffer);
+    fs_close(handle);
     fclose(stream);
     return true;
 }
 
 bool copyout(FileSystem *fs, size_t inode_number, const char *path) {
-    FILE *stream = fopen(path, "w");
+    /* Output is written to the descriptor directly, so anything already
+     * printed must go first */
+    fflush(stdout);
+
+    int fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    /* Copy in chunks so writers are not locked out while output drains; the
+     * handle keeps pointer blocks between chunks */
+    CopyOut   copy   = {.fd = fd};
+    FsHandle *handle = fs_open(fs, inode_number);
+    ssize_t   result = 0;
+    while (handle && (result = fs_pread_iter(handle, copy.bytes, FS_IOV_BLOCKS*BLOCK_SIZE, copyout_extents, &copy)) > 0);
+    fs_close(handle);
+    close(fd);
+    if (copy.failed) {
+        fprintf(stderr, "Unable to write %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    /* Invalid Inodes copy nothing, but a read error (e.g. a checksum
+     * mismatch) must not pass for the end of the file */
+    if (result < 0) {
+        fprintf(stderr, "Unable to read inode %lu\n", inode_number);
+        return false;
+    }
+    printf("%lu bytes copied\n", copy.bytes);
+    return true;
+}
+
+bool copyout_extents(const struct iovec *iov, int iovcnt, size_t offset, void *ctx) {
+    CopyOut *copy = ctx;
+
+    struct iovec pending[FS_ITER_EXTENTS];
+    memcpy(pending, iov, iovcnt*sizeof(struct iovec));
+
+    struct iovec *cursor = pending;
+    while (iovcnt > 0) {
+        ssize_t written = writev(copy->fd, cursor, iovcnt);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            copy->failed = true;
+            return false;
+        }
+
+        copy->bytes += written;
+        while (iovcnt > 0 && (size_t)written >= cursor->iov_len) {
+            written -= cursor->iov_len;
+            cursor++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            cursor->iov_base  = (char *)cursor->iov_base + written;
+            cursor->iov_len  -= written;
+        }
+    }
+    return true;
+}
+
+void copy_batch_command(FileSystem *fs, int args, char *arg1, char *arg2, bool in) {
+    const char *name    = in ? "copyin-batch" : "copyout-batch";
+    size_t      workers = (args == 3) ? strtoul(arg2, NULL, 10) : COPY_WORKERS;
+    if ((args != 2 && args != 3) || workers == 0) {
+        printf("Usage: %s <manifest> [threads]\n", name);
+        return;
+    }
+
+    CopyJob *jobs;
+    size_t   njobs;
+    if (!copy_manifest(arg1, &jobs, &njobs) || !copy_batch(fs, jobs, njobs, workers, in)) {
+        printf("%s failed!\n", name);
+        return;
+    }
+
+    size_t copied = 0;
+    size_t bytes  = 0;
+    for (size_t j = 0; j < njobs; j++) {
+        if (jobs[j].failed) {
+            fprintf(stderr, "Unable to copy %s %s inode %lu\n", jobs[j].path, in ? "to" : "from", jobs[j].inode_number);
+            continue;
+        }
+        copied++;
+        bytes += jobs[j].bytes;
+    }
+    printf("%lu files (%lu bytes) copied, %lu failed\n", copied, bytes, njobs - copied);
+    copy_free(jobs, njobs);
+}
+
+bool copy_manifest(const char *path, CopyJob **jobs, size_t *njobs) {
+    FILE *stream = fopen(path, "r");
     if (!stream) {
         fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
         return false;
     }
 
-    char buffer[4*BUFSIZ] = {0};
-    size_t offset = 0;
-    while (true) {
-        ssize_t result = fs_read(fs, inode_number, buffer, sizeof(buffer), offset);
-        if (result <= 0) {
+    /* Each line is "<inode> <file>"; blank lines and # comments are skipped */
+    char   line[BUFSIZ];
+    size_t capacity = 0;
+    bool   valid    = true;
+    *jobs  = NULL;
+    *njobs = 0;
+    while (valid && fgets(line, BUFSIZ, stream)) {
+        char *cursor = line;
+        while (isspace((unsigned char)*cursor)) cursor++;
+        if (*cursor == 0 || *cursor == '#') continue;
+
+        char  *file;
+        size_t inode_number = strtoul(cursor, &file, 10);
+        size_t length       = 0;
+        if (file != cursor && isspace((unsigned char)*file)) {
+            while (isspace((unsigned char)*file)) file++;
+            length = strlen(file);
+            while (length > 0 && isspace((unsigned char)file[length - 1])) file[--length] = 0;
+        }
+        if (length == 0) {
+            fprintf(stderr, "Invalid manifest line: %s", line);
+            valid = false;
             break;
         }
-        fwrite(buffer, 1, result, stream);
-        offset += result;
+
+        if (*njobs == capacity) {
+            capacity = capacity ? 2*capacity : 64;
+            CopyJob *grown = realloc(*jobs, capacity*sizeof(CopyJob));
+            if (!grown) {
+                fprintf(stderr, "Unable to allocate manifest: %s\n", strerror(errno));
+                valid = false;
+                break;
+            }
+            *jobs = grown;
+        }
+        (*jobs)[*njobs] = (CopyJob){.inode_number = inode_number, .path = strdup(file)};
+        valid = (*jobs)[(*njobs)++].path != NULL;
     }
-    printf("%lu bytes copied\n", offset);
     fclose(stream);
-    return true;
+
+    if (!valid) {
+        copy_free(*jobs, *njobs);
+        *jobs  = NULL;
+        *njobs = 0;
+    }
+    return valid;
+}
+
+void copy_free(CopyJob *jobs, size_t njobs) {
+    for (size_t j = 0; j < njobs; j++) {
+        free(jobs[j].path);
+    }
+    free(jobs);
+}
+
+bool copy_batch(FileSystem *fs, CopyJob *jobs, size_t njobs, size_t workers, bool in) {
+    CopyBatch batch = {.fs = fs, .in = in, .jobs = jobs, .njobs = njobs};
+    workers = min(workers, njobs);
+
+    /* Each pipeline pairs a producer with a consumer through two chunk
+     * buffers, so reading one chunk overlaps writing the one before it */
+    CopyPipe *pipes = calloc(workers, sizeof(CopyPipe));
+    if (!pipes && workers) {
+        fprintf(stderr, "Unable to allocate pipelines: %s\n", strerror(errno));
+        return false;
+    }
+
+    bool   success = true;
+    size_t started = 0;
+    for (; started < workers; started++) {
+        CopyPipe *pipeline = &pipes[started];
+        pipeline->batch = &batch;
+        pipeline->slots[0].data = malloc(COPY_CHUNK);
+        pipeline->slots[1].data = malloc(COPY_CHUNK);
+        pthread_mutex_init(&pipeline->lock, NULL);
+        pthread_cond_init(&pipeline->changed, NULL);
+        if (!pipeline->slots[0].data || !pipeline->slots[1].data) {
+            break;
+        }
+        if (pthread_create(&pipeline->consumer, NULL, copy_consume, pipeline) != 0) {
+            break;
+        }
+        if (pthread_create(&pipeline->producer, NULL, copy_produce, pipeline) != 0) {
+            /* Let consumer exit as if producer ran out of jobs */
+            copy_release(pipeline, &pipeline->slots[0], true);
+            pthread_join(pipeline->consumer, NULL);
+            break;
+        }
+    }
+    if (started < workers) {
+        fprintf(stderr, "Unable to start pipeline %lu\n", started);
+        success = started > 0;
+    }
+
+    for (size_t w = 0; w < min(started + 1, workers); w++) {
+        CopyPipe *pipeline = &pipes[w];
+        if (w < started) {
+            pthread_join(pipeline->producer, NULL);
+            pthread_join(pipeline->consumer, NULL);
+        }
+        pthread_mutex_destroy(&pipeline->lock);
+        pthread_cond_destroy(&pipeline->changed);
+        free(pipeline->slots[0].data);
+        free(pipeline->slots[1].data);
+    }
+    free(pipes);
+    return success;
+}
+
+CopyJob *copy_claim(CopyBatch *batch) {
+    size_t next = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED);
+    return (next < batch->njobs) ? &batch->jobs[next] : NULL;
+}
+
+CopySlot *copy_acquire(CopyPipe *pipeline, size_t slot, bool full) {
+    pthread_mutex_lock(&pipeline->lock);
+    while (pipeline->slots[slot].full != full) {
+        pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+    return &pipeline->slots[slot];
+}
+
+void copy_release(CopyPipe *pipeline, CopySlot *slot, bool full) {
+    pthread_mutex_lock(&pipeline->lock);
+    slot->full = full;
+    pthread_cond_broadcast(&pipeline->changed);
+    pthread_mutex_unlock(&pipeline->lock);
+}
+
+void *copy_produce(void *arg) {
+    CopyPipe  *pipeline  = arg;
+    CopyBatch *batch = pipeline->batch;
+    CopyJob   *job;
+    size_t     s     = 0;
+
+    while ((job = copy_claim(batch))) {
+        int       fd     = batch->in ? open(job->path, O_RDONLY) : -1;
+        FsHandle *handle = batch->in ? NULL : fs_open(batch->fs, job->inode_number);
+        bool      failed = batch->in ? fd < 0 : handle == NULL;
+        bool      last   = false;
+        while (!last) {
+            CopySlot *slot = copy_acquire(pipeline, s, false);
+            ssize_t   n    = 0;
+            if (!failed && !__atomic_load_n(&job->failed, __ATOMIC_RELAXED)) {
+                n = batch->in ? copy_read(fd, slot->data, COPY_CHUNK)
+                              : fs_hread(handle, slot->data, COPY_CHUNK);
+                failed = n < 0;
+            }
+            /* Short chunks (and failures) end the job */
+            last = n < (ssize_t)COPY_CHUNK;
+            slot->job    = job;
+            slot->length = n > 0 ? n : 0;
+            slot->failed = failed;
+            slot->last   = last;
+            copy_release(pipeline, slot, true);
+            s ^= 1;
+        }
+        if (fd >= 0) close(fd);
+        fs_close(handle);
+    }
+
+    CopySlot *slot = copy_acquire(pipeline, s, false);
+    slot->job = NULL;
+    copy_release(pipeline, slot, true);
+    return NULL;
+}
+
+void *copy_consume(void *arg) {
+    CopyPipe  *pipeline  = arg;
+    CopyBatch *batch = pipeline->batch;
+    CopyJob   *job   = NULL;
+    int        fd    = -1;
+    FsHandle  *handle = NULL;
+    size_t     s     = 0;
+
+    while (true) {
+        CopySlot *slot = copy_acquire(pipeline, s, true);
+        if (!slot->job) break;
+
+        /* First chunk of job opens its destination */
+        if (slot->job != job) {
+            job = slot->job;
+            if (!slot->failed && batch->in) {
+                handle = fs_open(batch->fs, job->inode_number);
+            } else if (!slot->failed) {
+                fd = open(job->path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+            }
+            if (batch->in ? handle == NULL : fd < 0) {
+                __atomic_store_n(&job->failed, true, __ATOMIC_RELAXED);
+            }
+        }
+        if (slot->failed) {
+            __atomic_store_n(&job->failed, true, __ATOMIC_RELAXED);
+        }
+        if (!job->failed && slot->length) {
+            ssize_t n = batch->in ? fs_hwrite(handle, slot->data, slot->length)
+                                  : copy_write(fd, slot->data, slot->length);
+            if (n == (ssize_t)slot->length) {
+                job->bytes += n;
+            } else {
+                __atomic_store_n(&job->failed, true, __ATOMIC_RELAXED);
+            }
+        }
+        if (slot->last) {
+            if (fd >= 0 && close(fd) != 0) {
+                __atomic_store_n(&job->failed, true, __ATOMIC_RELAXED);
+            }
+            fs_close(handle);
+            fd     = -1;
+            handle = NULL;
+            job    = NULL;
+        }
+        copy_release(pipeline, slot, false);
+        s ^= 1;
+    }
+    return NULL;
+}
+
+ssize_t copy_read(int fd, char *data, size_t length) {
+    size_t total = 0;
+    while (total < length) {
+        ssize_t n = read(fd, data + total, length - total);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) break;
+        total += n;
+    }
+    return total;
+}
+
+ssize_t copy_write(int fd, const char *data, size_t length) {
+    size_t total = 0;
+    while (total < length) {
+        ssize_t n = write(fd, data + total, length - total);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        total += n;
+    }
+    return total;
+}
+
+void print_defrag(size_t inode_number, size_t before, size_t after, void *ctx) {
+    printf("inode %lu: fragmentation %lu -> %lu\n", inode_number, before, after);
+}
+
+void print_corrupt(size_t block, void *ctx) {
+    size_t *corrupt = ctx;
+    (*corrupt)++;
+    printf("block %lu: checksum mismatch\n", block);
+}
+
+void print_op_stats(const char *name, const OpStats *stats) {
+    printf("%-12s %10lu %8lu %14lu %10.1f %10.1f %10.1f\n",
+        name, stats->calls, stats->errors, stats->bytes,
+        stats_average(stats) / 1000.0,
+        stats_percentile(stats, 50) / 1000.0,
+        stats_percentile(stats, 99) / 1000.0);
 }
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
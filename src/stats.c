@@ -0,0 +1,110 @@
+/* stats.c: SimpleFS operation statistics */
+
+#include "sfs/stats.h"
+
+#include <time.h>
+
+/* External Functions */
+
+/**
+ * Return current monotonic time.
+ *
+ * @return      Time in nanoseconds.
+ **/
+uint64_t    stats_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Record a completed call by doing the following:
+ *
+ *  1. Count call (and error if result is negative) and bytes transferred (if
+ *  result is positive).
+ *
+ *  2. Add latency since start to total and to its log2 histogram bucket.
+ *
+ * Note: Counters are updated with relaxed atomics so concurrent callers can
+ * share one OpStats without locking.
+ *
+ * @param       stats       Pointer to OpStats structure.
+ * @param       start       Time call started (from stats_now).
+ * @param       result      Result of call (negative on failure).
+ *
+ * @return      The result that was passed in.
+ **/
+ssize_t     stats_record(OpStats *stats, uint64_t start, ssize_t result) {
+    uint64_t elapsed = stats_now() - start;
+    size_t   bucket  = elapsed ? 63 - __builtin_clzll(elapsed) : 0;
+    if (bucket >= STATS_BUCKETS) bucket = STATS_BUCKETS - 1;
+
+    __atomic_add_fetch(&stats->calls, 1, __ATOMIC_RELAXED);
+    if (result < 0) {
+        __atomic_add_fetch(&stats->errors, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_add_fetch(&stats->bytes, result, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&stats->nanoseconds, elapsed, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->histogram[bucket], 1, __ATOMIC_RELAXED);
+    return result;
+}
+
+/**
+ * Copy counters of stats into snapshot (each counter is loaded atomically).
+ *
+ * @param       snapshot    Pointer to OpStats structure to fill.
+ * @param       stats       Pointer to OpStats structure to copy.
+ **/
+void        stats_snapshot(OpStats *snapshot, const OpStats *stats) {
+    snapshot->calls       = __atomic_load_n(&stats->calls, __ATOMIC_RELAXED);
+    snapshot->errors      = __atomic_load_n(&stats->errors, __ATOMIC_RELAXED);
+    snapshot->bytes       = __atomic_load_n(&stats->bytes, __ATOMIC_RELAXED);
+    snapshot->nanoseconds = __atomic_load_n(&stats->nanoseconds, __ATOMIC_RELAXED);
+    for (size_t b = 0; b < STATS_BUCKETS; b++) {
+        snapshot->histogram[b] = __atomic_load_n(&stats->histogram[b], __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Return average latency of recorded calls.
+ *
+ * @param       stats       Pointer to OpStats structure.
+ *
+ * @return      Average latency in nanoseconds (0 if no calls).
+ **/
+uint64_t    stats_average(const OpStats *stats) {
+    return stats->calls ? stats->nanoseconds / stats->calls : 0;
+}
+
+/**
+ * Estimate latency percentile from histogram by doing the following:
+ *
+ *  1. Walk buckets until the requested fraction of calls is covered.
+ *
+ *  2. Return upper bound of that bucket (estimates are within 2x).
+ *
+ * @param       stats       Pointer to OpStats structure.
+ * @param       percentile  Percentile to estimate (0 - 100).
+ *
+ * @return      Latency in nanoseconds (0 if no calls).
+ **/
+uint64_t    stats_percentile(const OpStats *stats, double percentile) {
+    size_t total = 0;
+    for (size_t b = 0; b < STATS_BUCKETS; b++) {
+        total += stats->histogram[b];
+    }
+    if (total == 0) return 0;
+
+    double target = total * percentile / 100.0;
+    size_t seen   = 0;
+    for (size_t b = 0; b < STATS_BUCKETS; b++) {
+        seen += stats->histogram[b];
+        if (seen >= target && seen > 0) {
+            return UINT64_C(1) << (b + 1);
+        }
+    }
+    return UINT64_C(1) << STATS_BUCKETS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
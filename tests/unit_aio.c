@@ -0,0 +1,262 @@
+/* unit_aio.c: Unit tests for SimpleFS asynchronous disk I/O */
+
+#include "sfs/aio.h"
+#include "sfs/logging.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <unistd.h>
+
+/* Constants */
+
+#define DISK_PATH   "unit_aio.image"
+#define DISK_BLOCKS (16)
+
+const AioBackend BACKENDS[] = {AIO_URING, AIO_THREADS};
+const size_t     NBACKENDS  = sizeof(BACKENDS) / sizeof(BACKENDS[0]);
+
+/* Functions */
+
+void test_cleanup() {
+    unlink(DISK_PATH);
+}
+
+void test_fill_disk(Disk *disk) {
+    char data[BLOCK_SIZE];
+    for (size_t b = 0; b < disk->blocks; b++) {
+        memset(data, 'a' + b, BLOCK_SIZE);
+        assert(disk_write(disk, b, data) == BLOCK_SIZE);
+    }
+}
+
+void test_count_callback(AioRequest *request) {
+    __atomic_add_fetch((size_t *)request->arg, 1, __ATOMIC_RELAXED);
+}
+
+int test_00_aio_create() {
+    Disk *disk = disk_open(DISK_PATH, DISK_BLOCKS);
+    assert(disk);
+
+    debug("Check bad disk");
+    assert(aio_create(NULL, AIO_AUTO, 4) == NULL);
+
+    debug("Check bad depth");
+    assert(aio_create(disk, AIO_AUTO, 0) == NULL);
+
+    debug("Check auto backend");
+    Aio *aio = aio_create(disk, AIO_AUTO, 4);
+    assert(aio);
+    assert(aio->disk     == disk);
+    assert(aio->backend  == AIO_URING || aio->backend == AIO_THREADS);
+    assert(aio->depth    <= 4);
+    assert(aio->inflight == 0);
+    aio_delete(aio);
+
+    debug("Check thread pool backend");
+    aio = aio_create(disk, AIO_THREADS, 4);
+    assert(aio);
+    assert(aio->backend  == AIO_THREADS);
+    assert(aio->depth    == 4);
+    assert(aio->nworkers == AIO_WORKERS);
+    aio_delete(aio);
+
+    aio_delete(NULL);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_01_aio_read() {
+    Disk *disk = disk_open(DISK_PATH, DISK_BLOCKS);
+    assert(disk);
+    test_fill_disk(disk);
+
+    for (size_t i = 0; i < NBACKENDS; i++) {
+        Aio *aio = aio_create(disk, BACKENDS[i], 8);
+        if (!aio) {
+            debug("Skip unavailable backend %d", BACKENDS[i]);
+            continue;
+        }
+
+        debug("Check reads with backend %d", aio->backend);
+        char       data[DISK_BLOCKS*BLOCK_SIZE];
+        AioRequest requests[4];
+        memset(data, 0, sizeof(data));
+        memset(requests, 0, sizeof(requests));
+        for (size_t r = 0; r < 4; r++) {
+            requests[r].block = r*4;
+            requests[r].count = 4;
+            requests[r].data  = data + r*4*BLOCK_SIZE;
+        }
+
+        size_t reads = disk->reads;
+        assert(aio_submit(aio, requests, 4));
+        assert(aio_wait_all(aio, requests, 4));
+        assert(aio->inflight == 0);
+        assert(disk->reads   == reads + DISK_BLOCKS);
+
+        for (size_t r = 0; r < 4; r++) {
+            assert(requests[r].done);
+            assert(requests[r].result == 4*BLOCK_SIZE);
+        }
+        for (size_t b = 0; b < DISK_BLOCKS; b++) {
+            assert(data[b*BLOCK_SIZE] == (char)('a' + b));
+            assert(data[b*BLOCK_SIZE + BLOCK_SIZE - 1] == (char)('a' + b));
+        }
+
+        aio_delete(aio);
+    }
+
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_02_aio_write() {
+    Disk *disk = disk_open(DISK_PATH, DISK_BLOCKS);
+    assert(disk);
+    test_fill_disk(disk);
+
+    for (size_t i = 0; i < NBACKENDS; i++) {
+        Aio *aio = aio_create(disk, BACKENDS[i], 2);
+        if (!aio) {
+            debug("Skip unavailable backend %d", BACKENDS[i]);
+            continue;
+        }
+
+        debug("Check writes and callbacks beyond queue depth with backend %d", aio->backend);
+        char       data[DISK_BLOCKS][BLOCK_SIZE];
+        AioRequest requests[DISK_BLOCKS];
+        size_t     completed = 0;
+        memset(requests, 0, sizeof(requests));
+        for (size_t b = 0; b < DISK_BLOCKS; b++) {
+            memset(data[b], 'A' + b + i, BLOCK_SIZE);
+            requests[b].block    = b;
+            requests[b].count    = 1;
+            requests[b].data     = data[b];
+            requests[b].write    = true;
+            requests[b].callback = test_count_callback;
+            requests[b].arg      = &completed;
+        }
+
+        assert(aio_submit(aio, requests, DISK_BLOCKS));
+        assert(aio_wait_all(aio, requests, DISK_BLOCKS));
+        assert(completed     == DISK_BLOCKS);
+        assert(aio->inflight == 0);
+
+        char buffer[BLOCK_SIZE];
+        for (size_t b = 0; b < DISK_BLOCKS; b++) {
+            assert(disk_read(disk, b, buffer) == BLOCK_SIZE);
+            assert(memcmp(buffer, data[b], BLOCK_SIZE) == 0);
+        }
+
+        aio_delete(aio);
+    }
+
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_03_aio_invalid() {
+    Disk *disk = disk_open(DISK_PATH, DISK_BLOCKS);
+    assert(disk);
+
+    for (size_t i = 0; i < NBACKENDS; i++) {
+        Aio *aio = aio_create(disk, BACKENDS[i], 4);
+        if (!aio) {
+            debug("Skip unavailable backend %d", BACKENDS[i]);
+            continue;
+        }
+
+        debug("Check invalid requests with backend %d", aio->backend);
+        char       data[2*BLOCK_SIZE];
+        AioRequest requests[2] = {
+            {.block = 0,               .count = 1, .data = data},
+            {.block = DISK_BLOCKS - 1, .count = 2, .data = data},
+        };
+
+        size_t reads = disk->reads;
+        assert(aio_submit(NULL, requests, 2) == false);
+        assert(aio_submit(aio, requests, 2)  == false);
+        assert(aio->inflight == 0);
+        assert(disk->reads   == reads);
+
+        requests[1] = (AioRequest){.block = 1, .count = 0, .data = data};
+        assert(aio_submit(aio, requests, 2) == false);
+
+        requests[1] = (AioRequest){.block = 1, .count = 1, .data = NULL};
+        assert(aio_submit(aio, requests, 2) == false);
+
+        debug("Check empty submission");
+        assert(aio_submit(aio, requests, 0));
+        assert(aio_wait(aio, NULL) == false);
+
+        aio_delete(aio);
+    }
+
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_04_aio_mmap() {
+    Disk *disk = disk_open(DISK_PATH, DISK_BLOCKS);
+    assert(disk);
+    test_fill_disk(disk);
+    disk_close(disk);
+
+    disk = disk_open_mode(DISK_PATH, DISK_BLOCKS, DISK_MMAP);
+    assert(disk);
+
+    debug("Check requests complete during submission on memory mapped disk");
+    Aio *aio = aio_create(disk, AIO_AUTO, 4);
+    assert(aio);
+    assert(aio->ring_fd  == -1);
+    assert(aio->nworkers == 0);
+
+    char       data[2*BLOCK_SIZE];
+    size_t     completed = 0;
+    AioRequest request   = {.block = 3, .count = 2, .data = data, .callback = test_count_callback, .arg = &completed};
+    assert(aio_submit(aio, &request, 1));
+    assert(request.done);
+    assert(completed == 1);
+    assert(aio_wait(aio, &request));
+    assert(data[0]          == 'd');
+    assert(data[BLOCK_SIZE] == 'e');
+
+    aio_delete(aio);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test aio_create\n");
+        fprintf(stderr, "    1. Test aio_submit reads\n");
+        fprintf(stderr, "    2. Test aio_submit writes\n");
+        fprintf(stderr, "    3. Test aio_submit invalid requests\n");
+        fprintf(stderr, "    4. Test aio_submit on memory mapped disk\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    atexit(test_cleanup);
+
+    switch (number) {
+        case 0:  status = test_00_aio_create(); break;
+        case 1:  status = test_01_aio_read(); break;
+        case 2:  status = test_02_aio_write(); break;
+        case 3:  status = test_03_aio_invalid(); break;
+        case 4:  status = test_04_aio_mmap(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
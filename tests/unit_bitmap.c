@@ -0,0 +1,231 @@
+/* unit_bitmap.c: Unit tests for SimpleFS packed bitmap */
+
+#include "sfs/bitmap.h"
+#include "sfs/logging.h"
+
+#include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+
+/* Constants */
+
+#define BITMAP_BITS (200)
+
+/* Functions */
+
+int test_00_bitmap_create() {
+    debug("Check empty bitmap");
+    Bitmap *bitmap = bitmap_create(BITMAP_BITS, false);
+    assert(bitmap);
+    assert(bitmap->bits   == BITMAP_BITS);
+    assert(bitmap->nwords == 4);
+    assert(bitmap_count(bitmap) == 0);
+    for (size_t b = 0; b < BITMAP_BITS; b++) {
+        assert(bitmap_test(bitmap, b) == false);
+    }
+    bitmap_delete(bitmap);
+
+    debug("Check full bitmap");
+    bitmap = bitmap_create(BITMAP_BITS, true);
+    assert(bitmap);
+    assert(bitmap_count(bitmap) == BITMAP_BITS);
+    for (size_t b = 0; b < BITMAP_BITS; b++) {
+        assert(bitmap_test(bitmap, b) == true);
+    }
+
+    debug("Check bits past end");
+    assert(bitmap_test(bitmap, BITMAP_BITS) == false);
+    assert(bitmap->words[3] >> (BITMAP_BITS % BITMAP_WORD_BITS) == 0);
+    bitmap_delete(bitmap);
+    return EXIT_SUCCESS;
+}
+
+int test_01_bitmap_set() {
+    Bitmap *bitmap = bitmap_create(BITMAP_BITS, false);
+    assert(bitmap);
+
+    debug("Check set and clear");
+    bitmap_set(bitmap, 0);
+    bitmap_set(bitmap, 63);
+    bitmap_set(bitmap, 64);
+    bitmap_set(bitmap, BITMAP_BITS - 1);
+    assert(bitmap_count(bitmap) == 4);
+    assert(bitmap_test(bitmap, 63) && bitmap_test(bitmap, 64));
+    assert(bitmap_test(bitmap, 62) == false);
+
+    bitmap_set(bitmap, 63);
+    assert(bitmap_count(bitmap) == 4);
+
+    bitmap_clear(bitmap, 63);
+    bitmap_clear(bitmap, 63);
+    assert(bitmap_count(bitmap) == 3);
+    assert(bitmap_test(bitmap, 63) == false);
+
+    debug("Check out of range");
+    bitmap_set(bitmap, BITMAP_BITS);
+    bitmap_clear(bitmap, BITMAP_BITS + 100);
+    assert(bitmap_count(bitmap) == 3);
+
+    bitmap_delete(bitmap);
+    return EXIT_SUCCESS;
+}
+
+int test_02_bitmap_find() {
+    Bitmap *bitmap = bitmap_create(BITMAP_BITS, false);
+    assert(bitmap);
+
+    debug("Check find (empty)");
+    assert(bitmap_find(bitmap, 0) == BITMAP_NONE);
+
+    debug("Check find (next-fit)");
+    bitmap_set(bitmap, 5);
+    bitmap_set(bitmap, 130);
+    assert(bitmap_find(bitmap, 0)   == 5);
+    assert(bitmap_find(bitmap, 5)   == 5);
+    assert(bitmap_find(bitmap, 6)   == 130);
+    assert(bitmap_find(bitmap, 130) == 130);
+
+    debug("Check find (wrap around)");
+    assert(bitmap_find(bitmap, 131) == 5);
+    assert(bitmap_find(bitmap, BITMAP_BITS) == 5);
+
+    bitmap_clear(bitmap, 5);
+    assert(bitmap_find(bitmap, 131) == 130);
+
+    debug("Check sequential allocation");
+    bitmap_delete(bitmap);
+    bitmap = bitmap_create(BITMAP_BITS, true);
+    size_t hint = 0;
+    for (size_t b = 0; b < BITMAP_BITS; b++) {
+        size_t bit = bitmap_find(bitmap, hint);
+        assert(bit == b);
+        bitmap_clear(bitmap, bit);
+        hint = bit + 1;
+    }
+    assert(bitmap_find(bitmap, hint) == BITMAP_NONE);
+
+    bitmap_delete(bitmap);
+    return EXIT_SUCCESS;
+}
+
+int test_03_bitmap_run() {
+    Bitmap *bitmap = bitmap_create(BITMAP_BITS, false);
+    assert(bitmap);
+
+    debug("Check set and clear range");
+    bitmap_set_range(bitmap, 10, 3);
+    bitmap_set_range(bitmap, 60, 70);
+    bitmap_set_range(bitmap, 150, 8);
+    bitmap_set_range(bitmap, 195, 100);
+    assert(bitmap_count(bitmap) == 3 + 70 + 8 + 5);
+    assert(bitmap_test(bitmap, 59) == false && bitmap_test(bitmap, 60));
+    assert(bitmap_test(bitmap, 129) && bitmap_test(bitmap, 130) == false);
+
+    bitmap_clear_range(bitmap, 100, 10);
+    bitmap_clear_range(bitmap, 100, 10);
+    assert(bitmap_count(bitmap) == 3 + 60 + 8 + 5);
+
+    debug("Check run length");
+    assert(bitmap_run(bitmap, 10)  == 3);
+    assert(bitmap_run(bitmap, 11)  == 2);
+    assert(bitmap_run(bitmap, 13)  == 0);
+    assert(bitmap_run(bitmap, 60)  == 40);
+    assert(bitmap_run(bitmap, 110) == 20);
+    assert(bitmap_run(bitmap, 195) == 5);
+
+    debug("Check best fit");
+    size_t length = 0;
+    assert(bitmap_find_run(bitmap, 3, &length)  == 10  && length == 3);
+    assert(bitmap_find_run(bitmap, 2, &length)  == 10  && length == 3);
+    assert(bitmap_find_run(bitmap, 4, &length)  == 195 && length == 5);
+    assert(bitmap_find_run(bitmap, 6, &length)  == 150 && length == 8);
+    assert(bitmap_find_run(bitmap, 9, &length)  == 110 && length == 20);
+    assert(bitmap_find_run(bitmap, 21, &length) == 60  && length == 40);
+
+    debug("Check largest run when nothing fits");
+    assert(bitmap_find_run(bitmap, 50, &length) == 60  && length == 40);
+
+    debug("Check empty bitmap");
+    bitmap_clear_range(bitmap, 0, BITMAP_BITS);
+    assert(bitmap_count(bitmap) == 0);
+    assert(bitmap_find_run(bitmap, 1, &length) == BITMAP_NONE && length == 0);
+
+    bitmap_delete(bitmap);
+    return EXIT_SUCCESS;
+}
+
+int test_04_bitmap_load() {
+    Bitmap *bitmap = bitmap_create(BITMAP_BITS, false);
+    assert(bitmap);
+    bitmap_set_range(bitmap, 5, 20);
+    bitmap_set(bitmap, 130);
+
+    debug("Check copy");
+    Bitmap *copy = bitmap_copy(bitmap);
+    assert(copy);
+    assert(copy->bits == BITMAP_BITS && copy->nwords == bitmap->nwords);
+    assert(bitmap_count(copy) == 21);
+    assert(bitmap_test(copy, 5) && bitmap_test(copy, 24) && bitmap_test(copy, 130));
+    bitmap_clear(copy, 130);
+    assert(bitmap_test(bitmap, 130));
+
+    debug("Check load recounts and clears bits past end");
+    uint64_t words[4] = {UINT64_MAX, 0, 0x3, UINT64_MAX};
+    bitmap_load(copy, words);
+    assert(bitmap_count(copy) == 64 + 2 + (BITMAP_BITS - 192));
+    assert(bitmap_test(copy, 128) && bitmap_test(copy, 129) && bitmap_test(copy, 130) == false);
+    assert(bitmap_test(copy, BITMAP_BITS - 1));
+    assert(copy->words[3] == (UINT64_C(1) << (BITMAP_BITS - 192)) - 1);
+
+    bitmap_load(copy, bitmap->words);
+    assert(bitmap_count(copy) == bitmap_count(bitmap));
+
+    debug("Check setting and clearing the bits of a mask");
+    Bitmap *mask = bitmap_create(BITMAP_BITS, false);
+    assert(mask);
+    bitmap_set_range(mask, 20, 50);
+    bitmap_set(mask, BITMAP_BITS - 1);
+    bitmap_set_bits(copy, mask);
+    assert(bitmap_count(copy) == 65 + 1 + 1);
+    assert(bitmap_test(copy, 5) && bitmap_test(copy, 69) && bitmap_test(copy, 70) == false);
+    assert(bitmap_test(copy, 130) && bitmap_test(copy, BITMAP_BITS - 1));
+    bitmap_clear_bits(copy, mask);
+    assert(bitmap_count(copy) == 15 + 1);
+    assert(bitmap_test(copy, 19) && bitmap_test(copy, 20) == false && bitmap_test(copy, 130));
+    bitmap_delete(mask);
+
+    bitmap_delete(copy);
+    bitmap_delete(bitmap);
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test bitmap_create\n");
+        fprintf(stderr, "    1. Test bitmap_set/bitmap_clear\n");
+        fprintf(stderr, "    2. Test bitmap_find\n");
+        fprintf(stderr, "    3. Test bitmap_find_run\n");
+        fprintf(stderr, "    4. Test bitmap_copy/bitmap_load/bitmap_set_bits\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    switch (number) {
+        case 0:  status = test_00_bitmap_create(); break;
+        case 1:  status = test_01_bitmap_set(); break;
+        case 2:  status = test_02_bitmap_find(); break;
+        case 3:  status = test_03_bitmap_run(); break;
+        case 4:  status = test_04_bitmap_load(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,299 @@
+/* unit_cache.c: Unit tests for SimpleFS block cache */
+
+#include "sfs/cache.h"
+#include "sfs/logging.h"
+
+#include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+
+#include <unistd.h>
+
+/* Constants */
+
+#define DISK_PATH   "unit_cache.image"
+#define DISK_BLOCKS (8)
+
+/* Functions */
+
+void test_cleanup() {
+    unlink(DISK_PATH);
+}
+
+int test_00_cache_create() {
+    Disk *disk = disk_open(DISK_PATH, DISK_BLOCKS);
+    assert(disk);
+
+    debug("Check bad disk");
+    assert(cache_create(NULL, 4) == NULL);
+
+    debug("Check bad capacity");
+    assert(cache_create(disk, 0) == NULL);
+
+    debug("Check cache attributes");
+    Cache *cache = cache_create(disk, 4);
+    assert(cache);
+    assert(cache->disk     == disk);
+    assert(cache->capacity == 4);
+    assert(cache->hits     == 0);
+    assert(cache->misses   == 0);
+
+    cache_delete(cache);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_01_cache_read() {
+    Disk *disk = disk_open(DISK_PATH, DISK_BLOCKS);
+    assert(disk);
+
+    char data[BLOCK_SIZE] = {0};
+    for (size_t b = 0; b < DISK_BLOCKS; b++) {
+        memset(data, b, BLOCK_SIZE);
+        assert(disk_write(disk, b, data) == BLOCK_SIZE);
+    }
+
+    Cache *cache = cache_create(disk, 4);
+    assert(cache);
+
+    debug("Check bad block");
+    assert(cache_read(cache, DISK_BLOCKS, data) == DISK_FAILURE);
+
+    debug("Check bad data");
+    assert(cache_read(cache, 0, NULL) == DISK_FAILURE);
+
+    debug("Check read misses");
+    for (size_t b = 0; b < 4; b++) {
+        assert(cache_read(cache, b, data) == BLOCK_SIZE);
+        for (size_t i = 0; i < BLOCK_SIZE; i++) {
+            assert((unsigned char)data[i] == (unsigned char)b);
+        }
+    }
+    assert(cache->misses == 4);
+    assert(disk->reads   == 4);
+
+    debug("Check read hits");
+    for (size_t b = 0; b < 4; b++) {
+        assert(cache_read(cache, b, data) == BLOCK_SIZE);
+        assert((unsigned char)data[0] == (unsigned char)b);
+    }
+    assert(cache->hits   == 4);
+    assert(disk->reads   == 4);
+
+    debug("Check read eviction");
+    for (size_t b = 4; b < DISK_BLOCKS; b++) {
+        assert(cache_read(cache, b, data) == BLOCK_SIZE);
+        assert((unsigned char)data[0] == (unsigned char)b);
+    }
+    assert(cache->misses == DISK_BLOCKS);
+    assert(disk->reads   == DISK_BLOCKS);
+    assert(disk->writes  == DISK_BLOCKS);
+
+    cache_delete(cache);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_02_cache_write() {
+    Disk *disk = disk_open(DISK_PATH, DISK_BLOCKS);
+    assert(disk);
+
+    Cache *cache = cache_create(disk, 2);
+    assert(cache);
+
+    char data[BLOCK_SIZE] = {0};
+
+    debug("Check bad block");
+    assert(cache_write(cache, DISK_BLOCKS, data) == DISK_FAILURE);
+
+    debug("Check write back");
+    for (size_t r = 0; r < 3; r++) {
+        memset(data, r + 1, BLOCK_SIZE);
+        assert(cache_write(cache, 1, data) == BLOCK_SIZE);
+    }
+    assert(disk->writes == 0);
+
+    memset(data, 0, BLOCK_SIZE);
+    assert(cache_read(cache, 1, data) == BLOCK_SIZE);
+    assert(data[0] == 3);
+    assert(disk->reads  == 0);
+
+    debug("Check write eviction");
+    for (size_t b = 2; b < DISK_BLOCKS; b++) {
+        memset(data, b, BLOCK_SIZE);
+        assert(cache_write(cache, b, data) == BLOCK_SIZE);
+    }
+    assert(disk->writes == DISK_BLOCKS - 3);
+
+    debug("Check flush");
+    assert(cache_flush(cache));
+    assert(disk->writes == DISK_BLOCKS - 1);
+    assert(cache_flush(cache));
+    assert(disk->writes == DISK_BLOCKS - 1);
+
+    for (size_t b = 1; b < DISK_BLOCKS; b++) {
+        assert(disk_read(disk, b, data) == BLOCK_SIZE);
+        assert((unsigned char)data[0] == (unsigned char)(b == 1 ? 3 : b));
+    }
+
+    cache_delete(cache);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_03_cache_vector() {
+    Disk *disk = disk_open(DISK_PATH, DISK_BLOCKS);
+    assert(disk);
+
+    Cache *cache = cache_create(disk, 2);
+    assert(cache);
+
+    char blocks[DISK_BLOCKS][BLOCK_SIZE];
+    struct iovec iov[DISK_BLOCKS];
+    for (size_t b = 0; b < DISK_BLOCKS; b++) {
+        memset(blocks[b], b, BLOCK_SIZE);
+        iov[b].iov_base = blocks[b];
+        iov[b].iov_len  = BLOCK_SIZE;
+    }
+
+    debug("Check bad vectors");
+    assert(cache_writev(cache, 1, iov, DISK_BLOCKS) == DISK_FAILURE);
+
+    debug("Check write through uncached runs");
+    memset(blocks[3], 0x33, BLOCK_SIZE);
+    assert(cache_write(cache, 3, blocks[3]) == BLOCK_SIZE);
+    memset(blocks[3], 3, BLOCK_SIZE);
+    assert(cache_writev(cache, 0, iov, DISK_BLOCKS) == DISK_BLOCKS*BLOCK_SIZE);
+    assert(disk->writes == DISK_BLOCKS - 1);
+
+    debug("Check read cached and uncached runs");
+    memset(blocks, 0xff, sizeof(blocks));
+    assert(cache_readv(cache, 0, iov, DISK_BLOCKS) == DISK_BLOCKS*BLOCK_SIZE);
+    assert(disk->reads == DISK_BLOCKS - 1);
+    for (size_t b = 0; b < DISK_BLOCKS; b++) {
+        assert((unsigned char)blocks[b][0] == (unsigned char)b);
+        assert((unsigned char)blocks[b][BLOCK_SIZE - 1] == (unsigned char)b);
+    }
+
+    cache_delete(cache);
+    assert(disk->writes == DISK_BLOCKS);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_04_cache_probe() {
+    Disk *disk = disk_open(DISK_PATH, DISK_BLOCKS);
+    assert(disk);
+
+    char data[BLOCK_SIZE] = {0};
+    for (size_t b = 0; b < DISK_BLOCKS; b++) {
+        memset(data, b, BLOCK_SIZE);
+        assert(disk_write(disk, b, data) == BLOCK_SIZE);
+    }
+
+    Cache *cache = cache_create(disk, 4);
+    assert(cache);
+
+    debug("Check bad arguments");
+    assert(cache_probe(NULL, 0, data) == false);
+    assert(cache_probe(cache, 0, NULL) == false);
+
+    debug("Check uncached block is not read");
+    size_t reads = disk->reads;
+    assert(cache_probe(cache, 2, data) == false);
+    assert(cache_probe(cache, DISK_BLOCKS, data) == false);
+    assert(disk->reads   == reads);
+    assert(cache->misses == 2);
+
+    debug("Check cached and dirty blocks");
+    assert(cache_read(cache, 2, data) == BLOCK_SIZE);
+    memset(data, 0x55, BLOCK_SIZE);
+    assert(cache_write(cache, 5, data) == BLOCK_SIZE);
+
+    memset(data, 0xff, BLOCK_SIZE);
+    assert(cache_probe(cache, 2, data));
+    assert(data[0] == 2 && data[BLOCK_SIZE - 1] == 2);
+    assert(cache_probe(cache, 5, data));
+    assert(data[0] == 0x55);
+    assert(disk->reads == reads + 1);
+    assert(cache->hits == 2);
+
+    cache_delete(cache);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_05_cache_prefetch() {
+    Disk *disk = disk_open(DISK_PATH, DISK_BLOCKS);
+    assert(disk);
+
+    char data[BLOCK_SIZE] = {0};
+    for (size_t b = 0; b < DISK_BLOCKS; b++) {
+        memset(data, b, BLOCK_SIZE);
+        assert(disk_write(disk, b, data) == BLOCK_SIZE);
+    }
+
+    Cache *cache = cache_create(disk, 4);
+    assert(cache);
+
+    debug("Check bad arguments");
+    assert(cache_prefetch(NULL, 0, 1) < 0);
+    assert(cache_prefetch(cache, DISK_BLOCKS, 1) < 0);
+
+    debug("Check prefetch skips cached blocks and reads runs at once");
+    assert(cache_read(cache, 2, data) == BLOCK_SIZE);
+    size_t reads = disk->reads;
+    assert(cache_prefetch(cache, 1, 3) == 2);
+    assert(disk->reads == reads + 2);
+    assert(cache->hits == 0 && cache->misses == 1);
+
+    debug("Check prefetched blocks are served from cache");
+    for (size_t b = 1; b < 4; b++) {
+        assert(cache_read(cache, b, data) == BLOCK_SIZE);
+        assert((unsigned char)data[0] == (unsigned char)b);
+    }
+    assert(disk->reads == reads + 2);
+    assert(cache->hits == 3);
+
+    debug("Check prefetch is limited to capacity");
+    assert(cache_prefetch(cache, 0, DISK_BLOCKS) <= 4);
+
+    cache_delete(cache);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test cache_create\n");
+        fprintf(stderr, "    1. Test cache_read\n");
+        fprintf(stderr, "    2. Test cache_write\n");
+        fprintf(stderr, "    3. Test cache_readv/cache_writev\n");
+        fprintf(stderr, "    4. Test cache_probe\n");
+        fprintf(stderr, "    5. Test cache_prefetch\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    atexit(test_cleanup);
+
+    switch (number) {
+        case 0:  status = test_00_cache_create(); break;
+        case 1:  status = test_01_cache_read(); break;
+        case 2:  status = test_02_cache_write(); break;
+        case 3:  status = test_03_cache_vector(); break;
+        case 4:  status = test_04_cache_probe(); break;
+        case 5:  status = test_05_cache_prefetch(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
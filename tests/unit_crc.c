@@ -0,0 +1,123 @@
+/* unit_crc.c: Unit tests for SimpleFS CRC32C checksums */
+
+#include "sfs/crc.h"
+#include "sfs/logging.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Constants */
+
+#define INPUT_SIZE  (16384)
+
+/* Functions */
+
+void test_fill_random(char *data, size_t length) {
+    uint32_t state = 0x2545f491;
+    for (size_t i = 0; i < length; i++) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        data[i] = state;
+    }
+}
+
+int test_00_crc_vectors() {
+    char zeros[32] = {0};
+    char ones[32];
+    memset(ones, 0xff, sizeof(ones));
+
+    debug("Check standard check value");
+    assert(crc32c(0, "123456789", 9) == 0xe3069283);
+    assert(crc32c_software(0, "123456789", 9) == 0xe3069283);
+
+    debug("Check RFC 3720 vectors");
+    assert(crc32c(0, zeros, sizeof(zeros)) == 0x8a9136aa);
+    assert(crc32c(0, ones, sizeof(ones)) == 0x62a8ab43);
+    assert(crc32c_software(0, zeros, sizeof(zeros)) == 0x8a9136aa);
+    assert(crc32c_software(0, ones, sizeof(ones)) == 0x62a8ab43);
+
+    debug("Check empty input");
+    assert(crc32c(0, "", 0) == 0);
+    assert(crc32c(0x12345678, "", 0) == 0x12345678);
+    return EXIT_SUCCESS;
+}
+
+int test_01_crc_software() {
+    static char input[INPUT_SIZE];
+    test_fill_random(input, INPUT_SIZE);
+
+    debug("Hardware is %s", crc32c_hardware() ? "available" : "not available");
+
+    debug("Check every alignment and length matches software");
+    for (size_t start = 0; start < 16; start++) {
+        for (size_t length = 0; length < 64; length++) {
+            assert(crc32c(0, input + start, length) == crc32c_software(0, input + start, length));
+        }
+    }
+    assert(crc32c(0, input, INPUT_SIZE) == crc32c_software(0, input, INPUT_SIZE));
+
+    debug("Check checksum can be extended");
+    uint32_t crc = crc32c(0, input, 1000);
+    crc = crc32c_software(crc, input + 1000, 3000);
+    crc = crc32c(crc, input + 4000, INPUT_SIZE - 4000);
+    assert(crc == crc32c(0, input, INPUT_SIZE));
+
+    debug("Check single bit flips change checksum");
+    uint32_t whole = crc32c(0, input, INPUT_SIZE);
+    for (size_t bit = 0; bit < 64; bit++) {
+        input[bit * 251 % INPUT_SIZE] ^= 1 << (bit % 8);
+        assert(crc32c(0, input, INPUT_SIZE) != whole);
+        input[bit * 251 % INPUT_SIZE] ^= 1 << (bit % 8);
+    }
+    return EXIT_SUCCESS;
+}
+
+int test_02_crc_many() {
+    static char input[INPUT_SIZE];
+    test_fill_random(input, INPUT_SIZE);
+
+    const char *buffers[8];
+    uint32_t    crcs[8];
+    for (size_t n = 0; n <= 8; n++) {
+        debug("Check %zu buffers", n);
+        for (size_t length = 0; length <= 1027; length += 79) {
+            for (size_t i = 0; i < n; i++) {
+                buffers[i] = input + i * 1031 + (i % 3);
+            }
+            crc32c_many(buffers, n, length, crcs);
+            for (size_t i = 0; i < n; i++) {
+                assert(crcs[i] == crc32c_software(0, buffers[i], length));
+            }
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test crc32c known vectors\n");
+        fprintf(stderr, "    1. Test crc32c against software implementation\n");
+        fprintf(stderr, "    2. Test crc32c_many\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    switch (number) {
+        case 0:  status = test_00_crc_vectors(); break;
+        case 1:  status = test_01_crc_software(); break;
+        case 2:  status = test_02_crc_many(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -114,6 +114,139 @@ int test_02_disk_write() {
     return EXIT_SUCCESS;
 }
 
+int test_03_disk_range() {
+    Disk *disk = disk_open(DISK_PATH, DISK_BLOCKS);
+    assert(disk);
+
+    char data[DISK_BLOCKS*BLOCK_SIZE] = {0};
+
+    debug("Check bad disk");
+    assert(disk_read_range(NULL, 0, 1, data) == DISK_FAILURE);
+    assert(disk_write_range(NULL, 0, 1, data) == DISK_FAILURE);
+
+    debug("Check bad range");
+    assert(disk_read_range(disk, 1, DISK_BLOCKS, data) == DISK_FAILURE);
+    assert(disk_write_range(disk, DISK_BLOCKS, 1, data) == DISK_FAILURE);
+    assert(disk_read_range(disk, 0, 0, data) == DISK_FAILURE);
+
+    debug("Check bad data");
+    assert(disk_read_range(disk, 0, 1, NULL) == DISK_FAILURE);
+
+    debug("Check write range");
+    for (size_t i = 0; i < DISK_BLOCKS*BLOCK_SIZE; i++) {
+        data[i] = i / BLOCK_SIZE + 1;
+    }
+    assert(disk_write_range(disk, 0, DISK_BLOCKS, data) == DISK_BLOCKS*BLOCK_SIZE);
+    assert(disk->writes == DISK_BLOCKS);
+
+    debug("Check read range");
+    memset(data, 0, sizeof(data));
+    assert(disk_read_range(disk, 1, DISK_BLOCKS - 1, data) == (DISK_BLOCKS - 1)*BLOCK_SIZE);
+    for (size_t i = 0; i < (DISK_BLOCKS - 1)*BLOCK_SIZE; i++) {
+        assert((unsigned char)data[i] == (unsigned char)(i / BLOCK_SIZE + 2));
+    }
+    assert(disk->reads == DISK_BLOCKS - 1);
+
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_04_disk_vector() {
+    Disk *disk = disk_open(DISK_PATH, DISK_BLOCKS);
+    assert(disk);
+
+    char blocks[DISK_BLOCKS][BLOCK_SIZE];
+    struct iovec iov[DISK_BLOCKS];
+    for (size_t b = 0; b < DISK_BLOCKS; b++) {
+        memset(blocks[b], b + 1, BLOCK_SIZE);
+        iov[DISK_BLOCKS - b - 1].iov_base = blocks[b];
+        iov[DISK_BLOCKS - b - 1].iov_len  = BLOCK_SIZE;
+    }
+
+    debug("Check bad vectors");
+    assert(disk_writev(disk, 0, NULL, 1) == DISK_FAILURE);
+    assert(disk_writev(disk, 0, iov, 0) == DISK_FAILURE);
+    assert(disk_writev(disk, 1, iov, DISK_BLOCKS) == DISK_FAILURE);
+
+    struct iovec half = {blocks[0], BLOCK_SIZE / 2};
+    assert(disk_readv(disk, 0, &half, 1) == DISK_FAILURE);
+
+    debug("Check gather write");
+    assert(disk_writev(disk, 0, iov, DISK_BLOCKS) == DISK_BLOCKS*BLOCK_SIZE);
+    assert(disk->writes == DISK_BLOCKS);
+
+    char data[BLOCK_SIZE];
+    for (size_t b = 0; b < DISK_BLOCKS; b++) {
+        assert(disk_read(disk, b, data) == BLOCK_SIZE);
+        assert((unsigned char)data[0] == (unsigned char)(DISK_BLOCKS - b));
+        assert((unsigned char)data[BLOCK_SIZE - 1] == (unsigned char)(DISK_BLOCKS - b));
+    }
+
+    debug("Check scatter read");
+    memset(blocks, 0, sizeof(blocks));
+    struct iovec split[3] = {
+        {blocks[0], BLOCK_SIZE / 2},
+        {blocks[1], BLOCK_SIZE},
+        {blocks[0] + BLOCK_SIZE / 2, BLOCK_SIZE / 2},
+    };
+    assert(disk_readv(disk, 1, split, 3) == 2*BLOCK_SIZE);
+    assert(disk->reads == DISK_BLOCKS + 2);
+    assert(blocks[0][0] == DISK_BLOCKS - 1);
+    assert(blocks[1][0] == DISK_BLOCKS - 1);
+    assert(blocks[1][BLOCK_SIZE - 1] == DISK_BLOCKS - 2);
+    assert(blocks[0][BLOCK_SIZE - 1] == DISK_BLOCKS - 2);
+
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_05_disk_mmap() {
+    debug("Check bad block size");
+    Disk *disk = disk_open_mode(DISK_PATH, LONG_MAX, DISK_MMAP);
+    assert(disk == NULL);
+
+    disk = disk_open_mode(DISK_PATH, DISK_BLOCKS, DISK_MMAP);
+    assert(disk);
+    assert(disk->map);
+
+    debug("Check bad block");
+    char data[BLOCK_SIZE] = {0};
+    assert(disk_read(disk, DISK_BLOCKS, data) == DISK_FAILURE);
+    assert(disk_block(disk, DISK_BLOCKS) == NULL);
+
+    debug("Check write and read through mapping");
+    for (size_t b = 0; b < DISK_BLOCKS; b++) {
+        memset(data, b + 1, BLOCK_SIZE);
+        assert(disk_write(disk, b, data) == BLOCK_SIZE);
+    }
+    assert(disk->writes == DISK_BLOCKS);
+
+    for (size_t b = 0; b < DISK_BLOCKS; b++) {
+        assert(disk_read(disk, b, data) == BLOCK_SIZE);
+        assert((unsigned char)data[0] == (unsigned char)(b + 1));
+
+        const char *block = disk_block(disk, b);
+        assert(block);
+        assert((unsigned char)block[BLOCK_SIZE - 1] == (unsigned char)(b + 1));
+    }
+    assert(disk->reads == 2*DISK_BLOCKS);
+
+    debug("Check flush");
+    assert(disk_flush(disk));
+    assert(pread(disk->fd, data, BLOCK_SIZE, 2*BLOCK_SIZE) == BLOCK_SIZE);
+    assert(data[0] == 3);
+    disk_close(disk);
+
+    debug("Check fd backend has no mapping");
+    disk = disk_open(DISK_PATH, DISK_BLOCKS);
+    assert(disk);
+    assert(disk->map == NULL);
+    assert(disk_block(disk, 0) == NULL);
+    assert(disk_flush(disk));
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
 /* Main execution */
 
 int main(int argc, char *argv[]) {
@@ -123,6 +256,9 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "    0. Test disk_open\n");
         fprintf(stderr, "    1. Test disk_read\n");
         fprintf(stderr, "    2. Test disk_write\n");
+        fprintf(stderr, "    3. Test disk_read_range/disk_write_range\n");
+        fprintf(stderr, "    4. Test disk_readv/disk_writev\n");
+        fprintf(stderr, "    5. Test disk_open_mode (DISK_MMAP)\n");
         return EXIT_FAILURE;
     }
 
@@ -135,6 +271,9 @@ int main(int argc, char *argv[]) {
         case 0:  status = test_00_disk_open(); break;
         case 1:  status = test_01_disk_read(); break;
         case 2:  status = test_02_disk_write(); break;
+        case 3:  status = test_03_disk_range(); break;
+        case 4:  status = test_04_disk_vector(); break;
+        case 5:  status = test_05_disk_mmap(); break;
         default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
     }
 
@@ -2,17 +2,120 @@
 
 #include "sfs/fs.h"
 #include "sfs/logging.h"
+#include "sfs/utils.h"
 
 #include <assert.h>
 #include <limits.h>
 #include <stdio.h>
+#include <string.h>
 
+#include <pthread.h>
 #include <unistd.h>
 
+/* Constants */
+
+#define THREADS_COUNT   (8)
+#define THREADS_BYTES   (256*BLOCK_SIZE)
+
+/* Structures */
+
+typedef struct {
+    FileSystem *fs;
+    ssize_t     inode_number;
+    bool        ok;
+} ThreadTask;
+
 /* Functions */
 
+void *test_thread_io(void *arg) {
+    ThreadTask *task = arg;
+    char       *data = malloc(THREADS_BYTES);
+    char       *copy = malloc(THREADS_BYTES);
+    assert(data && copy);
+
+    for (size_t i = 0; i < THREADS_BYTES; i++) {
+        data[i] = task->inode_number + i / BLOCK_SIZE;
+    }
+
+    /* Write with uneven chunk sizes so writes straddle blocks */
+    size_t offset = 0;
+    size_t chunk  = 1000;
+    task->ok = true;
+    while (task->ok && offset < THREADS_BYTES) {
+        size_t length = min(chunk, (size_t)THREADS_BYTES - offset);
+        task->ok = fs_write(task->fs, task->inode_number, data + offset, length, offset) == (ssize_t)length;
+        offset  += length;
+        chunk    = chunk * 3 % 20000 + 1;
+    }
+
+    task->ok = task->ok && fs_read(task->fs, task->inode_number, copy, THREADS_BYTES, 0) == THREADS_BYTES;
+    task->ok = task->ok && memcmp(data, copy, THREADS_BYTES) == 0;
+
+    free(data);
+    free(copy);
+    return NULL;
+}
+
 void test_cleanup() {
     unlink("data/image.unit");
+    unlink("data/crash.unit");
+}
+
+size_t test_find_block(Disk *disk, size_t blocks, const char *data) {
+    char buffer[BLOCK_SIZE];
+    for (size_t b = 1; b < blocks; b++) {
+        assert(disk_read(disk, b, buffer) == BLOCK_SIZE);
+        if (memcmp(buffer, data, BLOCK_SIZE) == 0) return b;
+    }
+    return 0;
+}
+
+Disk *test_crash_image(size_t blocks) {
+    FILE *source = fopen("data/image.unit", "r");
+    FILE *target = fopen("data/crash.unit", "w");
+    assert(source && target);
+
+    char data[BLOCK_SIZE];
+    for (size_t b = 0; b < blocks; b++) {
+        assert(fread(data, BLOCK_SIZE, 1, source) == 1);
+        assert(fwrite(data, BLOCK_SIZE, 1, target) == 1);
+    }
+    fclose(source);
+    fclose(target);
+    return disk_open("data/crash.unit", blocks);
+}
+
+typedef struct IterTask IterTask;
+struct IterTask {
+    char       *data;                           /* Buffer to gather extents into */
+    size_t      offset;                         /* Offset expected by next batch */
+    size_t      bytes;                          /* Bytes gathered so far */
+    size_t      batches;                        /* Number of callbacks */
+    size_t      stop;                           /* Stop after this many batches (0 never) */
+};
+
+bool test_iter_gather(const struct iovec *iov, int iovcnt, size_t offset, void *ctx) {
+    IterTask *task = ctx;
+    assert(offset == task->offset);
+    assert(iovcnt > 0 && iovcnt <= FS_ITER_EXTENTS);
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(task->data + task->bytes, iov[i].iov_base, iov[i].iov_len);
+        task->bytes  += iov[i].iov_len;
+        task->offset += iov[i].iov_len;
+    }
+    task->batches++;
+    return task->stop == 0 || task->batches < task->stop;
+}
+
+void test_defrag_report(size_t inode_number, size_t before, size_t after, void *ctx) {
+    assert(before > after);
+    (*(size_t *)ctx)++;
+}
+
+void test_scrub_report(size_t block, void *ctx) {
+    size_t *found = ctx;
+    assert(found[0] < 4);
+    found[1 + found[0]++] = block;
 }
 
 int test_00_fs_mount() {
@@ -24,11 +127,12 @@ int test_00_fs_mount() {
     assert(fs_mount(&fs, disk));
     assert(fs.disk           == disk);
     assert(fs.free_blocks);
-    assert(fs.free_blocks[0] == false);
-    assert(fs.free_blocks[1] == false);
-    assert(fs.free_blocks[2] == false);
-    assert(fs.free_blocks[3] == true);
-    assert(fs.free_blocks[4] == true);
+    assert(bitmap_test(fs.free_blocks, 0) == false);
+    assert(bitmap_test(fs.free_blocks, 1) == false);
+    assert(bitmap_test(fs.free_blocks, 2) == false);
+    assert(bitmap_test(fs.free_blocks, 3) == true);
+    assert(bitmap_test(fs.free_blocks, 4) == true);
+    assert(fs_free_count(&fs) == 2);
 
     debug("Check mounting filesystem (already mounted)");
     assert(fs_mount(&fs, disk) == false);
@@ -43,26 +147,27 @@ int test_00_fs_mount() {
     assert(fs_mount(&fs, disk));
     assert(fs.disk           == disk);
     assert(fs.free_blocks);
-    assert(fs.free_blocks[0] == false);
-    assert(fs.free_blocks[1] == false);
-    assert(fs.free_blocks[2] == false);
-    assert(fs.free_blocks[3] == true);
-    assert(fs.free_blocks[4] == false);
-    assert(fs.free_blocks[5] == false);
-    assert(fs.free_blocks[6] == false);
-    assert(fs.free_blocks[7] == false);
-    assert(fs.free_blocks[8] == false);
-    assert(fs.free_blocks[9] == false);
-    assert(fs.free_blocks[10] == false);
-    assert(fs.free_blocks[11] == false);
-    assert(fs.free_blocks[12] == false);
-    assert(fs.free_blocks[13] == false);
-    assert(fs.free_blocks[14] == false);
-    assert(fs.free_blocks[15] == true);
-    assert(fs.free_blocks[16] == true);
-    assert(fs.free_blocks[17] == true);
-    assert(fs.free_blocks[18] == true);
-    assert(fs.free_blocks[19] == true);
+    assert(bitmap_test(fs.free_blocks, 0) == false);
+    assert(bitmap_test(fs.free_blocks, 1) == false);
+    assert(bitmap_test(fs.free_blocks, 2) == false);
+    assert(bitmap_test(fs.free_blocks, 3) == true);
+    assert(bitmap_test(fs.free_blocks, 4) == false);
+    assert(bitmap_test(fs.free_blocks, 5) == false);
+    assert(bitmap_test(fs.free_blocks, 6) == false);
+    assert(bitmap_test(fs.free_blocks, 7) == false);
+    assert(bitmap_test(fs.free_blocks, 8) == false);
+    assert(bitmap_test(fs.free_blocks, 9) == false);
+    assert(bitmap_test(fs.free_blocks, 10) == false);
+    assert(bitmap_test(fs.free_blocks, 11) == false);
+    assert(bitmap_test(fs.free_blocks, 12) == false);
+    assert(bitmap_test(fs.free_blocks, 13) == false);
+    assert(bitmap_test(fs.free_blocks, 14) == false);
+    assert(bitmap_test(fs.free_blocks, 15) == true);
+    assert(bitmap_test(fs.free_blocks, 16) == true);
+    assert(bitmap_test(fs.free_blocks, 17) == true);
+    assert(bitmap_test(fs.free_blocks, 18) == true);
+    assert(bitmap_test(fs.free_blocks, 19) == true);
+    assert(fs_free_count(&fs) == 6);
 
     debug("Check mounting filesystem (already mounted)");
     assert(fs_mount(&fs, disk) == false);
@@ -115,14 +220,14 @@ int test_02_fs_remove() {
 
     debug("Check removing inode 2");
     assert(fs_remove(&fs, 2));
-    assert(fs.free_blocks[4]);
-    assert(fs.free_blocks[5]);
-    assert(fs.free_blocks[6]);
-    assert(fs.free_blocks[7]);
-    assert(fs.free_blocks[8]);
-    assert(fs.free_blocks[9]);
-    assert(fs.free_blocks[13]);
-    assert(fs.free_blocks[14]);
+    assert(bitmap_test(fs.free_blocks, 4));
+    assert(bitmap_test(fs.free_blocks, 5));
+    assert(bitmap_test(fs.free_blocks, 6));
+    assert(bitmap_test(fs.free_blocks, 7));
+    assert(bitmap_test(fs.free_blocks, 8));
+    assert(bitmap_test(fs.free_blocks, 9));
+    assert(bitmap_test(fs.free_blocks, 13));
+    assert(bitmap_test(fs.free_blocks, 14));
 
     Block block;
     assert(disk_read(fs.disk, 1, block.data) != DISK_FAILURE);
@@ -145,8 +250,11 @@ int test_03_fs_stat() {
     assert(fs_mount(&fs, disk));
 
     debug("Check stat on inode 1");
+    size_t reads = disk->reads;
     assert(fs_stat(&fs, 1) == 965);
     assert(fs_stat(&fs, 2) == -1);
+    assert(fs_stat(&fs, 128) == -1);
+    assert(disk->reads == reads);
 
     fs_unmount(&fs);
     disk_close(disk);
@@ -164,6 +272,2128 @@ int test_03_fs_stat() {
     return EXIT_SUCCESS;
 }
 
+int test_04_fs_allocate_run() {
+    assert(system("cp data/image.20 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", 20);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_mount(&fs, disk));
+    assert(fs_free_count(&fs) == 6);
+
+    size_t length;
+    debug("Check allocating run at goal");
+    assert(fs_allocate_run(&fs, 2, 16, &length) == 16);
+    assert(length == 2);
+    assert(!bitmap_test(fs.free_blocks, 16) && !bitmap_test(fs.free_blocks, 17));
+
+    debug("Check allocating best fit run");
+    assert(fs_allocate_run(&fs, 1, 0, &length) == 3);
+    assert(length == 1);
+    assert(fs_allocate_run(&fs, 2, 16, &length) == 18);
+    assert(length == 2);
+
+    debug("Check allocating partial run");
+    assert(fs_allocate_run(&fs, 4, 0, &length) == 15);
+    assert(length == 1);
+    assert(fs_free_count(&fs) == 0);
+
+    debug("Check allocating run (disk full)");
+    assert(fs_allocate_run(&fs, 1, 0, &length) == 0);
+    assert(length == 0);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_05_fs_create_n() {
+    assert(system("cp data/image.20 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", 20);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_mount(&fs, disk));
+
+    debug("Check creating inodes in batch");
+    ssize_t inodes[256];
+    size_t writes = disk->writes;
+    assert(fs_create_n(&fs, 200, inodes) == 200);
+    assert(disk->writes == writes + 2);
+    assert(inodes[0] == 0);
+    assert(inodes[1] == 1);
+    assert(inodes[2] == 4);
+    assert(inodes[199] == 201);
+    assert(fs_stat(&fs, 201) == 0);
+
+    debug("Check creating inodes in batch after remove");
+    assert(fs_remove(&fs, 1));
+    assert(fs_create(&fs) == 1);
+
+    debug("Check creating inodes in batch (table full)");
+    assert(fs_create_n(&fs, 256, inodes) == 54);
+    assert(inodes[53] == 255);
+    assert(fs_create_n(&fs, 1, inodes) == 0);
+    assert(fs_create(&fs) < 0);
+
+    Block block;
+    assert(disk_read(fs.disk, 2, block.data) != DISK_FAILURE);
+    assert(block.inodes[127].valid == true);
+    assert(block.inodes[127].size  == 0);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_06_fs_mount_options() {
+    const char *images[] = {"data/image.20", "data/image.200"};
+    size_t      blocks[] = {20, 200};
+
+    for (size_t i = 0; i < 2; i++) {
+        Disk *disk = disk_open(images[i], blocks[i]);
+        assert(disk);
+
+        FileSystem serial = {0};
+        assert(fs_mount(&serial, disk));
+
+        debug("Check parallel mount matches serial mount (%s)", images[i]);
+        MountOptions options = {.threads = 4};
+        FileSystem parallel = {0};
+        assert(fs_mount_options(&parallel, disk, &options));
+        assert(parallel.options.threads == 4);
+        assert(fs_free_count(&parallel) == fs_free_count(&serial));
+        assert(bitmap_count(parallel.free_inodes) == bitmap_count(serial.free_inodes));
+        for (size_t b = 0; b < blocks[i]; b++) {
+            assert(bitmap_test(parallel.free_blocks, b) == bitmap_test(serial.free_blocks, b));
+        }
+
+        fs_unmount(&parallel);
+        fs_unmount(&serial);
+        disk_close(disk);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+int test_07_fs_format_mode() {
+    FormatMode modes[] = {FORMAT_FAST, FORMAT_SECURE};
+
+    for (size_t m = 0; m < 2; m++) {
+        assert(system("cp data/image.200 data/image.unit") == EXIT_SUCCESS);
+
+        Disk *disk = disk_open("data/image.unit", 200);
+        assert(disk);
+
+        debug("Check format (%s)", modes[m] == FORMAT_FAST ? "fast" : "secure");
+        FileSystem fs = {0};
+        size_t writes  = disk->writes;
+        size_t flushes = disk->flushes;
+        assert(fs_format_mode(&fs, disk, modes[m]));
+        if (modes[m] == FORMAT_FAST) {
+            assert(disk->writes == writes + 1 + 20);
+        } else {
+            assert(disk->writes == writes + 200);
+        }
+        assert(disk->flushes == flushes + 1);
+
+        Block block;
+        assert(disk_read(disk, 0, block.data) != DISK_FAILURE);
+        assert(block.super.magic_number == MAGIC_NUMBER);
+        assert(block.super.blocks       == 200);
+        assert(block.super.inode_blocks == 20);
+        assert(block.super.inodes       == 20 * INODES_PER_BLOCK);
+
+        debug("Check data blocks are cleared");
+        for (size_t b = 1; b < 200; b++) {
+            assert(disk_read(disk, b, block.data) != DISK_FAILURE);
+            for (size_t i = 0; i < BLOCK_SIZE; i++) {
+                assert(block.data[i] == 0);
+            }
+        }
+
+        debug("Check formatted disk mounts empty");
+        assert(fs_mount(&fs, disk));
+        assert(fs_free_count(&fs) == 200 - 1 - 20);
+        assert(fs_stat(&fs, 0) < 0);
+
+        fs_unmount(&fs);
+        disk_close(disk);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+int test_08_fs_stats() {
+    assert(system("cp data/image.20 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", 20);
+    assert(disk);
+
+    FileSystem fs = {0};
+    FsStats stats = fs_stats(&fs);
+    assert(stats.mount.calls == 0);
+
+    debug("Check stats after mount");
+    assert(fs_mount(&fs, disk));
+    stats = fs_stats(&fs);
+    assert(stats.mount.calls  == 1);
+    assert(stats.mount.errors == 0);
+    assert(stats.disk_read.calls >= 2);
+    assert(stats_percentile(&stats.mount, 50) > 0);
+
+    debug("Check stats of file operations");
+    char data[2*BLOCK_SIZE] = {0};
+    ssize_t inode_number = fs_create(&fs);
+    assert(inode_number >= 0);
+    assert(fs_write(&fs, inode_number, data, sizeof(data), 0) == sizeof(data));
+    assert(fs_read(&fs, inode_number, data, sizeof(data), 0) == sizeof(data));
+    assert(fs_read(&fs, 255, data, sizeof(data), 0) < 0);
+    assert(fs_stat(&fs, inode_number) == sizeof(data));
+    assert(fs_remove(&fs, inode_number));
+
+    stats = fs_stats(&fs);
+    assert(stats.create.calls == 1);
+    assert(stats.write.calls  == 1 && stats.write.bytes == sizeof(data));
+    assert(stats.read.calls   == 2 && stats.read.bytes  == sizeof(data));
+    assert(stats.read.errors  == 1);
+    assert(stats.stat.calls   == 1);
+    assert(stats.remove.calls == 1);
+    assert(stats.alloc_calls  >= 1);
+    assert(stats.disk_write.bytes >= sizeof(data));
+
+    debug("Check stats reset by mount");
+    fs_unmount(&fs);
+    assert(fs_stats(&fs).write.calls == 0);
+    assert(fs_mount(&fs, disk));
+    assert(fs_stats(&fs).write.calls == 0);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_09_fs_threads() {
+    size_t  blocks = 4096;
+    FILE   *stream = fopen("data/image.unit", "w");
+    assert(stream);
+    assert(ftruncate(fileno(stream), blocks*BLOCK_SIZE) == 0);
+    fclose(stream);
+
+    Disk *disk = disk_open("data/image.unit", blocks);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+    assert(fs_set_cache(&fs, CACHE_DEFAULT_BLOCKS));
+    size_t free_blocks = fs_free_count(&fs);
+
+    debug("Check concurrent writes and reads of different inodes");
+    ThreadTask tasks[THREADS_COUNT];
+    pthread_t  threads[THREADS_COUNT];
+    for (size_t t = 0; t < THREADS_COUNT; t++) {
+        tasks[t].fs           = &fs;
+        tasks[t].inode_number = fs_create(&fs);
+        assert(tasks[t].inode_number == (ssize_t)t);
+        assert(pthread_create(&threads[t], NULL, test_thread_io, &tasks[t]) == 0);
+    }
+
+    debug("Check fs_stats while writers run");
+    size_t alloc_calls = 0;
+    size_t cache_hits  = 0;
+    for (size_t s = 0; s < 1000; s++) {
+        FsStats stats = fs_stats(&fs);
+        assert(stats.alloc_calls >= alloc_calls && stats.cache_hits >= cache_hits);
+        alloc_calls = stats.alloc_calls;
+        cache_hits  = stats.cache_hits;
+    }
+
+    for (size_t t = 0; t < THREADS_COUNT; t++) {
+        assert(pthread_join(threads[t], NULL) == 0);
+        assert(tasks[t].ok);
+        assert(fs_stat(&fs, tasks[t].inode_number) == THREADS_BYTES);
+    }
+
+    debug("Check no block was allocated twice");
+    size_t per_file = THREADS_BYTES / BLOCK_SIZE + 1;
+    assert(fs_free_count(&fs) == (ssize_t)(free_blocks - THREADS_COUNT*per_file));
+
+    Bitmap *seen = bitmap_create(blocks, false);
+    for (size_t t = 0; t < THREADS_COUNT; t++) {
+        Inode *node = &fs.inode_table[0].inodes[t];
+        Block  indirect;
+        for (size_t d = 0; d < POINTERS_PER_INODE; d++) {
+            assert(!bitmap_test(seen, node->direct[d]));
+            bitmap_set(seen, node->direct[d]);
+        }
+        assert(!bitmap_test(seen, node->indirect));
+        bitmap_set(seen, node->indirect);
+        assert(fs_sync(&fs));
+        assert(disk_read(disk, node->indirect, indirect.data) != DISK_FAILURE);
+        for (size_t p = 0; p < per_file - 1 - POINTERS_PER_INODE; p++) {
+            assert(!bitmap_test(seen, indirect.pointers[p]));
+            bitmap_set(seen, indirect.pointers[p]);
+        }
+    }
+    assert(bitmap_count(seen) == THREADS_COUNT*per_file);
+    bitmap_delete(seen);
+
+    debug("Check concurrent removes");
+    fs_unmount(&fs);
+    assert(fs_mount(&fs, disk));
+    assert(fs_free_count(&fs) == (ssize_t)(free_blocks - THREADS_COUNT*per_file));
+    for (size_t t = 0; t < THREADS_COUNT; t++) {
+        assert(fs_remove(&fs, tasks[t].inode_number));
+    }
+    assert(fs_free_count(&fs) == (ssize_t)free_blocks);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_10_fs_set_aio() {
+    size_t  blocks = 1024;
+    FILE   *stream = fopen("data/image.unit", "w");
+    assert(stream);
+    assert(ftruncate(fileno(stream), blocks*BLOCK_SIZE) == 0);
+    fclose(stream);
+
+    Disk *disk = disk_open("data/image.unit", blocks);
+    assert(disk);
+
+    FileSystem fs = {0};
+    debug("Check bad file system");
+    assert(fs_set_aio(NULL, AIO_AUTO, AIO_DEFAULT_DEPTH) == false);
+    assert(fs_set_aio(&fs, AIO_AUTO, AIO_DEFAULT_DEPTH)  == false);
+
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+
+    size_t  length = 300*BLOCK_SIZE + 123;
+    char   *data   = malloc(length);
+    char   *buffer = malloc(length);
+    assert(data && buffer);
+    for (size_t i = 0; i < length; i++) {
+        data[i] = i * 7 + i / BLOCK_SIZE;
+    }
+
+    ssize_t inode_number = fs_create(&fs);
+    assert(inode_number >= 0);
+    assert(fs_write(&fs, inode_number, data, length, 0) == (ssize_t)length);
+
+    size_t ranges[][2] = {
+        {0, length}, {1, BLOCK_SIZE}, {BLOCK_SIZE - 1, 2}, {100, 10}, {5*BLOCK_SIZE, 6*BLOCK_SIZE + 1},
+        {length - 200, 1000}, {4*BLOCK_SIZE + 17, 200*BLOCK_SIZE},
+    };
+    AioBackend backends[] = {AIO_AUTO, AIO_THREADS};
+    size_t     caches[]   = {0, CACHE_DEFAULT_BLOCKS};
+
+    for (size_t b = 0; b < sizeof(backends)/sizeof(backends[0]); b++) {
+        for (size_t c = 0; c < sizeof(caches)/sizeof(caches[0]); c++) {
+            debug("Check reads with backend %d and cache %lu", backends[b], caches[c]);
+            assert(fs_set_cache(&fs, caches[c]));
+            assert(fs_set_aio(&fs, backends[b], 8));
+            assert(fs.aio);
+
+            for (size_t r = 0; r < sizeof(ranges)/sizeof(ranges[0]); r++) {
+                size_t  offset   = ranges[r][0];
+                size_t  expected = min(ranges[r][1], length - offset);
+                memset(buffer, 0, length);
+                assert(fs_read(&fs, inode_number, buffer, ranges[r][1], offset) == (ssize_t)expected);
+                assert(memcmp(buffer, data + offset, expected) == 0);
+            }
+            assert(fs_read(&fs, inode_number, buffer, 10, length) == 0);
+        }
+    }
+
+    debug("Check cached writes are visible to asynchronous reads");
+    memset(data + 2*BLOCK_SIZE, 'z', BLOCK_SIZE);
+    assert(fs_write(&fs, inode_number, data + 2*BLOCK_SIZE, BLOCK_SIZE, 2*BLOCK_SIZE) == BLOCK_SIZE);
+    assert(fs_read(&fs, inode_number, buffer, length, 0) == (ssize_t)length);
+    assert(memcmp(buffer, data, length) == 0);
+
+    debug("Check disabling and unmount release engine");
+    assert(fs_set_aio(&fs, AIO_AUTO, 0));
+    assert(fs.aio == NULL);
+    assert(fs_set_aio(&fs, AIO_AUTO, AIO_DEFAULT_DEPTH));
+    fs_unmount(&fs);
+    assert(fs.aio == NULL);
+
+    free(data);
+    free(buffer);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_11_fs_readahead() {
+    size_t  blocks = 1024;
+    FILE   *stream = fopen("data/image.unit", "w");
+    assert(stream);
+    assert(ftruncate(fileno(stream), blocks*BLOCK_SIZE) == 0);
+    fclose(stream);
+
+    Disk *disk = disk_open("data/image.unit", blocks);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+    assert(fs_set_cache(&fs, CACHE_DEFAULT_BLOCKS));
+
+    size_t  length = 400*BLOCK_SIZE;
+    char   *data   = malloc(length);
+    char   *buffer = malloc(length);
+    assert(data && buffer);
+    for (size_t i = 0; i < length; i++) {
+        data[i] = i * 13 + i / BLOCK_SIZE;
+    }
+
+    ssize_t inode_number = fs_create(&fs);
+    assert(inode_number >= 0);
+    assert(fs_write(&fs, inode_number, data, length, 0) == (ssize_t)length);
+    assert(fs_sync(&fs));
+
+    size_t chunks[] = {4*BLOCK_SIZE, BLOCK_SIZE + 100};
+    for (size_t a = 0; a < 2; a++) {
+        for (size_t c = 0; c < sizeof(chunks)/sizeof(chunks[0]); c++) {
+            debug("Check sequential scan in %lu byte chunks (aio %lu)", chunks[c], a);
+            assert(fs_set_cache(&fs, CACHE_DEFAULT_BLOCKS));
+            assert(fs_set_aio(&fs, AIO_AUTO, a ? AIO_DEFAULT_DEPTH : 0));
+
+            size_t reads = disk->reads;
+            size_t calls = fs.disk->read_stats.calls;
+            memset(buffer, 0, length);
+            for (size_t offset = 0; offset < length; offset += chunks[c]) {
+                size_t expected = min(chunks[c], length - offset);
+                assert(fs_read(&fs, inode_number, buffer + offset, chunks[c], offset) == (ssize_t)expected);
+            }
+            assert(memcmp(buffer, data, length) == 0);
+
+            /* Every data block plus the indirect block once (the partial
+             * block of the first unaligned read is fetched again), in far
+             * fewer requests than blocks */
+            assert(disk->reads - reads <= length / BLOCK_SIZE + 2);
+            assert(fs.disk->read_stats.calls - calls < length / BLOCK_SIZE / 4);
+        }
+    }
+
+    debug("Check random reads do not prefetch");
+    assert(fs_set_aio(&fs, AIO_AUTO, 0));
+    assert(fs_set_cache(&fs, CACHE_DEFAULT_BLOCKS));
+    size_t reads = disk->reads;
+    assert(fs_read(&fs, inode_number, buffer, 100, 300*BLOCK_SIZE) == 100);
+    assert(fs_read(&fs, inode_number, buffer, 100, 10*BLOCK_SIZE) == 100);
+    assert(disk->reads - reads <= 4);
+
+    debug("Check writes invalidate pinned indirect block");
+    assert(fs_read(&fs, inode_number, buffer, BLOCK_SIZE, 0) == BLOCK_SIZE);
+    assert(fs_read(&fs, inode_number, buffer, BLOCK_SIZE, BLOCK_SIZE) == BLOCK_SIZE);
+    ssize_t other = fs_create(&fs);
+    assert(other >= 0);
+    assert(fs_remove(&fs, inode_number));
+    assert(fs_create(&fs) == inode_number);
+    memset(data, 'x', length);
+    assert(fs_write(&fs, inode_number, data, length, 0) == (ssize_t)length);
+    assert(fs_read(&fs, inode_number, buffer, length, 0) == (ssize_t)length);
+    assert(memcmp(buffer, data, length) == 0);
+
+    fs_unmount(&fs);
+    assert(fs.streams == NULL);
+    free(data);
+    free(buffer);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_12_fs_read_iter() {
+    size_t  blocks = 1024;
+    FILE   *stream = fopen("data/image.unit", "w");
+    assert(stream);
+    assert(ftruncate(fileno(stream), blocks*BLOCK_SIZE) == 0);
+    fclose(stream);
+
+    size_t  length = 300*BLOCK_SIZE + 77;
+    char   *data   = malloc(length);
+    char   *buffer = malloc(length);
+    assert(data && buffer);
+    for (size_t i = 0; i < length; i++) {
+        data[i] = i * 11 + i / BLOCK_SIZE;
+    }
+
+    DiskMode modes[] = {DISK_FD, DISK_MMAP};
+    for (size_t m = 0; m < sizeof(modes)/sizeof(modes[0]); m++) {
+        Disk *disk = disk_open_mode("data/image.unit", blocks, modes[m]);
+        assert(disk);
+
+        FileSystem fs = {0};
+        assert(fs_format(&fs, disk));
+        assert(fs_mount(&fs, disk));
+        assert(fs_set_cache(&fs, CACHE_DEFAULT_BLOCKS));
+
+        debug("Check bad arguments (mode %d)", modes[m]);
+        IterTask task = {.data = buffer};
+        assert(fs_read_iter(NULL, 0, 0, length, test_iter_gather, &task) < 0);
+        assert(fs_read_iter(&fs, 0, 0, length, NULL, &task) < 0);
+        assert(fs_read_iter(&fs, 0, 0, length, test_iter_gather, &task) < 0);
+        assert(fs_read_iter(&fs, fs.meta_data.inodes, 0, length, test_iter_gather, &task) < 0);
+
+        ssize_t inode_number = fs_create(&fs);
+        assert(inode_number >= 0);
+        assert(fs_read_iter(&fs, inode_number, 0, length, test_iter_gather, &task) == 0);
+        assert(task.batches == 0);
+
+        /* Cached dirty blocks must win over the mapping */
+        assert(fs_write(&fs, inode_number, data, length, 0) == (ssize_t)length);
+
+        size_t ranges[][2] = {{0, length}, {0, SIZE_MAX}, {1, BLOCK_SIZE}, {BLOCK_SIZE - 1, 2}, {length - 5, 100}};
+        for (size_t r = 0; r < sizeof(ranges)/sizeof(ranges[0]); r++) {
+            size_t offset   = ranges[r][0];
+            size_t expected = min(ranges[r][1], length - offset);
+            task = (IterTask){.data = buffer, .offset = offset};
+            assert(fs_read_iter(&fs, inode_number, offset, ranges[r][1], test_iter_gather, &task) == (ssize_t)expected);
+            assert(task.bytes == expected);
+            assert(memcmp(buffer, data + offset, expected) == 0);
+        }
+        assert(fs_read_iter(&fs, inode_number, length, 10, test_iter_gather, &task) == 0);
+
+        debug("Check clean blocks and early stop");
+        assert(fs_sync(&fs));
+        assert(fs_set_cache(&fs, 0));
+        task = (IterTask){.data = buffer};
+        assert(fs_read_iter(&fs, inode_number, 0, length, test_iter_gather, &task) == (ssize_t)length);
+        assert(memcmp(buffer, data, length) == 0);
+        if (modes[m] == DISK_MMAP) {
+            assert(task.batches == 1);
+        }
+
+        task = (IterTask){.data = buffer, .stop = 1};
+        assert(fs_read_iter(&fs, inode_number, 0, length, test_iter_gather, &task) < 0);
+        assert(task.batches == 1);
+
+        fs_unmount(&fs);
+        disk_close(disk);
+    }
+
+    free(data);
+    free(buffer);
+    return EXIT_SUCCESS;
+}
+
+int test_13_fs_write_fresh() {
+    size_t  blocks = 1024;
+    FILE   *stream = fopen("data/image.unit", "w");
+    assert(stream);
+    assert(ftruncate(fileno(stream), blocks*BLOCK_SIZE) == 0);
+    fclose(stream);
+
+    Disk *disk = disk_open("data/image.unit", blocks);
+    assert(disk);
+
+    /* Leave garbage in every block so skipped reads must zero-fill */
+    char junk[BLOCK_SIZE];
+    memset(junk, 0xee, BLOCK_SIZE);
+    for (size_t b = 0; b < blocks; b++) {
+        assert(disk_write(disk, b, junk) == BLOCK_SIZE);
+    }
+
+    FileSystem fs = {0};
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+
+    size_t  length = 20*BLOCK_SIZE + 300;
+    char   *data   = malloc(length);
+    char   *buffer = malloc(length);
+    assert(data && buffer);
+    for (size_t i = 0; i < length; i++) {
+        data[i] = i * 3 + i / BLOCK_SIZE;
+    }
+
+    debug("Check new blocks are not read before writing (only second halves are merged)");
+    ssize_t inode_number = fs_create(&fs);
+    assert(inode_number >= 0);
+    size_t reads = disk->reads;
+    size_t half  = BLOCK_SIZE / 2;
+    for (size_t offset = 0; offset < POINTERS_PER_INODE*BLOCK_SIZE; offset += half) {
+        assert(fs_write(&fs, inode_number, data + offset, half, offset) == (ssize_t)half);
+    }
+    assert(disk->reads - reads == POINTERS_PER_INODE);
+    assert(fs_write(&fs, inode_number, data + POINTERS_PER_INODE*BLOCK_SIZE, length - POINTERS_PER_INODE*BLOCK_SIZE, POINTERS_PER_INODE*BLOCK_SIZE) > 0);
+    assert(fs_read(&fs, inode_number, buffer, length, 0) == (ssize_t)length);
+    assert(memcmp(buffer, data, length) == 0);
+
+    reads = disk->reads;
+    inode_number = fs_create(&fs);
+    assert(fs_write(&fs, inode_number, data, length, 0) == (ssize_t)length);
+    assert(disk->reads == reads);
+
+    debug("Check new partial blocks are zero-filled");
+    inode_number = fs_create(&fs);
+    assert(fs_write(&fs, inode_number, data, 10, 100) == 10);
+    assert(fs_read(&fs, inode_number, buffer, 110, 0) == 110);
+    for (size_t i = 0; i < 100; i++) {
+        assert(buffer[i] == 0);
+    }
+    assert(memcmp(buffer + 100, data, 10) == 0);
+    assert(fs_sync(&fs));
+    assert(disk_read(disk, fs.inode_table[0].inodes[inode_number].direct[0], junk) == BLOCK_SIZE);
+    assert(junk[BLOCK_SIZE - 1] == 0);
+
+    debug("Check partial overwrite keeps existing data");
+    reads = disk->reads;
+    assert(fs_write(&fs, inode_number, data + 500, 50, 50) == 50);
+    assert(disk->reads == reads + 1);
+    assert(fs_read(&fs, inode_number, buffer, 110, 0) == 110);
+    assert(memcmp(buffer + 50, data + 500, 50) == 0);
+    assert(memcmp(buffer + 100, data, 10) == 0);
+
+    fs_unmount(&fs);
+    free(data);
+    free(buffer);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_14_fs_write_metadata() {
+    size_t  blocks = 1024;
+    FILE   *stream = fopen("data/image.unit", "w");
+    assert(stream);
+    assert(ftruncate(fileno(stream), blocks*BLOCK_SIZE) == 0);
+    fclose(stream);
+
+    Disk *disk = disk_open("data/image.unit", blocks);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+
+    size_t  nblocks = 100;
+    size_t  length  = nblocks*BLOCK_SIZE;
+    char   *data    = malloc(length);
+    char   *buffer  = malloc(length);
+    assert(data && buffer);
+    for (size_t i = 0; i < length; i++) {
+        data[i] = i * 7 + i / BLOCK_SIZE;
+    }
+
+    debug("Check new file writes data plus one indirect and one inode block");
+    ssize_t inode_number = fs_create(&fs);
+    assert(inode_number >= 0);
+    size_t writes = disk->writes;
+    assert(fs_write(&fs, inode_number, data, length, 0) == (ssize_t)length);
+    assert(disk->writes - writes == nblocks + 2);
+
+    debug("Check appending to direct blocks records only data and inode");
+    inode_number = fs_create(&fs);
+    assert(fs_write(&fs, inode_number, data, BLOCK_SIZE, 0) == BLOCK_SIZE);
+    writes = disk->writes;
+    assert(fs_write(&fs, inode_number, data + BLOCK_SIZE, 2*BLOCK_SIZE, BLOCK_SIZE) == 2*BLOCK_SIZE);
+    assert(disk->writes - writes == 2 + 1);
+
+    debug("Check overwriting existing data leaves metadata alone");
+    writes = disk->writes;
+    assert(fs_write(&fs, inode_number, data + 10, 2*BLOCK_SIZE, 0) == 2*BLOCK_SIZE);
+    assert(disk->writes - writes == 2);
+    assert(fs_read(&fs, inode_number, buffer, 3*BLOCK_SIZE, 0) == 3*BLOCK_SIZE);
+    assert(memcmp(buffer, data + 10, 2*BLOCK_SIZE) == 0);
+    assert(memcmp(buffer + 2*BLOCK_SIZE, data + 2*BLOCK_SIZE, BLOCK_SIZE) == 0);
+    assert(fs_stat(&fs, inode_number) == 3*BLOCK_SIZE);
+
+    debug("Check metadata survives remount");
+    fs_unmount(&fs);
+    assert(fs_mount(&fs, disk));
+    assert(fs_stat(&fs, 0) == (ssize_t)length);
+    assert(fs_read(&fs, 0, buffer, length, 0) == (ssize_t)length);
+    assert(memcmp(buffer, data, length) == 0);
+
+    fs_unmount(&fs);
+    free(data);
+    free(buffer);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_15_fs_large_files() {
+    size_t  blocks = 4096;
+    FILE   *stream = fopen("data/image.unit", "w");
+    assert(stream);
+    assert(ftruncate(fileno(stream), blocks*BLOCK_SIZE) == 0);
+    fclose(stream);
+
+    Disk *disk = disk_open("data/image.unit", blocks);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+    ssize_t free_count = fs_free_count(&fs);
+
+    size_t  nblocks = 3000;
+    size_t  chunk   = FS_IOV_BLOCKS*BLOCK_SIZE;
+    size_t  length  = nblocks*BLOCK_SIZE;
+    char   *data    = malloc(length);
+    char   *buffer  = malloc(length);
+    assert(data && buffer);
+    for (size_t i = 0; i < length; i++) {
+        data[i] = i * 11 + i / BLOCK_SIZE;
+    }
+
+    debug("Check writing past the indirect block uses double indirect block");
+    ssize_t inode_number = fs_create(&fs);
+    assert(inode_number >= 0);
+    for (size_t offset = 0; offset < length; offset += chunk) {
+        size_t count = min(chunk, length - offset);
+        assert(fs_write(&fs, inode_number, data + offset, count, offset) == (ssize_t)count);
+    }
+    assert(fs_stat(&fs, inode_number) == (ssize_t)length);
+
+    Block  indirect;
+    Inode *node = &fs.inode_table[0].inodes[inode_number];
+    assert(fs_sync(&fs));
+    assert(disk_read(disk, node->indirect, indirect.data) == BLOCK_SIZE);
+    assert(indirect.pointers[INDIRECT_DOUBLE] != 0);
+    assert(indirect.pointers[INDIRECT_TRIPLE] == 0);
+
+    /* data, indirect block, double indirect block and two blocks below it */
+    assert(fs_free_count(&fs) == free_count - (ssize_t)(nblocks + 1 + 1 + 2));
+    assert(fs_read(&fs, inode_number, buffer, length, 0) == (ssize_t)length);
+    assert(memcmp(buffer, data, length) == 0);
+
+    debug("Check unaligned read across double indirect blocks");
+    size_t offset = (POINTERS_PER_INODE + INDIRECT_DOUBLE + POINTERS_PER_BLOCK)*BLOCK_SIZE - 100;
+    assert(fs_read(&fs, inode_number, buffer, 3*BLOCK_SIZE, offset) == 3*BLOCK_SIZE);
+    assert(memcmp(buffer, data + offset, 3*BLOCK_SIZE) == 0);
+
+    debug("Check remount finds blocks below double indirect block");
+    ssize_t used_count = fs_free_count(&fs);
+    fs_unmount(&fs);
+    assert(fs_mount(&fs, disk));
+    assert(fs_free_count(&fs) == used_count);
+    assert(fs_read(&fs, inode_number, buffer, length, 0) == (ssize_t)length);
+    assert(memcmp(buffer, data, length) == 0);
+
+    debug("Check writing at the largest file size");
+    ssize_t sparse = fs_create(&fs);
+    assert(sparse >= 0);
+    assert(fs_write(&fs, sparse, data, 20, FS_MAX_FILE_SIZE - 10) == 10);
+    assert(fs_write(&fs, sparse, data, 20, FS_MAX_FILE_SIZE) == -1);
+    assert(fs_stat(&fs, sparse) == FS_MAX_FILE_SIZE);
+    assert(fs_read(&fs, sparse, buffer, 20, FS_MAX_FILE_SIZE - 10) == 10);
+    assert(memcmp(buffer, data, 10) == 0);
+
+    debug("Check removing large files releases every block");
+    assert(fs_remove(&fs, inode_number));
+    assert(fs_remove(&fs, sparse));
+    assert(fs_free_count(&fs) == free_count);
+    fs_unmount(&fs);
+
+    debug("Check original format is limited to the indirect block");
+    Block super;
+    assert(disk_read(disk, 0, super.data) == BLOCK_SIZE);
+    super.super.magic_number = MAGIC_NUMBER_V1;
+    assert(disk_write(disk, 0, super.data) == BLOCK_SIZE);
+    assert(fs_mount(&fs, disk));
+    inode_number = fs_create(&fs);
+    offset = (POINTERS_PER_INODE + POINTERS_PER_BLOCK - 1)*BLOCK_SIZE;
+    assert(fs_write(&fs, inode_number, data, 2*BLOCK_SIZE, offset) == BLOCK_SIZE);
+    assert(fs_write(&fs, inode_number, data, BLOCK_SIZE, offset + BLOCK_SIZE) == -1);
+    assert(fs_read(&fs, inode_number, buffer, BLOCK_SIZE, offset) == BLOCK_SIZE);
+    assert(memcmp(buffer, data, BLOCK_SIZE) == 0);
+
+    fs_unmount(&fs);
+    free(data);
+    free(buffer);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_16_fs_extents() {
+    size_t  blocks = 4096;
+    FILE   *stream = fopen("data/image.unit", "w");
+    assert(stream);
+    assert(ftruncate(fileno(stream), blocks*BLOCK_SIZE) == 0);
+    fclose(stream);
+
+    Disk *disk = disk_open("data/image.unit", blocks);
+    assert(disk);
+
+    debug("Check format records extents feature");
+    FileSystem    fs      = {0};
+    FormatOptions options = {.mode = FORMAT_FAST, .features = FS_FEATURE_EXTENTS};
+    FormatOptions unknown = {.mode = FORMAT_FAST, .features = 1u<<31};
+    assert(fs_format_options(&fs, disk, NULL) == false);
+    assert(fs_format_options(&fs, disk, &unknown) == false);
+    assert(fs_format_options(&fs, disk, &options));
+    assert(fs_mount(&fs, disk));
+    assert(fs.meta_data.features == FS_FEATURE_EXTENTS);
+    ssize_t free_count = fs_free_count(&fs);
+
+    size_t  nblocks = 1200;
+    size_t  chunk   = FS_IOV_BLOCKS*BLOCK_SIZE;
+    size_t  length  = nblocks*BLOCK_SIZE;
+    char   *data    = malloc(length);
+    char   *buffer  = malloc(length);
+    assert(data && buffer);
+    for (size_t i = 0; i < length; i++) {
+        data[i] = i * 13 + i / BLOCK_SIZE;
+    }
+
+    debug("Check contiguous file is a single extent read without pointer blocks");
+    ssize_t inode_number = fs_create(&fs);
+    assert(inode_number >= 0);
+    for (size_t offset = 0; offset < length; offset += chunk) {
+        size_t count = min(chunk, length - offset);
+        assert(fs_write(&fs, inode_number, data + offset, count, offset) == (ssize_t)count);
+    }
+    Inode *node = &fs.inode_table[0].inodes[inode_number];
+    assert(node->nextents          == 1);
+    assert(node->extent_root       == 0);
+    assert(node->extents[0].length == nblocks);
+    assert(fs_free_count(&fs) == free_count - (ssize_t)nblocks);
+
+    size_t reads = disk->reads;
+    assert(fs_read(&fs, inode_number, buffer, length, 0) == (ssize_t)length);
+    assert(disk->reads - reads == nblocks);
+    assert(memcmp(buffer, data, length) == 0);
+
+    debug("Check interleaved files spill extents into leaves");
+    ssize_t a = fs_create(&fs);
+    ssize_t b = fs_create(&fs);
+    size_t  interleaved = EXTENTS_PER_BLOCK + 100;
+    for (size_t i = 0; i < interleaved; i++) {
+        assert(fs_write(&fs, a, data + i*BLOCK_SIZE, BLOCK_SIZE, i*BLOCK_SIZE) == BLOCK_SIZE);
+        assert(fs_write(&fs, b, data + (i + 1)*BLOCK_SIZE, BLOCK_SIZE, i*BLOCK_SIZE) == BLOCK_SIZE);
+    }
+    Inode *node_a = &fs.inode_table[0].inodes[a];
+    assert(node_a->nextents    == interleaved);
+    assert(node_a->extent_root != 0);
+    assert(fs_read(&fs, a, buffer, interleaved*BLOCK_SIZE, 0) == (ssize_t)(interleaved*BLOCK_SIZE));
+    assert(memcmp(buffer, data, interleaved*BLOCK_SIZE) == 0);
+    assert(fs_read(&fs, b, buffer, interleaved*BLOCK_SIZE, 0) == (ssize_t)(interleaved*BLOCK_SIZE));
+    assert(memcmp(buffer, data + BLOCK_SIZE, interleaved*BLOCK_SIZE) == 0);
+
+    Block root;
+    assert(fs_sync(&fs));
+    assert(disk_read(disk, node_a->extent_root, root.data) == BLOCK_SIZE);
+    assert(root.leaves[0].block != 0 && root.leaves[0].first == 0);
+    assert(root.leaves[1].block != 0 && root.leaves[1].first >  0);
+
+    debug("Check writes into holes split and merge extents");
+    ssize_t sparse = fs_create(&fs);
+    assert(fs_write(&fs, sparse, data, BLOCK_SIZE, 10*BLOCK_SIZE) == BLOCK_SIZE);
+    Inode *node_s = &fs.inode_table[0].inodes[sparse];
+    assert(node_s->nextents          == 2);
+    assert(node_s->extents[0].start  == 0);
+    assert(node_s->extents[0].length == 10);
+    assert(fs_write(&fs, sparse, data + 5*BLOCK_SIZE, BLOCK_SIZE, 5*BLOCK_SIZE) == BLOCK_SIZE);
+    assert(node_s->nextents    == 4);
+    assert(node_s->extent_root != 0);
+    assert(fs_write(&fs, sparse, data, 5*BLOCK_SIZE, 0) == 5*BLOCK_SIZE);
+    assert(fs_write(&fs, sparse, data + 6*BLOCK_SIZE, 4*BLOCK_SIZE, 6*BLOCK_SIZE) == 4*BLOCK_SIZE);
+    assert(fs_stat(&fs, sparse) == 11*BLOCK_SIZE);
+    assert(fs_read(&fs, sparse, buffer, 10*BLOCK_SIZE, 0) == 10*BLOCK_SIZE);
+    assert(memcmp(buffer, data, 10*BLOCK_SIZE) == 0);
+    assert(fs_read(&fs, sparse, buffer, BLOCK_SIZE, 10*BLOCK_SIZE) == BLOCK_SIZE);
+    assert(memcmp(buffer, data, BLOCK_SIZE) == 0);
+
+    debug("Check remount finds extents and extent leaves");
+    ssize_t used_count = fs_free_count(&fs);
+    fs_unmount(&fs);
+    assert(fs_mount(&fs, disk));
+    assert(fs_free_count(&fs) == used_count);
+    assert(fs_read(&fs, a, buffer, interleaved*BLOCK_SIZE, 0) == (ssize_t)(interleaved*BLOCK_SIZE));
+    assert(memcmp(buffer, data, interleaved*BLOCK_SIZE) == 0);
+
+    debug("Check removing extent files releases every block");
+    assert(fs_remove(&fs, inode_number));
+    assert(fs_remove(&fs, a));
+    assert(fs_remove(&fs, b));
+    assert(fs_remove(&fs, sparse));
+    assert(fs_free_count(&fs) == free_count);
+
+    fs_unmount(&fs);
+    free(data);
+    free(buffer);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_17_fs_inline() {
+    size_t  blocks = 200;
+    FILE   *stream = fopen("data/image.unit", "w");
+    assert(stream);
+    assert(ftruncate(fileno(stream), blocks*BLOCK_SIZE) == 0);
+    fclose(stream);
+
+    Disk *disk = disk_open("data/image.unit", blocks);
+    assert(disk);
+
+    char data[2*BLOCK_SIZE];
+    char buffer[2*BLOCK_SIZE];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = 'A' + i % 47;
+    }
+
+    const uint32_t features[] = {FS_FEATURE_INLINE, FS_FEATURE_INLINE | FS_FEATURE_EXTENTS};
+    for (size_t f = 0; f < sizeof(features) / sizeof(features[0]); f++) {
+        debug("Check format with inline data uses larger Inode records (features %u)", features[f]);
+        FileSystem    fs      = {0};
+        FormatOptions options = {.mode = FORMAT_FAST, .features = features[f]};
+        assert(fs_format_options(&fs, disk, &options));
+        assert(fs_mount(&fs, disk));
+        assert(fs.meta_data.inodes == fs.meta_data.inode_blocks * INLINE_INODES_PER_BLOCK);
+        ssize_t free_count = fs_free_count(&fs);
+
+        debug("Check small files are stored and read from the Inode table");
+        ssize_t small = fs_create(&fs);
+        ssize_t last  = fs.meta_data.inodes - 1;
+        assert(small >= 0);
+        assert(fs_write(&fs, small, data, 60, 0) == 60);
+        assert(fs_write(&fs, small, data + 60, 40, 60) == 40);
+        assert(fs_free_count(&fs) == free_count);
+
+        size_t reads = disk->reads;
+        assert(fs_stat(&fs, small) == 100);
+        assert(fs_read(&fs, small, buffer, sizeof(buffer), 0) == 100);
+        assert(memcmp(buffer, data, 100) == 0);
+        assert(fs_read(&fs, small, buffer, 10, 95) == 5);
+        assert(memcmp(buffer, data + 95, 5) == 0);
+        assert(fs_read(&fs, small, buffer, 10, 100) == 0);
+
+        IterTask task = {.data = buffer};
+        assert(fs_read_iter(&fs, small, 0, SIZE_MAX, test_iter_gather, &task) == 100);
+        assert(task.batches == 1);
+        assert(memcmp(buffer, data, 100) == 0);
+        assert(disk->reads == reads);
+
+        debug("Check writes past end of inline file leave zeros");
+        ssize_t gap = fs_create(&fs);
+        assert(gap >= 0);
+        assert(fs_write(&fs, gap, data, 10, INLINE_DATA_SIZE - 10) == 10);
+        assert(fs_read(&fs, gap, buffer, INLINE_DATA_SIZE, 0) == INLINE_DATA_SIZE);
+        for (size_t i = 0; i < INLINE_DATA_SIZE - 10; i++) {
+            assert(buffer[i] == 0);
+        }
+        assert(memcmp(buffer + INLINE_DATA_SIZE - 10, data, 10) == 0);
+        assert(fs_free_count(&fs) == free_count);
+
+        debug("Check empty writes past inline record leave file inline");
+        ssize_t empty_file = fs_create(&fs);
+        assert(empty_file >= 0);
+        assert(fs_write(&fs, empty_file, data, 0, INLINE_DATA_SIZE + 100) == 0);
+        assert(fs_write(&fs, gap, data, 0, 2*BLOCK_SIZE) == 0);
+        assert(fs_stat(&fs, empty_file) == 0);
+        assert(fs_stat(&fs, gap) == INLINE_DATA_SIZE);
+        assert(fs_free_count(&fs) == free_count);
+        assert(fs_remove(&fs, empty_file));
+
+        debug("Check inline file moves to blocks once it outgrows its record");
+        assert(fs_write(&fs, small, data + 100, 2*BLOCK_SIZE - 100, 100) == 2*BLOCK_SIZE - 100);
+        assert(fs_stat(&fs, small) == 2*BLOCK_SIZE);
+        assert(fs_free_count(&fs) < free_count);
+        assert(fs_read(&fs, small, buffer, sizeof(buffer), 0) == 2*BLOCK_SIZE);
+        assert(memcmp(buffer, data, 2*BLOCK_SIZE) == 0);
+
+        ssize_t grown = fs_create(&fs);
+        assert(grown >= 0);
+        assert(fs_write(&fs, grown, data, 50, 0) == 50);
+        assert(fs_write(&fs, grown, data + 30, 200, 30) == 200);
+        assert(fs_read(&fs, grown, buffer, sizeof(buffer), 0) == 230);
+        assert(memcmp(buffer, data, 230) == 0);
+
+        debug("Check remount keeps inline data and block accounting");
+        while (fs_create(&fs) >= 0 && fs_stat(&fs, last) < 0);
+        assert(fs_write(&fs, last, data, INLINE_DATA_SIZE, 0) == INLINE_DATA_SIZE);
+        ssize_t used_count = fs_free_count(&fs);
+        fs_unmount(&fs);
+        assert(fs_mount(&fs, disk));
+        assert(fs_free_count(&fs) == used_count);
+        assert(fs_read(&fs, gap, buffer, sizeof(buffer), 0) == INLINE_DATA_SIZE);
+        assert(memcmp(buffer + INLINE_DATA_SIZE - 10, data, 10) == 0);
+        assert(fs_read(&fs, last, buffer, sizeof(buffer), 0) == INLINE_DATA_SIZE);
+        assert(memcmp(buffer, data, INLINE_DATA_SIZE) == 0);
+        assert(fs_read(&fs, small, buffer, sizeof(buffer), 0) == 2*BLOCK_SIZE);
+        assert(memcmp(buffer, data, 2*BLOCK_SIZE) == 0);
+
+        debug("Check removing files clears their records and releases blocks");
+        for (ssize_t inode_number = 0; inode_number < (ssize_t)fs.meta_data.inodes; inode_number++) {
+            assert(fs_remove(&fs, inode_number));
+        }
+        assert(fs_free_count(&fs) == free_count);
+        const InlineInode empty = {{0}};
+        for (size_t r = 0; r < INLINE_INODES_PER_BLOCK; r++) {
+            assert(memcmp(&fs.inode_table[0].inline_inodes[r], &empty, sizeof(InlineInode)) == 0);
+        }
+        fs_unmount(&fs);
+    }
+
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_18_fs_remove_many() {
+    size_t  blocks = 1000;
+    FILE   *stream = fopen("data/image.unit", "w");
+    assert(stream);
+    assert(ftruncate(fileno(stream), blocks*BLOCK_SIZE) == 0);
+    fclose(stream);
+
+    Disk *disk = disk_open("data/image.unit", blocks);
+    assert(disk);
+
+    size_t  nfiles = 8;
+    size_t  length = 20*BLOCK_SIZE;
+    char   *data   = calloc(1, length);
+    assert(data);
+
+    FileSystem fs = {0};
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+    ssize_t free_count = fs_free_count(&fs);
+
+    debug("Check fs_remove_many writes the Inode block once and leaves indirect blocks alone");
+    size_t inodes[nfiles + 1];
+    for (size_t f = 0; f < nfiles; f++) {
+        ssize_t inode_number = fs_create(&fs);
+        assert(inode_number >= 0);
+        assert(fs_write(&fs, inode_number, data, length, 0) == (ssize_t)length);
+        inodes[f] = inode_number;
+    }
+    inodes[nfiles] = fs.meta_data.inodes - 1;
+
+    size_t writes = disk->writes;
+    assert(fs_remove_many(&fs, inodes, nfiles + 1) == (ssize_t)nfiles);
+    assert(disk->writes == writes + 1);
+    assert(fs_free_count(&fs) == free_count);
+    for (size_t f = 0; f < nfiles; f++) {
+        assert(fs_stat(&fs, inodes[f]) == -1);
+    }
+    assert(fs_remove_many(&fs, inodes, nfiles) == 0);
+    assert(fs_remove_many(&fs, inodes, 0) == 0);
+    assert(fs_remove_many(&fs, NULL, 1) == -1);
+    assert(fs_remove_many(NULL, inodes, 1) == -1);
+    fs_unmount(&fs);
+
+    debug("Check deferred removal frees Inodes at once and blocks in the background");
+    MountOptions options = {.deferred_reclaim = true};
+    assert(fs_mount_options(&fs, disk, &options));
+    assert(fs.reclaim.started);
+    for (size_t f = 0; f < nfiles; f++) {
+        assert((size_t)fs_create(&fs) == inodes[f]);
+        assert(fs_write(&fs, inodes[f], data, length, 0) == (ssize_t)length);
+    }
+    ssize_t used_count = fs_free_count(&fs);
+    assert(used_count < free_count);
+
+    writes = disk->writes;
+    assert(fs_remove_many(&fs, inodes, nfiles / 2) == (ssize_t)(nfiles / 2));
+    assert(fs_remove(&fs, inodes[nfiles / 2]));
+    assert(disk->writes == writes + 2);
+    assert(fs_stat(&fs, inodes[0]) == -1);
+    assert((size_t)fs_create(&fs) == inodes[0]);
+    assert(fs_sync(&fs));
+    assert(fs_free_count(&fs) > used_count);
+
+    debug("Check writes on a full disk wait for deferred reclamation");
+    ssize_t filler = fs_create(&fs);
+    size_t  filled = 0;
+    assert(filler >= 0);
+    while (fs_write(&fs, filler, data, length, filled) == (ssize_t)length) {
+        filled += length;
+    }
+    assert(fs_free_count(&fs) == 0);
+    assert(fs_remove(&fs, filler));
+    assert((filler = fs_create(&fs)) >= 0);
+    for (size_t offset = 0; offset < filled; offset += length) {
+        assert(fs_write(&fs, filler, data, length, offset) == (ssize_t)length);
+    }
+    assert(fs_remove(&fs, filler));
+    assert(fs_sync(&fs));
+
+    debug("Check next mount scan reclaims blocks left behind by unmount");
+    assert(fs_remove_many(&fs, inodes, nfiles) == (ssize_t)(nfiles - nfiles / 2));
+    fs_unmount(&fs);
+    assert(fs.reclaim.started == false);
+    assert(fs_mount(&fs, disk));
+    assert(fs_free_count(&fs) == free_count);
+    fs_unmount(&fs);
+
+    free(data);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_19_fs_journal() {
+    size_t  blocks = 1000;
+    FILE   *stream = fopen("data/image.unit", "w");
+    assert(stream);
+    assert(ftruncate(fileno(stream), blocks*BLOCK_SIZE) == 0);
+    fclose(stream);
+
+    Disk *disk = disk_open("data/image.unit", blocks);
+    assert(disk);
+
+    char data[BLOCK_SIZE];
+    char buffer[BLOCK_SIZE];
+    memset(data, 'j', BLOCK_SIZE);
+
+    debug("Check format reserves journal after Inode table");
+    FileSystem    fs      = {0};
+    FormatOptions options = {.mode = FORMAT_FAST, .features = FS_FEATURE_JOURNAL};
+    assert(fs_format_options(&fs, disk, &options));
+    assert(fs_mount(&fs, disk));
+    size_t journal_start  = fs.meta_data.inode_blocks + 1;
+    size_t journal_blocks = fs.meta_data.journal_blocks;
+    assert(journal_blocks >= FS_JOURNAL_MIN && journal_blocks <= FS_JOURNAL_BLOCKS);
+    assert(fs_free_count(&fs) == (ssize_t)(blocks - journal_start - journal_blocks));
+    assert(fs.journal.capacity == journal_blocks / 2 - 1);
+    fs_unmount(&fs);
+
+    debug("Check small updates share one commit and one disk flush");
+    MountOptions mount = {.commit_ms = 60000};
+    assert(fs_mount_options(&fs, disk, &mount));
+    size_t flushes = disk->flushes;
+    size_t nfiles  = 20;
+    for (size_t f = 0; f < nfiles; f++) {
+        assert(fs_create(&fs) == (ssize_t)f);
+        assert(fs_write(&fs, f, data, 100 + f, 0) == (ssize_t)(100 + f));
+    }
+    assert(disk->flushes == flushes);
+    assert(fs.journal.count == 1);
+    assert(fs_stat(&fs, nfiles - 1) == (ssize_t)(100 + nfiles - 1));
+    Inode node = fs.inode_table[0].inodes[0];
+    assert(node.direct[0] >= journal_start + journal_blocks);
+    assert(fs_sync(&fs));
+    assert(disk->flushes == flushes + 1);
+    assert(fs_stats(&fs).commits == 1);
+    assert(fs.journal.count == 0);
+    assert(fs_sync(&fs));
+    assert(disk->flushes == flushes + 1);
+    fs_unmount(&fs);
+
+    debug("Check group commit window");
+    mount.commit_ms = 1;
+    assert(fs_mount_options(&fs, disk, &mount));
+    flushes = disk->flushes;
+    assert(fs_write(&fs, 0, data, BLOCK_SIZE, 0) == BLOCK_SIZE);
+    usleep(2000);
+    assert(fs_write(&fs, 1, data, BLOCK_SIZE, 0) == BLOCK_SIZE);
+    assert(disk->flushes == flushes + 1);
+    fs_unmount(&fs);
+
+    debug("Check mount replays committed Inode blocks lost before checkpoint");
+    char zero[BLOCK_SIZE] = {0};
+    assert(disk_write(disk, 1, zero) == BLOCK_SIZE);
+    assert(fs_mount(&fs, disk));
+    for (size_t f = 0; f < nfiles; f++) {
+        assert(fs_stat(&fs, f) == (ssize_t)(f < 2 ? BLOCK_SIZE : 100 + f));
+    }
+    assert(fs_read(&fs, 0, buffer, BLOCK_SIZE, 0) == BLOCK_SIZE);
+    assert(memcmp(buffer, data, BLOCK_SIZE) == 0);
+
+    debug("Check torn record is ignored in favor of the previous one");
+    ssize_t added = fs_create(&fs);
+    assert(added == (ssize_t)nfiles);
+    assert(fs_sync(&fs));
+    uint32_t torn = fs.journal.sequence - 1;
+    fs_unmount(&fs);
+
+    size_t record = journal_start + (torn % 2)*(journal_blocks / 2);
+    Block  header;
+    assert(disk_read(disk, record, header.data) == BLOCK_SIZE);
+    assert(header.journal.magic == JOURNAL_MAGIC && header.journal.sequence == torn);
+    assert(disk_write(disk, record + 1, zero) == BLOCK_SIZE);
+    assert(disk_write(disk, 1, zero) == BLOCK_SIZE);
+    assert(fs_mount(&fs, disk));
+    assert(fs_stat(&fs, added) == -1);
+    assert(fs_stat(&fs, 0) == BLOCK_SIZE);
+    assert(fs.journal.sequence == torn);
+    fs_unmount(&fs);
+
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_20_fs_bitmap() {
+    size_t  blocks = 40000;
+    FILE   *stream = fopen("data/image.unit", "w");
+    assert(stream);
+    assert(ftruncate(fileno(stream), blocks*BLOCK_SIZE) == 0);
+    fclose(stream);
+
+    Disk *disk = disk_open("data/image.unit", blocks);
+    assert(disk);
+
+    char data[4*BLOCK_SIZE];
+    memset(data, 'b', sizeof(data));
+
+    debug("Check format stores bitmap after Inode table and marks it clean");
+    FileSystem    fs      = {0};
+    FormatOptions options = {.mode = FORMAT_FAST, .features = FS_FEATURE_BITMAP | FS_FEATURE_JOURNAL};
+    assert(fs_format_options(&fs, disk, &options));
+    Block super;
+    assert(disk_read(disk, 0, super.data) == BLOCK_SIZE);
+    assert(super.super.bitmap_blocks == 2);
+    assert(super.super.clean);
+    size_t data_start = super.super.inode_blocks + 1 + 2 + super.super.journal_blocks;
+
+    debug("Check clean mount loads stored bitmap and marks SuperBlock not clean");
+    assert(fs_mount(&fs, disk));
+    assert(fs.stored_blocks != NULL);
+    assert(fs_free_count(&fs) == (ssize_t)(blocks - data_start));
+    assert(disk_read(disk, 0, super.data) == BLOCK_SIZE);
+    assert(super.super.clean == 0);
+
+    for (size_t f = 0; f < 4; f++) {
+        assert(fs_create(&fs) == (ssize_t)f);
+        assert(fs_write(&fs, f, data, sizeof(data), 0) == sizeof(data));
+    }
+    assert(fs_remove(&fs, 1));
+    ssize_t free_count = fs_free_count(&fs);
+    assert(free_count == (ssize_t)(blocks - data_start - 3*4));
+
+    debug("Check unmount only writes changed bitmap block and SuperBlock");
+    assert(fs_sync(&fs));
+    size_t writes = disk->writes;
+    fs_unmount(&fs);
+    assert(disk->writes == writes + 2);
+    assert(disk_read(disk, 0, super.data) == BLOCK_SIZE);
+    assert(super.super.clean);
+
+    assert(fs_mount(&fs, disk));
+    assert(fs.stored_blocks != NULL);
+    assert(fs_free_count(&fs) == free_count);
+    assert(fs_create(&fs) == 1);
+    assert(fs_write(&fs, 1, data, BLOCK_SIZE, 0) == BLOCK_SIZE);
+    assert(fs_sync(&fs));
+    free_count = fs_free_count(&fs);
+
+    debug("Check unclean shutdown falls back to scan");
+    fs.clean = false;
+    fs_unmount(&fs);
+    assert(disk_read(disk, 0, super.data) == BLOCK_SIZE);
+    assert(super.super.clean == 0);
+    assert(fs_mount(&fs, disk));
+    assert(fs.stored_blocks == NULL);
+    assert(fs_free_count(&fs) == free_count);
+    assert(fs_remove(&fs, 1));
+    free_count = fs_free_count(&fs);
+    fs_unmount(&fs);
+
+    debug("Check stored bitmap marking meta data free is rejected");
+    Block bitmap;
+    memset(bitmap.data, 0xff, BLOCK_SIZE);
+    assert(disk_write(disk, super.super.inode_blocks + 1, bitmap.data) == BLOCK_SIZE);
+    assert(fs_mount(&fs, disk));
+    assert(fs.stored_blocks == NULL);
+    assert(fs_free_count(&fs) == free_count);
+    fs_unmount(&fs);
+
+    assert(fs_mount(&fs, disk));
+    assert(fs.stored_blocks != NULL);
+    assert(fs_free_count(&fs) == free_count);
+    fs_unmount(&fs);
+
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_21_fs_defrag() {
+    size_t  blocks = 1000;
+    FILE   *stream = fopen("data/image.unit", "w");
+    assert(stream);
+    assert(ftruncate(fileno(stream), blocks*BLOCK_SIZE) == 0);
+    fclose(stream);
+
+    Disk *disk = disk_open("data/image.unit", blocks);
+    assert(disk);
+
+    size_t  nfiles  = 3;
+    size_t  nblocks = 12;
+    size_t  length  = nblocks*BLOCK_SIZE - 100;
+    char   *data    = malloc(nfiles*length);
+    char   *buffer  = malloc(length);
+    assert(data && buffer);
+    for (size_t i = 0; i < nfiles*length; i++) {
+        data[i] = i / 97;
+    }
+
+    const uint32_t features[] = {0, FS_FEATURE_EXTENTS, FS_FEATURE_JOURNAL};
+    size_t         caches[]   = {0, CACHE_DEFAULT_BLOCKS};
+    for (size_t f = 0; f < sizeof(features) / sizeof(features[0]); f++) {
+        for (size_t c = 0; c < sizeof(caches) / sizeof(caches[0]); c++) {
+            debug("Check interleaved appends fragment files (features %u, cache %lu)", features[f], caches[c]);
+            FileSystem    fs      = {0};
+            FormatOptions options = {.mode = FORMAT_FAST, .features = features[f]};
+            assert(fs_format_options(&fs, disk, &options));
+            assert(fs_mount(&fs, disk));
+            assert(fs_set_cache(&fs, caches[c]));
+            for (size_t n = 0; n < nfiles; n++) {
+                assert(fs_create(&fs) == (ssize_t)n);
+            }
+            // two blocks at a time, so relocation copies multi-block runs
+            for (size_t offset = 0; offset < length; offset += 2*BLOCK_SIZE) {
+                size_t chunk = min((size_t)(2*BLOCK_SIZE), length - offset);
+                for (size_t n = 0; n < nfiles; n++) {
+                    assert(fs_write(&fs, n, data + n*length + offset, chunk, offset) == (ssize_t)chunk);
+                }
+            }
+            for (size_t n = 0; n < nfiles; n++) {
+                assert(fs_fragmentation(&fs, n) > 0);
+            }
+            assert(fs_fragmentation(&fs, nfiles) == -1);
+            assert(fs_fragmentation(&fs, fs.meta_data.inodes) == -1);
+            ssize_t free_count = fs_free_count(&fs);
+
+            debug("Check defrag stops at a file that does not fit what is left of the budget");
+            size_t reports = 0;
+            assert(fs_defrag(&fs, nblocks + nblocks / 2, test_defrag_report, &reports) == (ssize_t)nblocks);
+            assert(reports == 1);
+            assert(fs_fragmentation(&fs, 0) == 0);
+            assert(fs_fragmentation(&fs, 1) > 0);
+            assert(fs.defrag_next == 1);
+
+            debug("Check defrag skips files larger than the whole budget");
+            assert(fs_defrag(&fs, nblocks - 1, test_defrag_report, &reports) == 0);
+            assert(reports == 1);
+
+            debug("Check defrag relocates remaining files and keeps their contents");
+            assert(fs_defrag(&fs, SIZE_MAX, test_defrag_report, &reports) == (ssize_t)((nfiles - 1)*nblocks));
+            assert(reports == nfiles);
+            for (size_t n = 0; n < nfiles; n++) {
+                assert(fs_fragmentation(&fs, n) == 0);
+                assert(fs_read(&fs, n, buffer, length, 0) == (ssize_t)length);
+                assert(memcmp(buffer, data + n*length, length) == 0);
+            }
+            // extent files that became contiguous give back their extent leaves
+            assert(fs_free_count(&fs) >= free_count);
+            free_count = fs_free_count(&fs);
+            assert(fs_defrag(&fs, SIZE_MAX, NULL, NULL) == 0);
+            fs_unmount(&fs);
+
+            debug("Check relocated blocks survive remount");
+            assert(fs_mount(&fs, disk));
+            assert(fs_set_cache(&fs, caches[c]));
+            assert(fs_free_count(&fs) == free_count);
+            for (size_t n = 0; n < nfiles; n++) {
+                assert(fs_read(&fs, n, buffer, length, 0) == (ssize_t)length);
+                assert(memcmp(buffer, data + n*length, length) == 0);
+            }
+            fs_unmount(&fs);
+        }
+    }
+
+    free(buffer);
+    free(data);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_22_fs_handles() {
+    size_t  blocks = 1000;
+    FILE   *stream = fopen("data/image.unit", "w");
+    assert(stream);
+    assert(ftruncate(fileno(stream), blocks*BLOCK_SIZE) == 0);
+    fclose(stream);
+
+    Disk *disk = disk_open("data/image.unit", blocks);
+    assert(disk);
+
+    size_t  length = 12*BLOCK_SIZE + 300;
+    size_t  chunk  = 100;
+    char   *data   = malloc(2*length);
+    char   *buffer = malloc(2*length);
+    assert(data && buffer);
+    for (size_t i = 0; i < 2*length; i++) {
+        data[i] = i / 89;
+    }
+
+    const uint32_t features[] = {0, FS_FEATURE_EXTENTS, FS_FEATURE_INLINE | FS_FEATURE_JOURNAL};
+    for (size_t f = 0; f < sizeof(features) / sizeof(features[0]); f++) {
+        FileSystem    fs      = {0};
+        FormatOptions options = {.mode = FORMAT_FAST, .features = features[f]};
+        assert(fs_format_options(&fs, disk, &options));
+        assert(fs_mount(&fs, disk));
+        assert(fs_create(&fs) == 0);
+
+        debug("Check bad handles (features %u)", features[f]);
+        assert(fs_open(NULL, 0) == NULL);
+        assert(fs_open(&fs, 1) == NULL);
+        assert(fs_open(&fs, fs.meta_data.inodes) == NULL);
+        assert(fs_pread(NULL, buffer, chunk, 0) == -1);
+        assert(fs_pwrite(NULL, data, chunk, 0) == -1);
+        assert(fs_append(NULL, data, chunk) == -1);
+        assert(fs_hread(NULL, buffer, chunk) == -1);
+        assert(fs_hwrite(NULL, data, chunk) == -1);
+        fs_close(NULL);
+
+        debug("Check small sequential writes through handle");
+        FsHandle *handle = fs_open(&fs, 0);
+        assert(handle);
+        assert(handle->offset == 0);
+        for (size_t offset = 0; offset < length; offset += chunk) {
+            size_t count = min(chunk, length - offset);
+            assert(fs_hwrite(handle, data + offset, count) == (ssize_t)count);
+        }
+        assert(handle->offset == length);
+        assert(fs_stat(&fs, 0) == (ssize_t)length);
+
+        debug("Check scattered small reads only read data blocks");
+        size_t reads = disk->reads;
+        size_t calls = 50;
+        for (size_t c = 0, offset = length - chunk; c < calls; c++, offset = (7*offset + 1234) % (length - chunk)) {
+            assert(fs_pread(handle, buffer, chunk, offset) == (ssize_t)chunk);
+            assert(memcmp(buffer, data + offset, chunk) == 0);
+        }
+        assert(disk->reads <= reads + calls);
+        assert(handle->offset == length);
+        assert(fs_read(&fs, 0, buffer, length, 0) == (ssize_t)length);
+        assert(memcmp(buffer, data, length) == 0);
+
+        debug("Check handle sees writes made without it");
+        assert(fs_write(&fs, 0, data + length, length, length) == (ssize_t)length);
+        assert(fs_pread(handle, buffer, 2*length, 0) == (ssize_t)(2*length));
+        assert(memcmp(buffer, data, 2*length) == 0);
+
+        debug("Check append and cursor");
+        assert(fs_append(handle, data, chunk) == (ssize_t)chunk);
+        assert(handle->offset == 2*length + chunk);
+        assert(fs_stat(&fs, 0) == (ssize_t)(2*length + chunk));
+        assert(fs_seek(handle, 2*length) == 2*length);
+        assert(fs_hread(handle, buffer, 2*chunk) == (ssize_t)chunk);
+        assert(memcmp(buffer, data, chunk) == 0);
+        assert(fs_hread(handle, buffer, chunk) == 0);
+
+        IterTask task = {.data = buffer, .offset = length};
+        assert(fs_pread_iter(handle, length, length, test_iter_gather, &task) == (ssize_t)length);
+        assert(memcmp(buffer, data + length, length) == 0);
+        fs_close(handle);
+
+        debug("Check small file grows out of its Inode through handle");
+        assert(fs_create(&fs) == 1);
+        handle = fs_open(&fs, 1);
+        assert(handle);
+        for (size_t offset = 0; offset < length; offset += chunk) {
+            size_t count = min(chunk, length - offset);
+            assert(fs_append(handle, data + offset, count) == (ssize_t)count);
+            assert(fs_pread(handle, buffer, count, offset) == (ssize_t)count);
+            assert(memcmp(buffer, data + offset, count) == 0);
+        }
+        assert(handle->offset == length);
+
+        debug("Check removed Inode fails through handle");
+        assert(fs_remove(&fs, 1));
+        assert(fs_pread(handle, buffer, chunk, 0) == -1);
+        assert(fs_hwrite(handle, data, chunk) == -1);
+        fs_close(handle);
+        fs_unmount(&fs);
+
+        debug("Check handle writes survive remount");
+        assert(fs_mount(&fs, disk));
+        assert(fs_read(&fs, 0, buffer, 2*length, 0) == (ssize_t)(2*length));
+        assert(memcmp(buffer, data, 2*length) == 0);
+        fs_unmount(&fs);
+    }
+
+    free(buffer);
+    free(data);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_23_fs_clone() {
+    size_t  blocks = 3000;
+    FILE   *stream = fopen("data/image.unit", "w");
+    assert(stream);
+    assert(ftruncate(fileno(stream), blocks*BLOCK_SIZE) == 0);
+    fclose(stream);
+
+    Disk *disk = disk_open("data/image.unit", blocks);
+    assert(disk);
+
+    // long enough to reach the double indirect tree of pointer Inodes
+    size_t  length = 1100*BLOCK_SIZE + 300;
+    size_t  chunk  = BLOCK_SIZE + 200;
+    size_t  early  = 3*BLOCK_SIZE + 100;
+    size_t  late   = 1050*BLOCK_SIZE + 100;
+    char   *data   = malloc(length);
+    char   *patch  = malloc(length);
+    char   *buffer = malloc(length);
+    assert(data && patch && buffer);
+    for (size_t i = 0; i < length; i++) {
+        data[i]  = i / 89;
+        patch[i] = i / 89;
+    }
+    memset(patch + early, 'x', chunk);
+
+    debug("Check clones need FS_FEATURE_CLONE");
+    FileSystem    fs      = {0};
+    FormatOptions options = {.mode = FORMAT_FAST};
+    assert(fs_format_options(&fs, disk, &options));
+    assert(fs_mount(&fs, disk));
+    assert(fs_create(&fs) == 0);
+    assert(fs_clone(&fs, 0) == -1);
+    assert(fs_clone(NULL, 0) == -1);
+    fs_unmount(&fs);
+
+    const uint32_t features[] = {
+        FS_FEATURE_CLONE,
+        FS_FEATURE_CLONE | FS_FEATURE_EXTENTS,
+        FS_FEATURE_CLONE | FS_FEATURE_INLINE | FS_FEATURE_JOURNAL | FS_FEATURE_BITMAP,
+    };
+    for (size_t f = 0; f < sizeof(features) / sizeof(features[0]); f++) {
+        debug("Check clone shares data blocks (features %u)", features[f]);
+        MountOptions mount = {.threads = 4};
+        options.features   = features[f];
+        assert(fs_format_options(&fs, disk, &options));
+        assert(fs_mount(&fs, disk));
+        ssize_t empty = fs_free_count(&fs);
+        assert(fs_create(&fs) == 0);
+        assert(fs_write(&fs, 0, data, length, 0) == (ssize_t)length);
+        ssize_t written = fs_free_count(&fs);
+
+        assert(fs_clone(&fs, 0) == 1);
+        assert(fs_free_count(&fs) >= written - FS_INDIRECT_DEPTH);
+        assert(fs_stat(&fs, 1) == (ssize_t)length);
+        assert(fs_read(&fs, 1, buffer, length, 0) == (ssize_t)length);
+        assert(memcmp(buffer, data, length) == 0);
+
+        debug("Check bad clones leave no Inode behind");
+        assert(fs_clone(&fs, 2) == -1);
+        assert(fs_clone(&fs, fs.meta_data.inodes) == -1);
+        assert(fs_create(&fs) == 2);
+        assert(fs_remove(&fs, 2));
+
+        debug("Check writes to shared blocks are copied");
+        assert(fs_write(&fs, 1, patch + early, chunk, early) == (ssize_t)chunk);
+        memset(data + late, 'y', chunk);
+        assert(fs_write(&fs, 0, data + late, chunk, late) == (ssize_t)chunk);
+        assert(fs_free_count(&fs) <= written - 4);
+        assert(fs_read(&fs, 0, buffer, length, 0) == (ssize_t)length);
+        assert(memcmp(buffer, data, length) == 0);
+        assert(fs_read(&fs, 1, buffer, length, 0) == (ssize_t)length);
+        assert(memcmp(buffer, patch, early + chunk) == 0);
+        assert(memcmp(buffer + early + chunk, data + early + chunk, late - early - chunk) == 0);
+        assert(memcmp(buffer + late, patch + late, length - late) == 0);
+        ssize_t cloned = fs_free_count(&fs);
+        fs_unmount(&fs);
+
+        debug("Check mount counts shared blocks again");
+        assert(fs_mount_options(&fs, disk, &mount));
+        assert(fs_free_count(&fs) == cloned);
+        assert(fs_read(&fs, 1, buffer, length, 0) == (ssize_t)length);
+        assert(memcmp(buffer, patch, early + chunk) == 0);
+
+        debug("Check removing one file keeps blocks its clone shares");
+        assert(fs_remove(&fs, 0));
+        assert(fs_free_count(&fs) < empty - (ssize_t)(length / BLOCK_SIZE));
+        assert(fs_read(&fs, 1, buffer, length, 0) == (ssize_t)length);
+        assert(memcmp(buffer, patch, early + chunk) == 0);
+        assert(memcmp(buffer + late, patch + late, length - late) == 0);
+        assert(fs_remove(&fs, 1));
+        assert(fs_free_count(&fs) == empty);
+
+        debug("Check small files are cloned");
+        assert(fs_create(&fs) == 0);
+        assert(fs_write(&fs, 0, data, 50, 0) == 50);
+        assert(fs_clone(&fs, 0) == 1);
+        assert(fs_write(&fs, 1, patch + early, 10, 20) == 10);
+        assert(fs_read(&fs, 0, buffer, length, 0) == 50);
+        assert(memcmp(buffer, data, 50) == 0);
+        assert(fs_read(&fs, 1, buffer, length, 0) == 50);
+        assert(memcmp(buffer, data, 20) == 0);
+        assert(memcmp(buffer + 20, patch + early, 10) == 0);
+        assert(fs_remove(&fs, 0));
+        assert(fs_remove(&fs, 1));
+        assert(fs_free_count(&fs) == empty);
+        fs_unmount(&fs);
+
+        memcpy(data + late, patch + late, chunk);
+    }
+
+    free(buffer);
+    free(patch);
+    free(data);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_24_fs_punch_hole() {
+    size_t  blocks = 3000;
+    FILE   *stream = fopen("data/image.unit", "w");
+    assert(stream);
+    assert(ftruncate(fileno(stream), blocks*BLOCK_SIZE) == 0);
+    fclose(stream);
+
+    Disk *disk = disk_open("data/image.unit", blocks);
+    assert(disk);
+
+    // far past the indirect pointers of pointer Inodes
+    size_t  far      = 2000*BLOCK_SIZE + 100;
+    size_t  length   = 40*BLOCK_SIZE - 100;
+    size_t  offset   = 5*BLOCK_SIZE + 100;
+    size_t  punch    = 20*BLOCK_SIZE;
+    char   *data     = malloc(length);
+    char   *expected = malloc(length);
+    char   *buffer   = malloc(far + BLOCK_SIZE);
+    assert(data && expected && buffer);
+    for (size_t i = 0; i < length; i++) {
+        data[i] = i / 89 + 1;
+    }
+
+    const uint32_t features[] = {0, FS_FEATURE_EXTENTS, FS_FEATURE_INLINE | FS_FEATURE_JOURNAL, FS_FEATURE_CLONE | FS_FEATURE_EXTENTS};
+    for (size_t f = 0; f < sizeof(features) / sizeof(features[0]); f++) {
+        FileSystem    fs      = {0};
+        FormatOptions options = {.mode = FORMAT_FAST, .features = features[f]};
+        assert(fs_format_options(&fs, disk, &options));
+        assert(fs_mount(&fs, disk));
+        ssize_t empty = fs_free_count(&fs);
+
+        debug("Check writes far past end of file only map touched blocks (features %u)", features[f]);
+        assert(fs_create(&fs) == 0);
+        assert(fs_write(&fs, 0, data, BLOCK_SIZE, far) == BLOCK_SIZE);
+        assert(fs_stat(&fs, 0) == (ssize_t)(far + BLOCK_SIZE));
+        assert(fs_free_count(&fs) >= empty - 2 - FS_INDIRECT_DEPTH);
+
+        debug("Check holes read as zeros without disk reads");
+        size_t reads = disk->reads;
+        assert(fs_read(&fs, 0, buffer, far + BLOCK_SIZE, 0) == (ssize_t)(far + BLOCK_SIZE));
+        assert(disk->reads <= reads + 2 + FS_INDIRECT_DEPTH);
+        for (size_t i = 0; i < far; i++) {
+            assert(buffer[i] == 0);
+        }
+        assert(memcmp(buffer + far, data, BLOCK_SIZE) == 0);
+        assert(fs_remove(&fs, 0));
+        assert(fs_free_count(&fs) == empty);
+
+        debug("Check punched blocks are released and read as zeros");
+        assert(fs_create(&fs) == 0);
+        assert(fs_write(&fs, 0, data, length, 0) == (ssize_t)length);
+        ssize_t written = fs_free_count(&fs);
+        assert(fs_punch_hole(&fs, 0, offset, punch) == 19);
+        // splitting the only extent of an Inode moves its extents into a leaf
+        assert(fs_free_count(&fs) >= written + 19 - 2);
+        assert(fs_stat(&fs, 0) == (ssize_t)length);
+        memcpy(expected, data, length);
+        memset(expected + offset, 0, punch);
+        assert(fs_read(&fs, 0, buffer, length, 0) == (ssize_t)length);
+        assert(memcmp(buffer, expected, length) == 0);
+
+        debug("Check punching to end of file releases the last partial block");
+        assert(fs_punch_hole(&fs, 0, offset + punch, SIZE_MAX) == 14);
+        assert(fs_stat(&fs, 0) == (ssize_t)length);
+        memset(expected + offset, 0, length - offset);
+        assert(fs_read(&fs, 0, buffer, length, 0) == (ssize_t)length);
+        assert(memcmp(buffer, expected, length) == 0);
+        assert(fs_punch_hole(&fs, 0, length, BLOCK_SIZE) == 0);
+        assert(fs_punch_hole(&fs, 0, 0, 0) == 0);
+        assert(fs_punch_hole(&fs, 1, 0, BLOCK_SIZE) == -1);
+        assert(fs_punch_hole(NULL, 0, 0, BLOCK_SIZE) == -1);
+        fs_unmount(&fs);
+
+        debug("Check holes survive remount and fill in again");
+        assert(fs_mount(&fs, disk));
+        assert(fs_read(&fs, 0, buffer, length, 0) == (ssize_t)length);
+        assert(memcmp(buffer, expected, length) == 0);
+        assert(fs_punch_hole(&fs, 0, 0, length) == 7);
+        if (features[f] == FS_FEATURE_EXTENTS) {
+            // adjacent holes merge into one
+            assert(fs.inode_table[0].inodes[0].nextents == 1);
+        }
+        assert(fs_free_count(&fs) >= empty - 2);
+        assert(fs_write(&fs, 0, data, length, 0) == (ssize_t)length);
+        assert(fs_read(&fs, 0, buffer, length, 0) == (ssize_t)length);
+        assert(memcmp(buffer, data, length) == 0);
+
+        if (features[f] & FS_FEATURE_CLONE) {
+            debug("Check punching a clone keeps the blocks of its source");
+            assert(fs_clone(&fs, 0) == 1);
+            ssize_t cloned = fs_free_count(&fs);
+            assert(fs_punch_hole(&fs, 1, 0, length) == 40);
+            assert(fs_free_count(&fs) <= cloned + 2);
+            assert(fs_read(&fs, 0, buffer, length, 0) == (ssize_t)length);
+            assert(memcmp(buffer, data, length) == 0);
+            assert(fs_remove(&fs, 1));
+        }
+
+        debug("Check holes punched into small files");
+        assert(fs_create(&fs) == 1);
+        assert(fs_write(&fs, 1, data, 50, 0) == 50);
+        assert(fs_punch_hole(&fs, 1, 10, 20) == 0);
+        memcpy(expected, data, 50);
+        memset(expected + 10, 0, 20);
+        assert(fs_read(&fs, 1, buffer, length, 0) == 50);
+        assert(memcmp(buffer, expected, 50) == 0);
+        fs_unmount(&fs);
+    }
+
+    free(buffer);
+    free(expected);
+    free(data);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_25_fs_compress() {
+    size_t  blocks = 1000;
+    FILE   *stream = fopen("data/image.unit", "w");
+    assert(stream);
+    assert(ftruncate(fileno(stream), blocks*BLOCK_SIZE) == 0);
+    fclose(stream);
+
+    Disk *disk = disk_open("data/image.unit", blocks);
+    assert(disk);
+
+    size_t  length   = 100*BLOCK_SIZE + 123;
+    char   *text     = malloc(length);
+    char   *noise    = malloc(length);
+    char   *expected = malloc(length);
+    char   *buffer   = malloc(length);
+    assert(text && noise && expected && buffer);
+    uint32_t state = 0x2545f491;
+    for (size_t i = 0; i < length; i++) {
+        text[i]  = "inode block extent journal\n"[(i * 7 / 5) % 27];
+        state   ^= state << 13;
+        state   ^= state >> 17;
+        state   ^= state << 5;
+        noise[i] = state;
+    }
+
+    debug("Check compression needs the compress feature");
+    FileSystem fs = {0};
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+    assert(fs_create(&fs) == 0);
+    assert(fs_set_compressed(&fs, 0, true) == false);
+    fs_unmount(&fs);
+
+    const uint32_t features[] = {
+        FS_FEATURE_COMPRESS,
+        FS_FEATURE_COMPRESS | FS_FEATURE_EXTENTS,
+        FS_FEATURE_COMPRESS | FS_FEATURE_INLINE | FS_FEATURE_JOURNAL,
+        FS_FEATURE_COMPRESS | FS_FEATURE_CLONE | FS_FEATURE_EXTENTS,
+    };
+    for (size_t f = 0; f < sizeof(features) / sizeof(features[0]); f++) {
+        FormatOptions options = {.mode = FORMAT_FAST, .features = features[f]};
+        FsInfo        info;
+        fs = (FileSystem){0};
+        assert(fs_format_options(&fs, disk, &options));
+        assert(fs_mount(&fs, disk));
+        ssize_t empty = fs_free_count(&fs);
+
+        debug("Check compressed files round trip appends (features %u)", features[f]);
+        assert(fs_create(&fs) == 0);
+        assert(fs_set_compressed(&fs, 0, true));
+        assert(fs_set_compressed(&fs, 0, true));
+        for (size_t offset = 0, chunk = 1000; offset < length; chunk = chunk * 3 % 20000 + 1) {
+            size_t n = min(chunk, length - offset);
+            assert(fs_write(&fs, 0, text + offset, n, offset) == (ssize_t)n);
+            offset += n;
+        }
+        assert(fs_read(&fs, 0, buffer, length, 0) == (ssize_t)length);
+        assert(memcmp(buffer, text, length) == 0);
+
+        debug("Check compressed files take fewer blocks");
+        assert(fs_stat_info(&fs, 0, &info));
+        assert(info.compressed);
+        assert(info.size == length);
+        assert(info.physical <= length / 2);
+        assert(fs_set_compressed(&fs, 0, false) == false);
+        assert(empty - fs_free_count(&fs) <= (ssize_t)(info.physical / BLOCK_SIZE) + 2 + FS_INDIRECT_DEPTH);
+
+        debug("Check incompressible clusters are stored as is");
+        assert(fs_create(&fs) == 1);
+        assert(fs_set_compressed(&fs, 1, true));
+        assert(fs_write(&fs, 1, noise, length, 0) == (ssize_t)length);
+        assert(fs_stat_info(&fs, 1, &info));
+        assert(info.physical == 101*BLOCK_SIZE);
+        assert(fs_read(&fs, 1, buffer, length, 0) == (ssize_t)length);
+        assert(memcmp(buffer, noise, length) == 0);
+
+        debug("Check overwrites mix compressed and incompressible data");
+        size_t offset = 10*BLOCK_SIZE + 77;
+        size_t count  = 9*BLOCK_SIZE;
+        memcpy(expected, text, length);
+        memcpy(expected + offset, noise, count);
+        assert(fs_write(&fs, 0, noise, count, offset) == (ssize_t)count);
+        assert(fs_read(&fs, 0, buffer, length, 0) == (ssize_t)length);
+        assert(memcmp(buffer, expected, length) == 0);
+        assert(fs_read(&fs, 0, buffer, 5000, offset - 1000) == 5000);
+        assert(memcmp(buffer, expected + offset - 1000, 5000) == 0);
+
+        debug("Check zero clusters become holes");
+        memset(expected + 40*BLOCK_SIZE, 0, 2*FS_CLUSTER_SIZE);
+        assert(fs_write(&fs, 0, expected + 40*BLOCK_SIZE, 2*FS_CLUSTER_SIZE, 40*BLOCK_SIZE) == 2*FS_CLUSTER_SIZE);
+        FsInfo before = info;
+        assert(fs_stat_info(&fs, 0, &info));
+        assert(info.physical < before.physical);
+        assert(fs_read(&fs, 0, buffer, length, 0) == (ssize_t)length);
+        assert(memcmp(buffer, expected, length) == 0);
+
+        debug("Check punching compressed files");
+        assert(fs_punch_hole(&fs, 0, 3*BLOCK_SIZE + 5, 30*BLOCK_SIZE) > 0);
+        memset(expected + 3*BLOCK_SIZE + 5, 0, 30*BLOCK_SIZE);
+        assert(fs_read(&fs, 0, buffer, length, 0) == (ssize_t)length);
+        assert(memcmp(buffer, expected, length) == 0);
+        fs_unmount(&fs);
+
+        debug("Check compressed files survive remount");
+        assert(fs_mount(&fs, disk));
+        assert(fs_read(&fs, 0, buffer, length, 0) == (ssize_t)length);
+        assert(memcmp(buffer, expected, length) == 0);
+        assert(fs_read(&fs, 1, buffer, length, 0) == (ssize_t)length);
+        assert(memcmp(buffer, noise, length) == 0);
+
+        debug("Check read iterator and handles decompress");
+        IterTask task = {.data = buffer};
+        memset(buffer, 0xff, length);
+        assert(fs_read_iter(&fs, 0, 0, length, test_iter_gather, &task) == (ssize_t)length);
+        assert(task.bytes == length);
+        assert(memcmp(buffer, expected, length) == 0);
+        FsHandle *handle = fs_open(&fs, 0);
+        assert(handle);
+        assert(fs_pread(handle, buffer, length, 0) == (ssize_t)length);
+        assert(memcmp(buffer, expected, length) == 0);
+        assert(fs_pwrite(handle, text, 100, length) == 100);
+        assert(fs_pread(handle, buffer, 100, length) == 100);
+        assert(memcmp(buffer, text, 100) == 0);
+        fs_close(handle);
+
+        if (features[f] & FS_FEATURE_CLONE) {
+            debug("Check writes to a compressed clone leave its source alone");
+            assert(fs_clone(&fs, 0) == 2);
+            assert(fs_stat_info(&fs, 2, &info));
+            assert(info.compressed);
+            assert(fs_write(&fs, 2, noise, length, 0) == (ssize_t)length);
+            assert(fs_read(&fs, 0, buffer, length, 0) == (ssize_t)length);
+            assert(memcmp(buffer, expected, length) == 0);
+            assert(fs_read(&fs, 2, buffer, length, 0) == (ssize_t)length);
+            assert(memcmp(buffer, noise, length) == 0);
+            assert(fs_remove(&fs, 2));
+        }
+
+        if (features[f] & FS_FEATURE_INLINE) {
+            debug("Check compressed inline files move to clusters");
+            assert(fs_create(&fs) == 2);
+            assert(fs_set_compressed(&fs, 2, true));
+            assert(fs_write(&fs, 2, text, 50, 0) == 50);
+            assert(fs_write(&fs, 2, text + 50, 3*BLOCK_SIZE, 50) == 3*BLOCK_SIZE);
+            assert(fs_read(&fs, 2, buffer, length, 0) == 3*BLOCK_SIZE + 50);
+            assert(memcmp(buffer, text, 3*BLOCK_SIZE + 50) == 0);
+            assert(fs_stat_info(&fs, 2, &info));
+            assert(info.physical == BLOCK_SIZE);
+            assert(fs_remove(&fs, 2));
+        }
+
+        assert(fs_remove(&fs, 0));
+        assert(fs_remove(&fs, 1));
+        assert(fs_free_count(&fs) == empty);
+        fs_unmount(&fs);
+    }
+
+    free(buffer);
+    free(expected);
+    free(noise);
+    free(text);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_26_fs_checksum() {
+    size_t  blocks = 1000;
+    FILE   *stream = fopen("data/image.unit", "w");
+    assert(stream);
+    assert(ftruncate(fileno(stream), blocks*BLOCK_SIZE) == 0);
+    fclose(stream);
+
+    size_t  length = 20*BLOCK_SIZE;
+    char   *data   = malloc(length);
+    char   *buffer = malloc(length);
+    assert(data && buffer);
+    uint32_t state = 0x2545f491;
+    for (size_t i = 0; i < length; i++) {
+        state  ^= state << 13;
+        state  ^= state >> 17;
+        state  ^= state << 5;
+        data[i] = state;
+    }
+
+    debug("Check scrub needs the checksum feature");
+    Disk *disk = disk_open("data/image.unit", blocks);
+    assert(disk);
+    FileSystem fs = {0};
+    assert(fs_scrub(NULL, 0, NULL, NULL) < 0);
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+    assert(fs_scrub(&fs, 0, NULL, NULL) < 0);
+    fs_unmount(&fs);
+    disk_close(disk);
+
+    const uint32_t features[] = {
+        FS_FEATURE_CHECKSUM,
+        FS_FEATURE_CHECKSUM | FS_FEATURE_EXTENTS | FS_FEATURE_JOURNAL,
+        FS_FEATURE_CHECKSUM | FS_FEATURE_COMPRESS | FS_FEATURE_CLONE | FS_FEATURE_BITMAP,
+    };
+    DiskMode modes[] = {DISK_FD, DISK_MMAP};
+    for (size_t f = 0; f < sizeof(features) / sizeof(features[0]); f++) {
+        for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+            disk = disk_open_mode("data/image.unit", blocks, modes[m]);
+            assert(disk);
+
+            FormatOptions options = {.mode = FORMAT_FAST, .features = features[f]};
+            MountOptions  skip    = {.skip_verify = true};
+            fs = (FileSystem){0};
+            assert(fs_format_options(&fs, disk, &options));
+            assert(fs_mount(&fs, disk));
+            if (modes[m] == DISK_FD) {
+                assert(fs_set_aio(&fs, AIO_THREADS, 8));
+            }
+            ssize_t empty = fs_free_count(&fs);
+
+            debug("Check intact files verify (features %u, mode %d)", features[f], modes[m]);
+            assert(fs_create(&fs) == 0);
+            assert(fs_write(&fs, 0, data, length, 0) == (ssize_t)length);
+            assert(fs_write(&fs, 0, data, 100, 3*BLOCK_SIZE + 10) == 100);
+            memcpy(data + 3*BLOCK_SIZE + 10, data, 100);
+            assert(fs_read(&fs, 0, buffer, length, 0) == (ssize_t)length);
+            assert(memcmp(buffer, data, length) == 0);
+            size_t found[5] = {0};
+            assert(fs_scrub(&fs, 1, test_scrub_report, found) == 20);
+            assert(fs_scrub(&fs, 4, test_scrub_report, found) == 20);
+            assert(found[0] == 0);
+            assert(fs_stats(&fs).checksum_errors == 0);
+
+            debug("Check corrupt blocks fail reads");
+            size_t corrupt = 0;
+            for (size_t b = 1; b < blocks && !corrupt; b++) {
+                assert(disk_read(disk, b, buffer) == BLOCK_SIZE);
+                if (memcmp(buffer, data + 5*BLOCK_SIZE, BLOCK_SIZE) == 0) corrupt = b;
+            }
+            assert(corrupt);
+            buffer[100] ^= 0x10;
+            assert(disk_write(disk, corrupt, buffer) == BLOCK_SIZE);
+            assert(fs_read(&fs, 0, buffer, length, 0) < 0);
+            IterTask task = {.data = buffer};
+            assert(fs_read_iter(&fs, 0, 0, length, test_iter_gather, &task) < 0);
+            assert(fs_read(&fs, 0, buffer, 5*BLOCK_SIZE, 0) == 5*BLOCK_SIZE);
+            assert(memcmp(buffer, data, 5*BLOCK_SIZE) == 0);
+            assert(fs_stats(&fs).checksum_errors >= 2);
+
+            debug("Check scrub finds corrupt blocks");
+            assert(fs_scrub(&fs, 3, test_scrub_report, found) == 20);
+            assert(found[0] == 1);
+            assert(found[1] == corrupt);
+            fs_unmount(&fs);
+
+            debug("Check checksums survive remount");
+            assert(fs_mount(&fs, disk));
+            assert(fs_read(&fs, 0, buffer, length, 0) < 0);
+            fs_unmount(&fs);
+
+            debug("Check verification can be skipped");
+            assert(fs_mount_options(&fs, disk, &skip));
+            assert(fs_read(&fs, 0, buffer, length, 0) == (ssize_t)length);
+            assert(memcmp(buffer, data, length) != 0);
+            assert(memcmp(buffer, data, 5*BLOCK_SIZE + 100) == 0);
+            found[0] = 0;
+            assert(fs_scrub(&fs, 0, test_scrub_report, found) == 20);
+            assert(found[0] == 1);
+            assert(fs_stats(&fs).checksum_errors == 1);
+
+            debug("Check rewritten blocks verify again");
+            assert(fs_write(&fs, 0, data + 5*BLOCK_SIZE + 50, 100, 5*BLOCK_SIZE + 50) == 100);
+            found[0] = 0;
+            assert(fs_scrub(&fs, 0, test_scrub_report, found) == 20);
+            assert(found[0] == 0);
+            fs_unmount(&fs);
+            assert(fs_mount(&fs, disk));
+            assert(fs_read(&fs, 0, buffer, length, 0) == (ssize_t)length);
+            assert(memcmp(buffer, data, length) == 0);
+
+            if (features[f] & FS_FEATURE_CLONE) {
+                debug("Check clones share checksums of shared blocks");
+                assert(fs_clone(&fs, 0) == 1);
+                assert(fs_write(&fs, 1, data, BLOCK_SIZE, 0) == BLOCK_SIZE);
+                assert(fs_read(&fs, 1, buffer, length, 0) == (ssize_t)length);
+                assert(fs_scrub(&fs, 0, test_scrub_report, found) > 0);
+                assert(found[0] == 0);
+                assert(fs_remove(&fs, 1));
+            }
+
+            debug("Check removed files leave nothing to verify");
+            assert(fs_remove(&fs, 0));
+            assert(fs_free_count(&fs) == empty);
+            assert(fs_scrub(&fs, 0, test_scrub_report, found) == 0);
+            fs_unmount(&fs);
+            disk_close(disk);
+        }
+    }
+
+    free(buffer);
+    free(data);
+    return EXIT_SUCCESS;
+}
+
+int test_27_fs_crash() {
+    size_t  blocks = 200;
+    FILE   *stream = fopen("data/image.unit", "w");
+    assert(stream);
+    assert(ftruncate(fileno(stream), blocks*BLOCK_SIZE) == 0);
+    fclose(stream);
+
+    Disk *disk = disk_open("data/image.unit", blocks);
+    assert(disk);
+
+    size_t nblocks = 4;
+    char  *data    = malloc(nblocks*BLOCK_SIZE);
+    char  *buffer  = malloc(nblocks*BLOCK_SIZE);
+    assert(data && buffer);
+
+    FileSystem    fs      = {0};
+    FormatOptions options = {.mode = FORMAT_FAST, .features = FS_FEATURE_JOURNAL};
+    MountOptions  mount   = {.commit_ms = 60000};
+    assert(fs_format_options(&fs, disk, &options));
+    assert(fs_mount_options(&fs, disk, &mount));
+    ssize_t free_count = fs_free_count(&fs);
+
+    debug("Check blocks of a removed file are not reused before the removal commits");
+    memset(data, 'a', nblocks*BLOCK_SIZE);
+    assert(fs_create(&fs) == 0);
+    assert(fs_write(&fs, 0, data, nblocks*BLOCK_SIZE, 0) == (ssize_t)(nblocks*BLOCK_SIZE));
+    Inode old = fs.inode_table[0].inodes[0];
+
+    // fill the rest of the disk and free it again, so allocation wraps around
+    size_t  full  = fs_free_count(&fs) - 1;
+    char   *large = calloc(full, BLOCK_SIZE);
+    assert(large);
+    assert(fs_create(&fs) == 1);
+    assert(fs_write(&fs, 1, large, full*BLOCK_SIZE, 0) == (ssize_t)(full*BLOCK_SIZE));
+    assert(fs_free_count(&fs) == 0);
+    assert(fs_remove(&fs, 1));
+    assert(fs_sync(&fs));
+    size_t  commits = fs_stats(&fs).commits;
+
+    assert(fs_remove(&fs, 0));
+    assert(fs_free_count(&fs) == free_count);
+    memset(data, 'b', nblocks*BLOCK_SIZE);
+    ssize_t inode_number = fs_create(&fs);
+    assert(inode_number >= 0);
+    assert(fs_write(&fs, inode_number, data, nblocks*BLOCK_SIZE, 0) == (ssize_t)(nblocks*BLOCK_SIZE));
+    Inode new = fs.inode_table[0].inodes[inode_number];
+    for (size_t d = 0; d < nblocks; d++) {
+        for (size_t e = 0; e < nblocks; e++) {
+            assert(new.direct[d] != 0 && new.direct[d] != old.direct[e]);
+        }
+    }
+    assert(fs_stats(&fs).commits == commits);
+
+    debug("Check crash before commit replays the removed file intact");
+    Disk      *crash    = test_crash_image(blocks);
+    FileSystem replayed = {0};
+    assert(crash);
+    assert(fs_mount(&replayed, crash));
+    assert(fs_stat(&replayed, 0) == (ssize_t)(nblocks*BLOCK_SIZE));
+    assert(fs_read(&replayed, 0, buffer, nblocks*BLOCK_SIZE, 0) == (ssize_t)(nblocks*BLOCK_SIZE));
+    memset(data, 'a', nblocks*BLOCK_SIZE);
+    assert(memcmp(buffer, data, nblocks*BLOCK_SIZE) == 0);
+    fs_unmount(&replayed);
+    disk_close(crash);
+
+    debug("Check commit returns the released blocks");
+    assert(fs_sync(&fs));
+    assert(fs_free_count(&fs) == free_count - (ssize_t)nblocks);
+    assert(bitmap_count(fs.journal.freed) == 0);
+
+    debug("Check crash after commit replays the new file");
+    crash = test_crash_image(blocks);
+    assert(crash);
+    assert(fs_mount(&replayed, crash));
+    assert(fs_stat(&replayed, 0) == (inode_number == 0 ? (ssize_t)(nblocks*BLOCK_SIZE) : -1));
+    assert(fs_read(&replayed, inode_number, buffer, nblocks*BLOCK_SIZE, 0) == (ssize_t)(nblocks*BLOCK_SIZE));
+    memset(data, 'b', nblocks*BLOCK_SIZE);
+    assert(memcmp(buffer, data, nblocks*BLOCK_SIZE) == 0);
+    fs_unmount(&replayed);
+    disk_close(crash);
+
+    debug("Check writes on a full disk commit to reuse released blocks");
+    assert(fs_remove(&fs, inode_number));
+    assert(fs_create(&fs) == inode_number);
+    commits = fs_stats(&fs).commits;
+    full    = free_count - 1;
+    assert(fs_write(&fs, inode_number, large, full*BLOCK_SIZE, 0) == (ssize_t)(full*BLOCK_SIZE));
+    assert(fs_stats(&fs).commits > commits);
+    assert(fs_free_count(&fs) == 0);
+    free(large);
+    fs_unmount(&fs);
+
+    const uint32_t features[] = {FS_FEATURE_JOURNAL | FS_FEATURE_CHECKSUM, FS_FEATURES};
+    for (size_t f = 0; f < sizeof(features) / sizeof(features[0]); f++) {
+        debug("Check crash before commit keeps checksums of overwritten blocks (features %u)", features[f]);
+        options.features = features[f];
+        assert(fs_format_options(&fs, disk, &options));
+        assert(fs_mount_options(&fs, disk, &mount));
+        memset(data, 'c', nblocks*BLOCK_SIZE);
+        assert(fs_create(&fs) == 0);
+        assert(fs_write(&fs, 0, data, nblocks*BLOCK_SIZE, 0) == (ssize_t)(nblocks*BLOCK_SIZE));
+        assert(fs_sync(&fs));
+        free_count = fs_free_count(&fs);
+
+        memset(data, 'd', nblocks*BLOCK_SIZE);
+        assert(fs_write(&fs, 0, data, nblocks*BLOCK_SIZE, 0) == (ssize_t)(nblocks*BLOCK_SIZE));
+        assert(fs_write(&fs, 0, data, 100, 2*BLOCK_SIZE + 10) == 100);
+        assert(fs_read(&fs, 0, buffer, nblocks*BLOCK_SIZE, 0) == (ssize_t)(nblocks*BLOCK_SIZE));
+        assert(memcmp(buffer, data, nblocks*BLOCK_SIZE) == 0);
+
+        Disk      *crash    = test_crash_image(blocks);
+        FileSystem replayed = {0};
+        assert(crash);
+        assert(fs_mount(&replayed, crash));
+        assert(fs_read(&replayed, 0, buffer, nblocks*BLOCK_SIZE, 0) == (ssize_t)(nblocks*BLOCK_SIZE));
+        memset(data, 'c', nblocks*BLOCK_SIZE);
+        assert(memcmp(buffer, data, nblocks*BLOCK_SIZE) == 0);
+        assert(fs_scrub(&replayed, 1, NULL, NULL) == (ssize_t)nblocks);
+        assert(fs_stats(&replayed).checksum_errors == 0);
+        fs_unmount(&replayed);
+        disk_close(crash);
+
+        debug("Check crash after commit verifies the overwritten blocks");
+        assert(fs_sync(&fs));
+        assert(fs_free_count(&fs) == free_count);
+        crash = test_crash_image(blocks);
+        assert(crash);
+        assert(fs_mount(&replayed, crash));
+        assert(fs_read(&replayed, 0, buffer, nblocks*BLOCK_SIZE, 0) == (ssize_t)(nblocks*BLOCK_SIZE));
+        memset(data, 'd', nblocks*BLOCK_SIZE);
+        assert(memcmp(buffer, data, nblocks*BLOCK_SIZE) == 0);
+        assert(fs_scrub(&replayed, 1, NULL, NULL) == (ssize_t)nblocks);
+        assert(fs_stats(&replayed).checksum_errors == 0);
+        fs_unmount(&replayed);
+        disk_close(crash);
+
+        debug("Check overwrites within one transaction stay in place");
+        memset(data, 'e', BLOCK_SIZE);
+        assert(fs_write(&fs, 0, data, BLOCK_SIZE, 0) == BLOCK_SIZE);
+        size_t first = test_find_block(disk, blocks, data);
+        memset(data, 'f', BLOCK_SIZE);
+        assert(fs_write(&fs, 0, data, BLOCK_SIZE, 0) == BLOCK_SIZE);
+        assert(first && test_find_block(disk, blocks, data) == first);
+        assert(fs_sync(&fs));
+        memset(data, 'g', BLOCK_SIZE);
+        assert(fs_write(&fs, 0, data, BLOCK_SIZE, 0) == BLOCK_SIZE);
+        assert(test_find_block(disk, blocks, data) != first);
+        fs_unmount(&fs);
+    }
+
+    disk_close(disk);
+    free(buffer);
+    free(data);
+    return EXIT_SUCCESS;
+}
+
 /* Main execution */
 
 int main(int argc, char *argv[]) {
@@ -174,6 +2404,30 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "    1. Test fs_create\n");
         fprintf(stderr, "    2. Test fs_remove\n");
         fprintf(stderr, "    3. Test fs_stat\n");
+        fprintf(stderr, "    4. Test fs_allocate_run\n");
+        fprintf(stderr, "    5. Test fs_create_n\n");
+        fprintf(stderr, "    6. Test fs_mount_options\n");
+        fprintf(stderr, "    7. Test fs_format_mode\n");
+        fprintf(stderr, "    8. Test fs_stats\n");
+        fprintf(stderr, "    9. Test fs threads\n");
+        fprintf(stderr, "    10. Test fs_set_aio\n");
+        fprintf(stderr, "    11. Test fs read-ahead\n");
+        fprintf(stderr, "    12. Test fs_read_iter\n");
+        fprintf(stderr, "    13. Test fs_write new blocks\n");
+        fprintf(stderr, "    14. Test fs_write metadata updates\n");
+        fprintf(stderr, "    15. Test fs large files\n");
+        fprintf(stderr, "    16. Test fs extents\n");
+        fprintf(stderr, "    17. Test fs inline data\n");
+        fprintf(stderr, "    18. Test fs_remove_many\n");
+        fprintf(stderr, "    19. Test fs journal\n");
+        fprintf(stderr, "    20. Test fs stored bitmap\n");
+        fprintf(stderr, "    21. Test fs_defrag\n");
+        fprintf(stderr, "    22. Test fs handles\n");
+        fprintf(stderr, "    23. Test fs_clone\n");
+        fprintf(stderr, "    24. Test fs_punch_hole\n");
+        fprintf(stderr, "    25. Test fs compression\n");
+        fprintf(stderr, "    26. Test fs checksums\n");
+        fprintf(stderr, "    27. Test fs crash images\n");
         return EXIT_FAILURE;
     }
 
@@ -187,6 +2441,30 @@ int main(int argc, char *argv[]) {
         case 1:  status = test_01_fs_create(); break;
         case 2:  status = test_02_fs_remove(); break;
         case 3:  status = test_03_fs_stat(); break;
+        case 4:  status = test_04_fs_allocate_run(); break;
+        case 5:  status = test_05_fs_create_n(); break;
+        case 6:  status = test_06_fs_mount_options(); break;
+        case 7:  status = test_07_fs_format_mode(); break;
+        case 8:  status = test_08_fs_stats(); break;
+        case 9:  status = test_09_fs_threads(); break;
+        case 10: status = test_10_fs_set_aio(); break;
+        case 11: status = test_11_fs_readahead(); break;
+        case 12: status = test_12_fs_read_iter(); break;
+        case 13: status = test_13_fs_write_fresh(); break;
+        case 14: status = test_14_fs_write_metadata(); break;
+        case 15: status = test_15_fs_large_files(); break;
+        case 16: status = test_16_fs_extents(); break;
+        case 17: status = test_17_fs_inline(); break;
+        case 18: status = test_18_fs_remove_many(); break;
+        case 19: status = test_19_fs_journal(); break;
+        case 20: status = test_20_fs_bitmap(); break;
+        case 21: status = test_21_fs_defrag(); break;
+        case 22: status = test_22_fs_handles(); break;
+        case 23: status = test_23_fs_clone(); break;
+        case 24: status = test_24_fs_punch_hole(); break;
+        case 25: status = test_25_fs_compress(); break;
+        case 26: status = test_26_fs_checksum(); break;
+        case 27: status = test_27_fs_crash(); break;
         default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
     }
 
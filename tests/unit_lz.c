@@ -0,0 +1,158 @@
+/* unit_lz.c: Unit tests for SimpleFS LZ4 block codec */
+
+#include "sfs/lz.h"
+#include "sfs/logging.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Constants */
+
+#define INPUT_SIZE  (16384)
+
+/* Functions */
+
+void test_fill_text(char *data, size_t length) {
+    const char *words[] = {"inode ", "block ", "extent ", "journal ", "bitmap ", "\n"};
+    for (size_t i = 0, w = 0; i < length; w++) {
+        const char *word = words[(w * 7 + w / 5) % 6];
+        for (size_t c = 0; word[c] && i < length; c++) {
+            data[i++] = word[c];
+        }
+    }
+}
+
+void test_fill_random(char *data, size_t length) {
+    uint32_t state = 0x2545f491;
+    for (size_t i = 0; i < length; i++) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        data[i] = state;
+    }
+}
+
+int test_00_lz_roundtrip() {
+    static char input[INPUT_SIZE];
+    static char packed[INPUT_SIZE];
+    static char output[INPUT_SIZE];
+
+    debug("Check text compresses and round trips");
+    test_fill_text(input, INPUT_SIZE);
+    size_t n = lz_compress(input, INPUT_SIZE, packed, sizeof(packed));
+    assert(n > 0);
+    assert(n < INPUT_SIZE / 4);
+    assert(lz_decompress(packed, n, output, sizeof(output)) == INPUT_SIZE);
+    assert(memcmp(input, output, INPUT_SIZE) == 0);
+
+    debug("Check zeros compress to a few bytes");
+    memset(input, 0, INPUT_SIZE);
+    n = lz_compress(input, INPUT_SIZE, packed, sizeof(packed));
+    assert(n > 0);
+    assert(n < 128);
+    memset(output, 1, INPUT_SIZE);
+    assert(lz_decompress(packed, n, output, sizeof(output)) == INPUT_SIZE);
+    assert(memcmp(input, output, INPUT_SIZE) == 0);
+    return EXIT_SUCCESS;
+}
+
+int test_01_lz_incompressible() {
+    static char input[INPUT_SIZE];
+    static char packed[INPUT_SIZE + INPUT_SIZE / 255 + 16];
+    static char output[INPUT_SIZE];
+
+    debug("Check random data does not fit its own size");
+    test_fill_random(input, INPUT_SIZE);
+    assert(lz_compress(input, INPUT_SIZE, packed, INPUT_SIZE) == 0);
+
+    debug("Check random data round trips within bound");
+    assert(lz_bound(INPUT_SIZE) <= sizeof(packed));
+    size_t n = lz_compress(input, INPUT_SIZE, packed, lz_bound(INPUT_SIZE));
+    assert(n > INPUT_SIZE);
+    assert(lz_decompress(packed, n, output, sizeof(output)) == INPUT_SIZE);
+    assert(memcmp(input, output, INPUT_SIZE) == 0);
+    return EXIT_SUCCESS;
+}
+
+int test_02_lz_small() {
+    char input[64];
+    char packed[128];
+    char output[64];
+
+    debug("Check short inputs are stored as literals");
+    test_fill_text(input, sizeof(input));
+    for (size_t length = 0; length <= sizeof(input); length++) {
+        size_t n = lz_compress(input, length, packed, sizeof(packed));
+        assert(n > 0);
+        assert(lz_decompress(packed, n, output, sizeof(output)) == (ssize_t)length);
+        assert(memcmp(input, output, length) == 0);
+    }
+
+    debug("Check empty input");
+    assert(lz_compress(input, 0, packed, 0) == 0);
+    assert(lz_compress(input, 0, packed, 1) == 1);
+    assert(lz_decompress(packed, 1, output, sizeof(output)) == 0);
+    return EXIT_SUCCESS;
+}
+
+int test_03_lz_malformed() {
+    static char input[INPUT_SIZE];
+    static char packed[INPUT_SIZE];
+    static char output[INPUT_SIZE];
+
+    test_fill_text(input, INPUT_SIZE);
+    size_t n = lz_compress(input, INPUT_SIZE, packed, sizeof(packed));
+    assert(n > 0);
+
+    debug("Check output capacity is enforced");
+    assert(lz_decompress(packed, n, output, INPUT_SIZE - 1) == -1);
+
+    debug("Check truncated input");
+    for (size_t cut = 1; cut < 16; cut++) {
+        ssize_t result = lz_decompress(packed, n - cut, output, sizeof(output));
+        assert(result < INPUT_SIZE);
+    }
+
+    debug("Check match before start of output");
+    const char bad_offset[] = {0x10, 'a', 0x02, 0x00, 0x00};
+    assert(lz_decompress(bad_offset, sizeof(bad_offset), output, sizeof(output)) == -1);
+
+    debug("Check zero offset");
+    const char zero_offset[] = {0x10, 'a', 0x00, 0x00};
+    assert(lz_decompress(zero_offset, sizeof(zero_offset), output, sizeof(output)) == -1);
+
+    debug("Check literals past end of input");
+    const char long_literals[] = {0x50, 'a', 'b'};
+    assert(lz_decompress(long_literals, sizeof(long_literals), output, sizeof(output)) == -1);
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test lz_compress/lz_decompress round trip\n");
+        fprintf(stderr, "    1. Test lz_compress incompressible input\n");
+        fprintf(stderr, "    2. Test lz_compress short input\n");
+        fprintf(stderr, "    3. Test lz_decompress malformed input\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    switch (number) {
+        case 0:  status = test_00_lz_roundtrip(); break;
+        case 1:  status = test_01_lz_incompressible(); break;
+        case 2:  status = test_02_lz_small(); break;
+        case 3:  status = test_03_lz_malformed(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */